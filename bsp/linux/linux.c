@@ -0,0 +1,709 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <titan-secure-volume/titan-secure-volume.h>
+#include <titan-secure-volume/app.h>
+#include <titan-secure-volume/linux.h>
+
+
+#ifndef MIN
+	#define MIN(a,b)  (((a) < (b)) ? (a) : (b))
+#endif
+
+#define RtnOnError(x) {int _xxerr; if ((_xxerr = (x))) return _xxerr;}
+
+/* Alignment used for O_DIRECT on regular files.  Satisfies every common logical block size. */
+#define FILE_BLOCK_SIZE 4096
+
+/* Size of the aligned bounce buffer used by TSV_LINUX_DIRECT.  Must be a multiple of the block size. */
+#define BOUNCE_SIZE (1024 * 1024)
+
+
+typedef struct {
+	int fd;
+	int mode;
+	uint64_t size;
+	uint32_t block_size;
+	int block_device;
+
+	uint8_t *map;           /* TSV_LINUX_MMAP */
+	uint8_t *bounce;        /* TSV_LINUX_DIRECT */
+	int discard;            /* TSV_LINUX_DISCARD */
+
+	/* Held while the bounce buffer is in use, and by every write, since writes of partial blocks read and
+	 * write back their neighbours.  Reads that find it busy bring their own bounce buffer.
+	 */
+	pthread_mutex_t bounce_lock;
+} DEVICE;
+
+
+/* Global State.  The second device holds offsets from TSV_SPLIT_OFFSET on (tsv_linux_open_second). */
+static DEVICE g_devices[2] = {
+	{.fd = -1, .bounce_lock = PTHREAD_MUTEX_INITIALIZER},
+	{.fd = -1, .bounce_lock = PTHREAD_MUTEX_INITIALIZER},
+};
+
+/* tsv_linux_trace_open.  Records are buffered, and written out when the buffer fills. */
+#define TRACE_BUFFER_RECORDS 4096
+
+static struct {
+	int fd;
+	int failed;             /* A write failed; reported by tsv_linux_trace_close */
+	uint64_t start_ns;
+	size_t count;
+	uint8_t buffer[TRACE_BUFFER_RECORDS * TSV_TRACE_RECORD_SIZE];
+	pthread_mutex_t lock;   /* Threaded mode traces from several threads */
+} g_trace = {.fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER};
+
+/* tsv_lock.  Defined here rather than in an object of their own, since the library's defaults would
+ * keep such an object from being linked.
+ */
+static pthread_mutex_t g_locks[TSV_LOCK_COUNT] = {
+	[0 ... TSV_LOCK_COUNT - 1] = PTHREAD_MUTEX_INITIALIZER,
+};
+
+
+static int _device_size (int fd, uint64_t *size, uint32_t *block_size, int *block_device)
+{
+	struct stat st;
+	int logical_block_size;
+
+	if (fstat (fd, &st))
+		return -1;
+
+	*block_device = S_ISBLK (st.st_mode);
+
+	if (*block_device)
+	{
+		if (ioctl (fd, BLKGETSIZE64, size) || ioctl (fd, BLKSSZGET, &logical_block_size))
+			return -1;
+
+		*block_size = (uint32_t)logical_block_size;
+		return 0;
+	}
+
+	*size = (uint64_t)st.st_size;
+	*block_size = FILE_BLOCK_SIZE;
+
+	return 0;
+}
+
+
+static int _open_device (DEVICE *device, char const *path, uint64_t size, int mode)
+{
+	uint64_t current_size;
+	uint32_t block_size;
+	int block_device;
+	int flags = O_RDWR | O_CREAT | O_CLOEXEC;
+	int discard = mode & TSV_LINUX_DISCARD;
+
+	if (device->fd != -1)
+		return -1;
+
+	mode &= ~TSV_LINUX_DISCARD;
+
+	if (mode == TSV_LINUX_DIRECT)
+		flags |= O_DIRECT;
+	else if (mode != TSV_LINUX_BUFFERED && mode != TSV_LINUX_MMAP)
+		return -1;
+
+	int fd = open (path, flags, 0600);
+
+	if (fd == -1)
+		return -1;
+
+	if (_device_size (fd, &current_size, &block_size, &block_device) || block_size == 0 || (block_size & (block_size - 1)) || block_size > BOUNCE_SIZE)
+		goto fail;
+
+	if (size > current_size)
+	{
+		/* Whole blocks, so O_DIRECT never has to extend the file */
+		uint64_t file_size = (size + block_size - 1) & ~(uint64_t)(block_size - 1);
+
+		if (ftruncate (fd, (off_t)file_size))
+			goto fail;
+
+		current_size = size;
+	}
+
+	if (current_size == 0)
+		goto fail;
+
+	if (mode == TSV_LINUX_MMAP)
+	{
+		if (current_size > SIZE_MAX)
+			goto fail;
+
+		void *map = mmap (NULL, (size_t)current_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+		if (map == MAP_FAILED)
+			goto fail;
+
+		device->map = map;
+	}
+	else if (mode == TSV_LINUX_DIRECT)
+	{
+		void *bounce;
+
+		if (posix_memalign (&bounce, block_size, BOUNCE_SIZE))
+			goto fail;
+
+		device->bounce = bounce;
+	}
+
+	device->fd = fd;
+	device->mode = mode;
+	device->size = current_size;
+	device->block_size = block_size;
+	device->discard = discard;
+	device->block_device = block_device;
+
+	return 0;
+
+fail:
+	close (fd);
+	return -1;
+}
+
+
+static int _close_device (DEVICE *device)
+{
+	int err = 0;
+
+	if (device->fd == -1)
+		return 0;
+
+	if (device->map)
+		err |= munmap (device->map, (size_t)device->size);
+
+	free (device->bounce);
+	err |= close (device->fd);
+
+	device->fd = -1;
+	device->map = NULL;
+	device->bounce = NULL;
+
+	return err ? -1 : 0;
+}
+
+
+int tsv_linux_open (char const *path, uint64_t size, int mode)
+{
+	return _open_device (&g_devices[0], path, size, mode);
+}
+
+
+int tsv_linux_open_second (char const *path, uint64_t size)
+{
+	if (g_devices[0].fd == -1)
+		return -1;
+
+	return _open_device (&g_devices[1], path, size, g_devices[0].mode | g_devices[0].discard);
+}
+
+
+int tsv_linux_close (void)
+{
+	int err = 0;
+
+	if (g_devices[0].fd == -1)
+		return 0;
+
+	err |= tsv_physical_sync ();
+	err |= _close_device (&g_devices[1]);
+	err |= _close_device (&g_devices[0]);
+
+	return err ? -1 : 0;
+}
+
+
+/* The device an offset lands on, with offset made relative to it.  NULL if out of bounds. */
+static DEVICE *_in_bounds (uint64_t *offset, size_t len)
+{
+	DEVICE *device = &g_devices[0];
+
+	if (*offset >= TSV_SPLIT_OFFSET)
+	{
+		device = &g_devices[1];
+		*offset -= TSV_SPLIT_OFFSET;
+	}
+
+	if (device->fd == -1 || *offset >= device->size || (device->size - *offset) < len)
+		return NULL;
+
+	return device;
+}
+
+
+/* pread, retrying on EINTR and short reads.  Reads past the end of the file return zeros. */
+static int _pread_full (DEVICE const *device, void *dst, size_t len, uint64_t offset)
+{
+	while (len)
+	{
+		ssize_t bytes = pread (device->fd, dst, len, (off_t)offset);
+
+		if (bytes < 0 && errno == EINTR)
+			continue;
+
+		if (bytes < 0)
+			return -1;
+
+		if (bytes == 0)
+		{
+			memset (dst, 0, len);
+			return 0;
+		}
+
+		dst = ((uint8_t *)dst) + bytes;
+		len -= (size_t)bytes;
+		offset += (uint64_t)bytes;
+	}
+
+	return 0;
+}
+
+
+/* pwrite, retrying on EINTR and short writes. */
+static int _pwrite_full (DEVICE const *device, void const *src, size_t len, uint64_t offset)
+{
+	while (len)
+	{
+		ssize_t bytes = pwrite (device->fd, src, len, (off_t)offset);
+
+		if (bytes < 0 && errno == EINTR)
+			continue;
+
+		if (bytes <= 0)
+			return -1;
+
+		src = ((uint8_t const *)src) + bytes;
+		len -= (size_t)bytes;
+		offset += (uint64_t)bytes;
+	}
+
+	return 0;
+}
+
+
+/* Whether O_DIRECT can take buf, offset and len as they are */
+static int _direct_aligned (DEVICE const *device, void const *buf, uint64_t offset, size_t len)
+{
+	return !(((uint64_t)(uintptr_t)buf | offset | len) & (device->block_size - 1));
+}
+
+
+/* For reads: the device's bounce buffer, or if another thread is using it, a new one big enough for len
+ * bytes at any offset, up to BOUNCE_SIZE.  *size is its size, a multiple of the block size.
+ */
+static uint8_t *_bounce_acquire (DEVICE *device, size_t len, size_t *size)
+{
+	size_t block_size = device->block_size;
+	void *bounce;
+
+	if (!pthread_mutex_trylock (&device->bounce_lock))
+	{
+		*size = BOUNCE_SIZE;
+		return device->bounce;
+	}
+
+	*size = len < BOUNCE_SIZE - 2 * block_size ? (len + 2 * block_size) & ~(block_size - 1) : BOUNCE_SIZE;
+
+	if (!posix_memalign (&bounce, block_size, *size))
+		return bounce;
+
+	/* Out of memory, so wait for the shared one */
+	pthread_mutex_lock (&device->bounce_lock);
+	*size = BOUNCE_SIZE;
+
+	return device->bounce;
+}
+
+
+static void _bounce_release (DEVICE *device, uint8_t *bounce)
+{
+	if (bounce == device->bounce)
+		pthread_mutex_unlock (&device->bounce_lock);
+	else
+		free (bounce);
+}
+
+
+/* O_DIRECT needs block aligned offsets, lengths and buffers, so anything unaligned goes through a bounce
+ * buffer of bounce_size bytes.
+ */
+static int _direct_read (DEVICE const *device, uint8_t *bounce, size_t bounce_size, void *dst, uint64_t offset, size_t len)
+{
+	uint64_t mask = device->block_size - 1;
+
+	while (len)
+	{
+		uint64_t start = offset & ~mask;
+		size_t head = (size_t)(offset - start);
+		size_t chunk = MIN (len, bounce_size - head);
+		size_t span = (head + chunk + mask) & ~mask;
+
+		RtnOnError (_pread_full (device, bounce, span, start));
+		memmove (dst, bounce + head, chunk);
+
+		dst = ((uint8_t *)dst) + chunk;
+		len -= chunk;
+		offset += chunk;
+	}
+
+	return 0;
+}
+
+
+/* Partially covered blocks at either end are read first, then the whole span is written back. */
+static int _direct_write (DEVICE const *device, uint8_t *bounce, size_t bounce_size, uint64_t offset, void const *src, size_t len)
+{
+	uint64_t mask = device->block_size - 1;
+	size_t block_size = device->block_size;
+
+	while (len)
+	{
+		uint64_t start = offset & ~mask;
+		size_t head = (size_t)(offset - start);
+		size_t chunk = MIN (len, bounce_size - head);
+		size_t span = (head + chunk + mask) & ~mask;
+		size_t tail = span - head - chunk;
+
+		if (head)
+			RtnOnError (_pread_full (device, bounce, block_size, start));
+
+		if (tail && !(head && span == block_size))
+			RtnOnError (_pread_full (device, bounce + span - block_size, block_size, start + span - block_size));
+
+		memmove (bounce + head, src, chunk);
+		RtnOnError (_pwrite_full (device, bounce, span, start));
+
+		src = ((uint8_t const *)src) + chunk;
+		len -= chunk;
+		offset += chunk;
+	}
+
+	return 0;
+}
+
+
+int tsv_physical_read (void *dst, uint64_t offset, size_t len)
+{
+	DEVICE *device;
+	uint8_t *bounce;
+	size_t bounce_size;
+	int err;
+
+	if (!len)
+		return 0;
+
+	if ((device = _in_bounds (&offset, len)) == NULL)
+		return -1;
+
+	switch (device->mode)
+	{
+		case TSV_LINUX_MMAP:
+			memmove (dst, device->map + offset, len);
+			return 0;
+		case TSV_LINUX_DIRECT:
+			if (_direct_aligned (device, dst, offset, len))
+				return _pread_full (device, dst, len, offset);
+
+			bounce = _bounce_acquire (device, len, &bounce_size);
+			err = _direct_read (device, bounce, bounce_size, dst, offset, len);
+			_bounce_release (device, bounce);
+			return err;
+		default:
+			return _pread_full (device, dst, len, offset);
+	}
+}
+
+
+int tsv_physical_write (uint64_t offset, void const *src, size_t len)
+{
+	DEVICE *device;
+	int err;
+
+	if (!len)
+		return 0;
+
+	if ((device = _in_bounds (&offset, len)) == NULL)
+		return -1;
+
+	switch (device->mode)
+	{
+		case TSV_LINUX_MMAP:
+			memmove (device->map + offset, src, len);
+			return 0;
+		case TSV_LINUX_DIRECT:
+			pthread_mutex_lock (&device->bounce_lock);
+
+			if (_direct_aligned (device, src, offset, len))
+				err = _pwrite_full (device, src, len, offset);
+			else
+				err = _direct_write (device, device->bounce, BOUNCE_SIZE, offset, src, len);
+
+			pthread_mutex_unlock (&device->bounce_lock);
+			return err;
+		default:
+			return _pwrite_full (device, src, len, offset);
+	}
+}
+
+
+static int _sync_device (DEVICE const *device)
+{
+	if (device->mode == TSV_LINUX_MMAP)
+		return msync (device->map, (size_t)device->size, MS_SYNC) ? -1 : 0;
+
+	return fdatasync (device->fd) ? -1 : 0;
+}
+
+
+static void *_sync_main (void *arg)
+{
+	return (void *)(intptr_t)_sync_device (arg);
+}
+
+
+/* With a second device, both are flushed at once rather than one after the other. */
+int tsv_physical_sync (void)
+{
+	pthread_t thread;
+	void *result;
+	int err;
+
+	if (g_devices[0].fd == -1)
+		return -1;
+
+	if (g_devices[1].fd == -1)
+		return _sync_device (&g_devices[0]);
+
+	if (pthread_create (&thread, NULL, _sync_main, &g_devices[1]))
+		return (_sync_device (&g_devices[1]) | _sync_device (&g_devices[0])) ? -1 : 0;
+
+	err = _sync_device (&g_devices[0]);
+
+	if (pthread_join (thread, &result) || result)
+		return -1;
+
+	return err;
+}
+
+
+void const *tsv_physical_map (uint64_t offset, size_t len)
+{
+	DEVICE *device = _in_bounds (&offset, len);
+
+	if (device == NULL || device->mode != TSV_LINUX_MMAP)
+		return NULL;
+
+	return device->map + offset;
+}
+
+
+/* Punches a hole in regular files, or issues BLKDISCARD for the whole blocks of a block device. */
+int tsv_physical_discard (uint64_t offset, size_t len)
+{
+	DEVICE *device = _in_bounds (&offset, len);
+
+	if (device == NULL)
+		return -1;
+
+	if (!device->discard)
+		return 0;
+
+	/* Discard is only a hint, so filesystems without hole punching are not an error */
+	if (!device->block_device)
+		return (fallocate (device->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)offset, (off_t)len) && errno != EOPNOTSUPP) ? -1 : 0;
+
+	uint64_t mask = device->block_size - 1;
+	uint64_t range[2] = {(offset + mask) & ~mask, (offset + len) & ~mask};
+
+	if (range[1] <= range[0])
+		return 0;
+
+	range[1] -= range[0];
+
+	return ioctl (device->fd, BLKDISCARD, range) ? -1 : 0;
+}
+
+
+void *tsv_linux_host_cache (char const *name, size_t len)
+{
+	struct stat st;
+	void *cache;
+
+	int fd = shm_open (name, O_RDWR | O_CREAT, 0600);
+
+	if (fd == -1)
+		return NULL;
+
+	/* A new object is zero-filled by ftruncate; a racing creator sets the same size */
+	if (fstat (fd, &st) || (st.st_size == 0 && ftruncate (fd, (off_t)len)) || fstat (fd, &st) || (uint64_t)st.st_size != len)
+	{
+		close (fd);
+		return NULL;
+	}
+
+	cache = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close (fd);
+
+	return (cache == MAP_FAILED) ? NULL : cache;
+}
+
+
+int tsv_linux_host_cache_close (void *cache, size_t len)
+{
+	return munmap (cache, len) ? -1 : 0;
+}
+
+
+static uint64_t _monotonic_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+
+static void _pack_little (uint8_t *dst, uint64_t value, size_t len)
+{
+	for (size_t i = 0; i < len; ++i)
+		dst[i] = (uint8_t)(value >> (8 * i));
+}
+
+
+static int _write_all (int fd, void const *src, size_t len)
+{
+	while (len)
+	{
+		ssize_t written = write (fd, src, len);
+
+		if (written < 0 && errno == EINTR)
+			continue;
+
+		if (written <= 0)
+			return -1;
+
+		src = (uint8_t const *)src + written;
+		len -= (size_t)written;
+	}
+
+	return 0;
+}
+
+
+/* Called with g_trace.lock held */
+static void _trace_drain (void)
+{
+	if (g_trace.count && _write_all (g_trace.fd, g_trace.buffer, g_trace.count * TSV_TRACE_RECORD_SIZE))
+		g_trace.failed = 1;
+
+	g_trace.count = 0;
+}
+
+
+static void _trace_hook (void *ctx, uint32_t type, uint64_t offset, uint64_t len, int result)
+{
+	(void)ctx;
+
+	uint64_t time_ns = _monotonic_ns () - g_trace.start_ns;
+
+	pthread_mutex_lock (&g_trace.lock);
+
+	/* A zero length flush is still one record */
+	do
+	{
+		uint64_t piece = MIN (len, TSV_TRACE_MAX_LEN);
+		uint8_t *record = g_trace.buffer + g_trace.count * TSV_TRACE_RECORD_SIZE;
+
+		_pack_little (record, time_ns, 8);
+		_pack_little (record + 8, offset, 8);
+		_pack_little (record + 16, piece, 4);
+		record[20] = (uint8_t)type;
+		record[21] = (result != 0);
+		record[22] = 0;
+		record[23] = 0;
+
+		if (++g_trace.count == TRACE_BUFFER_RECORDS)
+			_trace_drain ();
+
+		offset += piece;
+		len -= piece;
+	} while (len);
+
+	pthread_mutex_unlock (&g_trace.lock);
+}
+
+
+int tsv_linux_trace_open (char const *path)
+{
+	if (g_trace.fd != -1)
+		return -1;
+
+	int fd = open (path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+
+	if (fd == -1)
+		return -1;
+
+	if (_write_all (fd, TSV_TRACE_MAGIC, 8))
+	{
+		close (fd);
+		return -1;
+	}
+
+	g_trace.fd = fd;
+	g_trace.failed = 0;
+	g_trace.count = 0;
+	g_trace.start_ns = _monotonic_ns ();
+	tsv_set_trace (_trace_hook, NULL);
+
+	return 0;
+}
+
+
+int tsv_linux_trace_close (void)
+{
+	if (g_trace.fd == -1)
+		return -1;
+
+	tsv_set_trace (NULL, NULL);
+	pthread_mutex_lock (&g_trace.lock);
+	_trace_drain ();
+	pthread_mutex_unlock (&g_trace.lock);
+
+	int failed = g_trace.failed;
+
+	if (close (g_trace.fd))
+		failed = 1;
+
+	g_trace.fd = -1;
+
+	return failed ? -1 : 0;
+}
+
+
+void tsv_lock (uint32_t lock)
+{
+	if (lock >= TSV_LOCK_COUNT || pthread_mutex_lock (&g_locks[lock]))
+		tsv_fatal_error ();
+}
+
+
+void tsv_unlock (uint32_t lock)
+{
+	if (lock >= TSV_LOCK_COUNT || pthread_mutex_unlock (&g_locks[lock]))
+		tsv_fatal_error ();
+}
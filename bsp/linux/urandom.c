@@ -0,0 +1,64 @@
+/*
+ * tsv_read_urandom for the Linux BSP.
+ *
+ * Kept in its own object so applications that provide their own tsv_read_urandom can still link
+ * against libtitan-secure-volume-linux.a.
+ */
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include <titan-secure-volume/app.h>
+
+
+/* Only used on kernels without getrandom.  Opened once and kept open. */
+static int g_urandom_fd = -1;
+
+
+static ssize_t _read_urandom_fd (void *dst, size_t len)
+{
+	if (g_urandom_fd == -1)
+	{
+		g_urandom_fd = open ("/dev/urandom", O_RDONLY | O_CLOEXEC);
+
+		if (g_urandom_fd == -1)
+			return -1;
+	}
+
+	return read (g_urandom_fd, dst, len);
+}
+
+
+void tsv_read_urandom (void *dst, size_t len)
+{
+	static int have_getrandom = 1;
+
+	while (len)
+	{
+		ssize_t bytes;
+
+		if (have_getrandom)
+		{
+			bytes = getrandom (dst, len, 0);
+
+			if (bytes < 0 && errno == ENOSYS)
+			{
+				have_getrandom = 0;
+				continue;
+			}
+		}
+		else
+			bytes = _read_urandom_fd (dst, len);
+
+		if (bytes < 0 && errno == EINTR)
+			continue;
+
+		if (bytes <= 0)
+			tsv_fatal_error ();
+
+		dst = ((uint8_t *)dst) + bytes;
+		len -= (size_t)bytes;
+	}
+}
@@ -0,0 +1,321 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <titan-secure-volume/titan-secure-volume.h>
+#include <titan-secure-volume/app.h>
+#include <titan-secure-volume/sim.h>
+
+
+#ifndef MIN
+	#define MIN(a,b)  (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef MAX
+	#define MAX(a,b)  (((a) > (b)) ? (a) : (b))
+#endif
+
+/* Deepest queue modelled */
+#define SIM_MAX_QUEUE 256
+
+
+TSV_SIM_PROFILE const TSV_SIM_HDD = {
+	.latency_ns = 200000,
+	.bytes_per_sec = 150000000,
+	.seek_ns = 8000000,
+	.sync_ns = 5000000,
+	.queue_depth = 1,
+	.block_size = 4096,
+};
+
+TSV_SIM_PROFILE const TSV_SIM_SATA_SSD = {
+	.latency_ns = 50000,
+	.bytes_per_sec = 500000000,
+	.sync_ns = 1000000,
+	.queue_depth = 32,
+	.block_size = 4096,
+};
+
+TSV_SIM_PROFILE const TSV_SIM_NVME = {
+	.latency_ns = 10000,
+	.bytes_per_sec = 3000000000,
+	.sync_ns = 100000,
+	.queue_depth = 128,
+	.block_size = 4096,
+};
+
+
+typedef struct {
+	uint8_t *data;
+	uint64_t size;
+	uint64_t slots[SIM_MAX_QUEUE];    /* When each queue slot is free again */
+	uint64_t head;                    /* Where the last request ended */
+} DEVICE;
+
+
+/* Global State.  The second device holds offsets from TSV_SPLIT_OFFSET on (tsv_sim_open_second). */
+static struct {
+	DEVICE devices[2];
+	TSV_SIM_PROFILE profile;
+	uint64_t now;                     /* The caller's simulated clock */
+
+	TSV_SIM_OP *log;
+	size_t log_capacity;
+	TSV_SIM_STATS stats;
+} g_sim;
+
+
+static uint64_t _transfer_ns (uint64_t bytes)
+{
+	if (!g_sim.profile.bytes_per_sec)
+		return 0;
+
+	return bytes * 1000000000ull / g_sim.profile.bytes_per_sec;
+}
+
+
+/* Advances the clock for one request.  Reads wait for completion; writes and discards only for a slot. */
+static void _simulate (DEVICE *device, uint32_t type, uint64_t offset, uint64_t len)
+{
+	uint64_t block = g_sim.profile.block_size;
+	uint32_t depth = MIN (MAX (g_sim.profile.queue_depth, 1), SIM_MAX_QUEUE);
+	uint32_t slot = 0;
+	uint64_t bytes = len;
+	uint64_t cost = g_sim.profile.latency_ns;
+	uint32_t unaligned = 0;
+
+	for (uint32_t i = 1; i < depth; ++i)
+	{
+		if (device->slots[i] < device->slots[slot])
+			slot = i;
+	}
+
+	if (offset != device->head)
+	{
+		cost += g_sim.profile.seek_ns;
+		g_sim.stats.seeks += 1;
+	}
+
+	if (block && len && ((offset % block) || (len % block)))
+	{
+		uint64_t first = offset / block;
+		uint64_t end = (offset + len + block - 1) / block;
+
+		unaligned = 1;
+		bytes = (end - first) * block;
+
+		/* Partial blocks are read before they are written */
+		if (type == TSV_SIM_WRITE)
+			cost += g_sim.profile.latency_ns + _transfer_ns ((uint64_t)(((offset % block) != 0) + (((offset + len) % block) != 0)) * block);
+	}
+
+	if (type != TSV_SIM_DISCARD)
+		cost += _transfer_ns (bytes);
+
+	uint64_t start = MAX (g_sim.now, device->slots[slot]);
+
+	device->slots[slot] = start + cost;
+	g_sim.now = (type == TSV_SIM_READ) ? start + cost : start;
+	device->head = offset + len;
+
+	g_sim.stats.ops[type] += 1;
+	g_sim.stats.bytes[type] += len;
+	g_sim.stats.unaligned += unaligned;
+	g_sim.stats.elapsed_ns = g_sim.now;
+
+	if (g_sim.log && g_sim.stats.recorded < g_sim.log_capacity)
+	{
+		g_sim.log[g_sim.stats.recorded] = (TSV_SIM_OP){
+			.type = type,
+			.unaligned = unaligned,
+			.offset = offset + (uint64_t)(device - g_sim.devices) * TSV_SPLIT_OFFSET,
+			.len = len,
+			.start_ns = start,
+			.end_ns = start + cost,
+		};
+		g_sim.stats.recorded += 1;
+	}
+}
+
+
+/* The device an offset lands on, with offset made relative to it.  NULL if out of range. */
+static DEVICE *_in_range (uint64_t *offset, size_t len)
+{
+	DEVICE *device = &g_sim.devices[0];
+
+	if (*offset >= TSV_SPLIT_OFFSET)
+	{
+		device = &g_sim.devices[1];
+		*offset -= TSV_SPLIT_OFFSET;
+	}
+
+	if (!device->data || *offset > device->size || len > device->size - *offset)
+		return NULL;
+
+	return device;
+}
+
+
+int tsv_physical_read (void *dst, uint64_t offset, size_t len)
+{
+	DEVICE *device = _in_range (&offset, len);
+
+	if (device == NULL)
+		return -1;
+
+	_simulate (device, TSV_SIM_READ, offset, len);
+	memmove (dst, device->data + offset, len);
+
+	return 0;
+}
+
+
+int tsv_physical_write (uint64_t offset, void const *src, size_t len)
+{
+	DEVICE *device = _in_range (&offset, len);
+
+	if (device == NULL)
+		return -1;
+
+	_simulate (device, TSV_SIM_WRITE, offset, len);
+	memmove (device->data + offset, src, len);
+
+	return 0;
+}
+
+
+/* Both devices drain and flush at the same time, so the barrier ends when the slower one is done. */
+int tsv_physical_sync (void)
+{
+	uint64_t start = g_sim.now;
+
+	if (!g_sim.devices[0].data)
+		return -1;
+
+	for (uint32_t d = 0; d < 2; ++d)
+	{
+		for (uint32_t i = 0; i < SIM_MAX_QUEUE; ++i)
+			start = MAX (start, g_sim.devices[d].slots[i]);
+	}
+
+	g_sim.now = start + g_sim.profile.sync_ns;
+
+	for (uint32_t d = 0; d < 2; ++d)
+	{
+		for (uint32_t i = 0; i < SIM_MAX_QUEUE; ++i)
+			g_sim.devices[d].slots[i] = g_sim.now;
+	}
+
+	g_sim.stats.ops[TSV_SIM_SYNC] += 1;
+	g_sim.stats.elapsed_ns = g_sim.now;
+
+	if (g_sim.log && g_sim.stats.recorded < g_sim.log_capacity)
+	{
+		g_sim.log[g_sim.stats.recorded] = (TSV_SIM_OP){
+			.type = TSV_SIM_SYNC,
+			.start_ns = start,
+			.end_ns = g_sim.now,
+		};
+		g_sim.stats.recorded += 1;
+	}
+
+	return 0;
+}
+
+
+/* Reads back as zeros, like most SSDs after TRIM */
+int tsv_physical_discard (uint64_t offset, size_t len)
+{
+	DEVICE *device = _in_range (&offset, len);
+
+	if (device == NULL)
+		return -1;
+
+	_simulate (device, TSV_SIM_DISCARD, offset, len);
+	memset (device->data + offset, 0, len);
+
+	return 0;
+}
+
+
+static int _open_device (DEVICE *device, uint64_t size)
+{
+	if (size > SIZE_MAX)
+		return -1;
+
+	if ((device->data = calloc (1, MAX ((size_t)size, 1))) == NULL)
+		return -1;
+
+	device->size = size;
+
+	return 0;
+}
+
+
+int tsv_sim_open (uint64_t size, TSV_SIM_PROFILE const *profile)
+{
+	tsv_sim_close ();
+
+	if (profile == NULL)
+		return -1;
+
+	g_sim.profile = *profile;
+
+	return _open_device (&g_sim.devices[0], size);
+}
+
+
+int tsv_sim_open_second (uint64_t size)
+{
+	if (!g_sim.devices[0].data || g_sim.devices[1].data)
+		return -1;
+
+	return _open_device (&g_sim.devices[1], size);
+}
+
+
+void tsv_sim_close (void)
+{
+	free (g_sim.devices[0].data);
+	free (g_sim.devices[1].data);
+	memset (&g_sim, 0, sizeof (g_sim));
+}
+
+
+uint8_t *tsv_sim_data (void)
+{
+	return g_sim.devices[0].data;
+}
+
+
+uint8_t *tsv_sim_data_second (void)
+{
+	return g_sim.devices[1].data;
+}
+
+
+void tsv_sim_record (TSV_SIM_OP *log, size_t capacity)
+{
+	g_sim.log = log;
+	g_sim.log_capacity = log ? capacity : 0;
+
+	/* Stopping keeps the count, so it can still be read */
+	if (log)
+		g_sim.stats.recorded = 0;
+}
+
+
+void tsv_sim_stats (TSV_SIM_STATS *stats)
+{
+	*stats = g_sim.stats;
+}
+
+
+void tsv_sim_reset (void)
+{
+	uint64_t recorded = g_sim.stats.recorded;
+
+	memset (&g_sim.stats, 0, sizeof (g_sim.stats));
+	memset (g_sim.devices[0].slots, 0, sizeof (g_sim.devices[0].slots));
+	memset (g_sim.devices[1].slots, 0, sizeof (g_sim.devices[1].slots));
+	g_sim.now = 0;
+	g_sim.stats.recorded = recorded;
+}
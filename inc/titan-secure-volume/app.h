@@ -12,4 +12,29 @@ void tsv_read_urandom (void *dst, size_t len);
 int tsv_physical_read (void *dst, uint64_t offset, size_t len);
 int tsv_physical_write (uint64_t offset, void const *src, size_t len);
 
+/* Barrier: must not return until all previous tsv_physical_write calls are durable. */
+int tsv_physical_sync (void);
+
+/* Optional.  Returns a pointer to len bytes of physical storage at offset, or NULL if it cannot be
+ * mapped, in which case tsv_physical_read is used.  The library authenticates and decrypts straight
+ * out of the mapping, so the storage must not be modified by anyone else while the volume is open.
+ * The default implementation always returns NULL.
+ */
+void const *tsv_physical_map (uint64_t offset, size_t len);
+
+/* Optional.  Tells the storage that len bytes at offset are no longer needed (e.g. TRIM), after the
+ * library has durably marked them unused.  Their contents may be lost.  Note that storage which then
+ * reads back as zeros shows which Sectors are in use.  The default implementation does nothing.
+ */
+int tsv_physical_discard (uint64_t offset, size_t len);
+
+/* Optional; needed for tsv_set_threaded.  Mutexes numbered 0 to TSV_LOCK_COUNT-1, which must not be
+ * recursive.  The library only takes them in increasing order, so they cannot deadlock.
+ * The default implementations call tsv_fatal_error.
+ */
+#define TSV_LOCK_COUNT 66
+
+void tsv_lock (uint32_t lock);
+void tsv_unlock (uint32_t lock);
+
 #endif
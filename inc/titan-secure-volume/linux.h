@@ -0,0 +1,58 @@
+/*
+ * Linux BSP.
+ *
+ * Implements the tsv_physical_* functions and tsv_read_urandom from app.h on top of a regular file
+ * or block device.  Link libtitan-secure-volume-linux.a and call tsv_linux_open before tsv_create
+ * or tsv_open.  The application still provides tsv_fatal_error.  tsv_lock and tsv_unlock are provided
+ * too, so tsv_set_threaded can be used; every mode may be accessed from several threads.
+ */
+#ifndef __TSV_LINUX_H__
+#define __TSV_LINUX_H__
+
+#include <stdint.h>
+
+
+/* O_DIRECT, through an aligned bounce buffer unless the request is already aligned.  Bypasses the page
+ * cache.  In threaded mode reads run in parallel; writes take turns.
+ */
+#define TSV_LINUX_DIRECT    0
+/* Plain pread/pwrite through the page cache.  For filesystems without O_DIRECT support, such as tmpfs. */
+#define TSV_LINUX_BUFFERED  1
+/* The whole device is mapped with mmap, and tsv_physical_map is supported. */
+#define TSV_LINUX_MMAP      2
+
+/* May be OR'ed into any mode.  Implements tsv_physical_discard by punching holes in regular files and
+ * with BLKDISCARD on block devices.  Off by default: it shows which Sectors are unused.
+ */
+#define TSV_LINUX_DISCARD   0x100
+
+
+/* Opens path as the backing storage using one of the modes above.
+ * If size is larger than a regular file, the file is extended.  A size of 0 uses the current size.
+ */
+int tsv_linux_open (char const *path, uint64_t size, int mode);
+
+/* Opens path as the second device of a TSV_FEATURE_SPLIT volume, in the same mode as tsv_linux_open,
+ * which must be called first.  Offsets from TSV_SPLIT_OFFSET on go to it, and tsv_physical_sync flushes
+ * both devices in parallel.  size is as for tsv_linux_open.
+ */
+int tsv_linux_open_second (char const *path, uint64_t size);
+
+/* Syncs and releases the backing storage, both devices if there are two. */
+int tsv_linux_close (void);
+
+/* Maps the POSIX shared memory object name (e.g. "/my-volume") for tsv_open_readonly, creating it with
+ * len bytes if it does not exist.  Returns NULL if it exists with another size.  Unmap it with
+ * tsv_linux_host_cache_close once the volume is closed; shm_unlink removes it.
+ */
+void *tsv_linux_host_cache (char const *name, size_t len);
+int tsv_linux_host_cache_close (void *cache, size_t len);
+
+/* Traces every call tsv_set_trace reports to the file at path (see TSV_TRACE_MAGIC), timestamped with
+ * CLOCK_MONOTONIC, until tsv_linux_trace_close.  Replaces any other tsv_set_trace hook.
+ * tsv_linux_trace_close fails if any record could not be written.
+ */
+int tsv_linux_trace_open (char const *path);
+int tsv_linux_trace_close (void);
+
+#endif
@@ -0,0 +1,92 @@
+/*
+ * Simulated storage BSP.
+ *
+ * Implements the tsv_physical_* functions from app.h on top of RAM, while keeping a simulated clock
+ * of how long the same requests would take on a device described by a TSV_SIM_PROFILE.  Every request
+ * is counted, and optionally recorded, so tests can assert I/O counts and compare profiles without
+ * real hardware.  Link libtitan-secure-volume-sim.a and call tsv_sim_open before tsv_create or
+ * tsv_open.  The application still provides tsv_fatal_error and tsv_read_urandom.
+ *
+ * The model: reads block until they complete.  Writes and discards are posted, so the caller only
+ * waits for one of queue_depth slots, and tsv_physical_sync waits for every slot to drain.  A request
+ * that does not start where the previous one ended pays seek_ns.  A request that is not aligned to
+ * block_size transfers whole blocks, and a partial block write also pays for reading the block first.
+ * A second device (tsv_sim_open_second) has a queue and head of its own, and is flushed alongside the
+ * first.  Not thread safe.
+ */
+#ifndef __TSV_SIM_H__
+#define __TSV_SIM_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+typedef struct
+{
+	uint64_t latency_ns;      /* Fixed cost of every request */
+	uint64_t bytes_per_sec;   /* Transfer rate; 0 for unlimited */
+	uint64_t seek_ns;         /* Extra cost of a request that is not sequential */
+	uint64_t sync_ns;         /* Cost of a barrier, once the queue has drained */
+	uint32_t queue_depth;     /* Requests in flight at once; 0 is treated as 1 */
+	uint32_t block_size;      /* Alignment of the media; 0 for none */
+} TSV_SIM_PROFILE;
+
+/* Rough figures for common media */
+extern TSV_SIM_PROFILE const TSV_SIM_HDD;
+extern TSV_SIM_PROFILE const TSV_SIM_SATA_SSD;
+extern TSV_SIM_PROFILE const TSV_SIM_NVME;
+
+
+#define TSV_SIM_READ     0
+#define TSV_SIM_WRITE    1
+#define TSV_SIM_SYNC     2
+#define TSV_SIM_DISCARD  3
+
+typedef struct
+{
+	uint32_t type;            /* TSV_SIM_* */
+	uint32_t unaligned;       /* Paid the alignment penalty */
+	uint64_t offset;
+	uint64_t len;
+	uint64_t start_ns;        /* When the device began the request */
+	uint64_t end_ns;          /* When it completed */
+} TSV_SIM_OP;
+
+typedef struct
+{
+	uint64_t ops[4];          /* Requests of each TSV_SIM_* type */
+	uint64_t bytes[4];        /* Bytes requested of each type */
+	uint64_t seeks;
+	uint64_t unaligned;
+	uint64_t recorded;        /* Requests stored by tsv_sim_record */
+	uint64_t elapsed_ns;      /* Simulated time the caller has spent waiting */
+} TSV_SIM_STATS;
+
+
+/* Allocates size bytes of zeroed storage, described by profile (copied).  Any previous storage is freed. */
+int tsv_sim_open (uint64_t size, TSV_SIM_PROFILE const *profile);
+
+/* Adds a second device of size bytes, with the same profile, for TSV_FEATURE_SPLIT volumes.  Offsets
+ * from TSV_SPLIT_OFFSET on go to it.  Requests to both are counted and recorded together.
+ */
+int tsv_sim_open_second (uint64_t size);
+
+/* Frees the storage. */
+void tsv_sim_close (void);
+
+/* The storage itself, e.g. for injecting corruption.  Accesses through it are not counted. */
+uint8_t *tsv_sim_data (void);
+uint8_t *tsv_sim_data_second (void);
+
+/* Records the following requests into log, up to capacity of them; NULL stops recording.
+ * TSV_SIM_STATS.recorded counts them.
+ */
+void tsv_sim_record (TSV_SIM_OP *log, size_t capacity);
+
+/* Counters since tsv_sim_open or the last tsv_sim_reset, which also restarts the clock with an
+ * empty queue.
+ */
+void tsv_sim_stats (TSV_SIM_STATS *stats);
+void tsv_sim_reset (void);
+
+#endif
@@ -1,30 +1,303 @@
 #ifndef __TITAN_SECURE_VOLUME_H__
 #define __TITAN_SECURE_VOLUME_H__
 
+#include <stddef.h>
 #include <stdint.h>
 
 
 #define TSV_MAC_KEY_SIZE 64
 #define TSV_ENCRYPTION_KEY_SIZE 64
 
+/* Optional features, chosen when a volume is created (tsv_create_ex) */
+#define TSV_FEATURE_DISCARD 0x00000001    /* Allocation bitmap, see tsv_discard */
+#define TSV_FEATURE_SPLIT   0x00000002    /* Second copy on its own device, see TSV_SPLIT_OFFSET */
+#define TSV_FEATURE_PARITY  0x00000004    /* Reed-Solomon parity instead of a second copy, see tsv_create_parity */
+#define TSV_FEATURE_INTENT  0x00000008    /* Write-intent record, so tsv_open after a crash only checks recently written regions */
+#define TSV_FEATURE_SHARED  0x00000010    /* Both copies hold the same ciphertext, so the second copy costs no crypto */
+#define TSV_FEATURE_LOG     0x00000020    /* Writes are appended to a log and cleaned home later, see tsv_log_clean */
+#define TSV_FEATURE_TRACK   0x00000040    /* Records the epoch each Sector was written in, see tsv_track_export */
+#define TSV_FEATURES_ALL    0x0000007F    /* Every flag above */
+
+/* Bytes in one record of tsv_track_export: a 4 byte little-endian Sector number, both copies' MAC tags,
+ * then both copies' ciphertext.
+ */
+#define TSV_TRACK_RECORD_SIZE(sector_size) (4 + 2 * 32 + 2 * (size_t)(sector_size))
+
+/* TSV_FEATURE_SPLIT volumes address their second device from this physical offset on.  It holds a copy
+ * of the header, then the second copy's MAC tags and data, so either device can fail on its own.  The
+ * BSP routes requests at or past this offset to the second device; reads are spread over both.
+ */
+#define TSV_SPLIT_OFFSET 0x4000000000000000ull
+
+
+/* Result of tsv_verify.  Discarded Sectors are not counted.  For TSV_FEATURE_PARITY volumes bad[1]
+ * counts parity Sectors, and lost the damaged Sectors of groups with more damage than parity to rebuild it.
+ */
+typedef struct
+{
+	uint32_t bad[2];    /* Sectors whose first (0) or second (1) copy fails authentication */
+	uint32_t lost;      /* Sectors with neither copy intact */
+} TSV_VERIFY;
+
+
+/* Bytes through each cryptographic primitive, from tsv_crypto_stats */
+typedef struct
+{
+	uint64_t encrypted;
+	uint64_t decrypted;
+	uint64_t keystream;       /* Noise, e.g. for Sectors not yet written */
+	uint64_t authenticated;   /* MAC'ed, whether sealing or verifying */
+} TSV_CRYPTO_STATS;
+
+
+/* Trace hook, see tsv_set_trace.  type is one of TSV_TRACE_*, and result what the call returned. */
+typedef void (*TSV_TRACE_HOOK) (void *ctx, uint32_t type, uint64_t offset, uint64_t len, int result);
+
+#define TSV_TRACE_READ     0
+#define TSV_TRACE_WRITE    1
+#define TSV_TRACE_FLUSH    2
+#define TSV_TRACE_DISCARD  3
+#define TSV_TRACE_READV    4   /* offset and total len of the buffers */
+#define TSV_TRACE_WRITEV   5
+#define TSV_TRACE_READ_BATCH       6   /* First request of a tsv_read_batch that reads anything */
+#define TSV_TRACE_READ_BATCH_NEXT  7   /* Each further such request, in order */
+
+/* Trace files, as written by tsv_linux_trace_open and replayed by tools/tsv-replay: the 8 bytes of
+ * TSV_TRACE_MAGIC, then one record per call.  A record is its time in nanoseconds since the trace began [8],
+ * offset [8], len [4], type [1], 1 if it failed [1] and 2 zero bytes, all little-endian.  Calls longer
+ * than TSV_TRACE_MAX_LEN are recorded in pieces.
+ */
+#define TSV_TRACE_MAGIC "TSVTRC01"
+#define TSV_TRACE_RECORD_SIZE 24
+#define TSV_TRACE_MAX_LEN 0x80000000u
+
+
+/* Memory for tsv_init.  Counts of 0 leave the corresponding cache out.  Buffers that only some features
+ * need are carved only if asked for; volumes needing one left out cannot be created or opened.
+ */
+typedef struct
+{
+	uint32_t max_sector_size;   /* Largest Sector size that will be created or opened */
+	uint32_t features;          /* TSV_FEATURE_* of the volumes that will be created or opened */
+	uint32_t vectored;          /* Non-zero if tsv_readv, tsv_writev or tsv_read_batch will be used */
+	uint32_t cache_sectors;     /* Decrypted Sectors kept in memory */
+	uint32_t mac_pages;         /* Pages of MAC tags kept in memory, TSV_MAC_PAGE_SIZE bytes each */
+	uint32_t staging_size;      /* Bytes for fetching runs of whole Sectors with one physical read */
+	uint32_t io_queue_size;     /* Bytes of writes held until the next barrier, then sorted and merged */
+} TSV_CONFIG;
+
+#define TSV_MAC_PAGE_SIZE 512
+
+
+/* One buffer of a tsv_readv or tsv_writev */
+typedef struct
+{
+	void *base;
+	size_t len;
+} TSV_IOVEC;
+
+/* Requests of a tsv_read_batch sorted together */
+#define TSV_READ_BATCH_WINDOW 32
+
+/* One read of a tsv_read_batch */
+typedef struct
+{
+	void *dst;
+	uint64_t offset;
+	size_t len;
+} TSV_READ_REQUEST;
+
 
 /* Titan Secure Volume API */
 
+/* Memory.  By default the library uses a small static arena that fits Sectors of up to 4096 bytes and
+ * has no caches; builds may shrink it, or leave it out, with TSV_DEFAULT_MAX_SECTOR_SIZE.  tsv_init
+ * carves every buffer and cache from the caller's arena instead, as config describes; nothing is ever
+ * allocated.  tsv_arena_size gives the bytes needed, or 0 if config is invalid.  Call tsv_init while no
+ * volume is open, and keep the arena until the next tsv_init; tsv_init (NULL, 0, NULL) goes back to the
+ * default, or fails if the build has none.  The arena is wiped by tsv_close.  An I/O queue takes twice
+ * io_queue_size, plus a few bytes for each write it can hold.
+ */
+size_t tsv_arena_size (TSV_CONFIG const *config);
+int tsv_init (void *arena, size_t arena_len, TSV_CONFIG const *config);
+
 /* */
 int tsv_create (uint8_t const mac_key[static TSV_MAC_KEY_SIZE], uint8_t const encryption_key[static TSV_ENCRYPTION_KEY_SIZE], uint32_t sector_size, uint32_t sector_count);
 
+/* tsv_create with features.  sector_count is the number of Sectors available to tsv_read and tsv_write;
+ * some features store extra Sectors, so use tsv_physical_size_ex to size storage.
+ */
+int tsv_create_ex (uint8_t const mac_key[static TSV_MAC_KEY_SIZE], uint8_t const encryption_key[static TSV_ENCRYPTION_KEY_SIZE], uint32_t sector_size, uint32_t sector_count, uint32_t features);
+
+/* Creates a TSV_FEATURE_PARITY volume.  Instead of a second copy, every group of data_shards Sectors gets
+ * parity_shards Reed-Solomon parity Sectors, so any parity_shards damaged Sectors of a group can be
+ * rebuilt.  Storage overhead is parity_shards / data_shards, and each commit rewrites the parity of every
+ * group it touches, so this suits volumes written in long runs.  One data and two parity shards is a
+ * three-way mirror.  data_shards may be 1 to 32 and parity_shards 1 to 8.  Parity volumes cannot have
+ * other features, grow, rekey or use threaded mode.  Size storage with tsv_physical_size_parity.
+ */
+int tsv_create_parity (uint8_t const mac_key[static TSV_MAC_KEY_SIZE], uint8_t const encryption_key[static TSV_ENCRYPTION_KEY_SIZE], uint32_t sector_size, uint32_t sector_count, uint32_t data_shards, uint32_t parity_shards);
+
 /* */
 int tsv_open (uint8_t const mac_key[static TSV_MAC_KEY_SIZE], uint8_t const encryption_key[static TSV_ENCRYPTION_KEY_SIZE]);
 
+/* Opens a volume that is only read; every write, discard, grow, rekey and log cleaning is refused.  A
+ * volume left by a crash, or part way through a grow or rekey, must be opened with tsv_open first.
+ * host_cache, if not NULL, is host_cache_len bytes of memory shared by every process reading the volume
+ * with the same keys (the Linux BSP maps one with tsv_linux_host_cache), where Sectors are kept once
+ * authenticated and decrypted.  It must be 8 byte aligned and zero-filled when first created; the first
+ * process to attach sets it up, and fails anyone else's for a different volume or keys.  It holds
+ * plaintext, so treat it like the keys.  The volume must not be written while anyone is attached.
+ * tsv_host_cache_size gives the bytes needed to hold sectors Sectors, or 0 if that is too many.
+ */
+int tsv_open_readonly (uint8_t const mac_key[static TSV_MAC_KEY_SIZE], uint8_t const encryption_key[static TSV_ENCRYPTION_KEY_SIZE], void *host_cache, size_t host_cache_len);
+size_t tsv_host_cache_size (uint32_t sector_size, uint32_t sectors);
+
 /* */
 int tsv_read (void *dst, uint64_t offset, size_t len);
 
 /* */
 int tsv_write (uint64_t offset, void const *src, size_t len);
 
-/* */
+/* tsv_read and tsv_write of one contiguous range, to or from iovcnt buffers in turn.  Every Sector is
+ * read or sealed once, however many buffers it is split across, and a tsv_writev commits like one
+ * tsv_write.
+ */
+int tsv_readv (uint64_t offset, TSV_IOVEC const *iov, size_t iovcnt);
+int tsv_writev (uint64_t offset, TSV_IOVEC const *iov, size_t iovcnt);
+
+/* Performs count independent reads, TSV_READ_BATCH_WINDOW requests at a time.  Within a window each
+ * distinct Sector is authenticated and decrypted once however many requests touch it, Sectors are fetched
+ * in ascending order, and with a staging area runs of adjacent Sectors are fetched with one physical read.
+ * Requests may overlap; fails without reading anything if any request is out of range.
+ */
+int tsv_read_batch (TSV_READ_REQUEST const *requests, size_t count);
+
+/* Marks the Sectors entirely inside [offset, offset+len) as unused.  They read as zeros without touching
+ * storage or the cipher until written again.  Partial Sectors at either end are left alone.  Like writes,
+ * discards are durable after the next commit, and are then passed on to tsv_physical_discard.
+ * Requires TSV_FEATURE_DISCARD.
+ */
+int tsv_discard (uint64_t offset, uint64_t len);
+
+/* Commits all outstanding writes; both copies of every written Sector are durable on return. */
 int tsv_flush (void);
 
+/* Group commit.  Between begin and end, tsv_write only updates one copy of each Sector.
+ * The other copies are written by tsv_flush, tsv_batch_end, or when the internal queue fills,
+ * costing two tsv_physical_sync calls per commit instead of two per tsv_write.
+ */
+int tsv_batch_begin (void);
+int tsv_batch_end (void);
+
+/* Deferred replication.  While enabled, tsv_write returns as soon as one copy of each Sector is written.
+ * Stale copies are brought up to date by tsv_replicate (e.g. from an idle loop), tsv_flush, or when the
+ * queue fills.  Until then writes keep going to the fresh copy; the stale copy is never overwritten first.
+ * Disabling deferred replication flushes.
+ */
+int tsv_set_deferred (int enable);
+
+/* Brings up to max_sectors stale copies up to date, oldest first. */
+int tsv_replicate (uint32_t max_sectors);
+
+/* Number of Sectors with a stale copy.  Zero means all replicas are in sync. */
+uint32_t tsv_replicas_pending (void);
+
+/* Log volumes (TSV_FEATURE_LOG) append every written Sector to a log of 256 Sectors per copy, so small
+ * random writes reach storage sequentially, and write them back to their place later.  tsv_log_clean
+ * writes back up to max_sectors committed Sectors, oldest first (e.g. from an idle loop); tsv_write does
+ * so itself, after a commit, when the log is full.  tsv_log_used is the number of Sectors in the log.
+ * Log volumes cannot have parity, a split or a write-intent record, and cannot grow, rekey or use
+ * threaded mode.
+ */
+int tsv_log_clean (uint32_t max_sectors);
+uint32_t tsv_log_used (void);
+
+/* Tracked volumes (TSV_FEATURE_TRACK) record the epoch each Sector, bitmap Sectors included, was last
+ * written in, for incremental backups.  tsv_track_epoch is the current epoch (1 after tsv_create, 0 if
+ * the volume is not tracked), and tsv_track_advance starts a new one and returns it, 0 on failure.
+ * tsv_track_export fills dst with up to max_records records (TSV_TRACK_RECORD_SIZE, also given by
+ * tsv_track_record_size) of the Sectors written in epoch since or later, starting at Sector *cursor and
+ * advancing it, and returns how many; it returns 0 once *cursor reaches the end.  Records hold storage as
+ * it lies, so nothing is decrypted.  tsv_track_import applies records to a replica, a volume with the
+ * same keys made from a copy of this one's storage, and fails without writing anything unless every
+ * record authenticates.  To back up: call tsv_track_advance and copy the whole storage; each later backup
+ * calls tsv_track_advance again and exports since the epoch the previous one returned.  A crash may mark
+ * Sectors that were not written, never the reverse.  Tracked volumes cannot be split or have a log, and
+ * cannot grow, rekey or use threaded mode.
+ */
+uint32_t tsv_track_epoch (void);
+uint32_t tsv_track_advance (void);
+size_t tsv_track_record_size (void);
+int tsv_track_export (uint32_t since, uint32_t *cursor, void *dst, uint32_t max_records);
+int tsv_track_import (void const *src, uint32_t count);
+
+/* Threaded mode.  While enabled, tsv_read, tsv_write, tsv_discard and tsv_rekey_range may be called from
+ * several threads at once; nothing else may run concurrently with them.  Writes to different Sectors
+ * proceed in parallel and a partial Sector write is atomic.  There is no group commit: each tsv_write is
+ * durable on return, and batch and deferred modes and grow are refused.  Needs tsv_lock and tsv_unlock
+ * (app.h).
+ */
+int tsv_set_threaded (int enable);
+
+/* Online grow to new_sector_count Sectors.  Physical storage must already be tsv_physical_size bytes
+ * for the new count.  Existing Sectors are moved, not re-encrypted, and the volume stays readable but
+ * not writable until the grow finishes.  An interrupted grow resumes after tsv_open; call tsv_grow again
+ * with the same count (or tsv_grow_begin and tsv_grow_step) to finish it.
+ * tsv_grow_step moves about max_bytes and returns 1 while there is more to do, 0 once the grow is done.
+ * TSV_FEATURE_SPLIT volumes cannot grow.
+ */
+int tsv_grow (uint32_t new_sector_count);
+int tsv_grow_begin (uint32_t new_sector_count);
+int tsv_grow_step (uint64_t max_bytes);
+
+/* Re-seals every Sector under new keys, without going through tsv_read and tsv_write.  The volume stays
+ * readable but not writable until the rekey finishes, and keeps opening with the old keys until then.
+ * An interrupted rekey resumes after tsv_open; call tsv_rekey again with the same new keys to finish it.
+ * Reads may fail after such a tsv_open until tsv_rekey_begin has been given the new keys.
+ * tsv_rekey_step re-seals about max_bytes and returns 1 while there is more to do, 0 once the rekey is done.
+ *
+ * tsv_rekey_step is tsv_rekey_next followed by tsv_rekey_range over the whole step.  tsv_rekey_next hands
+ * out the next step of about max_bytes, at most 2048 Sectors, as on-disk Sectors [*first, *first+*count)
+ * and returns 1, or returns 0 once the rekey is done.  tsv_rekey_range re-seals part of that step, a run
+ * of whole Sectors at a time through scratch, which must hold at least one Sector and its 32 byte tag.
+ * In threaded mode it may run on several threads at once, on disjoint parts of the step with separate
+ * scratch buffers, alongside tsv_read.  A step whose Sectors were not all re-sealed is handed out again;
+ * a Sector re-sealed twice is only counted once.
+ */
+int tsv_rekey (uint8_t const mac_key[static TSV_MAC_KEY_SIZE], uint8_t const encryption_key[static TSV_ENCRYPTION_KEY_SIZE]);
+int tsv_rekey_begin (uint8_t const mac_key[static TSV_MAC_KEY_SIZE], uint8_t const encryption_key[static TSV_ENCRYPTION_KEY_SIZE]);
+int tsv_rekey_step (uint64_t max_bytes);
+int tsv_rekey_next (uint64_t max_bytes, uint32_t *first, uint32_t *count);
+int tsv_rekey_range (uint32_t first, uint32_t count, void *scratch, size_t scratch_len);
+
+/* Checks the MAC tags of both copies of Sectors [first, first+count) and adds the failures to result.
+ * Nothing is decrypted or repaired.  scratch must hold 2*sector_size bytes.  Fails if replicas are
+ * pending or a grow or rekey is in progress.  Only reads the volume, so calls with separate scratch
+ * buffers may run on several threads at once, provided tsv_physical_read and tsv_physical_map can.
+ */
+int tsv_verify (uint32_t first, uint32_t count, void *scratch, TSV_VERIFY *result);
+
+/* Tracing.  While a hook is set, every tsv_read, tsv_write, tsv_readv, tsv_writev, tsv_read_batch,
+ * tsv_discard and tsv_flush is reported to it as it returns, including those made by the library itself
+ * (e.g. the flush of tsv_close).  A tsv_readv or tsv_writev is one record, not the reads and writes it
+ * makes, and a tsv_read_batch one record per request, all with the batch's result.  Flushes have an
+ * offset and len of 0.  The library has no clock, so the hook timestamps them.  In threaded mode it is
+ * called from several threads at once.  The hook stays set across tsv_close; tsv_set_trace (NULL, NULL)
+ * removes it.
+ */
+void tsv_set_trace (TSV_TRACE_HOOK hook, void *ctx);
+
+/* Counters of every byte encrypted, decrypted and authenticated while counting was enabled, since the
+ * program started or the last tsv_crypto_reset, whether by a volume or tsv_create.  Counting is off
+ * until tsv_crypto_count (1), and costs an atomic add on every call into the cipher or MAC while on.
+ * It needs a build with TSV_CRYPTO_COUNTERS, the default on Linux; elsewhere tsv_crypto_count (1) fails
+ * and the counters stay at zero.
+ */
+int tsv_crypto_count (int enable);
+void tsv_crypto_stats (TSV_CRYPTO_STATS *stats);
+void tsv_crypto_reset (void);
+
 /* */
 int tsv_close (void);
 
@@ -32,5 +305,18 @@ int tsv_close (void);
 /* */
 uint64_t tsv_get_size (void);
 
+/* */
+uint32_t tsv_get_sector_size (void);
+
+/* TSV_FEATURE_* flags of the open volume */
+uint32_t tsv_get_features (void);
+
+/* Number of bytes of physical storage needed for a volume, or 0 if the parameters are invalid.
+ * With TSV_FEATURE_SPLIT this is the size of each of the two devices.
+ */
+uint64_t tsv_physical_size (uint32_t sector_size, uint32_t sector_count);
+uint64_t tsv_physical_size_ex (uint32_t sector_size, uint32_t sector_count, uint32_t features);
+uint64_t tsv_physical_size_parity (uint32_t sector_size, uint32_t sector_count, uint32_t data_shards, uint32_t parity_shards);
+
 
 #endif
@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strong-arm/threefish.h>
@@ -8,12 +9,70 @@
 #include "_ciphers.h"
 
 
+/* Bytes through each primitive, for tsv_crypto_stats.  Threaded mode calls in from several threads, so
+ * the counters are atomic, and only touched while tsv_crypto_count has them enabled.  Builds without
+ * TSV_CRYPTO_COUNTERS (e.g. targets with no 64-bit atomics) leave them out.
+ */
+#ifdef TSV_CRYPTO_COUNTERS
+static TSV_CRYPTO_STATS g_crypto_stats = {0};
+static bool g_crypto_counting = false;
+
+#define COUNT_BYTES(field, len) do { if (__atomic_load_n (&g_crypto_counting, __ATOMIC_RELAXED)) __atomic_fetch_add (&g_crypto_stats.field, (uint64_t)(len), __ATOMIC_RELAXED); } while (0)
+
+
+int tsv_crypto_count (int enable)
+{
+	__atomic_store_n (&g_crypto_counting, enable != 0, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+
+void tsv_crypto_stats (TSV_CRYPTO_STATS *stats)
+{
+	stats->encrypted = __atomic_load_n (&g_crypto_stats.encrypted, __ATOMIC_RELAXED);
+	stats->decrypted = __atomic_load_n (&g_crypto_stats.decrypted, __ATOMIC_RELAXED);
+	stats->keystream = __atomic_load_n (&g_crypto_stats.keystream, __ATOMIC_RELAXED);
+	stats->authenticated = __atomic_load_n (&g_crypto_stats.authenticated, __ATOMIC_RELAXED);
+}
+
+
+void tsv_crypto_reset (void)
+{
+	__atomic_store_n (&g_crypto_stats.encrypted, 0, __ATOMIC_RELAXED);
+	__atomic_store_n (&g_crypto_stats.decrypted, 0, __ATOMIC_RELAXED);
+	__atomic_store_n (&g_crypto_stats.keystream, 0, __ATOMIC_RELAXED);
+	__atomic_store_n (&g_crypto_stats.authenticated, 0, __ATOMIC_RELAXED);
+}
+#else
+#define COUNT_BYTES(field, len) ((void)0)
+
+
+int tsv_crypto_count (int enable)
+{
+	return enable ? -1 : 0;
+}
+
+
+void tsv_crypto_stats (TSV_CRYPTO_STATS *stats)
+{
+	memset (stats, 0, sizeof (*stats));
+}
+
+
+void tsv_crypto_reset (void)
+{
+}
+#endif
+
+
 
 /* These asserts should be updated if the implemented cryptography changes. */
 _Static_assert (ENCRYPTION_BLOCK_SIZE == 64, "ENCRYPTION_BLOCK_SIZE does not match implemented cryptography.");
 _Static_assert (TSV_ENCRYPTION_KEY_SIZE == 64, "TSV_ENCRYPTION_KEY_SIZE does not match implemented cryptography.");
 
-void _volume_encrypt (void *dst, uint8_t const key[static TSV_ENCRYPTION_KEY_SIZE], void const *src, size_t len, uint32_t sector_num)
+/* Inlined into each caller, so a constant len gives a loop with a known trip count. */
+static inline __attribute__((always_inline)) void _threefish_blocks (void *dst, uint8_t const key[static TSV_ENCRYPTION_KEY_SIZE], void const *src, size_t len, uint32_t sector_num, bool encrypt)
 {
 	uint8_t tweak[16] = {0};
 	uint64_t block_num = 0;
@@ -24,11 +83,15 @@ void _volume_encrypt (void *dst, uint8_t const key[static TSV_ENCRYPTION_KEY_SIZ
 	// Calculate initial tweak
 	pack_uint32_little (tweak, sector_num);
 
-	// Encrypt blocks
+	// Encrypt or decrypt blocks
 	for (; len; len -= 64)
 	{
 		pack_uint64_little (tweak+8, block_num);
-		threefish512_encrypt_block (dst, key, tweak, src);
+
+		if (encrypt)
+			threefish512_encrypt_block (dst, key, tweak, src);
+		else
+			threefish512_decrypt_block (dst, key, tweak, src);
 
 		block_num += 1;
 		src = ((uint8_t const *)src) + 64;
@@ -37,25 +100,55 @@ void _volume_encrypt (void *dst, uint8_t const key[static TSV_ENCRYPTION_KEY_SIZ
 }
 
 
+void _volume_encrypt (void *dst, uint8_t const key[static TSV_ENCRYPTION_KEY_SIZE], void const *src, size_t len, uint32_t sector_num)
+{
+	COUNT_BYTES (encrypted, len);
+
+#ifdef TSV_FIXED_SECTOR_SIZE
+	if (len == TSV_FIXED_SECTOR_SIZE)
+	{
+		_threefish_blocks (dst, key, src, TSV_FIXED_SECTOR_SIZE, sector_num, true);
+		return;
+	}
+#endif
+
+	_threefish_blocks (dst, key, src, len, sector_num, true);
+}
+
+
 void _volume_decrypt (void *dst, uint8_t const key[static TSV_ENCRYPTION_KEY_SIZE], void const *src, size_t len, uint32_t sector_num)
 {
-	uint8_t tweak[16] = {0};
-	uint64_t block_num = 0;
+	COUNT_BYTES (decrypted, len);
+
+#ifdef TSV_FIXED_SECTOR_SIZE
+	if (len == TSV_FIXED_SECTOR_SIZE)
+	{
+		_threefish_blocks (dst, key, src, TSV_FIXED_SECTOR_SIZE, sector_num, false);
+		return;
+	}
+#endif
+
+	_threefish_blocks (dst, key, src, len, sector_num, false);
+}
+
+
+/* Threefish-512 in counter mode: block i of the output is the encryption of counter + i. */
+void _volume_keystream (void *dst, uint8_t const key[static TSV_ENCRYPTION_KEY_SIZE], uint64_t counter, size_t len)
+{
+	uint8_t const tweak[16] = {0};
+	uint8_t block[64] = {0};
 
 	if ((len & 63) != 0)
 		tsv_fatal_error ();
 
-	// Calculate initial tweak
-	pack_uint32_little (tweak, sector_num);
+	COUNT_BYTES (keystream, len);
 
-	// Decrypt blocks
 	for (; len; len -= 64)
 	{
-		pack_uint64_little (tweak+8, block_num);
-		threefish512_decrypt_block (dst, key, tweak, src);
+		pack_uint64_little (block, counter);
+		threefish512_encrypt_block (dst, key, tweak, block);
 
-		block_num += 1;
-		src = ((uint8_t const *)src) + 64;
+		counter += 1;
 		dst = ((uint8_t *)dst) + 64;
 	}
 }
@@ -71,6 +164,7 @@ void _volume_mac (void *dst, uint8_t const key[static TSV_MAC_KEY_SIZE], void co
 	uint8_t tmp[4];
 	HMAC_STATE hmac_state;
 
+	COUNT_BYTES (authenticated, len);
 	pack_uint32_little (tmp, sector_num);
 	HMAC_partial (NULL, &hmac_state, key, TSV_MAC_KEY_SIZE, src, len, true, false);
 	HMAC_partial (dst, &hmac_state, NULL, 0, tmp, sizeof (tmp), false, true);
@@ -26,6 +26,9 @@ void _volume_encrypt (void *dst, uint8_t const key[static TSV_ENCRYPTION_KEY_SIZ
 /* See above */
 void _volume_decrypt (void *dst, uint8_t const key[static TSV_ENCRYPTION_KEY_SIZE], void const *src, size_t len, uint32_t sector_num);
 
+/* len bytes of keystream, a multiple of ENCRYPTION_BLOCK_SIZE, starting at block counter.  Used for noise. */
+void _volume_keystream (void *dst, uint8_t const key[static TSV_ENCRYPTION_KEY_SIZE], uint64_t counter, size_t len);
+
 void _volume_mac (void *dst, uint8_t const key[static TSV_MAC_KEY_SIZE], void const *src, size_t len, uint32_t sector_num);
 
 #endif
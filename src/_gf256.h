@@ -0,0 +1,21 @@
+/*
+ * Private Header
+ *
+ * GF(2^8) arithmetic for Reed-Solomon parity.  Addition is XOR.
+ */
+#ifndef __TITAN_SECURE_VOLUME_GF256_H__
+#define __TITAN_SECURE_VOLUME_GF256_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+uint8_t _gf_mul (uint8_t a, uint8_t b);
+
+/* a must not be 0 */
+uint8_t _gf_inv (uint8_t a);
+
+/* dst[i] ^= c * src[i] for len bytes */
+void _gf_mul_add (uint8_t *dst, uint8_t const *src, uint8_t c, size_t len);
+
+#endif
@@ -0,0 +1,485 @@
+/*
+ * Private Header
+ *
+ * Volume state and Sector I/O, shared by the modules of the Titan Secure Volume code.
+ */
+#ifndef __TITAN_SECURE_VOLUME_VOLUME_H__
+#define __TITAN_SECURE_VOLUME_VOLUME_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <titan-secure-volume/titan-secure-volume.h>
+#include "_ciphers.h"
+
+
+#define member_size(type, member) sizeof(((type *)0)->member)
+
+/* Builds with TSV_FIXED_SECTOR_SIZE only create and open volumes with that Sector size, which the
+ * compiler then sees as a constant in every Sector calculation and cipher loop.
+ */
+#ifdef TSV_FIXED_SECTOR_SIZE
+	#define SECTOR_SIZE ((uint32_t)(TSV_FIXED_SECTOR_SIZE))
+	#define SECTOR_SHIFT ((((TSV_FIXED_SECTOR_SIZE) & ((TSV_FIXED_SECTOR_SIZE) - 1)) == 0) ? (uint32_t)__builtin_ctz (TSV_FIXED_SECTOR_SIZE) : 0)
+#else
+	#define SECTOR_SIZE (g_volume.sector_size)
+	#define SECTOR_SHIFT (g_volume.sector_shift)
+#endif
+
+/* Size of the stack buffers used in threaded mode. */
+#ifdef TSV_FIXED_SECTOR_SIZE
+	#define BUFFER_SIZE (TSV_FIXED_SECTOR_SIZE)
+#else
+	#define BUFFER_SIZE 4096
+#endif
+
+/* Largest Sector the default arena fits.  Builds may shrink it, or leave it out with 0, in which case
+ * tsv_init must be given an arena before any volume is created or opened.
+ */
+#ifdef TSV_DEFAULT_MAX_SECTOR_SIZE
+	#define DEFAULT_MAX_SECTOR_SIZE (TSV_DEFAULT_MAX_SECTOR_SIZE)
+#else
+	#define DEFAULT_MAX_SECTOR_SIZE BUFFER_SIZE
+#endif
+
+/* Builds with TSV_FEATURES only create and open volumes whose features are all in it, and leave the
+ * state of the others out of g_volume and the default arena.
+ */
+#ifdef TSV_FEATURES
+	#define BUILT_FEATURES ((uint32_t)(TSV_FEATURES) & TSV_FEATURES_ALL)
+#else
+	#define BUILT_FEATURES TSV_FEATURES_ALL
+#endif
+
+/* Entries of a feature's arrays in g_volume; one if the feature is left out, as C has no empty arrays */
+#define FEATURE_ENTRIES(feature, n) ((BUILT_FEATURES & (feature)) ? (n) : 1)
+
+/* MAC tags per page of the MAC page cache */
+#define MAC_PAGE_TAGS (TSV_MAC_PAGE_SIZE / MAC_TAG_SIZE)
+
+/* Number of Sectors which may have one stale copy before a commit is forced. */
+#define PENDING_QUEUE_SIZE 64
+
+/* Ranges discarded in batch or deferred mode which may wait for a commit before one is forced. */
+#define DISCARD_QUEUE_SIZE 8
+
+#define TSV_HEADER_SIZE (8+2+4+4+46)
+
+/* Progress record of a long running operation (grow, rekey), kept in the header Sector after the MAC tag.
+ * Sector tweaks are sector_num + 1, so RECORD_TWEAK is the one value that no copy of any Sector uses.
+ */
+#define RECORD_SIZE 64
+#define RECORD_OFFSET (TSV_HEADER_SIZE + MAC_TAG_SIZE)
+#define RECORD_TWEAK 0x80000000
+
+/* Write-intent record of TSV_FEATURE_INTENT volumes (see intent.c), after the progress record.  No
+ * Sector uses INTENT_TWEAK as long as sector_count stays below INTENT_MAX_SECTORS.
+ */
+#define INTENT_OFFSET (RECORD_OFFSET + RECORD_SIZE + MAC_TAG_SIZE)
+#define INTENT_MAX_SIZE 512
+#define INTENT_TWEAK 0xFFFFFFFF
+#define INTENT_MAX_SECTORS 0x7FFFFFFF
+
+/* Most Sectors tsv_rekey_next hands out at once, so the Sectors re-sealed fit in rekey_sealed. */
+#define REKEY_STEP_MAX 2048
+
+/* Log of TSV_FEATURE_LOG volumes (see log.c).  Entries are sealed with LOG_TWEAK, which no Sector uses
+ * as long as sector_count stays below LOG_MAX_SECTORS.  LOG_SLOTS is a power of two.
+ */
+#define LOG_SLOTS 256
+#define LOG_ENTRY_SIZE (64 + MAC_TAG_SIZE)
+#define LOG_TWEAK 0xFFFFFFFE
+#define LOG_MAX_SECTORS 0x7FFFFFFD
+#define LOG_EMPTY 0xFFFFFFFF
+
+/* Map of TSV_FEATURE_TRACK volumes (see track.c).  Pages are sealed with TRACK_TWEAK, which no Sector
+ * uses as long as sector_count stays below TRACK_MAX_SECTORS, and start with TRACK_PAGE_HEADER bytes.
+ */
+#define TRACK_TWEAK 0xFFFFFFFD
+#define TRACK_MAX_SECTORS 0x7FFFFFFC
+#define TRACK_PAGE_HEADER 8
+
+/* Limits of TSV_FEATURE_PARITY groups, so decoding fits on the stack. */
+#define PARITY_MAX_DATA_SHARDS 32
+#define PARITY_MAX_PARITY_SHARDS 8
+
+/* TSV_FEATURE_SPLIT reads alternate between devices every 1 << SPLIT_STRIPE_SHIFT Sectors. */
+#define SPLIT_STRIPE_SHIFT 4
+
+/* Threaded mode (see threaded.c).  Sector n is guarded by stripe lock n % LOCK_STRIPES.  LOCK_VOLUME
+ * guards the allocation bitmap cache and g_memory.buffer.  LOCK_CACHE guards the caches in memory.c and
+ * is taken last.
+ */
+#define LOCK_STRIPES (TSV_LOCK_COUNT - 2)
+#define LOCK_VOLUME (TSV_LOCK_COUNT - 2)
+#define LOCK_CACHE (TSV_LOCK_COUNT - 1)
+
+typedef struct __attribute__((__packed__))
+{
+	uint8_t magic[8];                 /* Magic Identifier ('TITANTSV') */
+	uint8_t version[2];               /* Version (0x0100, or 0x0101 if features are used) */
+	uint8_t sector_size[4];
+	uint8_t sector_count[4];
+	uint8_t features[4];              /* TSV_FEATURE_* (padding in version 0x0100) */
+	uint8_t data_shards;              /* TSV_FEATURE_PARITY only, otherwise padding */
+	uint8_t parity_shards;
+	uint8_t padding[40];
+} PACKED_TSV_HEADER;
+
+
+/* Global State */
+typedef struct {
+	bool open;
+	uint32_t sector_size;
+	uint32_t sector_shift;    /* log2 (sector_size) if that is a power of two (see _sector_of), else 0 */
+	uint32_t sector_count;    /* Sectors on disk, including any bitmap Sectors */
+	uint32_t user_sector_count;
+	uint32_t features;
+
+	uint64_t mac_table_size;
+	uint64_t volume_size;     /* sector_count * sector_size */
+
+	/* Physical location of each copy's MAC table and Sectors.  Index 0 is the first copy. */
+	uint64_t mac_offset[2];
+	uint64_t data_offset[2];
+	uint8_t readable;         /* Bit 0 set if the first copy may be read, bit 1 for the second */
+
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+
+	uint32_t corruption_count;  /* Only changed through _count_corruption */
+	bool threaded;
+
+	/* Sectors whose other copy is stale.  Each entry is the sector_num of the fresh copy. */
+	uint32_t pending[PENDING_QUEUE_SIZE];
+	uint8_t pending_tags[FEATURE_ENTRIES (TSV_FEATURE_SHARED, PENDING_QUEUE_SIZE)][MAC_TAG_SIZE];  /* Tags of the fresh copies, for TSV_FEATURE_SHARED */
+	uint32_t pending_count;
+	bool batch;
+	bool deferred;
+
+	/* Allocation bitmap Sector cached in g_memory.bitmap (see discard.c) */
+	uint32_t bitmap_sector;
+	bool bitmap_valid;
+
+	/* Ranges discarded in batch or deferred mode, as first and count, passed on to the platform once a
+	 * full commit has made their bits durable.
+	 */
+	uint32_t discard_queue[DISCARD_QUEUE_SIZE][2];
+	uint32_t discard_count;
+
+	/* Rekey in progress (see rekey.c).  Copies with their bit set in rekeyed use the new keys. */
+	uint8_t rekeyed;
+	bool rekey;
+	bool rekey_resumed;       /* Picked up by tsv_open; the new keys are not known yet */
+	uint32_t rekey_phase;
+	uint64_t rekey_position;  /* Next Sector to re-seal in the current phase */
+	uint32_t rekey_step;      /* Sectors from rekey_position handed out by tsv_rekey_next, 0 if none */
+	uint8_t rekey_sealed[REKEY_STEP_MAX / 8];  /* Of those, the ones tsv_rekey_range has re-sealed */
+	uint8_t new_mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t new_encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+
+	/* Reed-Solomon parity (see parity.c).  mac_offset[1] holds the shadow tags; there is no second copy. */
+	uint32_t data_shards;
+	uint32_t parity_shards;
+	uint64_t parity_mac_offset;
+	uint64_t parity_offset;
+
+	/* Write-intent record (see intent.c) */
+	uint8_t intent[FEATURE_ENTRIES (TSV_FEATURE_INTENT, INTENT_MAX_SIZE)];         /* Regions marked in storage */
+	uint8_t intent_recent[FEATURE_ENTRIES (TSV_FEATURE_INTENT, INTENT_MAX_SIZE)];  /* Regions marked since the record was last rewritten */
+	uint32_t intent_commits;                 /* Commits leaving nothing pending since then */
+
+	/* Log (see log.c).  Live slots hold sequence numbers [log_tail, log_next), slot seq % LOG_SLOTS. */
+	uint64_t log_offset;
+	uint64_t log_tail;
+	uint64_t log_next;
+	uint32_t log_sector[FEATURE_ENTRIES (TSV_FEATURE_LOG, LOG_SLOTS)];   /* Sector held by each live slot, LOG_EMPTY if none */
+	uint8_t log_written[FEATURE_ENTRIES (TSV_FEATURE_LOG, LOG_SLOTS)];   /* Bit 0 set once the first copy is written, bit 1 for the second */
+	bool log_active;                  /* Sectors are written to the log, not home */
+
+	/* Track map (see track.c), and the page of it cached in g_memory.track */
+	uint64_t track_offset;
+	uint32_t track_epoch;
+	uint32_t track_page;
+	bool track_valid;
+
+	/* Opened by tsv_open_readonly, and the host cache it attached to, if any (see hostcache.c) */
+	bool readonly;
+	uint8_t *host_cache;
+	uint32_t host_cache_slots;
+
+	/* Grow in progress (see grow.c).  grow_sector_count is 0 if there is none. */
+	uint32_t grow_sector_count;
+	uint32_t grow_phase;
+	uint64_t grow_position;   /* Units of the current phase left to process */
+	uint64_t grow_step;       /* Units in the step last recorded in the progress record */
+	bool grow_resumed;        /* The recorded step may have been interrupted and must be redone */
+} TSV_VOLUME;
+
+extern TSV_VOLUME g_volume;
+
+
+/* One write held in the I/O queue (see io.c).  The queue holds up to one write per IO_BYTES_PER_OP bytes. */
+#define IO_BYTES_PER_OP 128
+
+typedef struct {
+	uint64_t offset;
+	uint32_t len;
+	uint32_t pos;             /* Where its data is in g_memory.io_data */
+} TSV_IO_OP;
+
+
+/* Memory carved from the arena (see memory.c).  Kept apart from g_volume, so it outlives tsv_close. */
+typedef struct {
+	uint8_t *buffer;          /* One Sector, for decrypting and re-sealing */
+	uint8_t *bitmap;          /* One Sector, the cached allocation bitmap Sector; NULL if not carved (see _memory_check) */
+	uint8_t *gather;          /* One Sector, for Sectors split across the buffers of tsv_readv and tsv_writev; NULL if not carved */
+	uint8_t *track;           /* One Sector, the cached track map page; NULL if not carved */
+	uint32_t buffer_size;     /* Size of each, and of each cached Sector; the largest Sector size allowed */
+
+	uint32_t cache_sectors;
+	uint32_t *cache_tags;     /* Sector number + 1 held by each slot, 0 if empty */
+	uint8_t *cache;
+
+	uint32_t mac_pages;
+	uint32_t *mac_tags;       /* (copy << 31 | page) + 1 held by each slot, 0 if empty */
+	uint8_t *mac_cache;
+	uint32_t mac_puts;        /* _mac_put calls, so a page read outside LOCK_CACHE is only kept if none came in between */
+
+	uint32_t staging_size;
+	uint8_t *staging;
+
+	uint32_t io_queue_size;
+	uint32_t io_max_ops;
+	TSV_IO_OP *io_ops;        /* Sorted by offset, and never overlapping */
+	uint8_t *io_data;         /* io_queue_size bytes, in the order the writes were queued */
+	uint8_t *io_bounce;       /* io_queue_size bytes, for gathering a run of adjacent writes */
+	uint32_t io_count;
+	uint32_t io_used;
+} TSV_MEMORY;
+
+extern TSV_MEMORY g_memory;
+
+
+/* offset / SECTOR_SIZE and offset % SECTOR_SIZE.  Power-of-two Sector sizes use a shift and a mask,
+ * since 64-bit division is a library call on targets like the Cortex-M4.
+ */
+static inline uint64_t _sector_of (uint64_t offset)
+{
+	return SECTOR_SHIFT ? (offset >> SECTOR_SHIFT) : (offset / SECTOR_SIZE);
+}
+
+
+static inline uint32_t _offset_in (uint64_t offset)
+{
+	return (uint32_t)(SECTOR_SHIFT ? (offset & (SECTOR_SIZE - 1)) : (offset % SECTOR_SIZE));
+}
+
+
+/* Tweak for Sector sector_num.  TSV_FEATURE_SHARED volumes seal both copies with the first copy's, so
+ * they hold the same ciphertext and tag.
+ */
+static inline uint32_t _tweak (uint32_t sector_num)
+{
+	return ((g_volume.features & TSV_FEATURE_SHARED) ? (sector_num & 0x7FFFFFFF) : sector_num) + 1;
+}
+
+
+/* Atomic, since readers in threaded mode count damaged copies concurrently. */
+static inline void _count_corruption (void)
+{
+	__atomic_fetch_add (&g_volume.corruption_count, 1, __ATOMIC_RELAXED);
+}
+
+
+int sanity_check_parameters (uint32_t sector_size, uint32_t sector_count);
+
+/* Sets sector_size and sector_shift. */
+void _set_sector_size (uint32_t sector_size);
+
+/* Points both copies at their place in the layout for g_volume.sector_count, and makes both readable. */
+void _set_layout (void);
+
+/* Fills dst with a complete header Sector (header, MAC tag, noise) for the given geometry. */
+void _build_header (void *dst, uint8_t const mac_key[static TSV_MAC_KEY_SIZE], uint8_t const encryption_key[static TSV_ENCRYPTION_KEY_SIZE], uint32_t sector_size, uint32_t sector_count, uint32_t features);
+
+/* Writes a header Sector built by _build_header, to both devices of a split volume. */
+int _write_header (void const *header, uint32_t sector_size, uint32_t features);
+
+/* Encrypts, MACs and writes a RECORD_SIZE record, then issues a barrier. */
+int _record_write (void const *record);
+
+/* Reads and decrypts the record into dst.  Returns -1 if there is none (normally the slot is noise). */
+int _record_read (void *dst);
+
+/* Sector I/O.  The upper bit of sector_num selects the second copy.
+ * _auth_sector only checks the MAC tag; *data points at the ciphertext, in buf unless it could be mapped.
+ * _auth_sector only reads g_volume and storage, so it may run on several threads.  _read_sector reads
+ * tags through the MAC page cache, which is only safe on several threads in threaded mode.
+ * _write_sector encrypts src in place.  _seal_sector is _write_sector without the bounds check,
+ * for Sectors beyond sector_count that the current layout already has room for.
+ * _write_sealed writes ciphertext and tag that are already sealed for sector_num.  _copy_sector copies
+ * an authentic copy's ciphertext and tag over the other copy, which only TSV_FEATURE_SHARED allows.
+ */
+int _auth_sector (void *buf, uint32_t sector_num, void const **data);
+int _read_sector (void *dst, uint32_t sector_num);
+int _write_sector (uint32_t sector_num, void *src);
+int _seal_sector (uint32_t sector_num, void *src);
+int _write_sealed (uint32_t sector_num, void const *data, uint8_t const *tag);
+int _copy_sector (uint32_t sector_num);
+
+/* Fills both copies of a Sector that has never been written: a full bitmap Sector, or noise. */
+int _init_sector (uint32_t sector_num);
+
+/* Reads the current contents of a Sector, from whichever copy is fresh and intact. */
+int _read_current (void *dst, uint32_t sector_num);
+
+/* Reads a run of up to max whole Sectors from user Sector first, fetching the first copy's ciphertext and
+ * tags with one tsv_physical_read each through the staging area.  Sectors that do not authenticate go
+ * through _read_current.  *count is the number of Sectors read, 0 if no run could be formed.  dst may be
+ * g_memory.staging itself, in which case each Sector is decrypted in place.
+ */
+int _read_staged (uint8_t *dst, uint32_t first, uint32_t max, uint32_t *count);
+
+/* Replaces a whole Sector with src.  One copy is written now and the other at the next commit. */
+int _write_current (uint32_t sector_num, void const *src);
+
+/* Brings up to max_sectors stale copies up to date.  Sectors of the user range [offset, offset+len) are
+ * re-sealed from src instead of read back.
+ */
+int _commit (uint32_t max_sectors, uint64_t offset, void const *src, size_t len);
+
+/* Mapping between the Sector numbers of the API (user Sectors) and those on disk, which differ when
+ * TSV_FEATURE_DISCARD puts bitmap Sectors in between.  See discard.c.
+ */
+uint64_t _physical_count (uint32_t sector_size, uint32_t features, uint32_t user_count);
+uint32_t _user_count (uint32_t sector_size, uint32_t features, uint32_t physical_count);
+uint32_t _physical_sector (uint32_t user_sector);
+int _user_sector (uint32_t sector_num, uint32_t *user_sector);
+bool _is_bitmap_sector (uint32_t sector_num);
+
+/* On-disk number of the bitmap Sector tracking user_sector, and the bit for it. */
+uint32_t _bitmap_sector (uint32_t user_sector, uint32_t *bit);
+
+/* Allocation bitmap.  _discard_test sets *discarded if user_sector reads as zeros. */
+int _discard_test (uint32_t user_sector, bool *discarded);
+
+/* Sets or clears the bits of user Sectors [first, first+count), writing each changed bitmap Sector once. */
+int _discard_set (uint32_t first, uint32_t count, bool discarded);
+
+/* Passes the queued discards on to the platform, once nothing is pending.  Sectors written since are left out. */
+int _discard_drain (void);
+
+/* Passes user Sectors [first, first+count) of both copies on to tsv_physical_discard. */
+int _discard_forward (uint32_t first, uint32_t count);
+
+/* _discard_test by on-disk Sector number.  Discarded Sectors hold noise, so anything copying Sectors must skip them. */
+int _discard_test_sector (uint32_t sector_num, bool *discarded);
+
+/* Write-intent record (see intent.c).  _intent_size is the bitmap's size in bytes, 0 if the header
+ * Sector has no room.  _intent_build puts a clear record sealed with the given keys into a header Sector.
+ * _intent_mark makes the regions of physical Sectors [first, first+count) durably marked before any of
+ * them is written.  _intent_settle runs after each commit, _intent_clear once
+ * nothing is pending and no more writes are coming, and _intent_open reconciles marked regions.
+ */
+uint32_t _intent_size (uint32_t sector_size);
+void _intent_build (void *header, uint8_t const *mac_key, uint8_t const *encryption_key, uint32_t sector_size);
+int _intent_mark (uint32_t first, uint32_t count);
+int _intent_settle (void);
+int _intent_clear (void);
+int _intent_open (void);
+
+/* Log (see log.c).  _log_size is the log's physical size.  _log_find returns the live slot holding
+ * Sector sector_num, the newest if several do, or -1.  _log_auth is _auth_sector for a copy of a slot,
+ * and also returns its tag if tag is not NULL.  _log_write is _write_sealed for log volumes.  _log_clean
+ * writes up to max_sectors committed slots home, and _log_open replays the log.
+ */
+uint64_t _log_size (uint32_t sector_size);
+bool _log_full (void);
+int _log_find (uint32_t sector_num);
+int _log_auth (void *buf, uint32_t sector_num, uint32_t slot, void const **data, uint8_t *tag);
+int _log_write (uint32_t sector_num, void const *data, uint8_t const *tag);
+int _log_clean (uint32_t max_sectors);
+int _log_open (void);
+
+/* Changed-Sector tracking (see track.c).  _track_size is the map's physical size.  _track_init writes a
+ * new map, and _track_open reads the epoch.  _track_mark records that sector_num is about to be written,
+ * and is durable when it returns.
+ */
+uint64_t _track_size (uint32_t sector_size, uint32_t sector_count);
+int _track_init (void);
+int _track_open (void);
+int _track_mark (uint32_t sector_num);
+
+/* Reed-Solomon parity (see parity.c).  _parity_check validates a geometry and _parity_size gives its
+ * physical size, 0 if invalid.  _parity_update rewrites the parity of sector_num's group unless a Sector
+ * in updated[] shares it; damaged Sectors in the group are repaired first, and it returns 1 if one could not be.
+ * _parity_rebuild decodes sector_num from the rest of its group into dst.
+ */
+int _parity_check (uint32_t sector_size, uint32_t sector_count, uint32_t data_shards, uint32_t parity_shards);
+uint64_t _parity_size (uint32_t sector_size, uint32_t sector_count, uint32_t data_shards, uint32_t parity_shards);
+void _parity_layout (void);
+int _parity_init (void);
+int _parity_update (uint32_t sector_num, uint32_t const *updated, uint32_t updated_count);
+int _parity_rebuild (uint8_t *dst, uint32_t sector_num);
+int _parity_verify (uint32_t first, uint32_t count, uint8_t *buf, TSV_VERIFY *result);
+
+/* Threaded mode.  _lock_sectors takes the stripe locks of user Sectors [first, first+count), in order.
+ * _write_both writes both copies of a Sector in turn, with a barrier after each.
+ */
+void _lock_sectors (uint32_t first, uint32_t count);
+void _unlock_sectors (uint32_t first, uint32_t count);
+int _read_threaded (void *dst, uint64_t offset, size_t len);
+int _write_threaded (uint64_t offset, void const *src, size_t len);
+int _write_both (uint32_t sector_num, void const *src);
+
+/* Write-through caches (see memory.c).  _cache_get returns true on a hit; _cache_put and _mac_put with a
+ * NULL src drop the entry.  _mac_read reads the tag of sector_num, through the cache if there is one.
+ * _cache_reset empties both caches, _memory_wipe clears every buffer in the arena.  _memory_check fails
+ * if the arena lacks a buffer that volumes with features need.
+ */
+bool _cache_get (void *dst, uint32_t sector_num);
+void _cache_put (uint32_t sector_num, void const *src);
+int _mac_read (void *dst, uint32_t sector_num);
+void _mac_put (uint32_t sector_num, void const *tag);
+void _cache_reset (void);
+void _memory_wipe (void);
+int _memory_check (uint32_t features);
+
+/* Host cache (see hostcache.c).  _host_attach checks that cache was set up for the volume identified by
+ * volume_check, or sets it up.  _host_get returns true on a hit, and _host_put only takes verified plaintext.
+ */
+int _host_attach (void *cache, size_t len, uint8_t const volume_check[static MAC_TAG_SIZE]);
+bool _host_has (uint32_t sector_num);
+bool _host_get (void *dst, uint32_t sector_num);
+void _host_put (uint32_t sector_num, void const *src);
+
+/* Noise from an internal DRBG (see noise.c), for anything that is never decrypted.  _noise_wipe forgets
+ * the seed.
+ */
+void _noise (void *dst, size_t len);
+void _noise_wipe (void);
+
+/* Physical I/O through the I/O queue (see io.c).  Each is its tsv_physical_ counterpart, except that
+ * writes may be held back until _io_sync, or _io_flush, issues them.
+ */
+int _io_read (void *dst, uint64_t offset, size_t len);
+int _io_write (uint64_t offset, void const *src, size_t len);
+int _io_sync (void);
+void const *_io_map (uint64_t offset, size_t len);
+int _io_discard (uint64_t offset, size_t len);
+int _io_flush (void);
+
+/* Reports a call of the public API to the hook given to tsv_set_trace, if there is one. */
+void _trace (uint32_t type, uint64_t offset, uint64_t len, int result);
+
+/* tsv_read, tsv_write and tsv_flush without their trace records, for public calls traced as a whole. */
+int _read (void *dst, uint64_t offset, size_t len);
+int _write (uint64_t offset, void const *src, size_t len);
+int _flush (void);
+
+/* Called by tsv_open; pick up a grow or rekey that was interrupted. */
+int _grow_open (void);
+int _rekey_open (void);
+
+#endif
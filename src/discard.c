@@ -0,0 +1,359 @@
+/*
+ * Discard.
+ *
+ * Volumes created with TSV_FEATURE_DISCARD keep an allocation bitmap, one bit per Sector, set if the
+ * Sector is discarded.  Discarded Sectors read as zeros without touching storage or the cipher, and hold
+ * plain noise on disk.  Writing a Sector clears its bit.
+ *
+ * The bitmap lives in ordinary Sectors, so it is encrypted, authenticated and replicated like data.
+ * Each run of 8*sector_size Sectors is preceded by the bitmap Sector that tracks it, which keeps the
+ * bitmap next to its data and lets a grow just append more runs.  Bits past the end of the volume are
+ * set, so Sectors added by a grow start out discarded.  One bitmap Sector is cached in g_memory.bitmap.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "util.h"
+#include <titan-secure-volume/app.h>
+#include "_volume.h"
+
+
+/* Sectors tracked by one bitmap Sector */
+#define GROUP_SIZE(sector_size) (8 * (uint64_t)(sector_size))
+
+
+/* user_sector / GROUP_SIZE and user_sector % GROUP_SIZE for the open volume, which are on the path of
+ * every read and write.
+ */
+static inline uint32_t _group (uint32_t user_sector)
+{
+	return SECTOR_SHIFT ? (user_sector >> (SECTOR_SHIFT + 3)) : (uint32_t)(user_sector / GROUP_SIZE (SECTOR_SIZE));
+}
+
+
+static inline uint32_t _group_bit (uint32_t user_sector)
+{
+	return SECTOR_SHIFT ? (user_sector & ((8u << SECTOR_SHIFT) - 1)) : (uint32_t)(user_sector % GROUP_SIZE (SECTOR_SIZE));
+}
+
+
+uint64_t _physical_count (uint32_t sector_size, uint32_t features, uint32_t user_count)
+{
+	if (!(features & TSV_FEATURE_DISCARD))
+		return user_count;
+
+	return user_count + (user_count + GROUP_SIZE (sector_size) - 1) / GROUP_SIZE (sector_size);
+}
+
+
+uint32_t _user_count (uint32_t sector_size, uint32_t features, uint32_t physical_count)
+{
+	if (!(features & TSV_FEATURE_DISCARD))
+		return physical_count;
+
+	return physical_count - (uint32_t)((physical_count + GROUP_SIZE (sector_size)) / (GROUP_SIZE (sector_size) + 1));
+}
+
+
+uint32_t _physical_sector (uint32_t user_sector)
+{
+	if (!(g_volume.features & TSV_FEATURE_DISCARD))
+		return user_sector;
+
+	return user_sector + _group (user_sector) + 1;
+}
+
+
+int _user_sector (uint32_t sector_num, uint32_t *user_sector)
+{
+	if (!(g_volume.features & TSV_FEATURE_DISCARD))
+	{
+		*user_sector = sector_num;
+		return 0;
+	}
+
+	if (_is_bitmap_sector (sector_num))
+		return -1;
+
+	*user_sector = sector_num - (uint32_t)(sector_num / (GROUP_SIZE (SECTOR_SIZE) + 1)) - 1;
+
+	return 0;
+}
+
+
+bool _is_bitmap_sector (uint32_t sector_num)
+{
+	if (!(g_volume.features & TSV_FEATURE_DISCARD))
+		return false;
+
+	return (sector_num % (GROUP_SIZE (SECTOR_SIZE) + 1)) == 0;
+}
+
+
+uint32_t _bitmap_sector (uint32_t user_sector, uint32_t *bit)
+{
+	uint64_t group = _group (user_sector);
+
+	*bit = _group_bit (user_sector);
+
+	return (uint32_t)(group * (GROUP_SIZE (SECTOR_SIZE) + 1));
+}
+
+
+/* Loads the bitmap Sector for user_sector into the cache, returning the bit's index within it. */
+static int _load_bitmap (uint32_t user_sector, uint32_t *bit)
+{
+	uint32_t bitmap_sector = _bitmap_sector (user_sector, bit);
+
+	if (g_volume.bitmap_valid && g_volume.bitmap_sector == bitmap_sector)
+		return 0;
+
+	g_volume.bitmap_valid = false;
+	RtnOnError (_read_current (g_memory.bitmap, bitmap_sector));
+	g_volume.bitmap_sector = bitmap_sector;
+	g_volume.bitmap_valid = true;
+
+	return 0;
+}
+
+
+int _discard_test (uint32_t user_sector, bool *discarded)
+{
+	uint32_t bit;
+
+	*discarded = false;
+
+	if (!(g_volume.features & TSV_FEATURE_DISCARD))
+		return 0;
+
+	RtnOnError (_load_bitmap (user_sector, &bit));
+	*discarded = (g_memory.bitmap[bit / 8] >> (bit % 8)) & 1;
+
+	return 0;
+}
+
+
+int _discard_test_sector (uint32_t sector_num, bool *discarded)
+{
+	uint32_t user_sector;
+
+	*discarded = false;
+
+	if (_user_sector (sector_num, &user_sector))
+		return 0;
+
+	return _discard_test (user_sector, discarded);
+}
+
+
+/* Writes the cached bitmap Sector back; the cache is dropped if that fails, since it no longer matches.
+ * Threaded mode has no pending queue, so both copies are written straight away.
+ */
+static int _store_bitmap (void)
+{
+	int err;
+
+	if (g_volume.threaded)
+		err = _write_both (g_volume.bitmap_sector, g_memory.bitmap);
+	else
+		err = _write_current (g_volume.bitmap_sector, g_memory.bitmap);
+
+	if (err)
+	{
+		g_volume.bitmap_valid = false;
+		return -1;
+	}
+
+	return 0;
+}
+
+
+int _discard_set (uint32_t first, uint32_t count, bool discarded)
+{
+	bool dirty = false;
+
+	for (uint32_t sector_num = first; sector_num < first + count; ++sector_num)
+	{
+		uint32_t bit;
+
+		RtnOnError (_load_bitmap (sector_num, &bit));
+
+		uint8_t mask = (uint8_t)(1 << (bit % 8));
+
+		if (((g_memory.bitmap[bit / 8] & mask) != 0) != discarded)
+		{
+			g_memory.bitmap[bit / 8] ^= mask;
+			dirty = true;
+		}
+
+		/* Each bitmap Sector is written once, when leaving its run */
+		if (dirty && (bit + 1 == GROUP_SIZE (SECTOR_SIZE) || sector_num + 1 == first + count))
+		{
+			RtnOnError (_store_bitmap ());
+			dirty = false;
+		}
+	}
+
+	return 0;
+}
+
+
+int _discard_forward (uint32_t first, uint32_t count)
+{
+	uint64_t data = (uint64_t)_physical_sector (first) * SECTOR_SIZE;
+
+	for (int copy = 0; copy < 2; ++copy)
+		RtnOnError (_io_discard (g_volume.data_offset[copy] + data, (size_t)((uint64_t)count * SECTOR_SIZE)));
+
+	return 0;
+}
+
+
+int _discard_drain (void)
+{
+	/* The bits are only durable once both copies of their bitmap Sectors are */
+	if (g_volume.pending_count)
+		return 0;
+
+	for (uint32_t q = 0; q < g_volume.discard_count; ++q)
+	{
+		uint32_t end = g_volume.discard_queue[q][0] + g_volume.discard_queue[q][1];
+
+		for (uint32_t sector_num = g_volume.discard_queue[q][0]; sector_num < end;)
+		{
+			uint32_t limit = (uint32_t)MIN (end - sector_num, GROUP_SIZE (SECTOR_SIZE) - _group_bit (sector_num));
+			uint32_t run = 0;
+			bool discarded = true;
+
+			while (run < limit && discarded)
+			{
+				RtnOnError (_discard_test (sector_num + run, &discarded));
+				run += discarded;
+			}
+
+			if (run)
+				RtnOnError (_discard_forward (sector_num, run));
+
+			/* Past the run, and the Sector written since that ended it */
+			sector_num += MIN (run + 1, limit);
+		}
+	}
+
+	g_volume.discard_count = 0;
+
+	return 0;
+}
+
+
+/* Queues the range for _discard_drain, merged with the last one if they touch.  A full queue is
+ * committed and drained first.
+ */
+static int _discard_queue (uint32_t first, uint32_t count)
+{
+	uint32_t *last = g_volume.discard_count ? g_volume.discard_queue[g_volume.discard_count - 1] : NULL;
+
+	if (last && first <= last[0] + last[1] && last[0] <= first + count)
+	{
+		uint32_t end = MAX (last[0] + last[1], first + count);
+
+		last[0] = MIN (last[0], first);
+		last[1] = end - last[0];
+		return 0;
+	}
+
+	if (g_volume.discard_count == DISCARD_QUEUE_SIZE)
+	{
+		RtnOnError (_commit (PENDING_QUEUE_SIZE, 0, NULL, 0));
+		RtnOnError (_discard_drain ());
+	}
+
+	/* Still full if the commit left Sectors pending; the platform just keeps the data */
+	if (g_volume.discard_count < DISCARD_QUEUE_SIZE)
+	{
+		g_volume.discard_queue[g_volume.discard_count][0] = first;
+		g_volume.discard_queue[g_volume.discard_count][1] = count;
+		g_volume.discard_count += 1;
+	}
+
+	return 0;
+}
+
+
+/* One run at a time, holding the run's Sectors so no write lands between setting the bits and the
+ * platform dropping the data.
+ */
+static int _discard_threaded (uint32_t first, uint32_t end)
+{
+	for (uint32_t sector_num = first; sector_num < end;)
+	{
+		uint32_t run = (uint32_t)MIN (end - sector_num, GROUP_SIZE (SECTOR_SIZE) - _group_bit (sector_num));
+		int err;
+
+		_lock_sectors (sector_num, run);
+		tsv_lock (LOCK_VOLUME);
+		err = _discard_set (sector_num, run, true);
+		tsv_unlock (LOCK_VOLUME);
+
+		if (!err)
+			err = _discard_forward (sector_num, run);
+
+		_unlock_sectors (sector_num, run);
+		RtnOnError (err);
+		sector_num += run;
+	}
+
+	return 0;
+}
+
+
+static int _discard (uint64_t offset, uint64_t len)
+{
+	uint64_t size = (uint64_t)g_volume.user_sector_count * SECTOR_SIZE;
+
+	if (!g_volume.open || g_volume.readonly || g_volume.grow_sector_count || g_volume.rekey)
+		return -1;
+
+	if (!(g_volume.features & TSV_FEATURE_DISCARD))
+		return -1;
+
+	if (offset > size || len > size - offset)
+		return -1;
+
+	uint64_t first = _sector_of (offset + SECTOR_SIZE - 1);
+	uint64_t end = _sector_of (offset + len);
+
+	if (first >= end)
+		return 0;
+
+	if (g_volume.threaded)
+		return _discard_threaded ((uint32_t)first, (uint32_t)end);
+
+	RtnOnError (_discard_set ((uint32_t)first, (uint32_t)(end - first), true));
+
+	/* Passed on by the commit that makes the bits durable */
+	if (g_volume.batch || g_volume.deferred)
+		return _discard_queue ((uint32_t)first, (uint32_t)(end - first));
+
+	RtnOnError (_commit (PENDING_QUEUE_SIZE, 0, NULL, 0));
+
+	/* The bits are durable, so the platform may now drop the data of both copies */
+	for (uint64_t sector_num = first; sector_num < end;)
+	{
+		uint64_t run = MIN (end - sector_num, GROUP_SIZE (SECTOR_SIZE) - _group_bit ((uint32_t)sector_num));
+
+		RtnOnError (_discard_forward ((uint32_t)sector_num, (uint32_t)run));
+		sector_num += run;
+	}
+
+	return 0;
+}
+
+
+int tsv_discard (uint64_t offset, uint64_t len)
+{
+	int err = _discard (offset, len);
+
+	_trace (TSV_TRACE_DISCARD, offset, len, err);
+
+	return err;
+}
@@ -0,0 +1,424 @@
+/*
+ * Online grow.
+ *
+ * Growing a volume moves the second copy and enlarges both MAC tables, but does not change how a
+ * Sector is encrypted or authenticated (the tweak is the Sector number, not its location).  So existing
+ * ciphertext and tags are moved with plain copies, and only new Sectors go through the cipher.
+ *
+ * The work is split into phases.  Each is processed from the end of its region backwards, since
+ * everything moves towards the end of storage:
+ *   GROW_MOVE_B_DATA  Second copy's Sectors.  Only the first copy is read.
+ *   GROW_MOVE_B_MAC   Second copy's MAC tags.  Only the first copy is read.
+ *   GROW_MOVE_A_DATA  First copy's Sectors, if its MAC table needs more room.  Only the second copy is read.
+ *   GROW_INIT         Noise (or bitmap) for the new Sectors.
+ *   GROW_HEADER       MAC table padding, then the new header.
+ *
+ * Progress is kept in the progress record in the header Sector (see _volume.h).  The record names
+ * the step about to run and is made durable before the step starts.  If the volume is opened with a step in flight, that step is redone by re-sealing its Sectors
+ * from the other copy rather than copying, since its source may already be partly overwritten.
+ * Like the header itself, the record relies on writes to the header Sector not being torn.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "basic_packing.h"
+#include "util.h"
+#include <titan-secure-volume/app.h>
+#include "_volume.h"
+
+
+/* Bytes moved per tsv_grow_step by tsv_grow */
+#define GROW_STEP_SIZE (1024*1024)
+
+enum {
+	GROW_MOVE_B_DATA = 1,
+	GROW_MOVE_B_MAC,
+	GROW_MOVE_A_DATA,
+	GROW_INIT,
+	GROW_HEADER,
+};
+
+typedef struct __attribute__((__packed__))
+{
+	uint8_t magic[8];                 /* Magic Identifier ('TSVGROW\0') */
+	uint8_t old_sector_count[4];
+	uint8_t new_sector_count[4];
+	uint8_t phase[4];
+	uint8_t position[4];              /* Sectors of the phase left to process, including this step */
+	uint8_t step[4];                  /* Sectors in this step */
+	uint8_t padding[36];
+} PACKED_TSV_GROW_RECORD;
+
+
+_Static_assert (sizeof (PACKED_TSV_GROW_RECORD) == RECORD_SIZE, "Size of PACKED_TSV_GROW_RECORD struct does not match expected size.");
+
+
+static uint64_t _new_mac_table_size (void)
+{
+	return roundup_uint64 ((uint64_t)g_volume.grow_sector_count * (uint64_t)MAC_TAG_SIZE, SECTOR_SIZE);
+}
+
+
+static uint64_t _new_volume_size (void)
+{
+	return (uint64_t)g_volume.grow_sector_count * (uint64_t)SECTOR_SIZE;
+}
+
+
+static uint64_t _phase_length (uint32_t phase)
+{
+	switch (phase)
+	{
+		case GROW_MOVE_B_DATA:
+		case GROW_MOVE_B_MAC:
+			return g_volume.sector_count;
+		case GROW_MOVE_A_DATA:
+			return (_new_mac_table_size () != g_volume.mac_table_size) ? g_volume.sector_count : 0;
+		case GROW_INIT:
+			return g_volume.grow_sector_count - g_volume.sector_count;
+		default:
+			return 0;
+	}
+}
+
+
+/* Points each copy at wherever its Sectors and tags are valid during the current phase. */
+static void _grow_layout (void)
+{
+	uint64_t new_mac_table_size = _new_mac_table_size ();
+	uint64_t new_volume_size = _new_volume_size ();
+	uint64_t new_mac_offset_b = SECTOR_SIZE + new_mac_table_size + new_volume_size;
+
+	_set_layout ();
+
+	switch (g_volume.grow_phase)
+	{
+		case GROW_MOVE_B_DATA:
+			g_volume.data_offset[1] = new_mac_offset_b + new_mac_table_size;
+			g_volume.readable = 1;
+			break;
+		case GROW_MOVE_B_MAC:
+			g_volume.mac_offset[1] = new_mac_offset_b;
+			g_volume.data_offset[1] = new_mac_offset_b + new_mac_table_size;
+			g_volume.readable = 1;
+			break;
+		default:
+			g_volume.data_offset[0] = SECTOR_SIZE + new_mac_table_size;
+			g_volume.mac_offset[1] = new_mac_offset_b;
+			g_volume.data_offset[1] = new_mac_offset_b + new_mac_table_size;
+			g_volume.readable = (g_volume.grow_phase == GROW_MOVE_A_DATA) ? 2 : 3;
+			break;
+	}
+}
+
+
+/* Writes the progress record and makes it durable. */
+static int _grow_record (void)
+{
+	PACKED_TSV_GROW_RECORD record;
+
+	memmove (record.magic, "TSVGROW\0", 8);
+	pack_uint32_little (record.old_sector_count, g_volume.sector_count);
+	pack_uint32_little (record.new_sector_count, g_volume.grow_sector_count);
+	pack_uint32_little (record.phase, g_volume.grow_phase);
+	pack_uint32_little (record.position, (uint32_t)g_volume.grow_position);
+	pack_uint32_little (record.step, (uint32_t)g_volume.grow_step);
+	_noise (record.padding, member_size (PACKED_TSV_GROW_RECORD, padding));
+
+	return _record_write (&record);
+}
+
+
+int _grow_open (void)
+{
+	PACKED_TSV_GROW_RECORD record;
+
+	/* A record for a different sector_count is left over from a grow that finished */
+	if (_record_read (&record) || memcmp (record.magic, "TSVGROW\0", 8) || unpack_uint32_little (record.old_sector_count) != g_volume.sector_count)
+		return 0;
+
+	uint32_t new_sector_count = unpack_uint32_little (record.new_sector_count);
+	uint32_t phase = unpack_uint32_little (record.phase);
+	uint32_t position = unpack_uint32_little (record.position);
+	uint32_t step = unpack_uint32_little (record.step);
+
+	if (new_sector_count <= g_volume.sector_count || sanity_check_parameters (SECTOR_SIZE, new_sector_count))
+		return -1;
+
+	g_volume.grow_sector_count = new_sector_count;
+
+	if (phase < GROW_MOVE_B_DATA || phase > GROW_HEADER || position > _phase_length (phase) || step > position)
+	{
+		g_volume.grow_sector_count = 0;
+		return -1;
+	}
+
+	g_volume.grow_phase = phase;
+	g_volume.grow_position = position;
+	g_volume.grow_step = step;
+	g_volume.grow_resumed = true;
+	_grow_layout ();
+
+	return 0;
+}
+
+
+/* Copies len bytes from src to dst, where dst > src, last piece first so overlapping moves are safe.
+ * Pieces go through the staging area if it is larger than the Sector buffer.
+ */
+static int _grow_move (uint64_t dst, uint64_t src, uint64_t len)
+{
+	uint8_t *buf = g_memory.buffer;
+	uint32_t piece = g_memory.buffer_size;
+
+	if (g_memory.staging_size > piece)
+	{
+		buf = g_memory.staging;
+		piece = g_memory.staging_size;
+	}
+
+	while (len)
+	{
+		uint32_t move_len = (uint32_t)MIN (len, (uint64_t)piece);
+
+		len -= move_len;
+		RtnOnError (_io_read (buf, src + len, move_len));
+		RtnOnError (_io_write (dst + len, buf, move_len));
+	}
+
+	return 0;
+}
+
+
+/* Moves Sectors (or their tags) [first, first+count) for the current phase. */
+static int _grow_move_sectors (uint64_t first, uint64_t count)
+{
+	uint64_t new_mac_table_size = _new_mac_table_size ();
+	uint64_t new_volume_size = _new_volume_size ();
+	uint64_t sector_size = SECTOR_SIZE;
+	uint64_t mac_table_size = g_volume.mac_table_size;
+	uint64_t volume_size = g_volume.volume_size;
+
+	switch (g_volume.grow_phase)
+	{
+		case GROW_MOVE_B_DATA:
+			return _grow_move (sector_size + 2 * new_mac_table_size + new_volume_size + first * sector_size,
+			                   sector_size + 2 * mac_table_size + volume_size + first * sector_size,
+			                   count * sector_size);
+		case GROW_MOVE_B_MAC:
+			return _grow_move (sector_size + new_mac_table_size + new_volume_size + first * MAC_TAG_SIZE,
+			                   sector_size + mac_table_size + volume_size + first * MAC_TAG_SIZE,
+			                   count * MAC_TAG_SIZE);
+		case GROW_MOVE_A_DATA:
+			return _grow_move (sector_size + new_mac_table_size + first * sector_size,
+			                   sector_size + mac_table_size + first * sector_size,
+			                   count * sector_size);
+		default:
+			return -1;
+	}
+}
+
+
+/* Rebuilds Sectors [first, first+count) of the copy being moved from the other copy. */
+static int _grow_redo_sectors (uint64_t first, uint64_t count)
+{
+	uint32_t from = (g_volume.grow_phase == GROW_MOVE_A_DATA) ? 0x80000000 : 0;
+
+	for (uint64_t i = first; i < first + count; ++i)
+	{
+		bool discarded;
+
+		RtnOnError (_discard_test_sector ((uint32_t)i, &discarded));
+
+		if (discarded)
+			continue;
+
+		if (g_volume.features & TSV_FEATURE_SHARED)
+		{
+			RtnOnError (_copy_sector ((uint32_t)i | from));
+			continue;
+		}
+
+		RtnOnError (_read_sector (g_memory.buffer, (uint32_t)i | from));
+		RtnOnError (_write_sector ((uint32_t)i | (from ^ 0x80000000), g_memory.buffer));
+	}
+
+	return 0;
+}
+
+
+/* Initializes new Sectors [first, first+count), counted from the old sector_count. */
+static int _grow_init_sectors (uint64_t first, uint64_t count)
+{
+	for (uint64_t i = first + count; i > first; --i)
+		RtnOnError (_init_sector (g_volume.sector_count + (uint32_t)(i - 1)));
+
+	return 0;
+}
+
+
+/* Fills the unused ends of both MAC tables with noise and switches to the new header. */
+static int _grow_finish (void)
+{
+	uint64_t new_mac_table_size = _new_mac_table_size ();
+	uint64_t padding_start = (uint64_t)g_volume.grow_sector_count * (uint64_t)MAC_TAG_SIZE;
+
+	/* The same noise in both copies when they share ciphertext */
+	for (uint64_t offset = padding_start; offset < new_mac_table_size;)
+	{
+		uint32_t write_len = (uint32_t)MIN (new_mac_table_size - offset, (uint64_t)g_memory.buffer_size);
+
+		for (int copy = 0; copy < 2; ++copy)
+		{
+			if (copy == 0 || !(g_volume.features & TSV_FEATURE_SHARED))
+				_noise (g_memory.buffer, write_len);
+
+			RtnOnError (_io_write (g_volume.mac_offset[copy] + offset, g_memory.buffer, write_len));
+		}
+
+		offset += write_len;
+	}
+
+	RtnOnError (_io_sync ());
+
+	/* Once this is durable the volume has the new layout, and the progress record no longer matches it */
+	_build_header (g_memory.buffer, g_volume.mac_key, g_volume.encryption_key, SECTOR_SIZE, g_volume.grow_sector_count, g_volume.features);
+	RtnOnError (_write_header (g_memory.buffer, SECTOR_SIZE, g_volume.features));
+	RtnOnError (_io_sync ());
+
+	g_volume.sector_count = g_volume.grow_sector_count;
+	g_volume.user_sector_count = _user_count (SECTOR_SIZE, g_volume.features, g_volume.sector_count);
+	g_volume.mac_table_size = new_mac_table_size;
+	g_volume.volume_size = _new_volume_size ();
+	g_volume.grow_sector_count = 0;
+	g_volume.grow_phase = 0;
+	g_volume.grow_position = 0;
+	g_volume.grow_step = 0;
+	g_volume.grow_resumed = false;
+	_set_layout ();
+
+	return 0;
+}
+
+
+int tsv_grow_begin (uint32_t new_sector_count)
+{
+	/* The second device of a split volume would need growing too, and the log moving; not supported */
+	if (!g_volume.open || g_volume.readonly || g_volume.threaded || (g_volume.features & (TSV_FEATURE_SPLIT | TSV_FEATURE_PARITY | TSV_FEATURE_LOG | TSV_FEATURE_TRACK)))
+		return -1;
+
+	/* Bitmap Sectors are counted from here on */
+	if (_physical_count (SECTOR_SIZE, g_volume.features, new_sector_count) > 0x7FFFFFFF)
+		return -1;
+
+	new_sector_count = (uint32_t)_physical_count (SECTOR_SIZE, g_volume.features, new_sector_count);
+
+	if (g_volume.grow_sector_count)
+		return (new_sector_count == g_volume.grow_sector_count) ? 0 : -1;
+
+	if (g_volume.rekey)
+		return -1;
+
+	if (new_sector_count == g_volume.sector_count)
+		return 0;
+
+	if (new_sector_count < g_volume.sector_count)
+		return -1;
+
+	/* The progress record must fit in the header Sector */
+	if (SECTOR_SIZE < RECORD_OFFSET + RECORD_SIZE + MAC_TAG_SIZE)
+		return -1;
+
+	RtnOnError (sanity_check_parameters (SECTOR_SIZE, new_sector_count));
+
+	if ((g_volume.features & TSV_FEATURE_INTENT) && new_sector_count >= INTENT_MAX_SECTORS)
+		return -1;
+
+	/* Moves are raw copies, so both copies of every Sector must be current.  Regions change size, so
+	 * nothing may stay marked.
+	 */
+	RtnOnError (tsv_flush ());
+	RtnOnError (_intent_clear ());
+
+	g_volume.grow_sector_count = new_sector_count;
+	g_volume.grow_phase = GROW_MOVE_B_DATA;
+	g_volume.grow_position = _phase_length (GROW_MOVE_B_DATA);
+	g_volume.grow_step = 0;
+	g_volume.grow_resumed = false;
+	_grow_layout ();
+
+	return 0;
+}
+
+
+int tsv_grow_step (uint64_t max_bytes)
+{
+	if (!g_volume.open)
+		return -1;
+
+	if (!g_volume.grow_sector_count)
+		return 0;
+
+	/* A step that was in flight when the volume was last closed is rebuilt, not copied */
+	if (g_volume.grow_resumed)
+	{
+		g_volume.grow_resumed = false;
+
+		if (g_volume.grow_phase <= GROW_MOVE_A_DATA && g_volume.grow_step)
+		{
+			RtnOnError (_grow_redo_sectors (g_volume.grow_position - g_volume.grow_step, g_volume.grow_step));
+			RtnOnError (_io_sync ());
+			g_volume.grow_position -= g_volume.grow_step;
+			return 1;
+		}
+	}
+
+	while (g_volume.grow_position == 0 && g_volume.grow_phase < GROW_HEADER)
+	{
+		g_volume.grow_phase += 1;
+		g_volume.grow_position = _phase_length (g_volume.grow_phase);
+		_grow_layout ();
+	}
+
+	if (g_volume.grow_phase == GROW_HEADER)
+	{
+		g_volume.grow_step = 0;
+		RtnOnError (_grow_record ());
+		RtnOnError (_grow_finish ());
+		return 0;
+	}
+
+	uint64_t unit = (g_volume.grow_phase == GROW_MOVE_B_MAC) ? MAC_TAG_SIZE : SECTOR_SIZE;
+	uint64_t step = MIN (g_volume.grow_position, MAX (max_bytes / unit, 1));
+	uint64_t first = g_volume.grow_position - step;
+
+	g_volume.grow_step = step;
+	RtnOnError (_grow_record ());
+
+	if (g_volume.grow_phase == GROW_INIT)
+	{
+		RtnOnError (_grow_init_sectors (first, step));
+	}
+	else
+	{
+		RtnOnError (_grow_move_sectors (first, step));
+	}
+
+	RtnOnError (_io_sync ());
+	g_volume.grow_position = first;
+
+	return 1;
+}
+
+
+int tsv_grow (uint32_t new_sector_count)
+{
+	int ret;
+
+	RtnOnError (tsv_grow_begin (new_sector_count));
+
+	while ((ret = tsv_grow_step (GROW_STEP_SIZE)) > 0)
+		;
+
+	return ret;
+}
@@ -0,0 +1,149 @@
+/*
+ * Host cache.
+ *
+ * A Sector cache that several processes share, each attaching to it with tsv_open_readonly, so a hot
+ * Sector is authenticated and decrypted once per host rather than once per process.  The caller maps
+ * the memory (the Linux BSP has tsv_linux_host_cache); it is zero-filled when first created, and the
+ * first process to attach sets it up for its volume and keys.  Anyone else must have opened the same
+ * volume with the same keys.
+ *
+ * Slots are direct mapped by Sector number, like the arena's cache, and each is guarded by a sequence
+ * lock: a writer makes the count odd, fills the slot, then makes it even again, and a reader only keeps
+ * what it copied if the count was even and unchanged throughout.  Nothing waits: a reader that races a
+ * writer, or a writer that races another, just carries on without the cache.  A slot whose writer died
+ * half way stays odd, and is never used again.
+ *
+ * Only verified plaintext goes in, and the volume must not be written while any process is attached,
+ * since nothing tells the others.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "util.h"
+#include <titan-secure-volume/app.h>
+#include "_volume.h"
+
+
+/* Attempts to wait for another process to finish setting the cache up */
+#define HOST_SETUP_SPINS 1000000
+
+enum {
+	HOST_NEW = 0,
+	HOST_SETUP,
+	HOST_READY,
+};
+
+typedef struct
+{
+	uint32_t state;
+	uint32_t sector_size;
+	uint32_t slots;
+	uint32_t padding;
+	uint8_t volume_check[MAC_TAG_SIZE];   /* Identifies the volume and its keys */
+} TSV_HOST_HEADER;
+
+/* Each slot is a sequence count, Sector number + 1 (0 if empty), then the Sector */
+#define HOST_SLOT_SIZE(sector_size) (2 * sizeof (uint32_t) + (size_t)(sector_size))
+
+
+size_t tsv_host_cache_size (uint32_t sector_size, uint32_t sectors)
+{
+	uint64_t size = sizeof (TSV_HOST_HEADER) + (uint64_t)sectors * HOST_SLOT_SIZE (sector_size);
+
+	return (size > SIZE_MAX) ? 0 : (size_t)size;
+}
+
+
+int _host_attach (void *cache, size_t len, uint8_t const volume_check[static MAC_TAG_SIZE])
+{
+	TSV_HOST_HEADER *header = (TSV_HOST_HEADER *)cache;
+	uint32_t state = HOST_NEW;
+
+	if (((uintptr_t)cache & (sizeof (uint64_t) - 1)) || len < tsv_host_cache_size (SECTOR_SIZE, 1))
+		return -1;
+
+	uint64_t slots = (len - sizeof (TSV_HOST_HEADER)) / HOST_SLOT_SIZE (SECTOR_SIZE);
+
+	if (__atomic_compare_exchange_n (&header->state, &state, HOST_SETUP, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+	{
+		header->sector_size = SECTOR_SIZE;
+		header->slots = (uint32_t)MIN (slots, UINT32_MAX);
+		memmove (header->volume_check, volume_check, MAC_TAG_SIZE);
+		__atomic_store_n (&header->state, HOST_READY, __ATOMIC_RELEASE);
+	}
+
+	for (uint32_t i = 0; i < HOST_SETUP_SPINS && __atomic_load_n (&header->state, __ATOMIC_ACQUIRE) == HOST_SETUP; ++i)
+		;
+
+	/* Set up for something else, or by a process that did not finish */
+	if (__atomic_load_n (&header->state, __ATOMIC_ACQUIRE) != HOST_READY || header->sector_size != SECTOR_SIZE ||
+	    header->slots == 0 || header->slots > slots || secure_memcmp (header->volume_check, volume_check, MAC_TAG_SIZE))
+		return -1;
+
+	g_volume.host_cache = (uint8_t *)cache;
+	g_volume.host_cache_slots = header->slots;
+
+	return 0;
+}
+
+
+static uint32_t *_host_slot (uint32_t index)
+{
+	return (uint32_t *)(g_volume.host_cache + sizeof (TSV_HOST_HEADER) + (size_t)(index % g_volume.host_cache_slots) * HOST_SLOT_SIZE (SECTOR_SIZE));
+}
+
+
+/* Whether a Sector is in the cache right now, without copying it */
+bool _host_has (uint32_t sector_num)
+{
+	uint32_t index = sector_num & 0x7FFFFFFF;
+
+	if (!g_volume.host_cache)
+		return false;
+
+	uint32_t *slot = _host_slot (index);
+
+	return !(__atomic_load_n (&slot[0], __ATOMIC_ACQUIRE) & 1) && __atomic_load_n (&slot[1], __ATOMIC_RELAXED) == index + 1;
+}
+
+
+bool _host_get (void *dst, uint32_t sector_num)
+{
+	uint32_t index = sector_num & 0x7FFFFFFF;
+
+	if (!g_volume.host_cache)
+		return false;
+
+	uint32_t *slot = _host_slot (index);
+	uint32_t seq = __atomic_load_n (&slot[0], __ATOMIC_ACQUIRE);
+
+	if ((seq & 1) || __atomic_load_n (&slot[1], __ATOMIC_RELAXED) != index + 1)
+		return false;
+
+	memmove (dst, slot + 2, SECTOR_SIZE);
+	__atomic_thread_fence (__ATOMIC_ACQUIRE);
+
+	return __atomic_load_n (&slot[0], __ATOMIC_RELAXED) == seq;
+}
+
+
+void _host_put (uint32_t sector_num, void const *src)
+{
+	uint32_t index = sector_num & 0x7FFFFFFF;
+
+	if (!g_volume.host_cache)
+		return;
+
+	uint32_t *slot = _host_slot (index);
+	uint32_t seq = __atomic_load_n (&slot[0], __ATOMIC_RELAXED);
+
+	/* Someone else is filling it */
+	if ((seq & 1) || !__atomic_compare_exchange_n (&slot[0], &seq, seq + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	/* The odd count must be visible before any of the new data, as smp_wmb in write_seqcount_begin */
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+	__atomic_store_n (&slot[1], index + 1, __ATOMIC_RELAXED);
+	memmove (slot + 2, src, SECTOR_SIZE);
+	__atomic_store_n (&slot[0], seq + 2, __ATOMIC_RELEASE);
+}
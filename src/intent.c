@@ -0,0 +1,240 @@
+/*
+ * Write-intent record (TSV_FEATURE_INTENT).
+ *
+ * A crash between the two halves of a write can leave both copies of a Sector authentic but different,
+ * and without a record the only way to find such Sectors is to read both copies of the whole volume.
+ * Instead the volume is split into as many regions as the record has bits, and a region's bit is made
+ * durable before the first copy of any of its Sectors is written.  tsv_open compares the copies of the
+ * marked regions only, and makes them agree; the first copy wins if both authenticate, since either is a
+ * state the interrupted write could have left.
+ *
+ * Clearing a bit costs a write to the header Sector, so it is done lazily.  Once INTENT_SETTLE_COMMITS
+ * commits have left nothing pending, the record is rewritten with only the regions marked since it was
+ * last rewritten; busy regions stay marked instead of being marked again on every write.  tsv_close
+ * clears every bit.
+ *
+ * The record follows the progress record in the header Sector: _intent_size bytes of bitmap, sealed with
+ * INTENT_TWEAK, then its MAC tag.  Every header Sector _build_header makes holds a clear record, so a
+ * record that does not authenticate was torn while being rewritten, and tsv_open reconciles every region.
+ * Volumes made before headers carried a record pay for that once.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "util.h"
+#include <titan-secure-volume/app.h>
+#include "_volume.h"
+
+
+/* Commits leaving nothing pending between rewrites of the record */
+#define INTENT_SETTLE_COMMITS 64
+
+
+uint32_t _intent_size (uint32_t sector_size)
+{
+	if (sector_size < INTENT_OFFSET + ENCRYPTION_BLOCK_SIZE + MAC_TAG_SIZE)
+		return 0;
+
+	return MIN (INTENT_MAX_SIZE, (sector_size - INTENT_OFFSET - MAC_TAG_SIZE) / ENCRYPTION_BLOCK_SIZE * ENCRYPTION_BLOCK_SIZE);
+}
+
+
+/* Sectors per region */
+static uint32_t _intent_region (void)
+{
+	uint32_t bits = _intent_size (SECTOR_SIZE) * 8;
+
+	return MAX (1, (g_volume.sector_count + bits - 1) / bits);
+}
+
+
+/* Seals size bytes of bits into record, followed by its MAC tag. */
+static void _intent_seal (uint8_t *record, uint8_t const *mac_key, uint8_t const *encryption_key, uint8_t const *bits, uint32_t size)
+{
+	_volume_encrypt (record, encryption_key, bits, size, INTENT_TWEAK);
+	_volume_mac (record + size, mac_key, record, size, INTENT_TWEAK);
+}
+
+
+/* Seals bits into a record and writes it, without a barrier. */
+static int _intent_write (uint8_t const *bits)
+{
+	uint8_t record[INTENT_MAX_SIZE + MAC_TAG_SIZE];
+	uint32_t size = _intent_size (SECTOR_SIZE);
+
+	_intent_seal (record, g_volume.mac_key, g_volume.encryption_key, bits, size);
+
+	return _io_write (INTENT_OFFSET, record, size + MAC_TAG_SIZE);
+}
+
+
+void _intent_build (void *header, uint8_t const *mac_key, uint8_t const *encryption_key, uint32_t sector_size)
+{
+	uint8_t const clear[INTENT_MAX_SIZE] = {0};
+
+	_intent_seal ((uint8_t *)header + INTENT_OFFSET, mac_key, encryption_key, clear, _intent_size (sector_size));
+}
+
+
+int _intent_mark (uint32_t first, uint32_t count)
+{
+	uint8_t marked[INTENT_MAX_SIZE];
+	uint32_t size = _intent_size (SECTOR_SIZE);
+
+	if (!(g_volume.features & TSV_FEATURE_INTENT) || count == 0)
+		return 0;
+
+	uint32_t region = _intent_region ();
+
+	memmove (marked, g_volume.intent, size);
+
+	for (uint32_t r = first / region; r <= (first + count - 1) / region; ++r)
+	{
+		marked[r >> 3] |= (uint8_t)(1 << (r & 7));
+		g_volume.intent_recent[r >> 3] |= (uint8_t)(1 << (r & 7));
+	}
+
+	if (!memcmp (marked, g_volume.intent, size))
+		return 0;
+
+	/* Only bits known to be durable are remembered, so a failed mark is retried */
+	RtnOnError (_intent_write (marked));
+	RtnOnError (_io_sync ());
+	memmove (g_volume.intent, marked, size);
+
+	return 0;
+}
+
+
+int _intent_settle (void)
+{
+	uint32_t size = _intent_size (SECTOR_SIZE);
+
+	if (!(g_volume.features & TSV_FEATURE_INTENT) || g_volume.pending_count || g_volume.threaded)
+		return 0;
+
+	if (++g_volume.intent_commits < INTENT_SETTLE_COMMITS)
+		return 0;
+
+	g_volume.intent_commits = 0;
+
+	/* Every bit of intent_recent is also set in intent, so this only clears bits.  Losing the write
+	 * leaves them set, which is safe, so there is no barrier.
+	 */
+	if (memcmp (g_volume.intent, g_volume.intent_recent, size))
+	{
+		RtnOnError (_intent_write (g_volume.intent_recent));
+		memmove (g_volume.intent, g_volume.intent_recent, size);
+	}
+
+	memset (g_volume.intent_recent, 0, size);
+
+	return 0;
+}
+
+
+int _intent_clear (void)
+{
+	uint32_t size = _intent_size (SECTOR_SIZE);
+	bool marked = false;
+
+	if (!(g_volume.features & TSV_FEATURE_INTENT) || g_volume.pending_count)
+		return 0;
+
+	for (uint32_t i = 0; i < size; ++i)
+		marked |= g_volume.intent[i] != 0;
+
+	if (!marked)
+		return 0;
+
+	memset (g_volume.intent, 0, size);
+	memset (g_volume.intent_recent, 0, size);
+	g_volume.intent_commits = 0;
+
+	RtnOnError (_intent_write (g_volume.intent));
+
+	return _io_sync ();
+}
+
+
+/* _reconcile for TSV_FEATURE_SHARED volumes, whose copies agree if their ciphertext does. */
+static int _reconcile_shared (uint32_t sector_num)
+{
+	void const *data[2];
+	bool a = !_auth_sector (g_memory.buffer, sector_num, &data[0]);
+	bool b = !_auth_sector (g_memory.gather, sector_num | 0x80000000, &data[1]);
+
+	if (a && (!b || memcmp (data[0], data[1], SECTOR_SIZE)))
+		return _copy_sector (sector_num);
+
+	if (!a && b)
+		return _copy_sector (sector_num | 0x80000000);
+
+	return 0;
+}
+
+
+/* Makes both copies of Sector sector_num agree, if either authenticates. */
+static int _reconcile (uint32_t sector_num)
+{
+	if (g_volume.features & TSV_FEATURE_SHARED)
+		return _reconcile_shared (sector_num);
+
+	bool a = !_read_sector (g_memory.buffer, sector_num);
+	bool b = !_read_sector (g_memory.gather, sector_num | 0x80000000);
+
+	if (a && (!b || memcmp (g_memory.buffer, g_memory.gather, SECTOR_SIZE)))
+		return _write_sector (sector_num | 0x80000000, g_memory.buffer);
+
+	if (!a && b)
+		return _write_sector (sector_num, g_memory.gather);
+
+	return 0;
+}
+
+
+int _intent_open (void)
+{
+	uint8_t record[INTENT_MAX_SIZE + MAC_TAG_SIZE];
+	uint8_t calculated_mac[MAC_TAG_SIZE];
+	uint32_t size = _intent_size (SECTOR_SIZE);
+
+	if (!(g_volume.features & TSV_FEATURE_INTENT))
+		return 0;
+
+	RtnOnError (_io_read (record, INTENT_OFFSET, size + MAC_TAG_SIZE));
+
+	_volume_mac (calculated_mac, g_volume.mac_key, record, size, INTENT_TWEAK);
+
+	/* Torn by a crash, so any region could have been in flight */
+	if (secure_memcmp (calculated_mac, record + size, MAC_TAG_SIZE))
+		memset (g_volume.intent, 0xFF, size);
+	else
+		_volume_decrypt (g_volume.intent, g_volume.encryption_key, record, size, INTENT_TWEAK);
+
+	uint32_t region = _intent_region ();
+	bool marked = false;
+
+	for (uint32_t r = 0; r < size * 8; ++r)
+	{
+		if (!(g_volume.intent[r >> 3] & (1 << (r & 7))))
+			continue;
+
+		/* Left by a crash; a read-only open cannot make the copies agree */
+		if (g_volume.readonly)
+			return -1;
+
+		for (uint32_t i = r * region; i < g_volume.sector_count && i < (r + 1) * region; ++i)
+			RtnOnError (_reconcile (i));
+
+		marked = true;
+	}
+
+	if (!marked)
+		return 0;
+
+	/* The copies must agree in storage before the marks go */
+	RtnOnError (_io_sync ());
+
+	return _intent_clear ();
+}
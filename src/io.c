@@ -0,0 +1,209 @@
+/*
+ * Physical I/O scheduler.
+ *
+ * The library writes a Sector's data, then its MAC tag, then the next Sector's, in whatever order the
+ * request touches them.  With an I/O queue (TSV_CONFIG.io_queue_size) writes are held back until the
+ * next barrier instead, and then issued sorted by offset, with adjacent writes merged into one; a
+ * commit's Sectors and their tags reach storage as a few long sequential writes.  Nothing is moved
+ * across a barrier, so both copies of a Sector are still never in flight at once.
+ *
+ * A write to the same range as a queued one replaces it, a read within one is served from the queue,
+ * and a map of one fails so that the caller reads instead.  Anything else that overlaps a queued write
+ * (a read spanning several, a discard, or a differently sized write) flushes the queue first, so storage
+ * is always seen as if every write had gone straight through.
+ *
+ * Foreground writes never wait behind background ones: tsv_replicate and every grow and rekey step
+ * start or end with a barrier, which flushes the queue, so their writes never share a flush with a
+ * request's.
+ *
+ * A flush that fails empties the caches, which may hold writes that never reached storage.  The default
+ * arena has no queue, and threaded mode writes straight through.  Nothing is written to a volume opened
+ * with tsv_open_readonly.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "util.h"
+#include <titan-secure-volume/app.h>
+#include "_volume.h"
+
+
+static bool _io_queueing (void)
+{
+	return g_memory.io_queue_size && !g_volume.threaded;
+}
+
+
+/* Index of the first queued write ending after offset, or io_count */
+static uint32_t _io_find (uint64_t offset)
+{
+	uint32_t lo = 0, hi = g_memory.io_count;
+
+	while (lo < hi)
+	{
+		uint32_t mid = lo + (hi - lo) / 2;
+
+		if (g_memory.io_ops[mid].offset + g_memory.io_ops[mid].len <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+
+static bool _io_overlaps (uint64_t offset, size_t len)
+{
+	uint32_t i = _io_find (offset);
+
+	return i < g_memory.io_count && g_memory.io_ops[i].offset < offset + len;
+}
+
+
+/* Issues each run of adjacent queued writes as one write. */
+static int _io_issue (void)
+{
+	TSV_IO_OP const *ops = g_memory.io_ops;
+
+	for (uint32_t i = 0; i < g_memory.io_count;)
+	{
+		uint64_t end = ops[i].offset + ops[i].len;
+		uint32_t j = i + 1;
+
+		while (j < g_memory.io_count && ops[j].offset == end)
+			end += ops[j++].len;
+
+		if (j == i + 1)
+		{
+			RtnOnError (tsv_physical_write (ops[i].offset, g_memory.io_data + ops[i].pos, ops[i].len));
+		}
+		else
+		{
+			size_t run = 0;
+
+			for (uint32_t k = i; k < j; ++k)
+			{
+				memmove (g_memory.io_bounce + run, g_memory.io_data + ops[k].pos, ops[k].len);
+				run += ops[k].len;
+			}
+
+			RtnOnError (tsv_physical_write (ops[i].offset, g_memory.io_bounce, run));
+		}
+
+		i = j;
+	}
+
+	return 0;
+}
+
+
+int _io_flush (void)
+{
+	if (g_memory.io_count == 0)
+		return 0;
+
+	int err = _io_issue ();
+
+	g_memory.io_count = 0;
+	g_memory.io_used = 0;
+
+	if (err)
+		_cache_reset ();
+
+	return err;
+}
+
+
+int _io_write (uint64_t offset, void const *src, size_t len)
+{
+	/* Whatever the path, a read-only volume is never written */
+	if (g_volume.readonly)
+		return -1;
+
+	if (!_io_queueing () || len == 0)
+		return tsv_physical_write (offset, src, len);
+
+	uint32_t i = _io_find (offset);
+	TSV_IO_OP *op = &g_memory.io_ops[i];
+
+	/* Rewriting a queued range, like a fresh copy rewritten before its commit */
+	if (i < g_memory.io_count && op->offset == offset && op->len == len)
+	{
+		memmove (g_memory.io_data + op->pos, src, len);
+		return 0;
+	}
+
+	if ((i < g_memory.io_count && op->offset < offset + len) ||
+	    g_memory.io_count == g_memory.io_max_ops || len > g_memory.io_queue_size - g_memory.io_used)
+	{
+		RtnOnError (_io_flush ());
+		i = 0;
+	}
+
+	if (len > g_memory.io_queue_size)
+		return tsv_physical_write (offset, src, len);
+
+	memmove (g_memory.io_ops + i + 1, g_memory.io_ops + i, (g_memory.io_count - i) * sizeof (TSV_IO_OP));
+	g_memory.io_ops[i] = (TSV_IO_OP){
+		.offset = offset,
+		.len = (uint32_t)len,
+		.pos = g_memory.io_used,
+	};
+	memmove (g_memory.io_data + g_memory.io_used, src, len);
+	g_memory.io_count += 1;
+	g_memory.io_used += (uint32_t)len;
+
+	return 0;
+}
+
+
+int _io_read (void *dst, uint64_t offset, size_t len)
+{
+	uint32_t i = _io_find (offset);
+	TSV_IO_OP const *op = &g_memory.io_ops[i];
+
+	if (i < g_memory.io_count && op->offset < offset + len)
+	{
+		/* Straight from the queue if one write covers it, like a fresh copy read back before its commit */
+		if (op->offset <= offset && offset + len <= op->offset + op->len)
+		{
+			memmove (dst, g_memory.io_data + op->pos + (offset - op->offset), len);
+			return 0;
+		}
+
+		RtnOnError (_io_flush ());
+	}
+
+	return tsv_physical_read (dst, offset, len);
+}
+
+
+int _io_sync (void)
+{
+	RtnOnError (_io_flush ());
+
+	return tsv_physical_sync ();
+}
+
+
+/* Queued writes are not in the mapping yet, so the caller reads instead */
+void const *_io_map (uint64_t offset, size_t len)
+{
+	if (_io_overlaps (offset, len))
+		return NULL;
+
+	return tsv_physical_map (offset, len);
+}
+
+
+int _io_discard (uint64_t offset, size_t len)
+{
+	if (g_volume.readonly)
+		return -1;
+
+	if (_io_overlaps (offset, len))
+		RtnOnError (_io_flush ());
+
+	return tsv_physical_discard (offset, len);
+}
@@ -0,0 +1,427 @@
+/*
+ * Log-structured writes (TSV_FEATURE_LOG).
+ *
+ * Writing a Sector in place costs a scattered write of its data and another of its MAC tag, in each
+ * copy.  Log volumes append it to a log instead: a ring of LOG_SLOTS slots in each copy, each holding the
+ * Sector's ciphertext exactly as its home copy would, beside a sealed entry that names the Sector and
+ * carries its tag.  Consecutive writes fill consecutive slots, so with an I/O queue a commit reaches
+ * storage as one run of entries and one of data per copy, wherever its Sectors live.
+ *
+ * The copies of a slot are written as the copies of a Sector are: the fresh one first, the other at
+ * commit, after a barrier.  A Sector rewritten before its commit keeps its slot; a committed one gets a
+ * new slot, so a committed slot is never overwritten until it has been cleaned.
+ *
+ * The cleaner (tsv_log_clean, and tsv_write once the log is full) writes committed slots back to their
+ * home copies, oldest first, skipping any Sector that a later slot of the same pass holds, then issues a
+ * barrier and frees them.  It never passes a slot that is not committed yet.  If neither copy of a slot
+ * authenticates it stops there, and writes needing a new slot fail until the slot is repaired.
+ *
+ * Every entry records its sequence number and the oldest one still live (log_tail) when it was written,
+ * and the log's first Sector keeps log_tail after each cleaning pass.  tsv_open takes the largest tail
+ * it finds and replays the newer entries: the newest slot of each Sector wins, a slot with only one copy
+ * written is queued for commit as it was before the crash, and one whose only copy does not authenticate
+ * is dropped, leaving the Sector's previous contents.
+ *
+ * Log volumes cannot grow, rekey or use threaded mode, and have no write-intent record: a crash only
+ * ever leaves the log's newest slots to check.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "basic_packing.h"
+#include "util.h"
+#include <titan-secure-volume/app.h>
+#include "_volume.h"
+
+
+typedef struct __attribute__((__packed__))
+{
+	uint8_t sector[4];              /* Sector in the slot; LOG_EMPTY in the tail record */
+	uint8_t seq[8];
+	uint8_t tail[8];                /* log_tail when the entry was written */
+	uint8_t tag[MAC_TAG_SIZE];      /* The Sector's tag, as its home copy would hold it */
+	uint8_t padding[12];
+} PACKED_TSV_LOG_ENTRY;
+
+
+_Static_assert (sizeof (PACKED_TSV_LOG_ENTRY) + MAC_TAG_SIZE == LOG_ENTRY_SIZE, "Size of PACKED_TSV_LOG_ENTRY struct does not match expected size.");
+
+
+static uint64_t _log_table_size (uint32_t sector_size)
+{
+	return roundup_uint64 ((uint64_t)LOG_SLOTS * LOG_ENTRY_SIZE, sector_size);
+}
+
+
+/* The tail record's Sector, then each copy's entries and slots */
+uint64_t _log_size (uint32_t sector_size)
+{
+	return sector_size + 2 * (_log_table_size (sector_size) + (uint64_t)LOG_SLOTS * sector_size);
+}
+
+
+static uint64_t _log_copy_offset (uint32_t copy)
+{
+	return g_volume.log_offset + SECTOR_SIZE + copy * ((_log_size (SECTOR_SIZE) - SECTOR_SIZE) / 2);
+}
+
+
+static uint64_t _log_entry_offset (uint32_t copy, uint32_t slot)
+{
+	return _log_copy_offset (copy) + (uint64_t)slot * LOG_ENTRY_SIZE;
+}
+
+
+static uint64_t _log_data_offset (uint32_t copy, uint32_t slot)
+{
+	return _log_copy_offset (copy) + _log_table_size (SECTOR_SIZE) + (uint64_t)slot * SECTOR_SIZE;
+}
+
+
+/* Sequence number of a live slot */
+static uint64_t _log_seq (uint32_t slot)
+{
+	return g_volume.log_tail + ((slot - g_volume.log_tail) & (LOG_SLOTS - 1));
+}
+
+
+/* Seals an entry into dst.  The tail record has no tag. */
+static void _log_seal (uint8_t dst[static LOG_ENTRY_SIZE], uint32_t sector, uint64_t seq, uint8_t const *tag)
+{
+	PACKED_TSV_LOG_ENTRY entry;
+
+	pack_uint32_little (entry.sector, sector);
+	pack_uint64_little (entry.seq, seq);
+	pack_uint64_little (entry.tail, g_volume.log_tail);
+	_noise (entry.padding, member_size (PACKED_TSV_LOG_ENTRY, padding));
+
+	if (tag)
+		memmove (entry.tag, tag, MAC_TAG_SIZE);
+	else
+		_noise (entry.tag, MAC_TAG_SIZE);
+
+	_volume_encrypt (dst, g_volume.encryption_key, &entry, sizeof (entry), LOG_TWEAK);
+	_volume_mac (dst + sizeof (entry), g_volume.mac_key, dst, sizeof (entry), LOG_TWEAK);
+}
+
+
+/* Returns -1 if the entry at offset does not authenticate, as the noise of a new volume never does. */
+static int _log_read_entry (PACKED_TSV_LOG_ENTRY *entry, uint64_t offset)
+{
+	uint8_t sealed[LOG_ENTRY_SIZE];
+	uint8_t calculated_mac[MAC_TAG_SIZE];
+
+	RtnOnError (_io_read (sealed, offset, LOG_ENTRY_SIZE));
+
+	_volume_mac (calculated_mac, g_volume.mac_key, sealed, sizeof (*entry), LOG_TWEAK);
+	if (secure_memcmp (calculated_mac, sealed + sizeof (*entry), MAC_TAG_SIZE))
+		return -1;
+
+	_volume_decrypt (entry, g_volume.encryption_key, sealed, sizeof (*entry), LOG_TWEAK);
+
+	return 0;
+}
+
+
+bool _log_full (void)
+{
+	return g_volume.log_next - g_volume.log_tail == LOG_SLOTS;
+}
+
+
+int _log_find (uint32_t sector_num)
+{
+	for (uint64_t seq = g_volume.log_next; seq > g_volume.log_tail; --seq)
+	{
+		uint32_t slot = (uint32_t)((seq - 1) & (LOG_SLOTS - 1));
+
+		if (g_volume.log_sector[slot] == sector_num)
+			return (int)slot;
+	}
+
+	return -1;
+}
+
+
+int _log_auth (void *buf, uint32_t sector_num, uint32_t slot, void const **data, uint8_t *tag)
+{
+	PACKED_TSV_LOG_ENTRY entry;
+	uint8_t calculated_mac[MAC_TAG_SIZE];
+	uint32_t copy = sector_num >> 31;
+
+	if (!((g_volume.log_written[slot] >> copy) & 1))
+		return -1;
+
+	RtnOnError (_log_read_entry (&entry, _log_entry_offset (copy, slot)));
+
+	/* An entry moved from another slot, or left from an earlier pass, names something else */
+	if (unpack_uint32_little (entry.sector) != (sector_num & 0x7FFFFFFF) || unpack_uint64_little (entry.seq) != _log_seq (slot))
+		return -1;
+
+	uint64_t data_offset = _log_data_offset (copy, slot);
+
+	*data = _io_map (data_offset, SECTOR_SIZE);
+
+	if (*data == NULL)
+	{
+		RtnOnError (_io_read (buf, data_offset, SECTOR_SIZE));
+		*data = buf;
+	}
+
+	_volume_mac (calculated_mac, g_volume.mac_key, *data, SECTOR_SIZE, _tweak (sector_num));
+
+	if (secure_memcmp (entry.tag, calculated_mac, MAC_TAG_SIZE))
+		return -1;
+
+	if (tag)
+		memmove (tag, entry.tag, MAC_TAG_SIZE);
+
+	return 0;
+}
+
+
+int _log_write (uint32_t sector_num, void const *data, uint8_t const *tag)
+{
+	uint8_t entry[LOG_ENTRY_SIZE];
+	uint32_t copy = sector_num >> 31;
+	uint32_t index = sector_num & 0x7FFFFFFF;
+	int found = _log_find (index);
+	uint32_t slot;
+
+	/* The fresh copy rewritten before its commit, or the other copy at commit, stay in their slot */
+	if (found >= 0 && g_volume.log_written[found] != 3)
+	{
+		slot = (uint32_t)found;
+	}
+	else
+	{
+		if (_log_full ())
+			return -1;
+
+		slot = (uint32_t)(g_volume.log_next & (LOG_SLOTS - 1));
+		g_volume.log_sector[slot] = index;
+		g_volume.log_written[slot] = 0;
+		g_volume.log_next += 1;
+	}
+
+	_log_seal (entry, index, _log_seq (slot), tag);
+
+	if (_io_write (_log_data_offset (copy, slot), data, SECTOR_SIZE) ||
+	    _io_write (_log_entry_offset (copy, slot), entry, LOG_ENTRY_SIZE))
+	{
+		/* A new slot is given back; storage no longer matches the cache */
+		if (g_volume.log_written[slot] == 0)
+			g_volume.log_next -= 1;
+
+		_cache_put (sector_num, NULL);
+		return -1;
+	}
+
+	g_volume.log_written[slot] |= (uint8_t)(1 << copy);
+
+	return 0;
+}
+
+
+/* Writes both copies of a slot home, unless a later slot before end holds the same Sector.  A copy that
+ * does not authenticate is re-sealed from the other.
+ */
+static int _log_home (uint32_t slot, uint64_t end)
+{
+	uint32_t index = g_volume.log_sector[slot];
+	void const *data;
+	uint8_t tag[MAC_TAG_SIZE];
+
+	if (index == LOG_EMPTY)
+		return 0;
+
+	uint64_t newest = _log_seq ((uint32_t)_log_find (index));
+
+	if (newest > _log_seq (slot) && newest < end)
+		return 0;
+
+	for (uint32_t copy = 0; copy < 2; ++copy)
+	{
+		uint32_t sector_num = index | (copy << 31);
+
+		if (!_log_auth (g_memory.buffer, sector_num, slot, &data, tag))
+		{
+			RtnOnError (_write_sealed (sector_num, data, tag));
+			continue;
+		}
+
+		_count_corruption ();
+
+		if (_log_auth (g_memory.buffer, sector_num ^ 0x80000000, slot, &data, NULL))
+		{
+			_count_corruption ();
+			return -1;
+		}
+
+		_volume_decrypt (g_memory.buffer, g_volume.encryption_key, data, SECTOR_SIZE, _tweak (sector_num ^ 0x80000000));
+		RtnOnError (_seal_sector (sector_num, g_memory.buffer));
+
+		/* The plaintext cache holds the newest contents, which a later slot may still have */
+		_cache_put (sector_num, NULL);
+	}
+
+	return 0;
+}
+
+
+int _log_clean (uint32_t max_sectors)
+{
+	uint8_t record[LOG_ENTRY_SIZE];
+	uint64_t end = g_volume.log_tail;
+	int err = 0;
+
+	while (end < g_volume.log_next && end - g_volume.log_tail < max_sectors && g_volume.log_written[end & (LOG_SLOTS - 1)] == 3)
+		++end;
+
+	if (end == g_volume.log_tail)
+		return 0;
+
+	/* The log stays authoritative until the barrier, so both home copies may be in flight at once */
+	g_volume.log_active = false;
+
+	for (uint64_t seq = g_volume.log_tail; seq < end && !err; ++seq)
+		err = _log_home ((uint32_t)(seq & (LOG_SLOTS - 1)), end);
+
+	if (!err)
+		err = _io_sync ();
+
+	g_volume.log_active = true;
+	RtnOnError (err);
+
+	g_volume.log_tail = end;
+
+	/* Losing the record only means cleaning the same slots again, so there is no barrier */
+	_log_seal (record, LOG_EMPTY, 0, NULL);
+
+	return _io_write (g_volume.log_offset, record, LOG_ENTRY_SIZE);
+}
+
+
+/* Works out which copies of each live slot were written, dropping slots that hold nothing usable. */
+static void _log_replay (void)
+{
+	PACKED_TSV_LOG_ENTRY entry;
+
+	for (uint64_t seq = g_volume.log_tail; seq < g_volume.log_next; ++seq)
+	{
+		uint32_t slot = (uint32_t)(seq & (LOG_SLOTS - 1));
+		uint32_t index = LOG_EMPTY;
+		uint8_t written = 0;
+
+		for (uint32_t copy = 0; copy < 2; ++copy)
+		{
+			if (_log_read_entry (&entry, _log_entry_offset (copy, slot)) || unpack_uint64_little (entry.seq) != seq)
+				continue;
+
+			uint32_t sector = unpack_uint32_little (entry.sector);
+
+			if (sector < g_volume.sector_count && (index == LOG_EMPTY || index == sector))
+			{
+				index = sector;
+				written |= (uint8_t)(1 << copy);
+			}
+		}
+
+		g_volume.log_sector[slot] = index;
+		g_volume.log_written[slot] = (index == LOG_EMPTY) ? 3 : written;
+	}
+
+	/* Newest first, so a slot dropped here lets an older slot of the same Sector take over */
+	for (uint64_t seq = g_volume.log_next; seq > g_volume.log_tail; --seq)
+	{
+		uint32_t slot = (uint32_t)((seq - 1) & (LOG_SLOTS - 1));
+		uint32_t written = g_volume.log_written[slot];
+		uint32_t index = g_volume.log_sector[slot];
+		void const *data;
+
+		if (written == 3)
+			continue;
+
+		if (_log_find (index) == (int)slot && !_log_auth (g_memory.buffer, index | ((written >> 1) << 31), slot, &data, NULL))
+			continue;
+
+		g_volume.log_sector[slot] = LOG_EMPTY;
+		g_volume.log_written[slot] = 3;
+	}
+}
+
+
+int _log_open (void)
+{
+	PACKED_TSV_LOG_ENTRY entry;
+	uint64_t tail = 0, next = 0;
+
+	if (!(g_volume.features & TSV_FEATURE_LOG))
+		return 0;
+
+	if (!_log_read_entry (&entry, g_volume.log_offset))
+		tail = unpack_uint64_little (entry.tail);
+
+	for (uint32_t copy = 0; copy < 2; ++copy)
+	{
+		for (uint32_t slot = 0; slot < LOG_SLOTS; ++slot)
+		{
+			if (_log_read_entry (&entry, _log_entry_offset (copy, slot)))
+				continue;
+
+			uint64_t seq = unpack_uint64_little (entry.seq);
+
+			if ((seq & (LOG_SLOTS - 1)) != slot)
+				continue;
+
+			tail = MAX (tail, unpack_uint64_little (entry.tail));
+			next = MAX (next, seq + 1);
+		}
+	}
+
+	next = MAX (next, tail);
+	g_volume.log_next = next;
+	g_volume.log_tail = MAX (tail, next - MIN (next, LOG_SLOTS));
+
+	_log_replay ();
+	g_volume.log_active = true;
+
+	/* Slots with one copy written are committed as they would have been, oldest first */
+	for (uint64_t seq = g_volume.log_tail; seq < g_volume.log_next; ++seq)
+	{
+		uint32_t slot = (uint32_t)(seq & (LOG_SLOTS - 1));
+		uint32_t written = g_volume.log_written[slot];
+		uint32_t sector_num = g_volume.log_sector[slot] | ((written >> 1) << 31);
+		void const *data;
+
+		if (written == 3)
+			continue;
+
+		/* Left by a crash; a read-only open cannot finish the write */
+		if (g_volume.readonly)
+			return -1;
+
+		if (g_volume.pending_count == PENDING_QUEUE_SIZE)
+			RtnOnError (_commit (PENDING_QUEUE_SIZE, 0, NULL, 0));
+
+		RtnOnError (_log_auth (g_memory.buffer, sector_num, slot, &data, (g_volume.features & TSV_FEATURE_SHARED) ? g_volume.pending_tags[g_volume.pending_count] : NULL));
+		g_volume.pending[g_volume.pending_count++] = sector_num;
+	}
+
+	return _commit (PENDING_QUEUE_SIZE, 0, NULL, 0);
+}
+
+
+int tsv_log_clean (uint32_t max_sectors)
+{
+	if (!g_volume.open || g_volume.readonly || !(g_volume.features & TSV_FEATURE_LOG))
+		return -1;
+
+	return _log_clean (max_sectors);
+}
+
+
+uint32_t tsv_log_used (void)
+{
+	return (uint32_t)(g_volume.log_next - g_volume.log_tail);
+}
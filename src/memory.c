@@ -0,0 +1,368 @@
+/*
+ * Memory.
+ *
+ * Every buffer and cache lives in one arena, either the built-in default or one given to tsv_init, so
+ * nothing is allocated and caches can be sized to the platform.  The arena holds, in order: the slot
+ * I/O queue's writes, the slot tags of both caches, the Sector buffer, the bitmap Sector, the gather
+ * buffer, the track map page, cached Sectors, MAC pages, staging, and the I/O queue's data and bounce
+ * buffer.  The bitmap Sector, gather buffer and track map page are only carved for the features, or
+ * vectored I/O, that use them.
+ *
+ * Both caches are direct mapped and write-through.  _seal_sector updates them as it writes, so they
+ * always match storage and never need flushing.  The Sector cache holds plaintext by Sector number,
+ * since both copies of a current Sector decrypt to the same data; MAC pages are kept per copy.  Both
+ * are bypassed while a grow or rekey moves copies or changes keys, and emptied whenever the layout is
+ * set up again.  A read-only volume may also have a host cache, shared with other processes (see
+ * hostcache.c), behind the Sector cache.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "util.h"
+#include <titan-secure-volume/app.h>
+#include "_volume.h"
+
+
+/* Features using each of the buffers carved only when needed.  The bitmap Sector is also parity's
+ * scratch, and the gather buffer also serves vectored I/O.
+ */
+#define BITMAP_FEATURES (TSV_FEATURE_DISCARD | TSV_FEATURE_PARITY)
+#define GATHER_FEATURES (TSV_FEATURE_PARITY | TSV_FEATURE_INTENT)
+#define TRACK_FEATURES TSV_FEATURE_TRACK
+
+/* The default arena has the Sector buffer and gather buffer, then whatever the features built need */
+#define DEFAULT_BITMAP ((BUILT_FEATURES & BITMAP_FEATURES) != 0)
+#define DEFAULT_TRACK ((BUILT_FEATURES & TRACK_FEATURES) != 0)
+
+#if DEFAULT_MAX_SECTOR_SIZE
+static uint8_t g_default_arena[(2 + DEFAULT_BITMAP + DEFAULT_TRACK) * DEFAULT_MAX_SECTOR_SIZE];
+
+#define DEFAULT_MEMORY { \
+	.buffer = g_default_arena, \
+	.gather = g_default_arena + DEFAULT_MAX_SECTOR_SIZE, \
+	.bitmap = DEFAULT_BITMAP ? g_default_arena + 2 * DEFAULT_MAX_SECTOR_SIZE : NULL, \
+	.track = DEFAULT_TRACK ? g_default_arena + (2 + DEFAULT_BITMAP) * DEFAULT_MAX_SECTOR_SIZE : NULL, \
+	.buffer_size = DEFAULT_MAX_SECTOR_SIZE, \
+}
+#else
+#define DEFAULT_MEMORY { .buffer = NULL }
+#endif
+
+TSV_MEMORY g_memory = DEFAULT_MEMORY;
+
+
+/* Sector-sized buffers config needs besides the Sector buffer */
+static uint32_t _extra_buffers (TSV_CONFIG const *config)
+{
+	return ((config->features & BITMAP_FEATURES) != 0) + ((config->features & GATHER_FEATURES) || config->vectored) + ((config->features & TRACK_FEATURES) != 0);
+}
+
+
+size_t tsv_arena_size (TSV_CONFIG const *config)
+{
+	if (config == NULL || config->max_sector_size < TSV_HEADER_SIZE + MAC_TAG_SIZE || (config->max_sector_size % ENCRYPTION_BLOCK_SIZE) != 0)
+		return 0;
+
+	/* Slack for aligning the queued writes and slot tags */
+	uint64_t size = sizeof (uint64_t) - 1;
+
+	size += sizeof (TSV_IO_OP) * (uint64_t)(config->io_queue_size / IO_BYTES_PER_OP);
+	size += sizeof (uint32_t) * ((uint64_t)config->cache_sectors + config->mac_pages);
+	size += (1 + _extra_buffers (config) + (uint64_t)config->cache_sectors) * config->max_sector_size;
+	size += (uint64_t)config->mac_pages * TSV_MAC_PAGE_SIZE;
+	size += config->staging_size;
+	size += 2 * (uint64_t)config->io_queue_size;
+
+	return (size > SIZE_MAX) ? 0 : (size_t)size;
+}
+
+
+int tsv_init (void *arena, size_t arena_len, TSV_CONFIG const *config)
+{
+	if (g_volume.open)
+		return -1;
+
+	if (arena == NULL)
+	{
+		_memory_wipe ();
+		g_memory = (TSV_MEMORY)DEFAULT_MEMORY;
+		return g_memory.buffer ? 0 : -1;
+	}
+
+	size_t size = tsv_arena_size (config);
+
+	if (size == 0 || arena_len < size)
+		return -1;
+
+	uint8_t *p = (uint8_t *)arena + (-(uintptr_t)arena & (sizeof (uint64_t) - 1));
+
+	_memory_wipe ();
+	memset (&g_memory, 0, sizeof (g_memory));
+
+	g_memory.io_max_ops = config->io_queue_size / IO_BYTES_PER_OP;
+	g_memory.io_ops = (TSV_IO_OP *)p;
+	p += sizeof (TSV_IO_OP) * g_memory.io_max_ops;
+
+	g_memory.cache_sectors = config->cache_sectors;
+	g_memory.cache_tags = (uint32_t *)p;
+	p += sizeof (uint32_t) * config->cache_sectors;
+	g_memory.mac_pages = config->mac_pages;
+	g_memory.mac_tags = (uint32_t *)p;
+	p += sizeof (uint32_t) * config->mac_pages;
+
+	g_memory.buffer_size = config->max_sector_size;
+	g_memory.buffer = p;
+	p += config->max_sector_size;
+
+	if (config->features & BITMAP_FEATURES)
+	{
+		g_memory.bitmap = p;
+		p += config->max_sector_size;
+	}
+
+	if ((config->features & GATHER_FEATURES) || config->vectored)
+	{
+		g_memory.gather = p;
+		p += config->max_sector_size;
+	}
+
+	if (config->features & TRACK_FEATURES)
+	{
+		g_memory.track = p;
+		p += config->max_sector_size;
+	}
+
+	g_memory.cache = p;
+	p += (size_t)config->cache_sectors * config->max_sector_size;
+	g_memory.mac_cache = p;
+	p += (size_t)config->mac_pages * TSV_MAC_PAGE_SIZE;
+	g_memory.staging_size = config->staging_size;
+	g_memory.staging = p;
+	p += config->staging_size;
+	g_memory.io_queue_size = g_memory.io_max_ops ? config->io_queue_size : 0;
+	g_memory.io_data = p;
+	p += config->io_queue_size;
+	g_memory.io_bounce = p;
+
+	_memory_wipe ();
+
+	return 0;
+}
+
+
+/* Not while a grow or rekey is moving copies or switching keys */
+static bool _caching (void)
+{
+	return !g_volume.grow_sector_count && !g_volume.rekey;
+}
+
+
+static void _cache_lock (void)
+{
+	if (g_volume.threaded)
+		tsv_lock (LOCK_CACHE);
+}
+
+
+static void _cache_unlock (void)
+{
+	if (g_volume.threaded)
+		tsv_unlock (LOCK_CACHE);
+}
+
+
+bool _cache_get (void *dst, uint32_t sector_num)
+{
+	uint32_t index = sector_num & 0x7FFFFFFF;
+	bool hit = false;
+
+	if (!_caching ())
+		return false;
+
+	if (g_memory.cache_sectors)
+	{
+		uint32_t slot = index % g_memory.cache_sectors;
+
+		_cache_lock ();
+
+		if (g_memory.cache_tags[slot] == index + 1)
+		{
+			memmove (dst, g_memory.cache + (size_t)slot * g_memory.buffer_size, SECTOR_SIZE);
+			hit = true;
+		}
+
+		_cache_unlock ();
+	}
+
+	/* Then the host cache, if tsv_open_readonly attached one */
+	return hit || _host_get (dst, index);
+}
+
+
+void _cache_put (uint32_t sector_num, void const *src)
+{
+	uint32_t index = sector_num & 0x7FFFFFFF;
+
+	if (!_caching ())
+		return;
+
+	/* Read-only, so the host cache is only ever offered Sectors just read */
+	if (src)
+		_host_put (index, src);
+
+	if (!g_memory.cache_sectors)
+		return;
+
+	uint32_t slot = index % g_memory.cache_sectors;
+
+	_cache_lock ();
+
+	if (src)
+	{
+		memmove (g_memory.cache + (size_t)slot * g_memory.buffer_size, src, SECTOR_SIZE);
+		g_memory.cache_tags[slot] = index + 1;
+	}
+	else if (g_memory.cache_tags[slot] == index + 1)
+	{
+		g_memory.cache_tags[slot] = 0;
+	}
+
+	_cache_unlock ();
+}
+
+
+static uint32_t _mac_key (uint32_t sector_num)
+{
+	return ((sector_num & 0x80000000) | ((sector_num & 0x7FFFFFFF) / MAC_PAGE_TAGS)) + 1;
+}
+
+
+int _mac_read (void *dst, uint32_t sector_num)
+{
+	uint32_t copy = sector_num >> 31;
+	uint32_t index = sector_num & 0x7FFFFFFF;
+
+	if (!g_memory.mac_pages || !_caching ())
+		return _io_read (dst, g_volume.mac_offset[copy] + (uint64_t)index * MAC_TAG_SIZE, MAC_TAG_SIZE);
+
+	uint32_t key = _mac_key (sector_num);
+	uint32_t slot = key % g_memory.mac_pages;
+	uint8_t *page = g_memory.mac_cache + (size_t)slot * TSV_MAC_PAGE_SIZE;
+	uint8_t fetched[TSV_MAC_PAGE_SIZE];
+	uint32_t puts;
+
+	_cache_lock ();
+
+	if (g_memory.mac_tags[slot] == key)
+	{
+		memmove (dst, page + (index % MAC_PAGE_TAGS) * MAC_TAG_SIZE, MAC_TAG_SIZE);
+		_cache_unlock ();
+		return 0;
+	}
+
+	puts = g_memory.mac_puts;
+	_cache_unlock ();
+
+	/* Other threads keep using the cache meanwhile.  The last page stops at the end of the MAC table. */
+	uint64_t page_offset = (uint64_t)(index / MAC_PAGE_TAGS) * TSV_MAC_PAGE_SIZE;
+	size_t page_len = (size_t)MIN (g_volume.mac_table_size - page_offset, TSV_MAC_PAGE_SIZE);
+
+	RtnOnError (_io_read (fetched, g_volume.mac_offset[copy] + page_offset, page_len));
+	memmove (dst, fetched + (index % MAC_PAGE_TAGS) * MAC_TAG_SIZE, MAC_TAG_SIZE);
+
+	/* A tag written since may be missing from the page, so then it is not kept */
+	_cache_lock ();
+
+	if (g_memory.mac_puts == puts)
+	{
+		memmove (page, fetched, page_len);
+		g_memory.mac_tags[slot] = key;
+	}
+
+	_cache_unlock ();
+
+	return 0;
+}
+
+
+void _mac_put (uint32_t sector_num, void const *tag)
+{
+	if (!g_memory.mac_pages || !_caching ())
+		return;
+
+	uint32_t key = _mac_key (sector_num);
+	uint32_t slot = key % g_memory.mac_pages;
+
+	_cache_lock ();
+
+	g_memory.mac_puts += 1;
+
+	if (g_memory.mac_tags[slot] == key)
+	{
+		if (tag)
+			memmove (g_memory.mac_cache + (size_t)slot * TSV_MAC_PAGE_SIZE + ((sector_num & 0x7FFFFFFF) % MAC_PAGE_TAGS) * MAC_TAG_SIZE, tag, MAC_TAG_SIZE);
+		else
+			g_memory.mac_tags[slot] = 0;
+	}
+
+	_cache_unlock ();
+}
+
+
+void _cache_reset (void)
+{
+	/* The cached plaintext goes too, not just the tags */
+	if (g_memory.cache_sectors)
+		memset (g_memory.cache, 0, (size_t)g_memory.cache_sectors * g_memory.buffer_size);
+
+	for (uint32_t i = 0; i < g_memory.cache_sectors; ++i)
+		g_memory.cache_tags[i] = 0;
+
+	for (uint32_t i = 0; i < g_memory.mac_pages; ++i)
+		g_memory.mac_tags[i] = 0;
+}
+
+
+void _memory_wipe (void)
+{
+	_cache_reset ();
+
+	/* Buffers left out are NULL */
+	uint8_t *buffers[] = {g_memory.buffer, g_memory.bitmap, g_memory.gather, g_memory.track};
+
+	for (size_t i = 0; i < sizeof (buffers) / sizeof (buffers[0]); ++i)
+	{
+		if (buffers[i])
+			memset (buffers[i], 0, g_memory.buffer_size);
+	}
+
+	if (g_memory.mac_pages)
+		memset (g_memory.mac_cache, 0, (size_t)g_memory.mac_pages * TSV_MAC_PAGE_SIZE);
+
+	if (g_memory.staging_size)
+		memset (g_memory.staging, 0, g_memory.staging_size);
+
+	if (g_memory.io_queue_size)
+	{
+		memset (g_memory.io_data, 0, g_memory.io_queue_size);
+		memset (g_memory.io_bounce, 0, g_memory.io_queue_size);
+	}
+
+	g_memory.io_count = 0;
+	g_memory.io_used = 0;
+}
+
+
+int _memory_check (uint32_t features)
+{
+	if ((features & BITMAP_FEATURES) && g_memory.bitmap == NULL)
+		return -1;
+
+	if ((features & GATHER_FEATURES) && g_memory.gather == NULL)
+		return -1;
+
+	if ((features & TRACK_FEATURES) && g_memory.track == NULL)
+		return -1;
+
+	return 0;
+}
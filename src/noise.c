@@ -0,0 +1,70 @@
+/*
+ * Noise.
+ *
+ * Padding, and the noise that fills MAC tables and unused Sectors, comes from Threefish-512 in counter
+ * mode under a key seeded once from tsv_read_urandom, rather than from a tsv_read_urandom call per
+ * buffer.  After every request the key is replaced by more of the keystream, so noise already written
+ * cannot be recovered from the state, and it is seeded again every NOISE_RESEED_BYTES.
+ *
+ * Only called by create, grow and rekey, none of which run in threaded mode.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "util.h"
+#include <titan-secure-volume/app.h>
+#include "_volume.h"
+
+
+#define NOISE_RESEED_BYTES (64*1024*1024)
+
+static struct {
+	uint8_t key[TSV_ENCRYPTION_KEY_SIZE];
+	uint64_t counter;
+	uint64_t remaining;    /* Bytes left before seeding again; 0 if not seeded */
+} g_noise;
+
+
+void _noise (void *dst, size_t len)
+{
+	uint8_t tail[TSV_ENCRYPTION_KEY_SIZE];
+
+	while (len)
+	{
+		if (g_noise.remaining == 0)
+		{
+			tsv_read_urandom (g_noise.key, sizeof (g_noise.key));
+			g_noise.counter = 0;
+			g_noise.remaining = NOISE_RESEED_BYTES;
+		}
+
+		size_t chunk = (size_t)MIN (len, g_noise.remaining);
+		size_t whole = chunk & ~(size_t)(ENCRYPTION_BLOCK_SIZE - 1);
+
+		_volume_keystream (dst, g_noise.key, g_noise.counter, whole);
+		g_noise.counter += whole / ENCRYPTION_BLOCK_SIZE;
+
+		if (chunk > whole)
+		{
+			_volume_keystream (tail, g_noise.key, g_noise.counter, ENCRYPTION_BLOCK_SIZE);
+			memmove ((uint8_t *)dst + whole, tail, chunk - whole);
+			g_noise.counter += 1;
+		}
+
+		dst = ((uint8_t *)dst) + chunk;
+		len -= chunk;
+		g_noise.remaining -= chunk;
+	}
+
+	/* Fast key erasure; the key is one block of keystream */
+	_volume_keystream (tail, g_noise.key, g_noise.counter, sizeof (g_noise.key));
+	memmove (g_noise.key, tail, sizeof (g_noise.key));
+	g_noise.counter = 0;
+	memset (tail, 0, sizeof (tail));
+}
+
+
+void _noise_wipe (void)
+{
+	memset (&g_noise, 0, sizeof (g_noise));
+}
@@ -0,0 +1,399 @@
+/*
+ * Reed-Solomon parity (TSV_FEATURE_PARITY).
+ *
+ * Instead of a second copy, Sectors are taken data_shards at a time and each group gets parity_shards
+ * parity Sectors, computed over the stored ciphertext.  The code is systematic, using a Cauchy matrix
+ * scaled so its first row is all ones: the first parity Sector is the XOR of its group, and a group of
+ * one is a plain mirror.  Any data_shards intact Sectors of a group give back the rest; a short last
+ * group is padded with zero Sectors.  Parity Sectors are sealed like any Sector, with tweak
+ * (index | 0x80000000) + 1, which no data Sector uses without a second copy, so the volume stays noise.
+ *
+ * Writes still never have both halves in flight: a write lands on the data Sector, and its group's parity
+ * is rewritten at commit, after a barrier.  Until then the old parity describes the old data, so the
+ * shadow tags, where the second MAC table would be, keep the tag each data Sector had when its group's
+ * parity was written.  Only data Sectors that still match their shadow tag count as intact, and a rebuilt
+ * Sector must match its own, so stale parity is never trusted.
+ *
+ * Rebuilding uses g_memory.bitmap as scratch, which is free without an allocation bitmap.  An update first
+ * repairs damaged Sectors of its group, while the old parity still describes them, then reads each data
+ * Sector of the group once if the staging area holds every parity accumulator, and once per parity
+ * Sector otherwise.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "util.h"
+#include <titan-secure-volume/app.h>
+#include "_volume.h"
+#include "_gf256.h"
+
+
+static uint64_t _parity_count (uint32_t sector_count, uint32_t data_shards, uint32_t parity_shards)
+{
+	return (((uint64_t)sector_count + data_shards - 1) / data_shards) * parity_shards;
+}
+
+
+int _parity_check (uint32_t sector_size, uint32_t sector_count, uint32_t data_shards, uint32_t parity_shards)
+{
+	if (data_shards < 1 || data_shards > PARITY_MAX_DATA_SHARDS || parity_shards < 1 || parity_shards > PARITY_MAX_PARITY_SHARDS)
+		return -1;
+
+	return _parity_size (sector_size, sector_count, data_shards, parity_shards) ? 0 : -1;
+}
+
+
+uint64_t _parity_size (uint32_t sector_size, uint32_t sector_count, uint32_t data_shards, uint32_t parity_shards)
+{
+	if (data_shards == 0 || sanity_check_parameters (sector_size, sector_count))
+		return 0;
+
+	uint64_t count = _parity_count (sector_count, data_shards, parity_shards);
+
+	/* Parity tweaks must stay clear of the header's and the progress record's */
+	if (count > 0x7FFFFFFF)
+		return 0;
+
+	uint64_t mac_table_size = roundup_uint64 ((uint64_t)sector_count * MAC_TAG_SIZE, sector_size);
+	uint64_t parity_size = roundup_uint64 (count * MAC_TAG_SIZE, sector_size) + count * sector_size;
+
+	/* sanity_check_parameters only vouches for the header, a MAC table and the data Sectors */
+	uint64_t size = sector_size + mac_table_size + (uint64_t)sector_size * sector_count;
+
+	if (mac_table_size > 0x7FFFFFFFFFFFFFFFull - size || parity_size > 0x7FFFFFFFFFFFFFFFull - size - mac_table_size)
+		return 0;
+
+	return size + mac_table_size + parity_size;
+}
+
+
+/* After the shadow tags: the parity MAC table, then the parity Sectors. */
+void _parity_layout (void)
+{
+	uint64_t count = _parity_count (g_volume.sector_count, g_volume.data_shards, g_volume.parity_shards);
+
+	g_volume.parity_mac_offset = g_volume.mac_offset[1] + g_volume.mac_table_size;
+	g_volume.parity_offset = g_volume.parity_mac_offset + roundup_uint64 (count * MAC_TAG_SIZE, SECTOR_SIZE);
+	g_volume.readable = 1;
+}
+
+
+/* Row row, column col of the parity matrix: 1 / (x_row + y_col) for x_row = data_shards + row and
+ * y_col = col, scaled so row 0 is all ones.  Scaling columns keeps every square submatrix invertible.
+ */
+static uint8_t _coefficient (uint32_t row, uint32_t col)
+{
+	uint8_t x0 = (uint8_t)g_volume.data_shards;
+	uint8_t x = (uint8_t)(g_volume.data_shards + row);
+
+	return _gf_mul (x0 ^ (uint8_t)col, _gf_inv (x ^ (uint8_t)col));
+}
+
+
+/* Encrypts and MACs parity Sector index in place, and writes it. */
+static int _parity_write (uint32_t index, uint8_t *src)
+{
+	uint8_t tag[MAC_TAG_SIZE];
+	uint32_t tweak = (index | 0x80000000) + 1;
+
+	_volume_encrypt (src, g_volume.encryption_key, src, SECTOR_SIZE, tweak);
+	_volume_mac (tag, g_volume.mac_key, src, SECTOR_SIZE, tweak);
+
+	RtnOnError (_io_write (g_volume.parity_offset + (uint64_t)index * SECTOR_SIZE, src, SECTOR_SIZE));
+
+	return _io_write (g_volume.parity_mac_offset + (uint64_t)index * MAC_TAG_SIZE, tag, MAC_TAG_SIZE);
+}
+
+
+/* Reads parity Sector index into buf and authenticates it, without decrypting.  Touches no shared state. */
+static int _parity_auth (uint8_t *buf, uint32_t index)
+{
+	uint8_t tag[MAC_TAG_SIZE];
+	uint8_t calculated_mac[MAC_TAG_SIZE];
+
+	RtnOnError (_io_read (tag, g_volume.parity_mac_offset + (uint64_t)index * MAC_TAG_SIZE, MAC_TAG_SIZE));
+	RtnOnError (_io_read (buf, g_volume.parity_offset + (uint64_t)index * SECTOR_SIZE, SECTOR_SIZE));
+
+	_volume_mac (calculated_mac, g_volume.mac_key, buf, SECTOR_SIZE, (index | 0x80000000) + 1);
+
+	return secure_memcmp (tag, calculated_mac, MAC_TAG_SIZE) ? -1 : 0;
+}
+
+
+/* Whether data Sector sector_num is what its group's parity was computed from.  Touches no shared state. */
+static bool _data_current (uint8_t *buf, uint32_t sector_num, void const **data)
+{
+	uint8_t tags[2][MAC_TAG_SIZE];
+
+	if (_auth_sector (buf, sector_num, data))
+		return false;
+
+	if (_io_read (tags[0], g_volume.mac_offset[0] + (uint64_t)sector_num * MAC_TAG_SIZE, MAC_TAG_SIZE) ||
+	    _io_read (tags[1], g_volume.mac_offset[1] + (uint64_t)sector_num * MAC_TAG_SIZE, MAC_TAG_SIZE))
+		return false;
+
+	return !secure_memcmp (tags[0], tags[1], MAC_TAG_SIZE);
+}
+
+
+int _parity_init (void)
+{
+	uint64_t count = _parity_count (g_volume.sector_count, g_volume.data_shards, g_volume.parity_shards);
+	uint64_t used = count * MAC_TAG_SIZE;
+	uint32_t padding = (uint32_t)(roundup_uint64 (used, SECTOR_SIZE) - used);
+
+	/* Padding of the parity MAC table */
+	_noise (g_memory.buffer, padding);
+	RtnOnError (_io_write (g_volume.parity_mac_offset + used, g_memory.buffer, padding));
+
+	for (uint32_t first = 0; first < g_volume.sector_count; first += g_volume.data_shards)
+	{
+		if (_parity_update (first, NULL, 0))
+			return -1;
+	}
+
+	return 0;
+}
+
+
+int _parity_update (uint32_t sector_num, uint32_t const *updated, uint32_t updated_count)
+{
+	uint32_t sector_size = SECTOR_SIZE;
+	uint32_t data_shards = g_volume.data_shards;
+	uint32_t parity_shards = g_volume.parity_shards;
+	uint32_t group = sector_num / data_shards;
+	uint32_t first = group * data_shards;
+	uint32_t count = MIN (data_shards, g_volume.sector_count - first);
+	uint8_t tags[PARITY_MAX_DATA_SHARDS * MAC_TAG_SIZE];
+
+	/* Once per group and commit */
+	for (uint32_t i = 0; i < updated_count; ++i)
+	{
+		if ((updated[i] & 0x7FFFFFFF) / data_shards == group)
+			return 0;
+	}
+
+	/* Parity over a damaged Sector would make the damage permanent, so it is rebuilt from the old parity
+	 * and written back first.  Nothing else uses g_memory.gather during a commit.
+	 */
+	for (uint32_t col = 0; col < count; ++col)
+	{
+		void const *data;
+
+		if (!_auth_sector (g_memory.bitmap, first + col, &data))
+			continue;
+
+		_count_corruption ();
+
+		if (_parity_rebuild (g_memory.gather, first + col) || _seal_sector (first + col, g_memory.gather))
+			return 1;
+	}
+
+	/* Every accumulator in the staging area, or one at a time in g_memory.buffer */
+	uint32_t per_pass = (g_memory.staging_size / sector_size >= parity_shards) ? parity_shards : 1;
+	uint8_t *acc = (per_pass > 1) ? g_memory.staging : g_memory.buffer;
+
+	for (uint32_t row = 0; row < parity_shards; row += per_pass)
+	{
+		memset (acc, 0, (size_t)per_pass * sector_size);
+
+		for (uint32_t col = 0; col < count; ++col)
+		{
+			void const *data;
+
+			if (_auth_sector (g_memory.bitmap, first + col, &data))
+				return 1;
+
+			for (uint32_t j = 0; j < per_pass; ++j)
+				_gf_mul_add (acc + (size_t)j * sector_size, data, _coefficient (row + j, col), sector_size);
+		}
+
+		for (uint32_t j = 0; j < per_pass; ++j)
+			RtnOnError (_parity_write (group * parity_shards + row + j, acc + (size_t)j * sector_size));
+	}
+
+	/* The shadow tags now describe what the parity was computed from */
+	for (uint32_t col = 0; col < count; ++col)
+		RtnOnError (_mac_read (tags + col * MAC_TAG_SIZE, first + col));
+
+	RtnOnError (_io_write (g_volume.mac_offset[1] + (uint64_t)first * MAC_TAG_SIZE, tags, count * MAC_TAG_SIZE));
+
+	for (uint32_t col = 0; col < count; ++col)
+		_mac_put ((first + col) | 0x80000000, tags + col * MAC_TAG_SIZE);
+
+	return 0;
+}
+
+
+/* Row target of the inverse of the matrix that takes a group's data Sectors to the chosen shards, which
+ * are data columns below data_shards and parity rows (plus data_shards) above.  Gauss-Jordan elimination.
+ */
+static int _solve (uint8_t *coefficients, uint32_t const *shards, uint32_t target)
+{
+	uint32_t n = g_volume.data_shards;
+	uint8_t a[PARITY_MAX_DATA_SHARDS][2 * PARITY_MAX_DATA_SHARDS];
+
+	for (uint32_t r = 0; r < n; ++r)
+	{
+		for (uint32_t c = 0; c < n; ++c)
+		{
+			a[r][c] = (shards[r] < n) ? (shards[r] == c) : _coefficient (shards[r] - n, c);
+			a[r][n + c] = (r == c);
+		}
+	}
+
+	for (uint32_t c = 0; c < n; ++c)
+	{
+		uint32_t pivot = c;
+
+		while (pivot < n && a[pivot][c] == 0)
+			pivot += 1;
+
+		if (pivot == n)
+			return -1;
+
+		for (uint32_t i = 0; i < 2 * n; ++i)
+		{
+			uint8_t t = a[c][i];
+
+			a[c][i] = a[pivot][i];
+			a[pivot][i] = t;
+		}
+
+		uint8_t scale = _gf_inv (a[c][c]);
+
+		for (uint32_t i = 0; i < 2 * n; ++i)
+			a[c][i] = _gf_mul (a[c][i], scale);
+
+		for (uint32_t r = 0; r < n; ++r)
+		{
+			uint8_t factor = a[r][c];
+
+			if (r == c || factor == 0)
+				continue;
+
+			for (uint32_t i = 0; i < 2 * n; ++i)
+				a[r][i] ^= _gf_mul (factor, a[c][i]);
+		}
+	}
+
+	memmove (coefficients, &a[target][n], n);
+
+	return 0;
+}
+
+
+/* Whether shard s of a group is intact.  Zero Sectors past the end always are; buf is scratch. */
+static bool _shard_intact (uint8_t *buf, uint32_t group, uint32_t s)
+{
+	uint32_t first = group * g_volume.data_shards;
+	void const *data;
+
+	if (s >= g_volume.data_shards)
+		return !_parity_auth (buf, group * g_volume.parity_shards + s - g_volume.data_shards);
+
+	return first + s >= g_volume.sector_count || _data_current (buf, first + s, &data);
+}
+
+
+int _parity_rebuild (uint8_t *dst, uint32_t sector_num)
+{
+	uint32_t sector_size = SECTOR_SIZE;
+	uint32_t data_shards = g_volume.data_shards;
+	uint32_t group = sector_num / data_shards;
+	uint32_t first = group * data_shards;
+	uint32_t target = sector_num - first;
+	uint32_t shards[PARITY_MAX_DATA_SHARDS];
+	uint8_t coefficients[PARITY_MAX_DATA_SHARDS];
+	uint8_t shadow[MAC_TAG_SIZE], calculated_mac[MAC_TAG_SIZE];
+	uint32_t count = 0;
+
+	/* Any data_shards intact shards will do; other data Sectors first, since they need no decoding */
+	for (uint32_t s = 0; s < data_shards + g_volume.parity_shards && count < data_shards; ++s)
+	{
+		if (s != target && _shard_intact (g_memory.bitmap, group, s))
+			shards[count++] = s;
+	}
+
+	if (count < data_shards || _solve (coefficients, shards, target))
+		return -1;
+
+	memset (dst, 0, sector_size);
+
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		void const *data = g_memory.bitmap;
+
+		if (coefficients[i] == 0 || (shards[i] < data_shards && first + shards[i] >= g_volume.sector_count))
+			continue;
+
+		if (shards[i] < data_shards)
+		{
+			RtnOnError (_auth_sector (g_memory.bitmap, first + shards[i], &data));
+		}
+		else
+		{
+			uint32_t index = group * g_volume.parity_shards + shards[i] - data_shards;
+
+			RtnOnError (_parity_auth (g_memory.bitmap, index));
+			_volume_decrypt (g_memory.bitmap, g_volume.encryption_key, g_memory.bitmap, sector_size, (index | 0x80000000) + 1);
+		}
+
+		_gf_mul_add (dst, data, coefficients[i], sector_size);
+	}
+
+	/* What was rebuilt must be what the parity was computed from */
+	RtnOnError (_mac_read (shadow, sector_num | 0x80000000));
+	_volume_mac (calculated_mac, g_volume.mac_key, dst, sector_size, sector_num + 1);
+
+	if (secure_memcmp (shadow, calculated_mac, MAC_TAG_SIZE))
+		return -1;
+
+	_volume_decrypt (dst, g_volume.encryption_key, dst, sector_size, sector_num + 1);
+
+	return 0;
+}
+
+
+/* Whole groups are checked, so damage just outside [first, first+count) still counts towards lost. */
+int _parity_verify (uint32_t first, uint32_t count, uint8_t *buf, TSV_VERIFY *result)
+{
+	uint32_t data_shards = g_volume.data_shards;
+
+	for (uint32_t group = first / data_shards; count && group * data_shards < first + count; ++group)
+	{
+		uint32_t group_first = group * data_shards;
+		uint32_t erasures = 0, bad = 0;
+
+		for (uint32_t s = 0; s < data_shards + g_volume.parity_shards; ++s)
+		{
+			void const *data;
+			uint32_t sector_num = group_first + s;
+
+			if (s >= data_shards)
+			{
+				if (_parity_auth (buf, group * g_volume.parity_shards + s - data_shards))
+				{
+					erasures += 1;
+
+					/* Counted by whichever call covers the group's first Sector */
+					result->bad[1] += (group_first >= first);
+				}
+			}
+			else if (sector_num < g_volume.sector_count && !_data_current (buf, sector_num, &data))
+			{
+				erasures += 1;
+
+				if (sector_num >= first && sector_num < first + count && _auth_sector (buf, sector_num, &data))
+					bad += 1;
+			}
+		}
+
+		result->bad[0] += bad;
+
+		if (erasures > g_volume.parity_shards)
+			result->lost += bad;
+	}
+
+	return 0;
+}
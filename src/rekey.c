@@ -0,0 +1,418 @@
+/*
+ * Rekey.
+ *
+ * Both copies are re-sealed under the new keys, one copy at a time, so every Sector always has one
+ * complete copy that can be read:
+ *   REKEY_COPY_B  Second copy, from the first (old keys).  Only the first copy is read.
+ *   REKEY_COPY_A  First copy, from the second (new keys).  Only the second copy is read.
+ *   REKEY_HEADER  The header, under the new keys.
+ *
+ * Before each step the progress record (see _volume.h) is updated, under the old keys.  A step only
+ * writes the copy that is not being read, so an interrupted step is simply run again.  The record holds
+ * a check value for the new keys, so a rekey is never resumed with different ones.
+ *
+ * Until the header is rewritten the volume opens with the old keys.  If an interrupted rekey had
+ * reached REKEY_COPY_A, the only complete copy is under the new keys, so nothing can be read until
+ * tsv_rekey_begin is called with them.
+ *
+ * tsv_rekey_next hands out a step as a range of Sectors, which tsv_rekey_range re-seals a run at a time:
+ * the ciphertext and tags of a run are fetched with one physical read each, and written back with one
+ * physical write each.  In threaded mode several threads may re-seal disjoint parts of a step at once,
+ * each with its own scratch buffer.  The step is only recorded as done by the next tsv_rekey_next once
+ * every Sector of it has been re-sealed; otherwise it is handed out again.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "basic_packing.h"
+#include "util.h"
+#include <titan-secure-volume/app.h>
+#include "_volume.h"
+
+
+/* Bytes re-sealed per tsv_rekey_step by tsv_rekey */
+#define REKEY_STEP_SIZE (1024*1024)
+
+enum {
+	REKEY_COPY_B = 1,
+	REKEY_COPY_A,
+	REKEY_HEADER,
+};
+
+typedef struct __attribute__((__packed__))
+{
+	uint8_t magic[8];                 /* Magic Identifier ('TSVREKEY') */
+	uint8_t phase[4];
+	uint8_t position[4];              /* First Sector of this step */
+	uint8_t key_check[MAC_TAG_SIZE];  /* Identifies the new keys */
+	uint8_t padding[16];
+} PACKED_TSV_REKEY_RECORD;
+
+
+_Static_assert (sizeof (PACKED_TSV_REKEY_RECORD) == RECORD_SIZE, "Size of PACKED_TSV_REKEY_RECORD struct does not match expected size.");
+
+
+/* A value derived from both keys, which reveals nothing about them. */
+static void _key_check (uint8_t dst[static MAC_TAG_SIZE], uint8_t const mac_key[static TSV_MAC_KEY_SIZE], uint8_t const encryption_key[static TSV_ENCRYPTION_KEY_SIZE])
+{
+	uint8_t block[ENCRYPTION_BLOCK_SIZE] = {0};
+
+	_volume_encrypt (block, encryption_key, block, sizeof (block), RECORD_TWEAK);
+	_volume_mac (dst, mac_key, block, sizeof (block), RECORD_TWEAK);
+}
+
+
+/* Selects keys and the readable copy for the current phase. */
+static void _rekey_layout (void)
+{
+	if (g_volume.rekey_phase == REKEY_COPY_B)
+	{
+		g_volume.rekeyed = 2;
+		g_volume.readable = 1;
+	}
+	else
+	{
+		g_volume.rekeyed = 3;
+		g_volume.readable = 2;
+	}
+}
+
+
+static int _rekey_record (void)
+{
+	PACKED_TSV_REKEY_RECORD record;
+
+	memmove (record.magic, "TSVREKEY", 8);
+	pack_uint32_little (record.phase, g_volume.rekey_phase);
+	pack_uint32_little (record.position, (uint32_t)g_volume.rekey_position);
+	_key_check (record.key_check, g_volume.new_mac_key, g_volume.new_encryption_key);
+	_noise (record.padding, member_size (PACKED_TSV_REKEY_RECORD, padding));
+
+	return _record_write (&record);
+}
+
+
+int _rekey_open (void)
+{
+	PACKED_TSV_REKEY_RECORD record;
+
+	if (_record_read (&record) || memcmp (record.magic, "TSVREKEY", 8))
+		return 0;
+
+	uint32_t phase = unpack_uint32_little (record.phase);
+	uint32_t position = unpack_uint32_little (record.position);
+
+	if (phase < REKEY_COPY_B || phase > REKEY_HEADER || position > g_volume.sector_count)
+		return -1;
+
+	/* The new keys are not known yet, so only a copy still under the old keys can be read */
+	g_volume.rekey = true;
+	g_volume.rekey_resumed = true;
+	g_volume.rekey_phase = phase;
+	g_volume.rekey_position = position;
+	g_volume.rekeyed = 0;
+	g_volume.readable = (phase == REKEY_COPY_B) ? 1 : 0;
+
+	return 0;
+}
+
+
+/* Reads Sector sector_num of the copy being rewritten, which still has it under the old keys. */
+static int _rekey_read_old (uint8_t *dst, uint32_t sector_num)
+{
+	uint32_t copy = sector_num >> 31;
+	uint32_t index = sector_num & 0x7FFFFFFF;
+	uint8_t tag[MAC_TAG_SIZE];
+	uint8_t calculated_mac[MAC_TAG_SIZE];
+
+	RtnOnError (_io_read (dst, g_volume.data_offset[copy] + (uint64_t)index * SECTOR_SIZE, SECTOR_SIZE));
+	RtnOnError (_io_read (tag, g_volume.mac_offset[copy] + (uint64_t)index * MAC_TAG_SIZE, MAC_TAG_SIZE));
+	_volume_mac (calculated_mac, g_volume.mac_key, dst, SECTOR_SIZE, _tweak (sector_num));
+
+	if (secure_memcmp (tag, calculated_mac, MAC_TAG_SIZE))
+		return -1;
+
+	_volume_decrypt (dst, g_volume.encryption_key, dst, SECTOR_SIZE, _tweak (sector_num));
+
+	return 0;
+}
+
+
+/* Re-seals the run of Sectors [first, first+count) of the copy being rekeyed, none of them discarded.
+ * data holds count Sectors and tags their tags.
+ */
+static int _rekey_run (uint32_t first, uint32_t count, uint8_t *data, uint8_t *tags)
+{
+	uint32_t from = (g_volume.rekey_phase == REKEY_COPY_A) ? 1 : 0;
+	uint32_t to = from ^ 1;
+	uint8_t const *from_mac_key = ((g_volume.rekeyed >> from) & 1) ? g_volume.new_mac_key : g_volume.mac_key;
+	uint8_t const *from_encryption_key = ((g_volume.rekeyed >> from) & 1) ? g_volume.new_encryption_key : g_volume.encryption_key;
+
+	RtnOnError (_io_read (data, g_volume.data_offset[from] + (uint64_t)first * SECTOR_SIZE, (size_t)count * SECTOR_SIZE));
+	RtnOnError (_io_read (tags, g_volume.mac_offset[from] + (uint64_t)first * MAC_TAG_SIZE, (size_t)count * MAC_TAG_SIZE));
+
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		uint8_t calculated_mac[MAC_TAG_SIZE];
+		uint8_t *sector = data + (size_t)i * SECTOR_SIZE;
+		uint8_t *tag = tags + (size_t)i * MAC_TAG_SIZE;
+		uint32_t from_tweak = _tweak ((first + i) | (from << 31));
+		uint32_t to_tweak = _tweak ((first + i) | (to << 31));
+
+		_volume_mac (calculated_mac, from_mac_key, sector, SECTOR_SIZE, from_tweak);
+
+		if (secure_memcmp (tag, calculated_mac, MAC_TAG_SIZE))
+		{
+			/* The copy being rewritten still has this Sector under the old keys */
+			_count_corruption ();
+			RtnOnError (_rekey_read_old (sector, (first + i) | (to << 31)));
+		}
+		else
+		{
+			_volume_decrypt (sector, from_encryption_key, sector, SECTOR_SIZE, from_tweak);
+		}
+
+		_volume_encrypt (sector, g_volume.new_encryption_key, sector, SECTOR_SIZE, to_tweak);
+		_volume_mac (tag, g_volume.new_mac_key, sector, SECTOR_SIZE, to_tweak);
+	}
+
+	RtnOnError (_io_write (g_volume.data_offset[to] + (uint64_t)first * SECTOR_SIZE, data, (size_t)count * SECTOR_SIZE));
+
+	return _io_write (g_volume.mac_offset[to] + (uint64_t)first * MAC_TAG_SIZE, tags, (size_t)count * MAC_TAG_SIZE);
+}
+
+
+/* Re-seals Sectors [first, first+count) of the copy being rekeyed, in runs of up to max Sectors.  data
+ * holds max Sectors and tags their tags.
+ */
+static int _rekey_sectors (uint32_t first, uint32_t count, uint8_t *data, uint8_t *tags, uint32_t max)
+{
+	for (uint32_t i = first; i < first + count;)
+	{
+		uint32_t n = 0;
+		bool discarded = false;
+		int err = 0;
+
+		/* A run stops before a discarded Sector, which holds noise and is skipped */
+		if (g_volume.threaded)
+			tsv_lock (LOCK_VOLUME);
+
+		while (n < max && i + n < first + count && !(err = _discard_test_sector (i + n, &discarded)) && !discarded)
+			n += 1;
+
+		if (g_volume.threaded)
+			tsv_unlock (LOCK_VOLUME);
+
+		RtnOnError (err);
+
+		if (n > 0)
+		{
+			/* Held as a write's would be.  Readers only use the copy not being rewritten, so they need not
+			 * wait; the locks keep overlapping tsv_rekey_range calls from interleaving.
+			 */
+			if (g_volume.threaded)
+				_lock_sectors (i, n);
+
+			err = _rekey_run (i, n, data, tags);
+
+			if (g_volume.threaded)
+				_unlock_sectors (i, n);
+
+			RtnOnError (err);
+		}
+
+		/* A Sector re-sealed twice is only counted once; a discarded one counts as done */
+		uint32_t done = MAX (n, 1), at = i - (uint32_t)g_volume.rekey_position;
+
+		if (g_volume.threaded)
+			tsv_lock (LOCK_VOLUME);
+
+		for (uint32_t j = at; j < at + done; ++j)
+			g_volume.rekey_sealed[j / 8] |= 1 << (j % 8);
+
+		if (g_volume.threaded)
+			tsv_unlock (LOCK_VOLUME);
+
+		i += done;
+	}
+
+	return 0;
+}
+
+
+/* Switches the header to the new keys, which also erases the progress record. */
+static int _rekey_finish (void)
+{
+	_build_header (g_memory.buffer, g_volume.new_mac_key, g_volume.new_encryption_key, SECTOR_SIZE, g_volume.sector_count, g_volume.features);
+	RtnOnError (_write_header (g_memory.buffer, SECTOR_SIZE, g_volume.features));
+	RtnOnError (_io_sync ());
+
+	memmove (g_volume.mac_key, g_volume.new_mac_key, TSV_MAC_KEY_SIZE);
+	memmove (g_volume.encryption_key, g_volume.new_encryption_key, TSV_ENCRYPTION_KEY_SIZE);
+	memset (g_volume.new_mac_key, 0, TSV_MAC_KEY_SIZE);
+	memset (g_volume.new_encryption_key, 0, TSV_ENCRYPTION_KEY_SIZE);
+	g_volume.rekey = false;
+	g_volume.rekey_phase = 0;
+	g_volume.rekey_position = 0;
+	g_volume.rekeyed = 0;
+	_set_layout ();
+
+	return 0;
+}
+
+
+int tsv_rekey_begin (uint8_t const mac_key[static TSV_MAC_KEY_SIZE], uint8_t const encryption_key[static TSV_ENCRYPTION_KEY_SIZE])
+{
+	PACKED_TSV_REKEY_RECORD record;
+	uint8_t check[MAC_TAG_SIZE];
+
+	/* Log entries are sealed under the volume's keys */
+	if (!g_volume.open || g_volume.readonly || g_volume.grow_sector_count || (g_volume.features & (TSV_FEATURE_PARITY | TSV_FEATURE_LOG | TSV_FEATURE_TRACK)))
+		return -1;
+
+	if (g_volume.rekey && !g_volume.rekey_resumed)
+		return (secure_memcmp (mac_key, g_volume.new_mac_key, TSV_MAC_KEY_SIZE) | secure_memcmp (encryption_key, g_volume.new_encryption_key, TSV_ENCRYPTION_KEY_SIZE)) ? -1 : 0;
+
+	if (g_volume.rekey)
+	{
+		/* Resuming; the keys must be the ones the rekey was started with */
+		_key_check (check, mac_key, encryption_key);
+		RtnOnError (_record_read (&record));
+
+		if (secure_memcmp (check, record.key_check, MAC_TAG_SIZE))
+			return -1;
+
+		g_volume.rekey_resumed = false;
+	}
+	else
+	{
+		/* The progress record must fit in the header Sector */
+		if (SECTOR_SIZE < RECORD_OFFSET + RECORD_SIZE + MAC_TAG_SIZE)
+			return -1;
+
+		/* Only one copy of each Sector is read, so both must be current, and nothing marked */
+		RtnOnError (tsv_flush ());
+		RtnOnError (_intent_clear ());
+
+		g_volume.rekey = true;
+		g_volume.rekey_phase = REKEY_COPY_B;
+		g_volume.rekey_position = 0;
+	}
+
+	memmove (g_volume.new_mac_key, mac_key, TSV_MAC_KEY_SIZE);
+	memmove (g_volume.new_encryption_key, encryption_key, TSV_ENCRYPTION_KEY_SIZE);
+	_rekey_layout ();
+
+	return 0;
+}
+
+
+/* Records the step handed out last as done if all of it was re-sealed; otherwise it is handed out again. */
+static int _rekey_commit (void)
+{
+	uint32_t sealed = 0;
+
+	while (sealed < g_volume.rekey_step && (g_volume.rekey_sealed[sealed / 8] & (1 << (sealed % 8))))
+		sealed += 1;
+
+	if (g_volume.rekey_step && sealed == g_volume.rekey_step)
+	{
+		RtnOnError (_io_sync ());
+		g_volume.rekey_position += g_volume.rekey_step;
+	}
+
+	g_volume.rekey_step = 0;
+	memset (g_volume.rekey_sealed, 0, sizeof (g_volume.rekey_sealed));
+
+	return 0;
+}
+
+
+int tsv_rekey_next (uint64_t max_bytes, uint32_t *first, uint32_t *count)
+{
+	if (!g_volume.open)
+		return -1;
+
+	if (!g_volume.rekey)
+		return 0;
+
+	/* Needs the new keys from tsv_rekey_begin */
+	if (g_volume.rekey_resumed)
+		return -1;
+
+	RtnOnError (_rekey_commit ());
+
+	while (g_volume.rekey_position == g_volume.sector_count && g_volume.rekey_phase < REKEY_HEADER)
+	{
+		g_volume.rekey_phase += 1;
+		g_volume.rekey_position = 0;
+		_rekey_layout ();
+	}
+
+	if (g_volume.rekey_phase == REKEY_HEADER)
+	{
+		RtnOnError (_rekey_finish ());
+		return 0;
+	}
+
+	uint64_t step = MIN (g_volume.sector_count - g_volume.rekey_position, MIN (MAX (max_bytes / SECTOR_SIZE, 1), REKEY_STEP_MAX));
+
+	RtnOnError (_rekey_record ());
+	g_volume.rekey_step = (uint32_t)step;
+	*first = (uint32_t)g_volume.rekey_position;
+	*count = (uint32_t)step;
+
+	return 1;
+}
+
+
+int tsv_rekey_range (uint32_t first, uint32_t count, void *scratch, size_t scratch_len)
+{
+	uint32_t max = (uint32_t)MIN (scratch_len / (SECTOR_SIZE + MAC_TAG_SIZE), UINT32_MAX);
+
+	if (!g_volume.open || !g_volume.rekey || !g_volume.rekey_step || max == 0)
+		return -1;
+
+	/* Only the step handed out by tsv_rekey_next */
+	if (first < g_volume.rekey_position || first - g_volume.rekey_position > g_volume.rekey_step || count > g_volume.rekey_step - (first - g_volume.rekey_position))
+		return -1;
+
+	return _rekey_sectors (first, count, scratch, (uint8_t *)scratch + (size_t)max * SECTOR_SIZE, max);
+}
+
+
+int tsv_rekey_step (uint64_t max_bytes)
+{
+	uint8_t tag[MAC_TAG_SIZE];
+	uint32_t first, count;
+	int ret;
+
+	if ((ret = tsv_rekey_next (max_bytes, &first, &count)) <= 0)
+		return ret;
+
+	/* Whole runs through the staging area if it holds two Sectors, else one Sector at a time */
+	uint32_t max = g_memory.staging_size / (SECTOR_SIZE + MAC_TAG_SIZE);
+
+	if (max >= 2)
+		ret = _rekey_sectors (first, count, g_memory.staging, g_memory.staging + (size_t)max * SECTOR_SIZE, max);
+	else
+		ret = _rekey_sectors (first, count, g_memory.buffer, tag, 1);
+
+	RtnOnError (ret);
+	RtnOnError (_rekey_commit ());
+
+	return 1;
+}
+
+
+int tsv_rekey (uint8_t const mac_key[static TSV_MAC_KEY_SIZE], uint8_t const encryption_key[static TSV_ENCRYPTION_KEY_SIZE])
+{
+	int ret;
+
+	RtnOnError (tsv_rekey_begin (mac_key, encryption_key));
+
+	while ((ret = tsv_rekey_step (REKEY_STEP_SIZE)) > 0)
+		;
+
+	return ret;
+}
@@ -0,0 +1,276 @@
+/*
+ * Threaded mode.
+ *
+ * Lets tsv_read, tsv_write and tsv_discard run on several threads at once.  Each Sector is guarded by
+ * one of LOCK_STRIPES stripe locks, held across a whole read or read-modify-write, so requests for
+ * different Sectors proceed in parallel and a partial Sector write is never interleaved with another.
+ * LOCK_VOLUME guards the bitmap cache and g_memory.buffer; requests use scratch buffers on their stack.
+ *
+ * There is no pending queue.  A write seals one copy of each Sector it holds, issues a barrier, seals
+ * the other copies and issues another barrier before unlocking them, so both copies are current
+ * whenever a Sector is unlocked and readers can use either.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "util.h"
+#include <titan-secure-volume/app.h>
+#include "_volume.h"
+
+
+static bool _in_stripes (uint32_t lock, uint32_t first, uint32_t count)
+{
+	return count >= LOCK_STRIPES || (lock + LOCK_STRIPES - first % LOCK_STRIPES) % LOCK_STRIPES < count;
+}
+
+
+void _lock_sectors (uint32_t first, uint32_t count)
+{
+	for (uint32_t lock = 0; lock < LOCK_STRIPES; ++lock)
+	{
+		if (_in_stripes (lock, first, count))
+			tsv_lock (lock);
+	}
+}
+
+
+void _unlock_sectors (uint32_t first, uint32_t count)
+{
+	for (uint32_t lock = 0; lock < LOCK_STRIPES; ++lock)
+	{
+		if (_in_stripes (lock, first, count))
+			tsv_unlock (lock);
+	}
+}
+
+
+/* _discard_test, taking LOCK_VOLUME only if there is a bitmap. */
+static int _discard_test_locked (uint32_t user_sector, bool *discarded)
+{
+	int err;
+
+	if (!(g_volume.features & TSV_FEATURE_DISCARD))
+	{
+		*discarded = false;
+		return 0;
+	}
+
+	tsv_lock (LOCK_VOLUME);
+	err = _discard_test (user_sector, discarded);
+	tsv_unlock (LOCK_VOLUME);
+
+	return err;
+}
+
+
+int _write_both (uint32_t sector_num, void const *src)
+{
+	RtnOnError (_intent_mark (sector_num, 1));
+
+	/* Sealing encrypts in place */
+	memmove (g_memory.buffer, src, SECTOR_SIZE);
+	RtnOnError (_write_sector (sector_num, g_memory.buffer));
+	RtnOnError (_io_sync ());
+
+	memmove (g_memory.buffer, src, SECTOR_SIZE);
+	RtnOnError (_write_sector (sector_num | 0x80000000, g_memory.buffer));
+
+	return _io_sync ();
+}
+
+
+int _read_threaded (void *dst, uint64_t offset, size_t len)
+{
+	uint8_t buffer[BUFFER_SIZE];
+	uint32_t sector_num = (uint32_t)_sector_of (offset);
+	uint32_t sector_offset = _offset_in (offset);
+
+	while (len)
+	{
+		uint32_t read_len = MIN (len, SECTOR_SIZE - sector_offset);
+		bool discarded;
+		int err;
+
+		if (sector_num >= g_volume.user_sector_count)
+			return -1;
+
+		_lock_sectors (sector_num, 1);
+		err = _discard_test_locked (sector_num, &discarded);
+
+		if (err)
+			;
+		else if (discarded)
+			memset (dst, 0, read_len);
+		else if (read_len == SECTOR_SIZE)
+			err = _read_current (dst, _physical_sector (sector_num));
+		else if (!(err = _read_current (buffer, _physical_sector (sector_num))))
+			memmove (dst, buffer + sector_offset, read_len);
+
+		_unlock_sectors (sector_num, 1);
+		RtnOnError (err);
+
+		sector_offset = 0;
+		dst = ((uint8_t *)dst) + read_len;
+		len -= read_len;
+		sector_num += 1;
+	}
+
+	return 0;
+}
+
+
+/* Writes len bytes from src at sector_offset into the Sectors starting at first, which the caller holds.
+ * fresh[i] records which copy of Sector first+i was written first.
+ */
+static int _write_locked (uint32_t *fresh, uint32_t first, uint32_t sector_offset, uint8_t const *src, size_t len)
+{
+	uint8_t buffer[BUFFER_SIZE];
+	uint32_t written = 0;
+	bool cleared = false;
+	int err = 0;
+
+	/* The record is shared; bitmap Sectors in between are marked with the rest */
+	uint32_t p_first = _physical_sector (first);
+	uint32_t p_last = _physical_sector (first + (uint32_t)_sector_of (sector_offset + len - 1));
+
+	tsv_lock (LOCK_VOLUME);
+	err = _intent_mark (p_first, p_last - p_first + 1);
+	tsv_unlock (LOCK_VOLUME);
+	RtnOnError (err);
+
+	for (size_t pos = 0; pos < len; ++written)
+	{
+		uint32_t offset = written ? 0 : sector_offset;
+		uint32_t write_len = MIN (len - pos, SECTOR_SIZE - offset);
+		uint32_t p_sector_num = _physical_sector (first + written);
+		bool discarded;
+
+		if ((err = _discard_test_locked (first + written, &discarded)))
+			break;
+
+		cleared |= discarded;
+
+		/* Partial write; the second copy is overwritten first unless it is the damaged one */
+		fresh[written] = p_sector_num | 0x80000000;
+
+		if (write_len != SECTOR_SIZE && discarded)
+		{
+			memset (buffer, 0, SECTOR_SIZE);
+		}
+		else if (write_len != SECTOR_SIZE && _read_sector (buffer, p_sector_num))
+		{
+			_count_corruption ();
+			fresh[written] = p_sector_num;
+
+			if ((err = _read_sector (buffer, p_sector_num | 0x80000000)))
+			{
+				_count_corruption ();
+				break;
+			}
+		}
+
+		memmove (buffer + offset, src + pos, write_len);
+
+		if ((err = _write_sector (fresh[written], buffer)))
+			break;
+
+		pos += write_len;
+	}
+
+	/* Sectors that got one copy still get the other, so the copies never disagree */
+	if (written && _io_sync ())
+		return -1;
+
+	for (uint32_t i = 0; i < written; ++i)
+	{
+		uint32_t offset = i ? 0 : sector_offset;
+		size_t pos = i ? (size_t)i * SECTOR_SIZE - sector_offset : 0;
+
+		/* Whole Sectors are sealed from src again, others are read back */
+		if (offset == 0 && pos + SECTOR_SIZE <= len)
+			memmove (buffer, src + pos, SECTOR_SIZE);
+		else if (_read_sector (buffer, fresh[i]))
+		{
+			_count_corruption ();
+			err = -1;
+			continue;
+		}
+
+		if (_write_sector (fresh[i] ^ 0x80000000, buffer))
+			err = -1;
+	}
+
+	if (written && _io_sync ())
+		return -1;
+
+	/* Both copies are durable now, so clearing the bits cannot expose what was there before the discard */
+	if (cleared && !err)
+	{
+		tsv_lock (LOCK_VOLUME);
+		err = _discard_set (first, written, false);
+		tsv_unlock (LOCK_VOLUME);
+	}
+
+	return err;
+}
+
+
+int _write_threaded (uint64_t offset, void const *src, size_t len)
+{
+	uint32_t fresh[LOCK_STRIPES];
+	uint32_t sector_num = (uint32_t)_sector_of (offset);
+	uint32_t sector_offset = _offset_in (offset);
+
+	while (len)
+	{
+		/* At most LOCK_STRIPES Sectors are held at once */
+		uint64_t count = MIN (_sector_of ((uint64_t)sector_offset + len + SECTOR_SIZE - 1), LOCK_STRIPES);
+		size_t chunk_len = (size_t)MIN (len, count * SECTOR_SIZE - sector_offset);
+		int err;
+
+		if (sector_num + count > g_volume.user_sector_count)
+			return -1;
+
+		_lock_sectors (sector_num, (uint32_t)count);
+		err = _write_locked (fresh, sector_num, sector_offset, src, chunk_len);
+		_unlock_sectors (sector_num, (uint32_t)count);
+		RtnOnError (err);
+
+		src = ((uint8_t const *)src) + chunk_len;
+		len -= chunk_len;
+		sector_num += (uint32_t)count;
+		sector_offset = 0;
+	}
+
+	return 0;
+}
+
+
+int tsv_set_threaded (int enable)
+{
+	if (!g_volume.open)
+		return -1;
+
+	if (!enable)
+	{
+		g_volume.threaded = false;
+		return 0;
+	}
+
+	if (g_volume.batch || g_volume.deferred || g_volume.grow_sector_count)
+		return -1;
+
+	/* Parity updates rewrite a whole group at commit, and the log is appended to in order */
+	if (g_volume.features & (TSV_FEATURE_PARITY | TSV_FEATURE_LOG | TSV_FEATURE_TRACK))
+		return -1;
+
+	/* Requests use stack buffers of BUFFER_SIZE */
+	if (SECTOR_SIZE > BUFFER_SIZE)
+		return -1;
+
+	/* Readers in threaded mode do not look at the pending queue */
+	RtnOnError (tsv_flush ());
+	g_volume.threaded = true;
+
+	return 0;
+}
@@ -5,53 +5,67 @@
 #include "util.h"
 #include <titan-secure-volume/app.h>
 #include "_ciphers.h"
-#include <titan-secure-volume/titan-secure-volume.h>
+#include "_volume.h"
 
 
-#define member_size(type, member) sizeof(((type *)0)->member)
+/* Assertions */
+_Static_assert (sizeof (PACKED_TSV_HEADER) == TSV_HEADER_SIZE, "Size of PACKED_TSV_HEADER struct does not match expected size.");
+
+_Static_assert ((TSV_HEADER_SIZE % ENCRYPTION_BLOCK_SIZE) == 0, "Header must be an integer multiple of encryption block size.");
+
+_Static_assert ((TSV_HEADER_SIZE + MAC_TAG_SIZE) <= BUFFER_SIZE, "Header + MAC TAG must fit into BUFFER_SIZE.");
+
+#ifdef TSV_FIXED_SECTOR_SIZE
+_Static_assert ((TSV_FIXED_SECTOR_SIZE % ENCRYPTION_BLOCK_SIZE) == 0 && TSV_FIXED_SECTOR_SIZE <= (1 << 24), "TSV_FIXED_SECTOR_SIZE must be a multiple of the encryption block size, and at most 16 MiB.");
+#endif
+
 
-/* Size of internal buffers used for decrypting sectors, for example.  Consumed as global memory. */
-#define BUFFER_SIZE 4096
+/* Global State */
+TSV_VOLUME g_volume = {0};
+
+/* Kept across tsv_close, so a trace can span several opens */
+static TSV_TRACE_HOOK g_trace_hook = NULL;
+static void *g_trace_ctx = NULL;
 
-#define TSV_HEADER_SIZE (8+2+4+4+46)
 
-typedef struct __attribute__((__packed__))
+/* Default for the optional tsv_physical_map hook; platforms without it always go through tsv_physical_read. */
+__attribute__((weak)) void const *tsv_physical_map (uint64_t offset, size_t len)
 {
-	uint8_t magic[8];                 /* Magic Identifier ('TITANTSV') */
-	uint8_t version[2];               /* Version (0x0100) */
-	uint8_t sector_size[4];
-	uint8_t sector_count[4];
-	uint8_t padding[46];
-} PACKED_TSV_HEADER;
+	(void)offset;
+	(void)len;
 
+	return NULL;
+}
 
-/* Assertions */
-_Static_assert (sizeof (PACKED_TSV_HEADER) == TSV_HEADER_SIZE, "Size of PACKED_TSV_HEADER struct does not match expected size.");
 
-_Static_assert ((TSV_HEADER_SIZE % ENCRYPTION_BLOCK_SIZE) == 0, "Header must be an integer multiple of encryption block size.");
+/* Defaults for the lock hooks, which are only needed in threaded mode. */
+__attribute__((weak)) void tsv_lock (uint32_t lock)
+{
+	(void)lock;
 
-_Static_assert ((TSV_HEADER_SIZE + MAC_TAG_SIZE) <= BUFFER_SIZE, "Header + MAC TAG must fit into BUFFER_SIZE.");
+	tsv_fatal_error ();
+}
 
 
-/* Global State */
-static struct {
-	bool open;
-	uint32_t sector_size;
-	uint32_t sector_count;
+__attribute__((weak)) void tsv_unlock (uint32_t lock)
+{
+	(void)lock;
 
-	uint64_t mac_table_size;
-	uint64_t volume_size;     /* sector_count * sector_size */
+	tsv_fatal_error ();
+}
 
-	uint8_t mac_key[TSV_MAC_KEY_SIZE];
-	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
 
-	uint8_t buffer[BUFFER_SIZE];
-	uint32_t corruption_count;
-} g_volume = {0};
+/* Default for the optional tsv_physical_discard hook. */
+__attribute__((weak)) int tsv_physical_discard (uint64_t offset, size_t len)
+{
+	(void)offset;
+	(void)len;
 
+	return 0;
+}
 
 
-static int sanity_check_parameters (uint32_t sector_size, uint32_t sector_count)
+int sanity_check_parameters (uint32_t sector_size, uint32_t sector_count)
 {
 	/* Sector count must be <= 0x7FFFFFFF */
 	if (sector_count & 0x80000000)
@@ -70,8 +84,14 @@ static int sanity_check_parameters (uint32_t sector_size, uint32_t sector_count)
 		return -1;
 
 	// Sector must fit in buffer
-	if (sector_size > sizeof (g_volume.buffer))
+	if (sector_size > g_memory.buffer_size)
+		return -1;
+
+#ifdef TSV_FIXED_SECTOR_SIZE
+	// This build only handles one Sector size
+	if (sector_size != TSV_FIXED_SECTOR_SIZE)
 		return -1;
+#endif
 
 	// Make sure entire volume will fit within 64-bit addressing
 	uint64_t mac_table_size = roundup_uint64 ((uint64_t)sector_count * (uint64_t)MAC_TAG_SIZE, sector_size);
@@ -84,59 +104,298 @@ static int sanity_check_parameters (uint32_t sector_size, uint32_t sector_count)
 }
 
 
+void _build_header (void *dst, uint8_t const mac_key[static TSV_MAC_KEY_SIZE], uint8_t const encryption_key[static TSV_ENCRYPTION_KEY_SIZE], uint32_t sector_size, uint32_t sector_count, uint32_t features)
+{
+	PACKED_TSV_HEADER *const header_buffer = (PACKED_TSV_HEADER *)dst;
+
+	memmove (header_buffer->magic, "TITANTSV", 8);
+	pack_uint32_little (header_buffer->sector_size, sector_size);
+	pack_uint32_little (header_buffer->sector_count, sector_count);
+	_noise (header_buffer->padding, member_size (PACKED_TSV_HEADER, padding));
+
+	/* Volumes without features stay readable by version 0x0100 implementations */
+	if (features)
+	{
+		pack_uint16_little (header_buffer->version, 0x0101);
+		pack_uint32_little (header_buffer->features, features);
+	}
+
+	else
+	{
+		pack_uint16_little (header_buffer->version, 0x0100);
+		_noise (header_buffer->features, member_size (PACKED_TSV_HEADER, features));
+	}
+
+	if (features & TSV_FEATURE_PARITY)
+	{
+		header_buffer->data_shards = (uint8_t)g_volume.data_shards;
+		header_buffer->parity_shards = (uint8_t)g_volume.parity_shards;
+	}
+	else
+	{
+		_noise (&header_buffer->data_shards, 1);
+		_noise (&header_buffer->parity_shards, 1);
+	}
+
+	// Encrypt
+	_volume_encrypt (dst, encryption_key, dst, TSV_HEADER_SIZE, 0);
+
+	// Then MAC
+	_volume_mac ((uint8_t *)dst+TSV_HEADER_SIZE, mac_key, dst, TSV_HEADER_SIZE, 0);
+
+	// Extra padding to reach sector boundary
+	_noise ((uint8_t *)dst+TSV_HEADER_SIZE+MAC_TAG_SIZE, sector_size - (TSV_HEADER_SIZE+MAC_TAG_SIZE));
+
+	if (features & TSV_FEATURE_INTENT)
+		_intent_build (dst, mac_key, encryption_key, sector_size);
+}
+
+
+/* A header is written to the second device first, so the first device's, and the progress record in
+ * the same Sector, stays authoritative if a crash falls in between.
+ */
+int _write_header (void const *header, uint32_t sector_size, uint32_t features)
+{
+	if (features & TSV_FEATURE_SPLIT)
+	{
+		RtnOnError (_io_write (TSV_SPLIT_OFFSET, header, sector_size));
+		RtnOnError (_io_sync ());
+	}
+
+	return _io_write (0, header, sector_size);
+}
+
+
+/* Features this build understands, and the first copy of a split volume must end before the
+ * second device begins.  Parity replaces the second copy, and does not mix with anything else.  The
+ * write-intent record needs room in the header Sector.  The log follows the second copy, and replaces
+ * the write-intent record.  The track map follows the second copy too, so it has no log or split.
+ */
+static int _check_features (uint32_t sector_size, uint32_t sector_count, uint32_t features)
+{
+	if (features & ~BUILT_FEATURES)
+		return -1;
+
+	if ((features & TSV_FEATURE_PARITY) && features != TSV_FEATURE_PARITY)
+		return -1;
+
+	if ((features & TSV_FEATURE_INTENT) && (!_intent_size (sector_size) || sector_count >= INTENT_MAX_SECTORS))
+		return -1;
+
+	if ((features & TSV_FEATURE_LOG) && ((features & (TSV_FEATURE_SPLIT | TSV_FEATURE_INTENT)) || sector_count >= LOG_MAX_SECTORS))
+		return -1;
+
+	if ((features & TSV_FEATURE_TRACK) && ((features & (TSV_FEATURE_SPLIT | TSV_FEATURE_LOG)) || sector_count >= TRACK_MAX_SECTORS))
+		return -1;
+
+	uint64_t mac_table_size = roundup_uint64 ((uint64_t)sector_count * (uint64_t)MAC_TAG_SIZE, sector_size);
+	uint64_t volume_size = (uint64_t)sector_size * (uint64_t)sector_count;
+
+	if ((features & TSV_FEATURE_SPLIT) && mac_table_size + volume_size > TSV_SPLIT_OFFSET - sector_size)
+		return -1;
+
+	return 0;
+}
+
+
+int _record_write (void const *record)
+{
+	if (SECTOR_SIZE < RECORD_OFFSET + RECORD_SIZE + MAC_TAG_SIZE)
+		return -1;
+
+	_volume_encrypt (g_memory.buffer, g_volume.encryption_key, record, RECORD_SIZE, RECORD_TWEAK);
+	_volume_mac (g_memory.buffer+RECORD_SIZE, g_volume.mac_key, g_memory.buffer, RECORD_SIZE, RECORD_TWEAK);
+
+	RtnOnError (_io_write (RECORD_OFFSET, g_memory.buffer, RECORD_SIZE + MAC_TAG_SIZE));
+
+	return _io_sync ();
+}
+
+
+int _record_read (void *dst)
+{
+	uint8_t calculated_mac[MAC_TAG_SIZE];
+
+	if (SECTOR_SIZE < RECORD_OFFSET + RECORD_SIZE + MAC_TAG_SIZE)
+		return -1;
+
+	RtnOnError (_io_read (g_memory.buffer, RECORD_OFFSET, RECORD_SIZE + MAC_TAG_SIZE));
+
+	_volume_mac (calculated_mac, g_volume.mac_key, g_memory.buffer, RECORD_SIZE, RECORD_TWEAK);
+	if (secure_memcmp (calculated_mac, g_memory.buffer + RECORD_SIZE, MAC_TAG_SIZE))
+		return -1;
+
+	_volume_decrypt (dst, g_volume.encryption_key, g_memory.buffer, RECORD_SIZE, RECORD_TWEAK);
+
+	return 0;
+}
+
+
+void _set_sector_size (uint32_t sector_size)
+{
+	g_volume.sector_size = sector_size;
+	g_volume.sector_shift = 0;
+
+	/* Small enough that group arithmetic (see discard.c) can shift by sector_shift + 3 */
+	if ((sector_size & (sector_size - 1)) == 0 && sector_size <= (1 << 24))
+		g_volume.sector_shift = (uint32_t)__builtin_ctz (sector_size);
+}
+
+
+void _set_layout (void)
+{
+	g_volume.mac_offset[0] = SECTOR_SIZE;
+	g_volume.data_offset[0] = g_volume.mac_offset[0] + g_volume.mac_table_size;
+
+	/* The second device starts with its own copy of the header */
+	if (g_volume.features & TSV_FEATURE_SPLIT)
+		g_volume.mac_offset[1] = TSV_SPLIT_OFFSET + SECTOR_SIZE;
+	else
+		g_volume.mac_offset[1] = g_volume.data_offset[0] + g_volume.volume_size;
+
+	g_volume.data_offset[1] = g_volume.mac_offset[1] + g_volume.mac_table_size;
+	g_volume.readable = 3;
+
+	if (g_volume.features & TSV_FEATURE_PARITY)
+		_parity_layout ();
+
+	g_volume.log_offset = g_volume.data_offset[1] + g_volume.volume_size;
+	g_volume.track_offset = g_volume.data_offset[1] + g_volume.volume_size;
+	g_volume.track_valid = false;
+
+	_cache_reset ();
+}
+
+
+static int _seal (uint32_t sector_num, void *src, uint8_t calculated_mac[static MAC_TAG_SIZE]);
+
+
+int _init_sector (uint32_t sector_num)
+{
+	uint32_t sector_size = SECTOR_SIZE;
+	uint8_t tag[MAC_TAG_SIZE];
+
+	/* Discarded Sectors are never decrypted, so plain noise will do.  With shared ciphertext it is the
+	 * same noise in both copies, as for Sectors in use.
+	 */
+	if ((g_volume.features & TSV_FEATURE_DISCARD) && !_is_bitmap_sector (sector_num))
+	{
+		for (uint32_t copy = 0; copy < 2; ++copy)
+		{
+			if (copy == 0 || !(g_volume.features & TSV_FEATURE_SHARED))
+			{
+				_noise (g_memory.buffer, sector_size);
+				_noise (tag, sizeof (tag));
+			}
+
+			RtnOnError (_io_write (g_volume.data_offset[copy] + (uint64_t)sector_num * sector_size, g_memory.buffer, sector_size));
+			RtnOnError (_io_write (g_volume.mac_offset[copy] + (uint64_t)sector_num * MAC_TAG_SIZE, tag, MAC_TAG_SIZE));
+		}
+
+		return 0;
+	}
+
+	if (g_volume.features & TSV_FEATURE_DISCARD)
+		memset (g_memory.buffer, 0xFF, sector_size);
+	else
+		_noise (g_memory.buffer, sector_size);
+
+	RtnOnError (_seal (sector_num, g_memory.buffer, tag));
+
+	/* Parity is computed once every Sector is sealed (_parity_init) */
+	if (g_volume.features & TSV_FEATURE_PARITY)
+		return 0;
+
+	if (g_volume.features & TSV_FEATURE_SHARED)
+		return _write_sealed (sector_num | 0x80000000, g_memory.buffer, tag);
+
+	_volume_decrypt (g_memory.buffer, g_volume.encryption_key, g_memory.buffer, sector_size, sector_num + 1);
+
+	return _seal_sector (sector_num | 0x80000000, g_memory.buffer);
+}
+
+
+static int _create (uint8_t const mac_key[static TSV_MAC_KEY_SIZE], uint8_t const encryption_key[static TSV_ENCRYPTION_KEY_SIZE], uint32_t sector_size, uint32_t sector_count, uint32_t features, uint32_t data_shards, uint32_t parity_shards);
+
+
 int tsv_create (uint8_t const mac_key[static TSV_MAC_KEY_SIZE], uint8_t const encryption_key[static TSV_ENCRYPTION_KEY_SIZE], uint32_t sector_size, uint32_t sector_count)
+{
+	return tsv_create_ex (mac_key, encryption_key, sector_size, sector_count, 0);
+}
+
+
+int tsv_create_ex (uint8_t const mac_key[static TSV_MAC_KEY_SIZE], uint8_t const encryption_key[static TSV_ENCRYPTION_KEY_SIZE], uint32_t sector_size, uint32_t sector_count, uint32_t features)
+{
+	/* tsv_create_parity carries the geometry */
+	if (features & TSV_FEATURE_PARITY)
+		return -1;
+
+	return _create (mac_key, encryption_key, sector_size, sector_count, features, 0, 0);
+}
+
+
+int tsv_create_parity (uint8_t const mac_key[static TSV_MAC_KEY_SIZE], uint8_t const encryption_key[static TSV_ENCRYPTION_KEY_SIZE], uint32_t sector_size, uint32_t sector_count, uint32_t data_shards, uint32_t parity_shards)
+{
+	return _create (mac_key, encryption_key, sector_size, sector_count, TSV_FEATURE_PARITY, data_shards, parity_shards);
+}
+
+
+static int _create (uint8_t const mac_key[static TSV_MAC_KEY_SIZE], uint8_t const encryption_key[static TSV_ENCRYPTION_KEY_SIZE], uint32_t sector_size, uint32_t sector_count, uint32_t features, uint32_t data_shards, uint32_t parity_shards)
 {
 	int err;
-	PACKED_TSV_HEADER *const header_buffer = (PACKED_TSV_HEADER *)g_volume.buffer;
 
 	/* We consume some of the global state */
 	if (g_volume.open)
 		return -1;
 
 	/* Sanity checks */
-	RtnOnError (sanity_check_parameters (sector_size, sector_count));
+	if (sector_size == 0 || _physical_count (sector_size, features, sector_count) > 0x7FFFFFFF)
+		return -1;
 
-	/* Build header */
-	memmove (header_buffer->magic, "TITANTSV", 8);
-	pack_uint16_little (header_buffer->version, 0x0100);
-	pack_uint32_little (header_buffer->sector_size, sector_size);
-	pack_uint32_little (header_buffer->sector_count, sector_count);
-	tsv_read_urandom (header_buffer->padding, member_size (PACKED_TSV_HEADER, padding));
+	uint32_t user_sector_count = sector_count;
+	sector_count = (uint32_t)_physical_count (sector_size, features, user_sector_count);
 
-	// Encrypt
-	_volume_encrypt (g_volume.buffer, encryption_key, g_volume.buffer, TSV_HEADER_SIZE, 0);
+	RtnOnError (sanity_check_parameters (sector_size, sector_count));
+	RtnOnError (_check_features (sector_size, sector_count, features));
+	RtnOnError (_memory_check (features));
 
-	// Then MAC
-	_volume_mac (g_volume.buffer+TSV_HEADER_SIZE, mac_key, g_volume.buffer, TSV_HEADER_SIZE, 0);
+	if (features & TSV_FEATURE_PARITY)
+		RtnOnError (_parity_check (sector_size, sector_count, data_shards, parity_shards));
 
-	// Extra padding to reach sector boundary
-	tsv_read_urandom (g_volume.buffer+TSV_HEADER_SIZE+MAC_TAG_SIZE, sector_size - (TSV_HEADER_SIZE+MAC_TAG_SIZE));
+	/* _build_header records the parity geometry */
+	g_volume.data_shards = data_shards;
+	g_volume.parity_shards = parity_shards;
+	_build_header (g_memory.buffer, mac_key, encryption_key, sector_size, sector_count, features);
 
 	/* Write header */
-	RtnOnError (tsv_physical_write (0, g_volume.buffer, sector_size));
+	RtnOnError (_write_header (g_memory.buffer, sector_size, features));
 
 	/* Initialize all sectors to random data */
-	g_volume.sector_size = sector_size;
+	_set_sector_size (sector_size);
 	g_volume.sector_count = sector_count;
+	g_volume.user_sector_count = user_sector_count;
+	g_volume.features = features;
 	g_volume.mac_table_size = roundup_uint64 (((uint64_t)sector_count) * ((uint64_t)MAC_TAG_SIZE), sector_size);
 	g_volume.volume_size = (uint64_t)sector_size * (uint64_t)sector_count;
 	memmove (g_volume.mac_key, mac_key, TSV_MAC_KEY_SIZE);
 	memmove (g_volume.encryption_key, encryption_key, TSV_ENCRYPTION_KEY_SIZE);
+	_set_layout ();
 	g_volume.open = true;
 
-	/* First, fill MAC tables with noise */
-	for (uint64_t remaining = g_volume.mac_table_size, offset = sector_size; remaining;)
+	/* First, fill MAC tables with noise; the same noise when the copies share ciphertext */
+	for (uint64_t remaining = g_volume.mac_table_size, offset = 0; remaining;)
 	{
-		uint32_t write_len = (uint32_t)MIN (remaining, (uint64_t)sizeof (g_volume.buffer));
+		uint32_t write_len = (uint32_t)MIN (remaining, (uint64_t)g_memory.buffer_size);
 
-		tsv_read_urandom (g_volume.buffer, write_len);
-		if ((err = tsv_physical_write (offset, g_volume.buffer, write_len)))
+		_noise (g_memory.buffer, write_len);
+		if ((err = _io_write (g_volume.mac_offset[0] + offset, g_memory.buffer, write_len)))
 		{
 			tsv_close ();
 			return err;
 		}
-		tsv_read_urandom (g_volume.buffer, write_len);
-		if ((err = tsv_physical_write (offset + g_volume.mac_table_size + g_volume.volume_size, g_volume.buffer, write_len)))
+		if (!(features & TSV_FEATURE_SHARED))
+			_noise (g_memory.buffer, write_len);
+		if ((err = _io_write (g_volume.mac_offset[1] + offset, g_memory.buffer, write_len)))
 		{
 			tsv_close ();
 			return err;
@@ -146,158 +405,625 @@ int tsv_create (uint8_t const mac_key[static TSV_MAC_KEY_SIZE], uint8_t const en
 		remaining -= write_len;
 	}
 
+	/* The track map first, so sealing the Sectors finds them already marked */
+	if ((features & TSV_FEATURE_TRACK) && (err = _track_init ()))
+	{
+		tsv_close ();
+		return err;
+	}
+
 	/* Then write noise to all the sectors */
+	/* Nothing is readable until creation finishes, so there is no need to order the copies. */
 	for (uint32_t remaining = sector_count; remaining; --remaining)
 	{
-		uint64_t sector_num = remaining - 1;
+		if ((err = _init_sector (remaining - 1)))
+		{
+			tsv_close ();
+			return err;
+		}
+	}
+
+	if ((g_volume.features & TSV_FEATURE_PARITY) && (err = _parity_init ()))
+	{
+		tsv_close ();
+		return err;
+	}
 
-		tsv_read_urandom (g_volume.buffer, g_volume.sector_size);
+	/* The log starts empty: nothing in it authenticates */
+	for (uint64_t remaining = (features & TSV_FEATURE_LOG) ? _log_size (sector_size) : 0, offset = 0; remaining;)
+	{
+		uint32_t write_len = (uint32_t)MIN (remaining, (uint64_t)g_memory.buffer_size);
 
-		if ((err = tsv_write (sector_num * g_volume.sector_size, g_volume.buffer, g_volume.sector_size)))
+		_noise (g_memory.buffer, write_len);
+		if ((err = _io_write (g_volume.log_offset + offset, g_memory.buffer, write_len)))
 		{
 			tsv_close ();
 			return err;
 		}
+
+		offset += write_len;
+		remaining -= write_len;
 	}
 
+	err = _io_sync ();
 	tsv_close ();
-	return 0;
+	return err;
 }
 
 
-int tsv_open (uint8_t const mac_key[static TSV_MAC_KEY_SIZE], uint8_t const encryption_key[static TSV_ENCRYPTION_KEY_SIZE])
+static int _open (uint8_t const mac_key[static TSV_MAC_KEY_SIZE], uint8_t const encryption_key[static TSV_ENCRYPTION_KEY_SIZE], bool readonly, void *host_cache, size_t host_cache_len)
 {
-	PACKED_TSV_HEADER *const header_buffer = (PACKED_TSV_HEADER *)g_volume.buffer;
+	PACKED_TSV_HEADER *const header_buffer = (PACKED_TSV_HEADER *)g_memory.buffer;
 	uint8_t calculated_mac[MAC_TAG_SIZE];
+	uint8_t volume_check[MAC_TAG_SIZE];
 
 	if (g_volume.open)
 		return -1;
 
-	// Read header
-	RtnOnError (tsv_physical_read (g_volume.buffer, 0, TSV_HEADER_SIZE + MAC_TAG_SIZE));
-	
+	// Read header, from the second device of a split volume if the first cannot be read
+	bool second = false;
+
+	if (_io_read (g_memory.buffer, 0, TSV_HEADER_SIZE + MAC_TAG_SIZE))
+	{
+		RtnOnError (_io_read (g_memory.buffer, TSV_SPLIT_OFFSET, TSV_HEADER_SIZE + MAC_TAG_SIZE));
+		second = true;
+	}
+
 	// MAC
-	_volume_mac (calculated_mac, mac_key, g_volume.buffer, TSV_HEADER_SIZE, 0);
-	if (secure_memcmp (calculated_mac, g_volume.buffer + TSV_HEADER_SIZE, MAC_TAG_SIZE))
+	_volume_mac (calculated_mac, mac_key, g_memory.buffer, TSV_HEADER_SIZE, 0);
+	if (secure_memcmp (calculated_mac, g_memory.buffer + TSV_HEADER_SIZE, MAC_TAG_SIZE))
 		return -1;
 
+	// Identifies this volume and these keys to a host cache
+	_volume_mac (volume_check, mac_key, g_memory.buffer, TSV_HEADER_SIZE + MAC_TAG_SIZE, RECORD_TWEAK);
+
 	// Decrypt
-	_volume_decrypt (g_volume.buffer, encryption_key, g_volume.buffer, TSV_HEADER_SIZE, 0);
+	_volume_decrypt (g_memory.buffer, encryption_key, g_memory.buffer, TSV_HEADER_SIZE, 0);
 
 	// Verify fields
 	if (memcmp (header_buffer->magic, "TITANTSV", 8))
 		return -1;
 
-	if (unpack_uint16_little (header_buffer->version) != 0x0100)
+	uint16_t version = unpack_uint16_little (header_buffer->version);
+	uint32_t features = 0;
+
+	if (version == 0x0101)
+		features = unpack_uint32_little (header_buffer->features);
+	else if (version != 0x0100)
+		return -1;
+
+	if (second && !(features & TSV_FEATURE_SPLIT))
 		return -1;
 
 	uint32_t sector_size = unpack_uint32_little (header_buffer->sector_size);
 	uint32_t sector_count = unpack_uint32_little (header_buffer->sector_count);
 
 	RtnOnError (sanity_check_parameters (sector_size, sector_count));
+	RtnOnError (_check_features (sector_size, sector_count, features));
+	RtnOnError (_memory_check (features));
+
+	uint32_t data_shards = 0, parity_shards = 0;
+
+	if (features & TSV_FEATURE_PARITY)
+	{
+		data_shards = header_buffer->data_shards;
+		parity_shards = header_buffer->parity_shards;
+		RtnOnError (_parity_check (sector_size, sector_count, data_shards, parity_shards));
+	}
 
 	/* Everything looks good, finish opening. */
-	g_volume.sector_size = sector_size;
+	_set_sector_size (sector_size);
 	g_volume.sector_count = sector_count;
+	g_volume.user_sector_count = _user_count (sector_size, features, sector_count);
+	g_volume.features = features;
 	g_volume.mac_table_size = roundup_uint64 (((uint64_t)sector_count) * ((uint64_t)MAC_TAG_SIZE), sector_size);
 	g_volume.volume_size = (uint64_t)sector_size * (uint64_t)sector_count;
+	g_volume.data_shards = data_shards;
+	g_volume.parity_shards = parity_shards;
 
 	memmove (g_volume.mac_key, mac_key, TSV_MAC_KEY_SIZE);
 	memmove (g_volume.encryption_key, encryption_key, TSV_ENCRYPTION_KEY_SIZE);
+	_set_layout ();
+	g_volume.readonly = readonly;
+
+	/* Pick up an interrupted grow or rekey, if any; only a read-write open can finish one */
+	if (_grow_open () || _rekey_open () || (readonly && (g_volume.grow_sector_count || g_volume.rekey)))
+	{
+		memset (&g_volume, 0, sizeof (g_volume));
+		return -1;
+	}
 
 	g_volume.open = true;
 
+	/* Make the copies of whatever was being written at a crash agree; a grow or rekey is never started
+	 * with anything marked.  Log volumes replay the log instead.  Tracked volumes read their epoch first,
+	 * since that may rewrite Sectors.
+	 */
+	if (!g_volume.grow_sector_count && !g_volume.rekey && (_track_open () || _intent_open () || _log_open ()))
+	{
+		memset (&g_volume, 0, sizeof (g_volume));
+		return -1;
+	}
+
+	if (host_cache && _host_attach (host_cache, host_cache_len, volume_check))
+	{
+		memset (&g_volume, 0, sizeof (g_volume));
+		return -1;
+	}
+
 	return 0;
 }
 
 
-static int _read_sector (void *dst, uint32_t sector_num)
+int tsv_open (uint8_t const mac_key[static TSV_MAC_KEY_SIZE], uint8_t const encryption_key[static TSV_ENCRYPTION_KEY_SIZE])
+{
+	return _open (mac_key, encryption_key, false, NULL, 0);
+}
+
+
+int tsv_open_readonly (uint8_t const mac_key[static TSV_MAC_KEY_SIZE], uint8_t const encryption_key[static TSV_ENCRYPTION_KEY_SIZE], void *host_cache, size_t host_cache_len)
+{
+	return _open (mac_key, encryption_key, true, host_cache, host_cache_len);
+}
+
+
+/* Tags are read through the MAC page cache if cached is set. */
+static int _auth (void *buf, uint32_t sector_num, void const **data, bool cached)
 {
 	uint8_t mac[MAC_TAG_SIZE];
 	uint8_t calculated_mac[MAC_TAG_SIZE];
-	uint64_t offset = g_volume.sector_size;
+	uint32_t copy = sector_num >> 31;
+	uint32_t index = sector_num & 0x7FFFFFFF;
+	uint8_t const *mac_key = ((g_volume.rekeyed >> copy) & 1) ? g_volume.new_mac_key : g_volume.mac_key;
 
-	if (!g_volume.open || (sector_num & 0x7FFFFFFF) >= g_volume.sector_count)
+	if (!g_volume.open || index >= g_volume.sector_count)
 		return -1;
 
-	if (sector_num & 0x80000000)
-		offset += g_volume.mac_table_size + g_volume.volume_size;
+	/* Sectors in the log carry their tag in its entry */
+	int slot = _log_find (index);
 
-	/* Read sector */
-	RtnOnError (tsv_physical_read (dst, offset + g_volume.mac_table_size + (uint64_t)(sector_num & 0x7FFFFFFF) * (uint64_t)g_volume.sector_size, g_volume.sector_size));
-	RtnOnError (tsv_physical_read (mac, offset + (uint64_t)(sector_num & 0x7FFFFFFF) * (uint64_t)MAC_TAG_SIZE, MAC_TAG_SIZE));
+	if (slot >= 0)
+		return _log_auth (buf, sector_num, (uint32_t)slot, data, NULL);
 
-	/* Authenticate */
-	_volume_mac (calculated_mac, g_volume.mac_key, dst, g_volume.sector_size, sector_num + 1);
+	uint64_t data_offset = g_volume.data_offset[copy] + (uint64_t)index * (uint64_t)SECTOR_SIZE;
+	uint64_t mac_offset = g_volume.mac_offset[copy] + (uint64_t)index * (uint64_t)MAC_TAG_SIZE;
+
+	/* Read sector, or authenticate it where it lies if the platform can map it */
+	void const *tag = _io_map (mac_offset, MAC_TAG_SIZE);
+
+	*data = _io_map (data_offset, SECTOR_SIZE);
 
-	if (secure_memcmp (mac, calculated_mac, MAC_TAG_SIZE))
+	if (*data == NULL)
+	{
+		RtnOnError (_io_read (buf, data_offset, SECTOR_SIZE));
+		*data = buf;
+	}
+
+	if (tag == NULL)
+	{
+		RtnOnError (cached ? _mac_read (mac, sector_num) : _io_read (mac, mac_offset, MAC_TAG_SIZE));
+		tag = mac;
+	}
+
+	_volume_mac (calculated_mac, mac_key, *data, SECTOR_SIZE, _tweak (sector_num));
+
+	if (secure_memcmp (tag, calculated_mac, MAC_TAG_SIZE))
 		return -1;
 
+	return 0;
+}
+
+
+int _auth_sector (void *buf, uint32_t sector_num, void const **data)
+{
+	return _auth (buf, sector_num, data, false);
+}
+
+
+int _read_sector (void *dst, uint32_t sector_num)
+{
+	void const *data;
+	uint32_t copy = sector_num >> 31;
+	uint8_t const *encryption_key = ((g_volume.rekeyed >> copy) & 1) ? g_volume.new_encryption_key : g_volume.encryption_key;
+
+	/* Authenticate */
+	RtnOnError (_auth (dst, sector_num, &data, true));
+
 	/* Decrypt */
-	_volume_decrypt (dst, g_volume.encryption_key, dst, g_volume.sector_size, sector_num + 1);
+	_volume_decrypt (dst, encryption_key, data, SECTOR_SIZE, _tweak (sector_num));
 
 	return 0;
 }
 
 
-static int _write_sector (uint32_t sector_num, void *src)
+/* _seal_sector, leaving the tag in calculated_mac. */
+static int _seal (uint32_t sector_num, void *src, uint8_t calculated_mac[static MAC_TAG_SIZE])
 {
-	uint8_t calculated_mac[MAC_TAG_SIZE];
-	uint64_t offset = g_volume.sector_size;
+	uint32_t copy = sector_num >> 31;
+	uint8_t const *mac_key = ((g_volume.rekeyed >> copy) & 1) ? g_volume.new_mac_key : g_volume.mac_key;
+	uint8_t const *encryption_key = ((g_volume.rekeyed >> copy) & 1) ? g_volume.new_encryption_key : g_volume.encryption_key;
 
-	if (!g_volume.open || (sector_num & 0x7FFFFFFF) >= g_volume.sector_count)
-		return -1;
+	_cache_put (sector_num, src);
 
 	/* Encrypt */
-	_volume_encrypt (src, g_volume.encryption_key, src, g_volume.sector_size, sector_num + 1);
+	_volume_encrypt (src, encryption_key, src, SECTOR_SIZE, _tweak (sector_num));
 
 	/* MAC */
-	_volume_mac (calculated_mac, g_volume.mac_key, src, g_volume.sector_size, sector_num + 1);
+	_volume_mac (calculated_mac, mac_key, src, SECTOR_SIZE, _tweak (sector_num));
 
-	if (sector_num & 0x80000000)
-		offset += g_volume.mac_table_size + g_volume.volume_size;
-	sector_num &= 0x7FFFFFFF;
+	return _write_sealed (sector_num, src, calculated_mac);
+}
 
-	/* Write */
-	RtnOnError (tsv_physical_write (offset + g_volume.mac_table_size + (uint64_t)sector_num * (uint64_t)g_volume.sector_size, src, g_volume.sector_size));
-	RtnOnError (tsv_physical_write (offset + (uint64_t)sector_num * (uint64_t)MAC_TAG_SIZE, calculated_mac, MAC_TAG_SIZE));
 
-	return 0;
+int _seal_sector (uint32_t sector_num, void *src)
+{
+	uint8_t calculated_mac[MAC_TAG_SIZE];
+
+	return _seal (sector_num, src, calculated_mac);
 }
 
 
-int tsv_read (void *dst, uint64_t offset, size_t len)
+int _write_sealed (uint32_t sector_num, void const *data, uint8_t const *tag)
 {
-	if (!g_volume.open)
-		return -1;
+	uint32_t copy = sector_num >> 31;
+	uint32_t index = sector_num & 0x7FFFFFFF;
 
-	if ((offset / g_volume.sector_size) >= g_volume.sector_count)
-		return -1;
+	if (g_volume.log_active)
+		return _log_write (sector_num, data, tag);
 
-	uint32_t sector_num = (uint32_t)(offset / g_volume.sector_size);
-	uint32_t sector_offset = offset % g_volume.sector_size;
+	RtnOnError (_track_mark (sector_num));
 
-	while (len)
+	/* Storage no longer matches the caches if that fails */
+	if (_io_write (g_volume.data_offset[copy] + (uint64_t)index * (uint64_t)SECTOR_SIZE, data, SECTOR_SIZE) ||
+	    _io_write (g_volume.mac_offset[copy] + (uint64_t)index * (uint64_t)MAC_TAG_SIZE, tag, MAC_TAG_SIZE))
 	{
-		uint32_t read_len = MIN (len, g_volume.sector_size - sector_offset);
+		_cache_put (sector_num, NULL);
+		_mac_put (sector_num, NULL);
+		return -1;
+	}
 
-		if (sector_num >= g_volume.sector_count)
-			return -1;
+	_mac_put (sector_num, tag);
 
-		/* Read sector */
-		if (_read_sector (g_volume.buffer, sector_num))
-		{
-			g_volume.corruption_count += 1;
+	return 0;
+}
 
-			if (_read_sector (g_volume.buffer, sector_num | 0x80000000))
-			{
-				g_volume.corruption_count += 1;
-				return -1;
-			}
+
+int _copy_sector (uint32_t sector_num)
+{
+	void const *data;
+	uint8_t tag[MAC_TAG_SIZE];
+
+	RtnOnError (_auth (g_memory.buffer, sector_num, &data, true));
+	RtnOnError (_mac_read (tag, sector_num));
+
+	/* The cached plaintext may have come from the copy being replaced */
+	_cache_put (sector_num, NULL);
+
+	return _write_sealed (sector_num ^ 0x80000000, data, tag);
+}
+
+
+int _write_sector (uint32_t sector_num, void *src)
+{
+	if (!g_volume.open || (sector_num & 0x7FFFFFFF) >= g_volume.sector_count)
+		return -1;
+
+	return _seal_sector (sector_num, src);
+}
+
+
+/* Returns the index of sector_num in the pending queue, or -1 if both copies are current. */
+static int _pending_find (uint32_t sector_num)
+{
+	for (uint32_t i = 0; i < g_volume.pending_count; ++i)
+	{
+		if ((g_volume.pending[i] & 0x7FFFFFFF) == sector_num)
+			return (int)i;
+	}
+
+	return -1;
+}
+
+
+/* Writes g_memory.buffer to the fresh copy t_sector_num, and queues the other copy unless idx already
+ * has it.  The tag is kept for _commit, which reuses it on TSV_FEATURE_SHARED volumes.
+ */
+static int _write_fresh (uint32_t t_sector_num, int idx)
+{
+	uint8_t tag[MAC_TAG_SIZE];
+
+	if (!g_volume.open || (t_sector_num & 0x7FFFFFFF) >= g_volume.sector_count)
+		return -1;
+
+	RtnOnError (_seal (t_sector_num, g_memory.buffer, tag));
+
+	if (idx < 0)
+		idx = (int)g_volume.pending_count++;
+
+	g_volume.pending[idx] = t_sector_num;
+
+	if (g_volume.features & TSV_FEATURE_SHARED)
+		memmove (g_volume.pending_tags[idx], tag, MAC_TAG_SIZE);
+
+	return 0;
+}
+
+
+/* The copy to try first.  Split volumes spread reads over both devices, a stripe of Sectors at a time
+ * so sequential reads stay sequential on each.
+ */
+static uint32_t _first_copy (uint32_t sector_num)
+{
+	if (!(g_volume.features & TSV_FEATURE_SPLIT) || g_volume.readable != 3)
+		return 0;
+
+	return (sector_num >> SPLIT_STRIPE_SHIFT) & 1;
+}
+
+
+/* Falls back to the other copy if one is damaged.  If the sector has a stale copy, only the fresh copy is considered. */
+static int _read_stored (void *dst, uint32_t sector_num)
+{
+	int idx = _pending_find (sector_num);
+
+	if (idx >= 0)
+	{
+		if (_read_sector (dst, g_volume.pending[idx]))
+		{
+			_count_corruption ();
+			return -1;
+		}
+
+		return 0;
+	}
+
+	uint32_t first = _first_copy (sector_num);
+
+	/* Copies being moved by a grow are skipped */
+	for (uint32_t i = 0; i < 2; ++i)
+	{
+		uint32_t copy = first ^ i;
+
+		if (!(g_volume.readable & (1u << copy)))
+			continue;
+
+		if (!_read_sector (dst, sector_num | (copy << 31)))
+			return 0;
+
+		_count_corruption ();
+	}
+
+	if (g_volume.features & TSV_FEATURE_PARITY)
+		return _parity_rebuild (dst, sector_num);
+
+	return -1;
+}
+
+
+int _read_current (void *dst, uint32_t sector_num)
+{
+	if (_cache_get (dst, sector_num))
+		return 0;
+
+	RtnOnError (_read_stored (dst, sector_num));
+	_cache_put (sector_num, dst);
+
+	return 0;
+}
+
+
+/* Oldest first.  A barrier is issued before the first stale copy is touched, so a fresh copy always
+ * survives a crash, and another once the stale copies are written.
+ */
+int _commit (uint32_t max_sectors, uint64_t offset, void const *src, size_t len)
+{
+	int err = 0;
+	int ret = 0;   /* A Sector that could not be replicated; the rest of the queue still is */
+	uint32_t count = MIN (max_sectors, g_volume.pending_count);
+	uint32_t i;
+	/* Mid-rekey the copies may have different keys, and are sealed separately */
+	bool shared = (g_volume.features & TSV_FEATURE_SHARED) && (g_volume.rekeyed == 0 || g_volume.rekeyed == 3);
+	uint8_t const *encryption_key = g_volume.rekeyed ? g_volume.new_encryption_key : g_volume.encryption_key;
+
+	if (count == 0)
+		return 0;
+
+	RtnOnError (_io_sync ());
+
+	for (i = 0; i < count; ++i)
+	{
+		uint32_t t_sector_num = g_volume.pending[i];
+		uint32_t user_sector;
+		uint64_t sector_start = 0;
+		bool in_src = false;
+
+		/* Parity volumes bring the parity of the Sector's group up to date instead */
+		if (g_volume.features & TSV_FEATURE_PARITY)
+		{
+			if ((err = _parity_update (t_sector_num, g_volume.pending, i)) == 1)
+				ret = -1;
+			else if (err)
+				break;
+
+			continue;
+		}
+
+		/* Bitmap Sectors are never in src */
+		if (src && !_user_sector (t_sector_num & 0x7FFFFFFF, &user_sector))
+		{
+			sector_start = (uint64_t)user_sector * SECTOR_SIZE;
+			in_src = sector_start >= offset && (sector_start - offset) + SECTOR_SIZE <= len;
+		}
+
+		/* Shared ciphertext: encrypt the plaintext again, or copy the fresh copy once it authenticates */
+		if (shared)
+		{
+			void const *data = g_memory.buffer;
+
+			if (in_src)
+			{
+				_volume_encrypt (g_memory.buffer, encryption_key, ((uint8_t const *)src) + (sector_start - offset), SECTOR_SIZE, _tweak (t_sector_num));
+			}
+			else if (_auth (g_memory.buffer, t_sector_num, &data, true))
+			{
+				_count_corruption ();
+				ret = -1;
+				continue;
+			}
+
+			if ((err = _write_sealed (t_sector_num ^ 0x80000000, data, g_volume.pending_tags[i])))
+				break;
+
+			continue;
+		}
+
+		if (in_src)
+			memmove (g_memory.buffer, ((uint8_t const *)src) + (sector_start - offset), SECTOR_SIZE);
+		else if (_read_sector (g_memory.buffer, t_sector_num))
+		{
+			/* Fresh copy is damaged; the stale copy is all that is left, so leave it alone. */
+			_count_corruption ();
+			ret = -1;
+			continue;
+		}
+
+		if ((err = _write_sector (t_sector_num ^ 0x80000000, g_memory.buffer)))
+			break;
+	}
+
+	/* Keep whatever was not written, so a later commit can retry it.  A Sector whose fresh copy is
+	 * damaged is dropped and reported: retrying cannot repair it, and would wedge the queue.
+	 */
+	memmove (g_volume.pending, g_volume.pending + i, (g_volume.pending_count - i) * sizeof (g_volume.pending[0]));
+
+	if (g_volume.features & TSV_FEATURE_SHARED)
+		memmove (g_volume.pending_tags, g_volume.pending_tags + i, (g_volume.pending_count - i) * sizeof (g_volume.pending_tags[0]));
+
+	g_volume.pending_count -= i;
+
+	if (err)
+		return err;
+
+	RtnOnError (_io_sync ());
+	RtnOnError (_intent_settle ());
+
+	return ret;
+}
+
+
+int _read_staged (uint8_t *dst, uint32_t first, uint32_t max, uint32_t *count)
+{
+	uint32_t sector_size = SECTOR_SIZE;
+	uint32_t p_first = _physical_sector (first);
+	uint32_t copy = _first_copy (p_first);
+	uint32_t n = 0;
+
+	*count = 0;
+	max = MIN (max, g_memory.staging_size / (sector_size + MAC_TAG_SIZE));
+
+	/* The copy must be in place and both under the same keys; mapped storage needs no staging */
+	if (max < 2 || g_volume.threaded || !((g_volume.readable >> copy) & 1) || g_volume.rekeyed || _io_map (g_volume.data_offset[copy], sector_size))
+		return 0;
+
+	/* The run ends at a discarded, pending, logged or host cached Sector, or a bitmap Sector in between */
+	for (; n < max; ++n)
+	{
+		bool discarded;
+
+		RtnOnError (_discard_test (first + n, &discarded));
+
+		if (discarded || _physical_sector (first + n) != p_first + n || _pending_find (p_first + n) >= 0 || _log_find (p_first + n) >= 0 ||
+		    _host_has (p_first + n))
+			break;
+	}
+
+	if (n < 2)
+		return 0;
+
+	uint8_t *tags = g_memory.staging + (size_t)n * sector_size;
+
+	RtnOnError (_io_read (g_memory.staging, g_volume.data_offset[copy] + (uint64_t)p_first * sector_size, (size_t)n * sector_size));
+	RtnOnError (_io_read (tags, g_volume.mac_offset[copy] + (uint64_t)p_first * MAC_TAG_SIZE, (size_t)n * MAC_TAG_SIZE));
+
+	for (uint32_t i = 0; i < n; ++i)
+	{
+		uint8_t calculated_mac[MAC_TAG_SIZE];
+		uint8_t const *data = g_memory.staging + (size_t)i * sector_size;
+		uint32_t tweak = _tweak ((p_first + i) | (copy << 31));
+
+		_volume_mac (calculated_mac, g_volume.mac_key, data, sector_size, tweak);
+
+		if (secure_memcmp (tags + (size_t)i * MAC_TAG_SIZE, calculated_mac, MAC_TAG_SIZE))
+		{
+			RtnOnError (_read_current (dst + (size_t)i * sector_size, p_first + i));
+		}
+		else
+		{
+			_volume_decrypt (dst + (size_t)i * sector_size, g_volume.encryption_key, data, sector_size, tweak);
+			_host_put (p_first + i, dst + (size_t)i * sector_size);
+		}
+	}
+
+	*count = n;
+
+	return 0;
+}
+
+
+int _read (void *dst, uint64_t offset, size_t len)
+{
+	if (!g_volume.open)
+		return -1;
+
+	if (_sector_of (offset) >= g_volume.user_sector_count)
+		return -1;
+
+	if (g_volume.threaded)
+		return _read_threaded (dst, offset, len);
+
+	uint32_t sector_num = (uint32_t)_sector_of (offset);
+	uint32_t sector_offset = _offset_in (offset);
+
+	while (len)
+	{
+		uint32_t read_len = MIN (len, SECTOR_SIZE - sector_offset);
+		bool discarded;
+
+		if (sector_num >= g_volume.user_sector_count)
+			return -1;
+
+		/* Runs of whole Sectors are fetched in one go if there is a staging area */
+		if (sector_offset == 0 && g_memory.staging_size)
+		{
+			uint32_t count;
+
+			RtnOnError (_read_staged (dst, sector_num, (uint32_t)MIN (_sector_of (len), g_volume.user_sector_count - sector_num), &count));
+
+			if (count)
+			{
+				dst = ((uint8_t *)dst) + (size_t)count * SECTOR_SIZE;
+				len -= (size_t)count * SECTOR_SIZE;
+				sector_num += count;
+				continue;
+			}
 		}
 
-		/* Copy to destination */
-		memmove (dst, g_volume.buffer+sector_offset, read_len);
+		RtnOnError (_discard_test (sector_num, &discarded));
+
+		if (discarded)
+		{
+			memset (dst, 0, read_len);
+		}
+		/* Whole sectors are decrypted straight into the destination */
+		else if (read_len == SECTOR_SIZE)
+		{
+			RtnOnError (_read_current (dst, _physical_sector (sector_num)));
+		}
+		else
+		{
+			RtnOnError (_read_current (g_memory.buffer, _physical_sector (sector_num)));
+			memmove (dst, g_memory.buffer+sector_offset, read_len);
+		}
 
 		sector_offset = 0;
 		dst = ((uint8_t *)dst) + read_len;
@@ -309,35 +1035,95 @@ int tsv_read (void *dst, uint64_t offset, size_t len)
 }
 
 
-int tsv_write (uint64_t offset, void const *src, size_t len)
+int tsv_read (void *dst, uint64_t offset, size_t len)
 {
-	if (!g_volume.open)
+	int err = _read (dst, offset, len);
+
+	_trace (TSV_TRACE_READ, offset, len, err);
+
+	return err;
+}
+
+
+int _write (uint64_t offset, void const *src, size_t len)
+{
+	/* Read-only while a grow or rekey is in progress */
+	if (!g_volume.open || g_volume.readonly || g_volume.grow_sector_count || g_volume.rekey)
 		return -1;
 
-	if ((offset / g_volume.sector_size) >= g_volume.sector_count)
+	if (_sector_of (offset) >= g_volume.user_sector_count)
 		return -1;
 
-	uint32_t sector_num = (uint32_t)(offset / g_volume.sector_size);
-	uint32_t sector_offset = offset % g_volume.sector_size;
+	if (g_volume.threaded)
+		return _write_threaded (offset, src, len);
+
+	uint32_t sector_num = (uint32_t)_sector_of (offset);
+	uint32_t sector_offset = _offset_in (offset);
+	uint64_t commit_offset = offset;
+	void const *commit_src = src;
+	uint32_t cleared_first = 0, cleared_end = 0;
+
+	/* Every region the write touches is marked at once, with one barrier */
+	if (len)
+	{
+		uint64_t end = offset + MIN (len, (uint64_t)g_volume.user_sector_count * SECTOR_SIZE - offset);
+		uint32_t p_first = _physical_sector (sector_num);
+
+		RtnOnError (_intent_mark (p_first, _physical_sector ((uint32_t)_sector_of (end - 1)) - p_first + 1));
+	}
 
 	while (len)
 	{
 		/* How many bytes to write to the current sector */
-		uint32_t write_len = MIN (len, g_volume.sector_size - sector_offset);
+		uint32_t write_len = MIN (len, SECTOR_SIZE - sector_offset);
+		bool discarded;
 
-		if (sector_num >= g_volume.sector_count)
+		if (sector_num >= g_volume.user_sector_count)
 			return -1;
 
-		/* Read the sector if this is a partial write */
-		/* During partial writes, we should overwrite damaged sectors first */
-		uint32_t t_sector_num = sector_num;
+		RtnOnError (_discard_test (sector_num, &discarded));
+
+		uint32_t p_sector_num = _physical_sector (sector_num);
+		int idx = _pending_find (p_sector_num);
+		uint32_t t_sector_num = p_sector_num;
+
+		/* Only one copy is written here; make room to remember the other one.
+		 * Deferred mode only frees half the queue, to keep the latency of this write down.
+		 * A full log is cleaned, which needs everything in it committed first. */
+		if (idx < 0 && (g_volume.pending_count == PENDING_QUEUE_SIZE || _log_full ()))
+		{
+			uint32_t max_sectors = (g_volume.deferred && !_log_full ()) ? PENDING_QUEUE_SIZE / 2 : PENDING_QUEUE_SIZE;
+
+			RtnOnError (_commit (max_sectors, commit_offset, commit_src, (uint64_t)sector_num * SECTOR_SIZE + sector_offset - commit_offset));
+			commit_offset = (uint64_t)sector_num * SECTOR_SIZE + sector_offset;
+			commit_src = src;
+
+			if (_log_full ())
+				RtnOnError (_log_clean (LOG_SLOTS));
+		}
+
+		if (idx >= 0)
+		{
+			/* The other copy is stale, but it is the only one known to be durable.
+			 * Keep rewriting the fresh copy until the next commit. */
+			t_sector_num = g_volume.pending[idx];
 
-		if (write_len != g_volume.sector_size)
+			if (write_len != SECTOR_SIZE && !discarded)
+				RtnOnError (_read_current (g_memory.buffer, p_sector_num));
+		}
+		else if (write_len != SECTOR_SIZE && !discarded)
 		{
-			if (_read_sector (g_volume.buffer, sector_num))
+			/* Read the sector if this is a partial write */
+			/* During partial writes, we should overwrite damaged sectors first */
+			if (g_volume.features & TSV_FEATURE_PARITY)
+			{
+				/* The only copy is written first, and its parity at commit */
+				RtnOnError (_read_stored (g_memory.buffer, p_sector_num));
+			}
+			else if (_read_sector (g_memory.buffer, p_sector_num))
 			{
-				g_volume.corruption_count += 1;
-				RtnOnError (_read_sector (g_volume.buffer, sector_num | 0x80000000));
+				_count_corruption ();
+				RtnOnError (_read_sector (g_memory.buffer, p_sector_num | 0x80000000));
 			}
 			else
 			{
@@ -347,16 +1133,21 @@ int tsv_write (uint64_t offset, void const *src, size_t len)
 			}
 		}
 
+		/* A discarded sector reads as zeros, so there is nothing to read */
+		if (write_len != SECTOR_SIZE && discarded)
+			memset (g_memory.buffer, 0, SECTOR_SIZE);
+
 		/* Modify */
-		memmove (g_volume.buffer+sector_offset, src, write_len);
+		memmove (g_memory.buffer+sector_offset, src, write_len);
 
-		/* Write first sector */
-		RtnOnError (_write_sector (t_sector_num, g_volume.buffer));
+		/* Write first copy; the other is written at commit */
+		RtnOnError (_write_fresh (t_sector_num, idx));
 
-		/* Writer other sector */
-		_volume_decrypt (g_volume.buffer, g_volume.encryption_key, g_volume.buffer, g_volume.sector_size, t_sector_num + 1);
-		t_sector_num ^= 0x80000000;
-		RtnOnError (_write_sector (t_sector_num, g_volume.buffer));
+		if (discarded)
+		{
+			cleared_first = cleared_end ? cleared_first : sector_num;
+			cleared_end = sector_num + 1;
+		}
 
 		sector_offset = 0;
 		src = ((uint8_t const *)src) + write_len;
@@ -364,23 +1155,160 @@ int tsv_write (uint64_t offset, void const *src, size_t len)
 		sector_num += 1;
 	}
 
-	return 0;
+	/* Bits are cleared only behind a barrier, once the data is durable, so a crash never exposes what
+	 * was there before the discard.  Sectors in between were not discarded and keep their clear bits.
+	 */
+	if (cleared_end)
+	{
+		RtnOnError (_io_sync ());
+		RtnOnError (_discard_set (cleared_first, cleared_end - cleared_first, false));
+	}
+
+	if (g_volume.batch || g_volume.deferred)
+		return 0;
+
+	return _commit (PENDING_QUEUE_SIZE, commit_offset, commit_src, (uint64_t)((uint8_t const *)src - (uint8_t const *)commit_src));
+}
+
+
+int tsv_write (uint64_t offset, void const *src, size_t len)
+{
+	int err = _write (offset, src, len);
+
+	_trace (TSV_TRACE_WRITE, offset, len, err);
+
+	return err;
+}
+
+
+int _write_current (uint32_t sector_num, void const *src)
+{
+	int idx = _pending_find (sector_num);
+	uint32_t t_sector_num = sector_num;
+
+	if (idx < 0 && (g_volume.pending_count == PENDING_QUEUE_SIZE || _log_full ()))
+	{
+		RtnOnError (_commit ((g_volume.deferred && !_log_full ()) ? PENDING_QUEUE_SIZE / 2 : PENDING_QUEUE_SIZE, 0, NULL, 0));
+
+		if (_log_full ())
+			RtnOnError (_log_clean (LOG_SLOTS));
+	}
+
+	if (idx >= 0)
+		t_sector_num = g_volume.pending[idx];
+	else
+		RtnOnError (_intent_mark (sector_num, 1));
+
+	memmove (g_memory.buffer, src, SECTOR_SIZE);
+
+	return _write_fresh (t_sector_num, idx);
+}
+
+
+int _flush (void)
+{
+	if (!g_volume.open)
+		return 0;
+
+	RtnOnError (_commit (PENDING_QUEUE_SIZE, 0, NULL, 0));
+
+	/* Discards of batch and deferred mode are durable now */
+	RtnOnError (_discard_drain ());
+
+	/* Hand anything still queued to storage */
+	return _io_flush ();
 }
 
 
 int tsv_flush (void)
 {
-	// Currently no caching, so no flushing necessary
+	int err = _flush ();
+
+	_trace (TSV_TRACE_FLUSH, 0, 0, err);
+
+	return err;
+}
+
+
+void tsv_set_trace (TSV_TRACE_HOOK hook, void *ctx)
+{
+	g_trace_hook = hook;
+	g_trace_ctx = ctx;
+}
+
+
+void _trace (uint32_t type, uint64_t offset, uint64_t len, int result)
+{
+	if (g_trace_hook)
+		g_trace_hook (g_trace_ctx, type, offset, len, result);
+}
+
+
+int tsv_batch_begin (void)
+{
+	if (!g_volume.open || g_volume.threaded)
+		return -1;
+
+	g_volume.batch = true;
+
 	return 0;
 }
 
 
+int tsv_batch_end (void)
+{
+	if (!g_volume.open)
+		return -1;
+
+	g_volume.batch = false;
+
+	return tsv_flush ();
+}
+
+
+int tsv_set_deferred (int enable)
+{
+	if (!g_volume.open || (enable && g_volume.threaded))
+		return -1;
+
+	g_volume.deferred = (enable != 0);
+
+	if (g_volume.deferred)
+		return 0;
+
+	return tsv_flush ();
+}
+
+
+int tsv_replicate (uint32_t max_sectors)
+{
+	if (!g_volume.open)
+		return -1;
+
+	return _commit (max_sectors, 0, NULL, 0);
+}
+
+
+uint32_t tsv_replicas_pending (void)
+{
+	return g_volume.pending_count;
+}
+
+
 int tsv_close (void)
 {
 	if (g_volume.open)
+	{
 		RtnOnError (tsv_flush ());
+		RtnOnError (_intent_clear ());
+	}
+
+	/* Also anything queued by a tsv_open that failed part way */
+	RtnOnError (_io_flush ());
 
 	memset (&g_volume, 0, sizeof (g_volume));
+	_memory_wipe ();
+	_noise_wipe ();
 
 	return 0;
 }
@@ -388,5 +1316,62 @@ int tsv_close (void)
 
 uint64_t tsv_get_size (void)
 {
-	return g_volume.volume_size;
+	return (uint64_t)g_volume.user_sector_count * (uint64_t)SECTOR_SIZE;
+}
+
+
+uint32_t tsv_get_features (void)
+{
+	return g_volume.features;
+}
+
+
+uint32_t tsv_get_sector_size (void)
+{
+	return SECTOR_SIZE;
+}
+
+
+uint64_t tsv_physical_size (uint32_t sector_size, uint32_t sector_count)
+{
+	return tsv_physical_size_ex (sector_size, sector_count, 0);
+}
+
+
+uint64_t tsv_physical_size_ex (uint32_t sector_size, uint32_t sector_count, uint32_t features)
+{
+	/* See tsv_physical_size_parity */
+	if (features & TSV_FEATURE_PARITY)
+		return 0;
+
+	if (sector_size == 0 || _physical_count (sector_size, features, sector_count) > 0x7FFFFFFF)
+		return 0;
+
+	sector_count = (uint32_t)_physical_count (sector_size, features, sector_count);
+
+	if (sanity_check_parameters (sector_size, sector_count))
+		return 0;
+
+	uint64_t mac_table_size = roundup_uint64 ((uint64_t)sector_count * (uint64_t)MAC_TAG_SIZE, sector_size);
+	uint64_t volume_size = (uint64_t)sector_size * (uint64_t)sector_count;
+
+	if (features & TSV_FEATURE_SPLIT)
+		return _check_features (sector_size, sector_count, features) ? 0 : sector_size + mac_table_size + volume_size;
+
+	if (features & TSV_FEATURE_LOG)
+		return _check_features (sector_size, sector_count, features) ? 0 : sector_size + 2 * (mac_table_size + volume_size) + _log_size (sector_size);
+
+	if (features & TSV_FEATURE_TRACK)
+		return _check_features (sector_size, sector_count, features) ? 0 : sector_size + 2 * (mac_table_size + volume_size) + _track_size (sector_size, sector_count);
+
+	return sector_size + 2 * (mac_table_size + volume_size);
+}
+
+
+uint64_t tsv_physical_size_parity (uint32_t sector_size, uint32_t sector_count, uint32_t data_shards, uint32_t parity_shards)
+{
+	if (data_shards > PARITY_MAX_DATA_SHARDS || parity_shards == 0 || parity_shards > PARITY_MAX_PARITY_SHARDS)
+		return 0;
+
+	return _parity_size (sector_size, sector_count, data_shards, parity_shards);
 }
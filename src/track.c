@@ -0,0 +1,367 @@
+/*
+ * Changed-Sector tracking (TSV_FEATURE_TRACK).
+ *
+ * Every Sector on disk, bitmap Sectors included, has an entry in the track map: the epoch it was last
+ * written in.  tsv_track_advance starts a new epoch, and tsv_track_export streams out the Sectors written
+ * since a given one as they lie in storage, both copies' ciphertext and tags, so an incremental backup
+ * copies only what changed and never decrypts it.  tsv_track_import writes such records into a replica
+ * made from a copy of the volume: first copies, a barrier, then second copies, each authenticated first.
+ *
+ * The map follows the second copy: for each copy of the map, a table of tags, then pages of one Sector
+ * each.  A page holds its own number and the epoch when it was written, then one little-endian entry
+ * per Sector, and is sealed with TRACK_TWEAK; both copies of a page are identical.  The epoch is read
+ * from the first page at open, and tsv_track_advance rewrites that page, with a barrier, before it
+ * returns.
+ *
+ * A Sector's entry goes to both copies of its page, followed by a barrier, before the Sector is first
+ * written in an epoch, so a crash can only leave a Sector marked that was not written; later writes in
+ * the same epoch cost nothing.  If a crash tears one copy of a page the other is used, and if both are
+ * lost every Sector of the page counts as written in the current epoch.  Tracking only ever errs towards
+ * exporting too much.  One page is cached in g_memory.track.
+ *
+ * Tracked volumes cannot be split, have a log or parity, grow, rekey or use threaded mode.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "basic_packing.h"
+#include "util.h"
+#include <titan-secure-volume/app.h>
+#include "_volume.h"
+
+
+static uint32_t _track_per_page (uint32_t sector_size)
+{
+	return (sector_size - TRACK_PAGE_HEADER) / 4;
+}
+
+
+static uint64_t _track_pages (uint32_t sector_size, uint32_t sector_count)
+{
+	return (sector_count + (uint64_t)_track_per_page (sector_size) - 1) / _track_per_page (sector_size);
+}
+
+
+/* One copy of the map: its tags, then its pages */
+static uint64_t _track_copy_size (uint32_t sector_size, uint32_t sector_count)
+{
+	uint64_t pages = _track_pages (sector_size, sector_count);
+
+	return roundup_uint64 (pages * MAC_TAG_SIZE, sector_size) + pages * sector_size;
+}
+
+
+uint64_t _track_size (uint32_t sector_size, uint32_t sector_count)
+{
+	return 2 * _track_copy_size (sector_size, sector_count);
+}
+
+
+static uint64_t _track_tag_offset (uint32_t copy, uint32_t page)
+{
+	return g_volume.track_offset + copy * _track_copy_size (SECTOR_SIZE, g_volume.sector_count) + (uint64_t)page * MAC_TAG_SIZE;
+}
+
+
+static uint64_t _track_page_offset (uint32_t copy, uint32_t page)
+{
+	uint64_t pages = _track_pages (SECTOR_SIZE, g_volume.sector_count);
+
+	return g_volume.track_offset + copy * _track_copy_size (SECTOR_SIZE, g_volume.sector_count) +
+	       roundup_uint64 (pages * MAC_TAG_SIZE, SECTOR_SIZE) + (uint64_t)page * SECTOR_SIZE;
+}
+
+
+/* Reads one copy of a page into g_memory.track, or returns -1 if it does not authenticate. */
+static int _track_read (uint32_t copy, uint32_t page)
+{
+	uint8_t tag[MAC_TAG_SIZE];
+	uint8_t calculated_mac[MAC_TAG_SIZE];
+
+	RtnOnError (_io_read (g_memory.track, _track_page_offset (copy, page), SECTOR_SIZE));
+	RtnOnError (_io_read (tag, _track_tag_offset (copy, page), MAC_TAG_SIZE));
+
+	_volume_mac (calculated_mac, g_volume.mac_key, g_memory.track, SECTOR_SIZE, TRACK_TWEAK);
+
+	if (secure_memcmp (tag, calculated_mac, MAC_TAG_SIZE))
+		return -1;
+
+	_volume_decrypt (g_memory.track, g_volume.encryption_key, g_memory.track, SECTOR_SIZE, TRACK_TWEAK);
+
+	/* Sealed for another page */
+	return (unpack_uint32_little (g_memory.track) == page) ? 0 : -1;
+}
+
+
+/* Loads page into g_memory.track.  If neither copy authenticates, every Sector of the page counts as
+ * written now, unless strict is set.
+ */
+static int _track_load (uint32_t page, bool strict)
+{
+	if (g_volume.track_valid && g_volume.track_page == page)
+		return 0;
+
+	g_volume.track_valid = false;
+
+	if (_track_read (0, page) && _track_read (1, page))
+	{
+		if (strict)
+			return -1;
+
+		pack_uint32_little (g_memory.track, page);
+
+		for (uint32_t i = 0; i < _track_per_page (SECTOR_SIZE); ++i)
+			pack_uint32_little (g_memory.track + TRACK_PAGE_HEADER + 4 * i, g_volume.track_epoch);
+	}
+
+	g_volume.track_page = page;
+	g_volume.track_valid = true;
+
+	return 0;
+}
+
+
+/* Writes the cached page to both copies, sealed in place and then opened again, since g_memory.buffer
+ * may be in use by the write that needed it.
+ */
+static int _track_store (void)
+{
+	uint8_t tag[MAC_TAG_SIZE];
+	uint32_t page = g_volume.track_page;
+	int err = 0;
+
+	pack_uint32_little (g_memory.track + 4, g_volume.track_epoch);
+	_volume_encrypt (g_memory.track, g_volume.encryption_key, g_memory.track, SECTOR_SIZE, TRACK_TWEAK);
+	_volume_mac (tag, g_volume.mac_key, g_memory.track, SECTOR_SIZE, TRACK_TWEAK);
+
+	for (uint32_t copy = 0; copy < 2 && !err; ++copy)
+	{
+		err = _io_write (_track_page_offset (copy, page), g_memory.track, SECTOR_SIZE) ||
+		      _io_write (_track_tag_offset (copy, page), tag, MAC_TAG_SIZE);
+	}
+
+	_volume_decrypt (g_memory.track, g_volume.encryption_key, g_memory.track, SECTOR_SIZE, TRACK_TWEAK);
+
+	/* Storage may no longer match */
+	if (err)
+	{
+		g_volume.track_valid = false;
+		return -1;
+	}
+
+	return 0;
+}
+
+
+int _track_init (void)
+{
+	uint64_t pages = _track_pages (SECTOR_SIZE, g_volume.sector_count);
+
+	/* Everything was written by the create, in the first epoch */
+	g_volume.track_epoch = 1;
+
+	for (uint64_t page = 0; page < pages; ++page)
+	{
+		g_volume.track_page = (uint32_t)page;
+		g_volume.track_valid = true;
+		pack_uint32_little (g_memory.track, (uint32_t)page);
+
+		for (uint32_t i = 0; i < _track_per_page (SECTOR_SIZE); ++i)
+			pack_uint32_little (g_memory.track + TRACK_PAGE_HEADER + 4 * i, 1);
+
+		RtnOnError (_track_store ());
+	}
+
+	return 0;
+}
+
+
+int _track_open (void)
+{
+	if (!(g_volume.features & TSV_FEATURE_TRACK))
+		return 0;
+
+	/* Without the epoch nothing could be trusted, as with the header */
+	RtnOnError (_track_load (0, true));
+	g_volume.track_epoch = unpack_uint32_little (g_memory.track + 4);
+
+	return 0;
+}
+
+
+int _track_mark (uint32_t sector_num)
+{
+	uint32_t index = sector_num & 0x7FFFFFFF;
+
+	if (!(g_volume.features & TSV_FEATURE_TRACK))
+		return 0;
+
+	uint32_t per_page = _track_per_page (SECTOR_SIZE);
+	uint8_t *entry;
+
+	RtnOnError (_track_load (index / per_page, false));
+	entry = g_memory.track + TRACK_PAGE_HEADER + 4 * (index % per_page);
+
+	if (unpack_uint32_little (entry) == g_volume.track_epoch)
+		return 0;
+
+	pack_uint32_little (entry, g_volume.track_epoch);
+	RtnOnError (_track_store ());
+
+	/* The mark must be in storage before the Sector changes */
+	return _io_sync ();
+}
+
+
+uint32_t tsv_track_epoch (void)
+{
+	return (g_volume.open && (g_volume.features & TSV_FEATURE_TRACK)) ? g_volume.track_epoch : 0;
+}
+
+
+uint32_t tsv_track_advance (void)
+{
+	if (!g_volume.open || g_volume.readonly || !(g_volume.features & TSV_FEATURE_TRACK) || g_volume.track_epoch == UINT32_MAX)
+		return 0;
+
+	if (tsv_flush () || _track_load (0, true))
+		return 0;
+
+	g_volume.track_epoch += 1;
+
+	/* Writes in the new epoch must not be recorded under an epoch a crash could forget */
+	if (_track_store () || _io_sync ())
+	{
+		g_volume.track_epoch -= 1;
+		return 0;
+	}
+
+	return g_volume.track_epoch;
+}
+
+
+size_t tsv_track_record_size (void)
+{
+	if (!g_volume.open || !(g_volume.features & TSV_FEATURE_TRACK))
+		return 0;
+
+	return TSV_TRACK_RECORD_SIZE (SECTOR_SIZE);
+}
+
+
+/* Copies a copy of sector_num, with its tag, into a record, or returns -1 if it does not authenticate. */
+static int _track_copy_out (uint8_t *record, uint32_t sector_num)
+{
+	uint32_t copy = sector_num >> 31;
+	uint8_t *data = record + 4 + 2 * MAC_TAG_SIZE + (size_t)copy * SECTOR_SIZE;
+	void const *authentic;
+
+	RtnOnError (_auth_sector (data, sector_num, &authentic));
+	RtnOnError (_mac_read (record + 4 + (size_t)copy * MAC_TAG_SIZE, sector_num));
+
+	if (authentic != data)
+		memmove (data, authentic, SECTOR_SIZE);
+
+	return 0;
+}
+
+
+int tsv_track_export (uint32_t since, uint32_t *cursor, void *dst, uint32_t max_records)
+{
+	uint8_t *record = (uint8_t *)dst;
+	uint32_t per_page;
+	int count = 0;
+
+	if (!g_volume.open || !(g_volume.features & TSV_FEATURE_TRACK))
+		return -1;
+
+	/* Both copies of every Sector agree once nothing is pending */
+	if (!g_volume.readonly)
+		RtnOnError (tsv_flush ());
+
+	per_page = _track_per_page (SECTOR_SIZE);
+	max_records = MIN (max_records, INT32_MAX);
+
+	for (; *cursor < g_volume.sector_count && (uint32_t)count < max_records; *cursor += 1)
+	{
+		uint32_t sector_num = *cursor;
+		bool discarded;
+
+		RtnOnError (_track_load (sector_num / per_page, false));
+
+		if (unpack_uint32_little (g_memory.track + TRACK_PAGE_HEADER + 4 * (sector_num % per_page)) < since)
+			continue;
+
+		if (_track_copy_out (record, sector_num) || _track_copy_out (record, sector_num | 0x80000000))
+		{
+			/* Discarded Sectors hold noise, and their bitmap Sector is exported instead */
+			RtnOnError (_discard_test_sector (sector_num, &discarded));
+
+			if (discarded)
+				continue;
+
+			return -1;
+		}
+
+		pack_uint32_little (record, sector_num);
+		record += TSV_TRACK_RECORD_SIZE (SECTOR_SIZE);
+		count += 1;
+	}
+
+	return count;
+}
+
+
+int tsv_track_import (void const *src, uint32_t count)
+{
+	uint8_t const *records = (uint8_t const *)src;
+	size_t record_size = TSV_TRACK_RECORD_SIZE (SECTOR_SIZE);
+
+	if (!g_volume.open || g_volume.readonly || !(g_volume.features & TSV_FEATURE_TRACK))
+		return -1;
+
+	/* Nothing is written unless every record authenticates */
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		uint8_t const *record = records + (size_t)i * record_size;
+		uint32_t sector_num = unpack_uint32_little (record);
+		uint8_t calculated_mac[MAC_TAG_SIZE];
+
+		if (sector_num >= g_volume.sector_count)
+			return -1;
+
+		for (uint32_t copy = 0; copy < 2; ++copy)
+		{
+			_volume_mac (calculated_mac, g_volume.mac_key, record + 4 + 2 * MAC_TAG_SIZE + (size_t)copy * SECTOR_SIZE, SECTOR_SIZE, _tweak (sector_num | (copy << 31)));
+
+			if (secure_memcmp (calculated_mac, record + 4 + (size_t)copy * MAC_TAG_SIZE, MAC_TAG_SIZE))
+				return -1;
+		}
+	}
+
+	RtnOnError (tsv_flush ());
+
+	for (uint32_t i = 0; i < count; ++i)
+		RtnOnError (_intent_mark (unpack_uint32_little (records + (size_t)i * record_size), 1));
+
+	/* As a commit would: first copies, a barrier, then second copies */
+	for (uint32_t copy = 0; copy < 2; ++copy)
+	{
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			uint8_t const *record = records + (size_t)i * record_size;
+			uint32_t sector_num = unpack_uint32_little (record);
+
+			_cache_put (sector_num, NULL);
+
+			if (g_volume.bitmap_valid && g_volume.bitmap_sector == sector_num)
+				g_volume.bitmap_valid = false;
+
+			RtnOnError (_write_sealed (sector_num | (copy << 31), record + 4 + 2 * MAC_TAG_SIZE + (size_t)copy * SECTOR_SIZE, record + 4 + (size_t)copy * MAC_TAG_SIZE));
+		}
+
+		RtnOnError (_io_sync ());
+	}
+
+	return 0;
+}
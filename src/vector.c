@@ -0,0 +1,365 @@
+/*
+ * Scatter-gather I/O.
+ *
+ * tsv_readv and tsv_writev split a contiguous range into runs that lie within one buffer, which go
+ * straight to the reads and writes behind tsv_read and tsv_write, and the Sectors split across buffers,
+ * which are gathered into one Sector first.  Either way every Sector is read or sealed once.  Outside
+ * threaded mode the writes are one batch, so the whole vector costs the same two barriers as a single
+ * tsv_write.  Each of these calls is traced as itself, not as the reads and writes it is made of.
+ *
+ * tsv_read_batch takes its requests TSV_READ_BATCH_WINDOW at a time and sorts their indices by offset
+ * on the stack.  Requests that overlap or abut then form ranges of Sectors, which are fetched in ascending
+ * order in runs no longer than the staging area, and each run is copied into every request of its range.
+ * Each run costs one pass over at most a window of requests, whatever their size.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "util.h"
+#include <titan-secure-volume/app.h>
+#include "_volume.h"
+
+
+/* Position within an iovec list */
+typedef struct {
+	TSV_IOVEC const *iov;
+	size_t iovcnt;
+	size_t skip;    /* Bytes of iov[0] already used */
+} CURSOR;
+
+
+static void _cursor_skip_empty (CURSOR *cursor)
+{
+	while (cursor->iovcnt && cursor->skip == cursor->iov->len)
+	{
+		cursor->iov += 1;
+		cursor->iovcnt -= 1;
+		cursor->skip = 0;
+	}
+}
+
+
+static void _cursor_advance (CURSOR *cursor, size_t len)
+{
+	cursor->skip += len;
+	_cursor_skip_empty (cursor);
+}
+
+
+/* Copies len bytes between buf and the buffers at cursor, in the direction given by write. */
+static void _cursor_copy (CURSOR *cursor, uint8_t *buf, size_t len, bool write)
+{
+	while (len)
+	{
+		uint8_t *base = (uint8_t *)cursor->iov->base + cursor->skip;
+		size_t n = MIN (len, cursor->iov->len - cursor->skip);
+
+		if (write)
+			memmove (buf, base, n);
+		else
+			memmove (base, buf, n);
+
+		buf += n;
+		len -= n;
+		_cursor_advance (cursor, n);
+	}
+}
+
+
+static int _vector_io (uint64_t offset, TSV_IOVEC const *iov, size_t iovcnt, bool write)
+{
+	uint8_t stack_gather[BUFFER_SIZE];
+	CURSOR cursor = {iov, iovcnt, 0};
+	uint64_t total = 0;
+
+	/* Threaded requests cannot share g_memory.gather; tsv_set_threaded ensures Sectors fit the stack */
+	uint8_t *gather = g_volume.threaded ? stack_gather : g_memory.gather;
+
+	for (size_t i = 0; i < iovcnt; ++i)
+	{
+		if (iov[i].len > UINT64_MAX - total)
+			return -1;
+
+		total += iov[i].len;
+	}
+
+	if (offset > UINT64_MAX - total)
+		return -1;
+
+	_cursor_skip_empty (&cursor);
+
+	for (uint64_t pos = offset, end = offset + total; pos < end;)
+	{
+		uint64_t piece_end = MIN (pos - _offset_in (pos) + SECTOR_SIZE, end);
+		size_t run = cursor.iov->len - cursor.skip;
+
+		if (pos + run >= piece_end)
+		{
+			void *base = (uint8_t *)cursor.iov->base + cursor.skip;
+
+			/* Stop short of a Sector the next buffer also lands in */
+			if (pos + run < end)
+				run -= _offset_in (pos + run);
+
+			RtnOnError (write ? _write (pos, base, run) : _read (base, pos, run));
+			_cursor_advance (&cursor, run);
+			pos += run;
+			continue;
+		}
+
+		/* The rest of this Sector comes from more than one buffer, so it needs the gather buffer that
+		 * tsv_init only carves for a vectored TSV_CONFIG
+		 */
+		size_t len = (size_t)(piece_end - pos);
+
+		if (gather == NULL)
+			return -1;
+
+		if (write)
+		{
+			_cursor_copy (&cursor, gather, len, true);
+			RtnOnError (_write (pos, gather, len));
+		}
+		else
+		{
+			RtnOnError (_read (gather, pos, len));
+			_cursor_copy (&cursor, gather, len, false);
+		}
+
+		pos += len;
+	}
+
+	return 0;
+}
+
+
+/* Total length of the buffers, for the trace; 0 if it overflows, which fails the call anyway. */
+static uint64_t _vector_len (TSV_IOVEC const *iov, size_t iovcnt)
+{
+	uint64_t total = 0;
+
+	for (size_t i = 0; i < iovcnt; ++i)
+	{
+		if (iov[i].len > UINT64_MAX - total)
+			return 0;
+
+		total += iov[i].len;
+	}
+
+	return total;
+}
+
+
+static int _readv (uint64_t offset, TSV_IOVEC const *iov, size_t iovcnt)
+{
+	if (!g_volume.open)
+		return -1;
+
+	return _vector_io (offset, iov, iovcnt, false);
+}
+
+
+int tsv_readv (uint64_t offset, TSV_IOVEC const *iov, size_t iovcnt)
+{
+	int err = _readv (offset, iov, iovcnt);
+
+	_trace (TSV_TRACE_READV, offset, _vector_len (iov, iovcnt), err);
+
+	return err;
+}
+
+
+static int _writev (uint64_t offset, TSV_IOVEC const *iov, size_t iovcnt)
+{
+	int err;
+
+	if (!g_volume.open || g_volume.readonly)
+		return -1;
+
+	/* Already batched, deferred or threaded; each write commits as those modes do */
+	if (g_volume.batch || g_volume.deferred || g_volume.threaded)
+		return _vector_io (offset, iov, iovcnt, true);
+
+	RtnOnError (tsv_batch_begin ());
+	err = _vector_io (offset, iov, iovcnt, true);
+
+	/* Whatever was written is still committed, as tsv_batch_end would, but as part of this call */
+	g_volume.batch = false;
+
+	if (_flush ())
+		return -1;
+
+	return err;
+}
+
+
+int tsv_writev (uint64_t offset, TSV_IOVEC const *iov, size_t iovcnt)
+{
+	int err = _writev (offset, iov, iovcnt);
+
+	_trace (TSV_TRACE_WRITEV, offset, _vector_len (iov, iovcnt), err);
+
+	return err;
+}
+
+
+/* The last user Sector that request r touches */
+static uint32_t _batch_last (TSV_READ_REQUEST const *r)
+{
+	return (uint32_t)_sector_of (r->offset + r->len - 1);
+}
+
+
+/* Puts the indices of the requests with data among requests[0, count) into order, sorted by offset.
+ * Returns how many there are.
+ */
+static size_t _batch_sort (TSV_READ_REQUEST const *requests, size_t count, uint16_t *order)
+{
+	size_t n = 0;
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		size_t j = n;
+
+		if (!requests[i].len)
+			continue;
+
+		for (; j > 0 && requests[order[j - 1]].offset > requests[i].offset; --j)
+			order[j] = order[j - 1];
+
+		order[j] = (uint16_t)i;
+		n += 1;
+	}
+
+	return n;
+}
+
+
+/* Copies the plaintext of the run of user Sectors [sector_num, sector_num+run) into every request of
+ * order[0, n) that overlaps it.
+ */
+static void _batch_scatter (TSV_READ_REQUEST const *requests, uint16_t const *order, size_t n, uint32_t sector_num, uint32_t run, uint8_t const *plaintext)
+{
+	uint64_t run_start = (uint64_t)sector_num * SECTOR_SIZE;
+	uint64_t run_end = run_start + (uint64_t)run * SECTOR_SIZE;
+
+	for (size_t i = 0; i < n && requests[order[i]].offset < run_end; ++i)
+	{
+		TSV_READ_REQUEST const *r = &requests[order[i]];
+		uint64_t start = MAX (r->offset, run_start);
+		uint64_t end = MIN (r->offset + r->len, run_end);
+
+		if (start < end)
+			memmove ((uint8_t *)r->dst + (start - r->offset), plaintext + (start - run_start), (size_t)(end - start));
+	}
+}
+
+
+/* Reads the requests of order[0, n), which are sorted by offset. */
+static int _batch_window (TSV_READ_REQUEST const *requests, uint16_t const *order, size_t n)
+{
+	uint32_t max_run = MAX (1, g_memory.staging_size / SECTOR_SIZE);
+
+	for (size_t i = 0; i < n;)
+	{
+		/* Requests order[i, j) overlap or abut and cover Sectors [first, last] */
+		uint32_t first = (uint32_t)_sector_of (requests[order[i]].offset);
+		uint32_t last = _batch_last (&requests[order[i]]);
+		size_t j = i + 1;
+		size_t live = i;
+
+		for (; j < n && _sector_of (requests[order[j]].offset) <= (uint64_t)last + 1; ++j)
+			last = MAX (last, _batch_last (&requests[order[j]]));
+
+		for (uint32_t sector_num = first; sector_num <= last;)
+		{
+			uint32_t run = MIN (last - sector_num + 1, max_run);
+			uint32_t staged = 0;
+			bool discarded;
+
+			/* Requests that ended before this run need not be looked at again */
+			while (_batch_last (&requests[order[live]]) < sector_num)
+				live += 1;
+
+			if (run > 1)
+				RtnOnError (_read_staged (g_memory.staging, sector_num, run, &staged));
+
+			if (staged)
+			{
+				_batch_scatter (requests, order + live, j - live, sector_num, staged, g_memory.staging);
+				sector_num += staged;
+				continue;
+			}
+
+			RtnOnError (_discard_test (sector_num, &discarded));
+
+			if (discarded)
+				memset (g_memory.gather, 0, SECTOR_SIZE);
+			else
+				RtnOnError (_read_current (g_memory.gather, _physical_sector (sector_num)));
+
+			_batch_scatter (requests, order + live, j - live, sector_num, 1, g_memory.gather);
+			sector_num += 1;
+		}
+
+		i = j;
+	}
+
+	return 0;
+}
+
+
+static int _read_batch (TSV_READ_REQUEST const *requests, size_t count)
+{
+	uint64_t size = (uint64_t)g_volume.user_sector_count * SECTOR_SIZE;
+
+	if (!g_volume.open)
+		return -1;
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (requests[i].offset > size || requests[i].len > size - requests[i].offset)
+			return -1;
+	}
+
+	/* Threaded requests cannot share the staging area or g_memory.gather, and an arena may have no gather buffer */
+	if (g_volume.threaded || g_memory.gather == NULL)
+	{
+		for (size_t i = 0; i < count; ++i)
+		{
+			if (requests[i].len)
+				RtnOnError (_read (requests[i].dst, requests[i].offset, requests[i].len));
+		}
+
+		return 0;
+	}
+
+	for (size_t i = 0; i < count; i += TSV_READ_BATCH_WINDOW)
+	{
+		uint16_t order[TSV_READ_BATCH_WINDOW];
+		size_t window = MIN (count - i, TSV_READ_BATCH_WINDOW);
+
+		RtnOnError (_batch_window (requests + i, order, _batch_sort (requests + i, window, order)));
+	}
+
+	return 0;
+}
+
+
+int tsv_read_batch (TSV_READ_REQUEST const *requests, size_t count)
+{
+	int err = _read_batch (requests, count);
+	uint32_t type = TSV_TRACE_READ_BATCH;
+
+	/* One record per request that reads anything, the first of them beginning the batch */
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (requests[i].len)
+		{
+			_trace (type, requests[i].offset, requests[i].len, err);
+			type = TSV_TRACE_READ_BATCH_NEXT;
+		}
+	}
+
+	return err;
+}
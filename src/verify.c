@@ -0,0 +1,113 @@
+/*
+ * Verify.
+ *
+ * Checks the MAC tags of both copies of a range of Sectors without decrypting or repairing anything.
+ * All state lives in the caller's scratch buffer, so ranges can be checked on several threads at once.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "util.h"
+#include <titan-secure-volume/app.h>
+#include "_volume.h"
+
+
+/* Returns a bitmask of the copies of sector_num that fail authentication (or cannot be read). */
+static int _verify_copies (void *buf, uint32_t sector_num)
+{
+	void const *data;
+	int bad = 0;
+
+	for (uint32_t copy = 0; copy < 2; ++copy)
+	{
+		if (_auth_sector (buf, sector_num | (copy << 31), &data))
+			bad |= 1 << copy;
+	}
+
+	return bad;
+}
+
+
+static void _verify_count (TSV_VERIFY *result, int bad)
+{
+	result->bad[0] += bad & 1;
+	result->bad[1] += (bad >> 1) & 1;
+	result->lost += (bad == 3);
+}
+
+
+/* Verifies a bitmap Sector and decrypts a good copy of it into dst.  Returns the bad copies, or -1 if
+ * neither copy is good.
+ */
+static int _verify_bitmap (uint8_t *dst, uint8_t *buf, uint32_t sector_num)
+{
+	void const *data[2];
+	int bad = 0;
+
+	/* Each copy gets its own buffer, so the first can still be decrypted after reading the second */
+	if (_auth_sector (dst, sector_num, &data[0]))
+		bad |= 1;
+
+	if (_auth_sector (buf, sector_num | 0x80000000, &data[1]))
+		bad |= 2;
+
+	if (bad == 3)
+		return -1;
+
+	uint32_t copy = bad & 1;
+
+	_volume_decrypt (dst, g_volume.encryption_key, data[copy], SECTOR_SIZE, _tweak (sector_num | (copy << 31)));
+
+	return bad;
+}
+
+
+int tsv_verify (uint32_t first, uint32_t count, void *scratch, TSV_VERIFY *result)
+{
+	uint8_t *buf = scratch;
+	uint8_t *bitmap = buf + SECTOR_SIZE;
+	uint32_t bitmap_sector = 0;
+	bool have_bitmap = false;
+
+	/* Both copies must be current and under the same keys */
+	if (!g_volume.open || g_volume.grow_sector_count || g_volume.rekey || g_volume.pending_count)
+		return -1;
+
+	if (first > g_volume.user_sector_count || count > g_volume.user_sector_count - first)
+		return -1;
+
+	if (g_volume.features & TSV_FEATURE_PARITY)
+		return _parity_verify (first, count, buf, result);
+
+	for (uint32_t i = first; i < first + count; ++i)
+	{
+		if (g_volume.features & TSV_FEATURE_DISCARD)
+		{
+			uint32_t bit;
+			uint32_t sector_num = _bitmap_sector (i, &bit);
+
+			if (!have_bitmap || sector_num != bitmap_sector)
+			{
+				int bad = _verify_bitmap (bitmap, buf, sector_num);
+
+				if (bad == -1)
+					return -1;
+
+				/* Counted by whichever call covers the first Sector it tracks */
+				if (bit == 0)
+					_verify_count (result, bad);
+
+				bitmap_sector = sector_num;
+				have_bitmap = true;
+			}
+
+			/* Discarded Sectors hold noise */
+			if ((bitmap[bit / 8] >> (bit % 8)) & 1)
+				continue;
+		}
+
+		_verify_count (result, _verify_copies (buf, _physical_sector (i)));
+	}
+
+	return 0;
+}
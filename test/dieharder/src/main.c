@@ -89,6 +89,12 @@ int tsv_physical_write (uint64_t offset, void const *src, size_t len)
 }
 
 
+int tsv_physical_sync (void)
+{
+	return 0;
+}
+
+
 int main (int argc, char *argv[])
 {
 	int sector_size = 4096;
@@ -0,0 +1,628 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "minunit.h"
+#include <titan-secure-volume/titan-secure-volume.h>
+#include <titan-secure-volume/app.h>
+#include <titan-secure-volume/linux.h>
+
+int tests_run = 0;
+static char g_path[] = "/tmp/tsv-linux-test-XXXXXX";
+static char g_second_path[] = "/tmp/tsv-linux-test-XXXXXX";
+
+
+void tsv_fatal_error (void)
+{
+	fprintf (stderr, "ERROR: TSV_FATAL_ERROR\n");
+	exit (-1);
+}
+
+
+/* Creates a volume in a file, writes to it, and reads it back after reopening the file.
+ * Odd sector sizes leave almost every physical access unaligned.
+ */
+static char *_test_mode (int mode, uint32_t sector_size)
+{
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint32_t sector_count = 1024;
+	size_t volume_len = (size_t)sector_size * sector_count;
+	uint8_t *real_copy = malloc (volume_len);
+	uint8_t *result = malloc (volume_len);
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_read_urandom (real_copy, volume_len);
+
+	mu_assert (!tsv_linux_open (g_path, tsv_physical_size (sector_size, sector_count), mode), "tsv_linux_open should succeed.");
+	mu_assert (!tsv_create (mac_key, encryption_key, sector_size, sector_count), "tsv_create should succeed on a file.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed on a file.");
+	mu_assert (!tsv_write (0, real_copy, volume_len), "tsv_write should succeed on a file.");
+	mu_assert (!tsv_write (777, real_copy + 777, 3 * sector_size), "Unaligned tsv_write should succeed on a file.");
+	mu_assert (!tsv_close (), "tsv_close should succeed on a file.");
+	mu_assert (!tsv_linux_close (), "tsv_linux_close should succeed.");
+
+	mu_assert (!tsv_linux_open (g_path, 0, mode), "tsv_linux_open should succeed on an existing file.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed after reopening the file.");
+	mu_assert (!tsv_read (result, 0, volume_len), "tsv_read should succeed on a file.");
+	mu_assert (!memcmp (result, real_copy, volume_len), "Data should survive reopening the file.");
+	mu_assert (!tsv_read (result, 100, 2 * sector_size), "Unaligned tsv_read should succeed on a file.");
+	mu_assert (!memcmp (result, real_copy + 100, 2 * sector_size), "Unaligned reads should return the data written.");
+	mu_assert (!tsv_close (), "tsv_close should succeed on a file.");
+	mu_assert (!tsv_linux_close (), "tsv_linux_close should succeed.");
+
+	free (real_copy);
+	free (result);
+
+	return 0;
+}
+
+
+/* The test file is reused by every mode; make sure each starts from an empty file. */
+static void _truncate (void)
+{
+	if (truncate (g_path, 0))
+		tsv_fatal_error ();
+}
+
+
+START_TEST (test_linux_direct)
+{
+	char *msg;
+
+	_truncate ();
+	msg = _test_mode (TSV_LINUX_DIRECT, 4096);
+	mu_assert (!msg, msg);
+
+	_truncate ();
+	msg = _test_mode (TSV_LINUX_DIRECT, 576);
+	mu_assert (!msg, msg);
+}
+END_TEST
+
+
+START_TEST (test_linux_buffered)
+{
+	char *msg;
+
+	_truncate ();
+	msg = _test_mode (TSV_LINUX_BUFFERED, 4096);
+	mu_assert (!msg, msg);
+
+	_truncate ();
+	msg = _test_mode (TSV_LINUX_BUFFERED, 576);
+	mu_assert (!msg, msg);
+}
+END_TEST
+
+
+START_TEST (test_linux_mmap)
+{
+	char *msg;
+
+	_truncate ();
+	msg = _test_mode (TSV_LINUX_MMAP, 4096);
+	mu_assert (!msg, msg);
+
+	_truncate ();
+	msg = _test_mode (TSV_LINUX_MMAP, 576);
+	mu_assert (!msg, msg);
+}
+END_TEST
+
+
+/* Discarding most of a volume should give the space back to the filesystem. */
+START_TEST (test_linux_discard)
+{
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint32_t sector_count = 1024;
+	size_t volume_len = 4096 * sector_count;
+	uint8_t *real_copy = malloc (volume_len);
+	uint8_t *result = malloc (volume_len);
+	struct stat before, after;
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_read_urandom (real_copy, volume_len);
+
+	_truncate ();
+	mu_assert (!tsv_linux_open (g_path, tsv_physical_size_ex (4096, sector_count, TSV_FEATURE_DISCARD), TSV_LINUX_BUFFERED | TSV_LINUX_DISCARD), "tsv_linux_open should accept TSV_LINUX_DISCARD.");
+	mu_assert (!tsv_create_ex (mac_key, encryption_key, 4096, sector_count, TSV_FEATURE_DISCARD), "tsv_create_ex should succeed on a file.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed on a file.");
+	mu_assert (!tsv_write (0, real_copy, volume_len), "tsv_write should succeed on a file.");
+	mu_assert (!tsv_physical_sync () && !stat (g_path, &before), "stat should succeed.");
+
+	memset (real_copy + 4096, 0, volume_len - 2 * 4096);
+	mu_assert (!tsv_discard (4096, volume_len - 2 * 4096), "tsv_discard should succeed on a file.");
+	mu_assert (!stat (g_path, &after), "stat should succeed.");
+	mu_assert (after.st_blocks <= before.st_blocks, "tsv_discard should not allocate space.");
+
+	mu_assert (!tsv_close (), "tsv_close should succeed on a file.");
+	mu_assert (!tsv_linux_close (), "tsv_linux_close should succeed.");
+
+	mu_assert (!tsv_linux_open (g_path, 0, TSV_LINUX_DIRECT | TSV_LINUX_DISCARD), "tsv_linux_open should succeed on an existing file.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed after reopening the file.");
+	mu_assert (!tsv_read (result, 0, volume_len), "tsv_read should succeed on a file.");
+	mu_assert (!memcmp (result, real_copy, volume_len), "Discarded Sectors should read as zeros.");
+	mu_assert (!tsv_close (), "tsv_close should succeed on a file.");
+	mu_assert (!tsv_linux_close (), "tsv_linux_close should succeed.");
+
+	free (real_copy);
+	free (result);
+}
+END_TEST
+
+
+#define THREAD_COUNT 4
+#define SHARED_SECTORS 8
+#define REGION_SECTORS 500
+
+typedef struct {
+	uint32_t id;
+	uint32_t seed;
+	uint8_t *model;        /* This thread's region */
+	uint8_t *shared;       /* The whole shared range; only this thread's slices are updated */
+	char *msg;
+} THREAD_STATE;
+
+
+static uint32_t _next (uint32_t *seed)
+{
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 17;
+	*seed ^= *seed << 5;
+
+	return *seed;
+}
+
+
+/* Writes, discards and reads in its own region, and writes its own slice of every shared Sector. */
+static char *_thread_work (THREAD_STATE *state)
+{
+	uint64_t base = 512 * (SHARED_SECTORS + (uint64_t)state->id * REGION_SECTORS);
+	uint8_t buf[4096];
+	uint32_t slice = 512 / THREAD_COUNT;
+
+	for (int i = 0; i < 300; ++i)
+	{
+		uint32_t offset = _next (&state->seed) % (512 * REGION_SECTORS);
+		uint32_t len = _next (&state->seed) % sizeof (buf);
+
+		if (len > 512 * REGION_SECTORS - offset)
+			len = 512 * REGION_SECTORS - offset;
+
+		if (i % 5 == 4)
+		{
+			uint32_t first = (offset + 511) / 512, end = (offset + len) / 512;
+
+			if (first < end)
+				memset (state->model + 512 * first, 0, 512 * (end - first));
+
+			mu_assert (!tsv_discard (base + offset, len), "tsv_discard should succeed in threaded mode.");
+		}
+		else
+		{
+			tsv_read_urandom (buf, len);
+			memmove (state->model + offset, buf, len);
+			mu_assert (!tsv_write (base + offset, buf, len), "tsv_write should succeed in threaded mode.");
+		}
+
+		offset = _next (&state->seed) % (512 * REGION_SECTORS - sizeof (buf));
+		mu_assert (!tsv_read (buf, base + offset, sizeof (buf)), "tsv_read should succeed in threaded mode.");
+		mu_assert (!memcmp (buf, state->model + offset, sizeof (buf)), "Each thread should read back its own writes.");
+
+		/* Partial writes to Sectors every thread is writing */
+		uint32_t sector = _next (&state->seed) % SHARED_SECTORS;
+		uint8_t *dst = state->shared + 512 * sector + slice * state->id;
+
+		tsv_read_urandom (dst, slice);
+		mu_assert (!tsv_write (512 * sector + slice * state->id, dst, slice), "Partial tsv_write should succeed in threaded mode.");
+	}
+
+	return 0;
+}
+
+
+static void *_thread_main (void *arg)
+{
+	THREAD_STATE *state = arg;
+
+	state->msg = _thread_work (state);
+
+	return NULL;
+}
+
+
+typedef struct {
+	uint32_t first;
+	uint32_t count;
+	uint32_t seed;         /* Readers only */
+	uint8_t const *model;  /* Readers only */
+	uint8_t scratch[16 * (512 + 32)];
+	char *msg;
+} REKEY_PART;
+
+
+/* Re-seals its part of a rekey step. */
+static void *_rekey_main (void *arg)
+{
+	REKEY_PART *part = arg;
+
+	if (tsv_rekey_range (part->first, part->count, part->scratch, sizeof (part->scratch)))
+		part->msg = "tsv_rekey_range should succeed in threaded mode.";
+
+	return NULL;
+}
+
+
+/* Reads while a rekey step is being re-sealed. */
+static void *_rekey_reader_main (void *arg)
+{
+	REKEY_PART *part = arg;
+	uint32_t len = sizeof (part->scratch);
+
+	for (int i = 0; i < 20; ++i)
+	{
+		uint32_t offset = _next (&part->seed) % (512 * (SHARED_SECTORS + THREAD_COUNT * REGION_SECTORS) - len);
+
+		if (tsv_read (part->scratch, offset, len))
+			part->msg = "tsv_read should succeed during a rekey.";
+		else if (memcmp (part->scratch, part->model + offset, len))
+			part->msg = "tsv_read should return the data written during a rekey.";
+
+		if (part->msg)
+			break;
+	}
+
+	return NULL;
+}
+
+
+/* Several threads share a volume, with partial writes to the same Sectors racing each other. */
+static char *_test_threads (int mode)
+{
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint8_t new_mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t new_encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint32_t sector_count = SHARED_SECTORS + THREAD_COUNT * REGION_SECTORS;
+	size_t volume_len = 512 * (size_t)sector_count;
+	uint8_t *model = calloc (1, volume_len);
+	uint8_t *result = malloc (volume_len);
+	THREAD_STATE state[THREAD_COUNT];
+	pthread_t threads[THREAD_COUNT + 1];
+	REKEY_PART *parts = malloc ((THREAD_COUNT + 1) * sizeof (REKEY_PART));
+	uint32_t first, count, steps = 0;
+	TSV_VERIFY verify;
+	int ret;
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_read_urandom (new_mac_key, sizeof (new_mac_key));
+	tsv_read_urandom (new_encryption_key, sizeof (new_encryption_key));
+
+	_truncate ();
+	mu_assert (!tsv_linux_open (g_path, tsv_physical_size_ex (512, sector_count, TSV_FEATURE_DISCARD), mode), "tsv_linux_open should succeed.");
+	mu_assert (!tsv_create_ex (mac_key, encryption_key, 512, sector_count, TSV_FEATURE_DISCARD), "tsv_create_ex should succeed on a file.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed on a file.");
+
+	mu_assert (!tsv_batch_begin (), "tsv_batch_begin should succeed.");
+	mu_assert (tsv_set_threaded (1) == -1, "tsv_set_threaded should fail in a batch.");
+	mu_assert (!tsv_batch_end (), "tsv_batch_end should succeed.");
+
+	mu_assert (!tsv_set_threaded (1), "tsv_set_threaded should succeed.");
+	mu_assert (tsv_batch_begin () == -1, "tsv_batch_begin should fail in threaded mode.");
+	mu_assert (tsv_set_deferred (1) == -1, "tsv_set_deferred should fail in threaded mode.");
+	mu_assert (tsv_grow (sector_count + 1) == -1, "tsv_grow should fail in threaded mode.");
+
+	for (uint32_t i = 0; i < THREAD_COUNT; ++i)
+	{
+		state[i].id = i;
+		state[i].seed = 2463534242u + i;
+		state[i].model = model + 512 * (SHARED_SECTORS + i * REGION_SECTORS);
+		state[i].shared = model;
+		state[i].msg = NULL;
+		mu_assert (!pthread_create (&threads[i], NULL, _thread_main, &state[i]), "pthread_create should succeed.");
+	}
+
+	for (uint32_t i = 0; i < THREAD_COUNT; ++i)
+		pthread_join (threads[i], NULL);
+
+	for (uint32_t i = 0; i < THREAD_COUNT; ++i)
+		mu_assert (!state[i].msg, state[i].msg);
+
+	/* Rekey with every step split across threads, and a reader alongside them */
+	mu_assert (!tsv_rekey_begin (new_mac_key, new_encryption_key), "tsv_rekey_begin should succeed in threaded mode.");
+
+	while ((ret = tsv_rekey_next (64 * 512, &first, &count)) == 1)
+	{
+		uint32_t share = (count + THREAD_COUNT - 1) / THREAD_COUNT;
+
+		for (uint32_t i = 0; i <= THREAD_COUNT; ++i)
+		{
+			uint32_t start = i * share < count ? i * share : count;
+
+			parts[i].first = first + start;
+			parts[i].count = count - start < share ? count - start : share;
+			parts[i].seed = 88675123u + steps;
+			parts[i].model = model;
+			parts[i].msg = NULL;
+			mu_assert (!pthread_create (&threads[i], NULL, i < THREAD_COUNT ? _rekey_main : _rekey_reader_main, &parts[i]), "pthread_create should succeed.");
+		}
+
+		for (uint32_t i = 0; i <= THREAD_COUNT; ++i)
+			pthread_join (threads[i], NULL);
+
+		for (uint32_t i = 0; i <= THREAD_COUNT; ++i)
+			mu_assert (!parts[i].msg, parts[i].msg);
+
+		++steps;
+	}
+
+	mu_assert (!ret, "tsv_rekey_next should finish the rekey in threaded mode.");
+	mu_assert (steps > 1, "The rekey should take several steps.");
+
+	mu_assert (!tsv_set_threaded (0), "tsv_set_threaded should succeed.");
+	mu_assert (!tsv_close (), "tsv_close should succeed on a file.");
+	mu_assert (tsv_open (mac_key, encryption_key) == -1, "tsv_open should fail with the old keys after a rekey.");
+	mu_assert (!tsv_open (new_mac_key, new_encryption_key), "tsv_open should succeed after a threaded rekey.");
+	mu_assert (!tsv_read (result, 0, volume_len), "tsv_read should succeed on a file.");
+	mu_assert (!memcmp (result, model, volume_len), "No write should be lost or torn in threaded mode.");
+	memset (&verify, 0, sizeof (verify));
+	mu_assert (!tsv_verify (0, sector_count, result, &verify), "tsv_verify should succeed on a file.");
+	mu_assert (!verify.bad[0] && !verify.bad[1], "Threaded mode should leave both copies current.");
+	mu_assert (!tsv_close (), "tsv_close should succeed on a file.");
+	mu_assert (!tsv_linux_close (), "tsv_linux_close should succeed.");
+
+	free (model);
+	free (result);
+	free (parts);
+
+	return 0;
+}
+
+
+START_TEST (test_linux_threads)
+{
+	char *msg;
+
+	msg = _test_threads (TSV_LINUX_BUFFERED);
+	mu_assert (!msg, msg);
+
+	msg = _test_threads (TSV_LINUX_DIRECT);
+	mu_assert (!msg, msg);
+
+	/* Small caches, so the threads keep fetching MAC pages over each other */
+	TSV_CONFIG config = {.max_sector_size = 512, .features = TSV_FEATURE_DISCARD, .cache_sectors = 4, .mac_pages = 2};
+	size_t arena_len = tsv_arena_size (&config);
+	void *arena = malloc (arena_len);
+
+	mu_assert (!tsv_init (arena, arena_len, &config), "tsv_init should succeed.");
+	msg = _test_threads (TSV_LINUX_DIRECT);
+	mu_assert (!msg, msg);
+	mu_assert (!tsv_init (NULL, 0, NULL), "tsv_init should go back to the default arena.");
+	free (arena);
+}
+END_TEST
+
+
+/* A split volume keeps one copy on each file, and stays readable when the first file is lost. */
+START_TEST (test_linux_split)
+{
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint32_t sector_count = 1024;
+	size_t volume_len = 4096 * sector_count;
+	uint64_t device_size = tsv_physical_size_ex (4096, sector_count, TSV_FEATURE_SPLIT);
+	uint8_t *real_copy = malloc (volume_len);
+	uint8_t *result = malloc (volume_len);
+	struct stat st;
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_read_urandom (real_copy, volume_len);
+
+	mu_assert (device_size && device_size < tsv_physical_size (4096, sector_count), "Each device should hold about one copy.");
+
+	_truncate ();
+	mu_assert (tsv_linux_open_second (g_second_path, device_size) == -1, "tsv_linux_open_second should need tsv_linux_open first.");
+	mu_assert (!tsv_linux_open (g_path, device_size, TSV_LINUX_DIRECT), "tsv_linux_open should succeed.");
+	mu_assert (!tsv_linux_open_second (g_second_path, device_size), "tsv_linux_open_second should succeed.");
+	mu_assert (!tsv_create_ex (mac_key, encryption_key, 4096, sector_count, TSV_FEATURE_SPLIT), "tsv_create_ex should succeed on two files.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed on two files.");
+	mu_assert (tsv_get_features () == TSV_FEATURE_SPLIT, "The volume should be split.");
+	mu_assert (!tsv_write (0, real_copy, volume_len), "tsv_write should succeed on two files.");
+	mu_assert (tsv_grow (2 * sector_count) == -1, "Split volumes should refuse to grow.");
+	mu_assert (!tsv_close (), "tsv_close should succeed on two files.");
+	mu_assert (!tsv_linux_close (), "tsv_linux_close should succeed.");
+
+	mu_assert (!stat (g_path, &st) && (uint64_t)st.st_size == device_size, "The first file should hold one copy.");
+	mu_assert (!stat (g_second_path, &st) && (uint64_t)st.st_size == device_size, "The second file should hold the other.");
+
+	/* Without the first file, the header and every Sector come from the second */
+	_truncate ();
+	mu_assert (!truncate (g_path, 1), "The first file should be lost.");
+	mu_assert (!tsv_linux_open (g_path, 0, TSV_LINUX_BUFFERED), "tsv_linux_open should succeed.");
+	mu_assert (!tsv_linux_open_second (g_second_path, 0), "tsv_linux_open_second should succeed on an existing file.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should fall back to the second header.");
+	mu_assert (!tsv_read (result, 0, volume_len) && !memcmp (result, real_copy, volume_len), "tsv_read should fall back to the second copy.");
+	mu_assert (!tsv_close (), "tsv_close should succeed on two files.");
+	mu_assert (!tsv_linux_close (), "tsv_linux_close should succeed.");
+
+	free (real_copy);
+	free (result);
+}
+END_TEST
+
+
+static int _host_cache_reader (char const *name, size_t cache_len, uint8_t const *mac_key, uint8_t const *encryption_key, uint8_t const *real_copy, size_t volume_len)
+{
+	uint8_t *cache = tsv_linux_host_cache (name, cache_len);
+	uint8_t *result = malloc (volume_len);
+	int err = -1;
+
+	if (cache && result && !tsv_linux_open (g_path, 0, TSV_LINUX_BUFFERED) && !tsv_open_readonly (mac_key, encryption_key, cache, cache_len))
+		err = (tsv_read (result, 0, volume_len) || memcmp (result, real_copy, volume_len)) ? -1 : 0;
+
+	tsv_close ();
+	tsv_linux_close ();
+	free (result);
+
+	if (cache)
+		tsv_linux_host_cache_close (cache, cache_len);
+
+	return err;
+}
+
+
+/* Another process fills a named host cache, and this one reads through it. */
+START_TEST (test_linux_host_cache)
+{
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint32_t sector_count = 256;
+	size_t volume_len = 4096 * sector_count;
+	size_t cache_len = tsv_host_cache_size (4096, sector_count);
+	uint8_t *real_copy = malloc (volume_len);
+	char name[64];
+	int status;
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_read_urandom (real_copy, volume_len);
+	snprintf (name, sizeof (name), "/tsv-linux-test-%d", (int)getpid ());
+	shm_unlink (name);
+
+	_truncate ();
+	mu_assert (!tsv_linux_open (g_path, tsv_physical_size (4096, sector_count), TSV_LINUX_BUFFERED), "tsv_linux_open should succeed.");
+	mu_assert (!tsv_create (mac_key, encryption_key, 4096, sector_count), "tsv_create should succeed.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed.");
+	mu_assert (!tsv_write (0, real_copy, volume_len), "tsv_write should succeed.");
+	mu_assert (!tsv_close (), "tsv_close should succeed.");
+	mu_assert (!tsv_linux_close (), "tsv_linux_close should succeed.");
+
+	pid_t pid = fork ();
+
+	if (pid == 0)
+		_exit (_host_cache_reader (name, cache_len, mac_key, encryption_key, real_copy, volume_len) ? 1 : 0);
+
+	mu_assert (pid > 0 && waitpid (pid, &status, 0) == pid && WIFEXITED (status) && WEXITSTATUS (status) == 0, "The first reader should fill the host cache.");
+	mu_assert (tsv_linux_host_cache (name, cache_len / 2) == NULL, "tsv_linux_host_cache should refuse another size.");
+	mu_assert (!_host_cache_reader (name, cache_len, mac_key, encryption_key, real_copy, volume_len), "The second reader should attach to the host cache.");
+	mu_assert (!shm_unlink (name), "The host cache should have been created.");
+
+	free (real_copy);
+}
+END_TEST
+
+
+static uint64_t _unpack (uint8_t const *src, size_t len)
+{
+	uint64_t value = 0;
+
+	for (size_t i = len; i; --i)
+		value = (value << 8) | src[i - 1];
+
+	return value;
+}
+
+
+/* Calls are written to a trace file in order, with times that never go backwards. */
+START_TEST (test_linux_trace)
+{
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint32_t sector_count = 64;
+	uint8_t buf[2 * 4096];
+	uint8_t trace[8 + 8 * TSV_TRACE_RECORD_SIZE];
+	char trace_path[] = "/tmp/tsv-linux-trace-XXXXXX";
+	int fd = mkstemp (trace_path);
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_read_urandom (buf, sizeof (buf));
+
+	_truncate ();
+	mu_assert (fd != -1, "The trace file should be created.");
+	mu_assert (!tsv_linux_open (g_path, tsv_physical_size (4096, sector_count), TSV_LINUX_BUFFERED), "tsv_linux_open should succeed.");
+	mu_assert (!tsv_create (mac_key, encryption_key, 4096, sector_count), "tsv_create should succeed.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed.");
+
+	mu_assert (!tsv_linux_trace_open (trace_path), "tsv_linux_trace_open should succeed.");
+	mu_assert (tsv_linux_trace_open (trace_path) == -1, "Only one trace should be open at a time.");
+	mu_assert (!tsv_write (4096, buf, sizeof (buf)), "tsv_write should succeed.");
+	mu_assert (!tsv_read (buf, 100, 5000), "tsv_read should succeed.");
+	mu_assert (tsv_discard (0, 4096) == -1, "tsv_discard should fail without TSV_FEATURE_DISCARD.");
+	mu_assert (!tsv_close (), "tsv_close should succeed.");
+	mu_assert (!tsv_linux_trace_close (), "tsv_linux_trace_close should succeed.");
+	mu_assert (!tsv_linux_close (), "tsv_linux_close should succeed.");
+
+	ssize_t len = read (fd, trace, sizeof (trace));
+
+	close (fd);
+	unlink (trace_path);
+	mu_assert (len == 8 + 4 * TSV_TRACE_RECORD_SIZE && !memcmp (trace, TSV_TRACE_MAGIC, 8), "The trace should hold the four calls.");
+
+	uint8_t const *record = trace + 8;
+	uint8_t const expected[4][2] = {{TSV_TRACE_WRITE, 0}, {TSV_TRACE_READ, 0}, {TSV_TRACE_DISCARD, 1}, {TSV_TRACE_FLUSH, 0}};
+	uint64_t const offsets[4] = {4096, 100, 0, 0};
+	uint64_t const lens[4] = {sizeof (buf), 5000, 4096, 0};
+
+	for (int i = 0; i < 4; ++i, record += TSV_TRACE_RECORD_SIZE)
+	{
+		mu_assert (record[20] == expected[i][0] && record[21] == expected[i][1] && !record[22] && !record[23], "Records should hold each call's type and result.");
+		mu_assert (_unpack (record + 8, 8) == offsets[i] && _unpack (record + 16, 4) == lens[i], "Records should hold each call's offset and length.");
+		mu_assert (i == 0 || _unpack (record, 8) >= _unpack (record - TSV_TRACE_RECORD_SIZE, 8), "Times should never go backwards.");
+	}
+}
+END_TEST
+
+
+static char *all_tests (void)
+{
+	mu_run_test (test_linux_direct);
+	mu_run_test (test_linux_buffered);
+	mu_run_test (test_linux_mmap);
+	mu_run_test (test_linux_discard);
+	mu_run_test (test_linux_threads);
+	mu_run_test (test_linux_split);
+	mu_run_test (test_linux_host_cache);
+	mu_run_test (test_linux_trace);
+
+	return 0;
+}
+
+
+int main (void)
+{
+	int fd = mkstemp (g_path);
+
+	if (fd == -1)
+		return -1;
+	close (fd);
+
+	if ((fd = mkstemp (g_second_path)) == -1)
+		return -1;
+	close (fd);
+
+	char *result = all_tests ();
+
+	unlink (g_path);
+	unlink (g_second_path);
+
+	if (result != 0)
+		printf ("%s\n", result);
+	else
+		printf ("ALL TESTS PASSED\n");
+	printf ("Tests run: %d\n", tests_run);
+
+	return result != 0;
+}
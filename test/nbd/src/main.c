@@ -0,0 +1,283 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "minunit.h"
+#include <titan-secure-volume/titan-secure-volume.h>
+#include <titan-secure-volume/app.h>
+#include <titan-secure-volume/linux.h>
+#include "nbd.h"
+
+int tests_run = 0;
+static char g_path[] = "/tmp/tsv-nbd-test-XXXXXX";
+
+#define SECTOR_SIZE 4096
+#define SECTOR_COUNT 512
+#define VOLUME_LEN (SECTOR_SIZE * SECTOR_COUNT)
+#define IN_FLIGHT 32
+
+
+void tsv_fatal_error (void)
+{
+	fprintf (stderr, "ERROR: TSV_FATAL_ERROR\n");
+	exit (-1);
+}
+
+
+/* NBD client stub */
+static int g_fd = -1;
+
+
+static void _pack_be (uint8_t *dst, uint64_t src, int len)
+{
+	for (int i = len - 1; i >= 0; --i, src >>= 8)
+		dst[i] = (uint8_t)src;
+}
+
+
+static uint64_t _unpack_be (uint8_t const *src, int len)
+{
+	uint64_t result = 0;
+
+	for (int i = 0; i < len; ++i)
+		result = (result << 8) | src[i];
+
+	return result;
+}
+
+
+static int _recv (void *dst, size_t len)
+{
+	return recv (g_fd, dst, len, MSG_WAITALL) == (ssize_t)len ? 0 : -1;
+}
+
+
+static int _send (void const *src, size_t len)
+{
+	return send (g_fd, src, len, 0) == (ssize_t)len ? 0 : -1;
+}
+
+
+static int _send_request (uint16_t flags, uint16_t type, uint64_t handle, uint64_t offset, uint32_t len, void const *data)
+{
+	uint8_t request[28];
+
+	_pack_be (request, 0x25609513, 4);
+	_pack_be (request + 4, flags, 2);
+	_pack_be (request + 6, type, 2);
+	_pack_be (request + 8, handle, 8);
+	_pack_be (request + 16, offset, 8);
+	_pack_be (request + 24, len, 4);
+
+	if (_send (request, sizeof (request)))
+		return -1;
+
+	return (type == 1) ? _send (data, len) : 0;
+}
+
+
+/* Returns the reply's error field, or -1 if the reply is malformed or for the wrong handle. */
+static int64_t _recv_reply (uint64_t handle, void *data, uint32_t len)
+{
+	uint8_t reply[16];
+
+	if (_recv (reply, sizeof (reply)) || _unpack_be (reply, 4) != 0x67446698 || _unpack_be (reply + 8, 8) != handle)
+		return -1;
+
+	uint32_t error = (uint32_t)_unpack_be (reply + 4, 4);
+
+	if (!error && data && _recv (data, len))
+		return -1;
+
+	return error;
+}
+
+
+/* Fixed newstyle handshake followed by NBD_OPT_GO.  Returns the export size, or 0 on failure. */
+static uint64_t _handshake (void)
+{
+	uint8_t buf[64];
+
+	if (_recv (buf, 18) || _unpack_be (buf, 8) != 0x4e42444d41474943ull || _unpack_be (buf + 8, 8) != 0x49484156454F5054ull)
+		return 0;
+
+	_pack_be (buf, 3, 4);    /* FIXED_NEWSTYLE | NO_ZEROES */
+	if (_send (buf, 4))
+		return 0;
+
+	/* An unknown option must be refused without ending the negotiation */
+	_pack_be (buf, 0x49484156454F5054ull, 8);
+	_pack_be (buf + 8, 0x1234, 4);
+	_pack_be (buf + 12, 0, 4);
+	if (_send (buf, 16) || _recv (buf, 20) || _unpack_be (buf + 12, 4) != 0x80000001)
+		return 0;
+
+	_pack_be (buf, 0x49484156454F5054ull, 8);
+	_pack_be (buf + 8, 7, 4);     /* NBD_OPT_GO */
+	_pack_be (buf + 12, 6, 4);
+	_pack_be (buf + 16, 0, 4);    /* Empty export name */
+	_pack_be (buf + 20, 0, 2);    /* No info requests */
+	if (_send (buf, 22))
+		return 0;
+
+	/* NBD_REP_INFO (NBD_INFO_EXPORT), then NBD_REP_ACK */
+	if (_recv (buf, 20) || _unpack_be (buf + 12, 4) != 3 || _unpack_be (buf + 16, 4) != 12 || _recv (buf + 20, 12))
+		return 0;
+
+	uint64_t size = _unpack_be (buf + 22, 8);
+
+	/* The volume has TSV_FEATURE_DISCARD, so NBD_FLAG_SEND_TRIM must be set */
+	if (!(_unpack_be (buf + 30, 2) & (1 << 5)))
+		return 0;
+
+	if (_recv (buf, 20) || _unpack_be (buf + 12, 4) != 1)
+		return 0;
+
+	return size;
+}
+
+
+static int _server (int fd)
+{
+	uint8_t mac_key[TSV_MAC_KEY_SIZE] = {1};
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE] = {2};
+	int err = 0;
+
+	if (tsv_linux_open (g_path, tsv_physical_size_ex (SECTOR_SIZE, SECTOR_COUNT, TSV_FEATURE_DISCARD), TSV_LINUX_BUFFERED))
+		return -1;
+
+	if (tsv_create_ex (mac_key, encryption_key, SECTOR_SIZE, SECTOR_COUNT, TSV_FEATURE_DISCARD) || tsv_open (mac_key, encryption_key))
+		err = -1;
+
+	if (!err)
+		err = nbd_serve (fd, 0);
+
+	if (tsv_close () || tsv_linux_close ())
+		err = -1;
+
+	return err;
+}
+
+
+START_TEST (test_nbd0)
+{
+	uint8_t *real_copy = malloc (VOLUME_LEN);
+	uint8_t *result = malloc (VOLUME_LEN);
+	uint64_t offsets[IN_FLIGHT];
+	uint32_t lens[IN_FLIGHT];
+
+	mu_assert (_handshake () == VOLUME_LEN, "Handshake should report the volume size.");
+
+	tsv_read_urandom (real_copy, VOLUME_LEN);
+
+	/* Many writes in flight before any reply is read */
+	for (uint64_t i = 0; i < VOLUME_LEN / (64 * 1024); ++i)
+		mu_assert (!_send_request (0, 1, i, i * 64 * 1024, 64 * 1024, real_copy + i * 64 * 1024), "Sending writes should succeed.");
+
+	for (uint64_t i = 0; i < VOLUME_LEN / (64 * 1024); ++i)
+		mu_assert (_recv_reply (i, NULL, 0) == 0, "Writes should succeed, with replies in order.");
+
+	/* Small unaligned writes, some with FUA */
+	for (uint64_t i = 0; i < IN_FLIGHT; ++i)
+	{
+		uint32_t r[2];
+
+		tsv_read_urandom (r, sizeof (r));
+		lens[i] = (r[0] % 8000) + 1;
+		offsets[i] = r[1] % (VOLUME_LEN - lens[i]);
+		tsv_read_urandom (real_copy + offsets[i], lens[i]);
+
+		mu_assert (!_send_request ((i & 1) ? 1 : 0, 1, 1000 + i, offsets[i], lens[i], real_copy + offsets[i]), "Sending writes should succeed.");
+	}
+
+	for (uint64_t i = 0; i < IN_FLIGHT; ++i)
+		mu_assert (_recv_reply (1000 + i, NULL, 0) == 0, "Unaligned writes should succeed.");
+
+	mu_assert (!_send_request (0, 3, 2000, 0, 0, NULL), "Sending a flush should succeed.");
+	mu_assert (_recv_reply (2000, NULL, 0) == 0, "Flush should succeed.");
+
+	/* Pipelined reads */
+	for (uint64_t i = 0; i < IN_FLIGHT; ++i)
+		mu_assert (!_send_request (0, 0, 3000 + i, i * (VOLUME_LEN / IN_FLIGHT), VOLUME_LEN / IN_FLIGHT, NULL), "Sending reads should succeed.");
+
+	for (uint64_t i = 0; i < IN_FLIGHT; ++i)
+		mu_assert (_recv_reply (3000 + i, result + i * (VOLUME_LEN / IN_FLIGHT), VOLUME_LEN / IN_FLIGHT) == 0, "Reads should succeed.");
+
+	mu_assert (!memcmp (result, real_copy, VOLUME_LEN), "Reads should return the data written.");
+
+	/* Trims only drop whole Sectors */
+	memset (real_copy + 2 * SECTOR_SIZE, 0, 5 * SECTOR_SIZE);
+	mu_assert (!_send_request (1, 4, 3500, 2 * SECTOR_SIZE - 100, 5 * SECTOR_SIZE + 200, NULL), "Sending a trim should succeed.");
+	mu_assert (_recv_reply (3500, NULL, 0) == 0, "Trim should succeed.");
+	mu_assert (!_send_request (0, 0, 3501, 0, 8 * SECTOR_SIZE, NULL), "Sending a read should succeed.");
+	mu_assert (_recv_reply (3501, result, 8 * SECTOR_SIZE) == 0 && !memcmp (result, real_copy, 8 * SECTOR_SIZE), "Trimmed Sectors should read as zeros.");
+
+	/* Errors are reported per request, and the connection stays usable */
+	mu_assert (!_send_request (0, 0, 4000, VOLUME_LEN - 10, 20, NULL), "Sending a read should succeed.");
+	mu_assert (_recv_reply (4000, NULL, 0) == 22, "Reads past the end should fail with EINVAL.");
+	mu_assert (!_send_request (0, 1, 4001, VOLUME_LEN, 1, "x"), "Sending a write should succeed.");
+	mu_assert (_recv_reply (4001, NULL, 0) == 22, "Writes past the end should fail with EINVAL.");
+	mu_assert (!_send_request (0, 0, 4002, 12345, 100, NULL), "Sending a read should succeed.");
+	mu_assert (_recv_reply (4002, result, 100) == 0 && !memcmp (result, real_copy + 12345, 100), "Reads should still work after an error.");
+
+	mu_assert (!_send_request (0, 2, 5000, 0, 0, NULL), "Sending a disconnect should succeed.");
+
+	free (real_copy);
+	free (result);
+}
+END_TEST
+
+
+static char *all_tests (void)
+{
+	mu_run_test (test_nbd0);
+
+	return 0;
+}
+
+
+int main (void)
+{
+	int sv[2];
+	int status;
+	int fd = mkstemp (g_path);
+
+	if (fd == -1)
+		return -1;
+	close (fd);
+
+	if (socketpair (AF_UNIX, SOCK_STREAM, 0, sv))
+		return -1;
+
+	pid_t pid = fork ();
+
+	if (pid == 0)
+	{
+		close (sv[0]);
+		_exit (_server (sv[1]) ? 1 : 0);
+	}
+
+	close (sv[1]);
+	g_fd = sv[0];
+
+	char *result = all_tests ();
+
+	close (g_fd);
+
+	if (waitpid (pid, &status, 0) != pid || !WIFEXITED (status) || WEXITSTATUS (status) != 0)
+		result = result ? result : "Server should exit cleanly.";
+
+	unlink (g_path);
+
+	if (result != 0)
+		printf ("%s\n", result);
+	else
+		printf ("ALL TESTS PASSED\n");
+	printf ("Tests run: %d\n", tests_run);
+
+	return result != 0;
+}
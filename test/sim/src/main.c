@@ -0,0 +1,329 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "minunit.h"
+#include <titan-secure-volume/titan-secure-volume.h>
+#include <titan-secure-volume/app.h>
+#include <titan-secure-volume/sim.h>
+
+int tests_run = 0;
+
+
+void tsv_fatal_error (void)
+{
+	fprintf (stderr, "ERROR: TSV_FATAL_ERROR\n");
+	exit (-1);
+}
+
+
+void tsv_read_urandom (void *dst, size_t len)
+{
+	int fd = open ("/dev/urandom", O_RDONLY);
+
+	if (fd == -1)
+		tsv_fatal_error ();
+
+	while (len)
+	{
+		ssize_t bytes = read (fd, dst, len);
+
+		if (bytes <= 0)
+			tsv_fatal_error ();
+
+		dst = ((uint8_t *)dst) + bytes;
+		len -= (size_t)bytes;
+	}
+
+	close (fd);
+}
+
+
+static uint8_t g_mac_key[TSV_MAC_KEY_SIZE];
+static uint8_t g_encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+
+
+/* A fresh, open volume on simulated storage, with the counters reset. */
+static int _open_volume (TSV_SIM_PROFILE const *profile, uint32_t sector_size, uint32_t sector_count)
+{
+	tsv_close ();
+
+	if (tsv_sim_open (tsv_physical_size (sector_size, sector_count), profile) ||
+	    tsv_create (g_mac_key, g_encryption_key, sector_size, sector_count) ||
+	    tsv_open (g_mac_key, g_encryption_key))
+		return -1;
+
+	tsv_sim_reset ();
+
+	return 0;
+}
+
+
+/* 200 random one-Sector writes, optionally in batches of 20, returning the simulated time taken. */
+static uint64_t _random_writes (TSV_SIM_PROFILE const *profile, int batch)
+{
+	uint32_t sector_count = 1024;
+	uint8_t buf[4096];
+	TSV_SIM_STATS stats;
+
+	if (_open_volume (profile, 4096, sector_count))
+		return 0;
+
+	srand (7);
+	tsv_read_urandom (buf, sizeof (buf));
+
+	for (int i = 0; i < 200; ++i)
+	{
+		if (batch && (i % 20) == 0 && tsv_batch_begin ())
+			return 0;
+
+		if (tsv_write ((uint64_t)((uint32_t)rand () % sector_count) * 4096, buf, sizeof (buf)))
+			return 0;
+
+		if (batch && (i % 20) == 19 && tsv_batch_end ())
+			return 0;
+	}
+
+	tsv_sim_stats (&stats);
+	tsv_close ();
+
+	return stats.elapsed_ns;
+}
+
+
+/* Every request is counted and recorded, and a write never has both copies of a Sector in flight. */
+START_TEST (test_sim_record)
+{
+	uint32_t sector_size = 4096, sector_count = 64;
+	/* Header, then one Sector of MAC tags and the data of the first copy */
+	uint64_t copy_b = 2 * (uint64_t)sector_size + (uint64_t)sector_size * sector_count;
+	uint8_t buf[4096];
+	TSV_SIM_OP log[16];
+	TSV_SIM_STATS stats;
+
+	mu_assert (!_open_volume (&TSV_SIM_NVME, sector_size, sector_count), "A volume should be created on simulated storage.");
+	tsv_read_urandom (buf, sizeof (buf));
+
+	tsv_sim_record (log, 16);
+	mu_assert (!tsv_write (5 * sector_size, buf, sector_size), "tsv_write should succeed on simulated storage.");
+	tsv_sim_record (NULL, 0);
+	tsv_sim_stats (&stats);
+
+	/* Data and MAC tag of one copy, a barrier, the same for the other copy, and a barrier */
+	mu_assert (stats.ops[TSV_SIM_WRITE] == 4 && stats.ops[TSV_SIM_SYNC] == 2 && stats.ops[TSV_SIM_READ] == 0, "A whole-Sector write should take four writes and two barriers.");
+	mu_assert (stats.recorded == 6 && log[2].type == TSV_SIM_SYNC && log[5].type == TSV_SIM_SYNC, "Every request should be recorded in order.");
+	mu_assert ((log[0].offset < copy_b) == (log[1].offset < copy_b) && (log[3].offset < copy_b) == (log[4].offset < copy_b) && (log[0].offset < copy_b) != (log[3].offset < copy_b), "Each half of the write should touch one copy only.");
+	mu_assert (log[3].start_ns >= log[2].end_ns && log[2].start_ns >= log[0].end_ns && log[2].start_ns >= log[1].end_ns, "The second copy should only be written once the first is durable.");
+
+	/* MAC tags are smaller than a media block */
+	mu_assert (stats.unaligned == 2 && stats.bytes[TSV_SIM_WRITE] == 2 * (sector_size + 32), "MAC tag writes should be counted as unaligned.");
+
+	mu_assert (!tsv_read (buf, 5 * sector_size, sector_size), "tsv_read should succeed on simulated storage.");
+	tsv_sim_stats (&stats);
+	mu_assert (stats.ops[TSV_SIM_READ] == 2, "A one-Sector read should read the data and the MAC tag.");
+
+	mu_assert (!tsv_close (), "tsv_close should succeed on simulated storage.");
+	tsv_sim_close ();
+}
+END_TEST
+
+
+/* Predicted costs follow the profiles.  Batches save barriers, which dominate on fast media; on an HDD
+ * the seeks of re-reading each Sector at tsv_batch_end cost about as much as they save.
+ */
+START_TEST (test_sim_profiles)
+{
+	uint64_t hdd = _random_writes (&TSV_SIM_HDD, 0);
+	uint64_t ssd = _random_writes (&TSV_SIM_SATA_SSD, 0);
+	uint64_t ssd_batched = _random_writes (&TSV_SIM_SATA_SSD, 1);
+	uint64_t nvme = _random_writes (&TSV_SIM_NVME, 0);
+	uint64_t nvme_batched = _random_writes (&TSV_SIM_NVME, 1);
+
+	mu_assert (hdd && ssd && ssd_batched && nvme && nvme_batched, "Random writes should succeed on simulated storage.");
+	mu_assert (hdd > ssd && ssd > nvme, "Slower media should take longer.");
+	mu_assert (ssd_batched * 2 < ssd && nvme_batched * 2 < nvme, "Batches should save most of the barrier time on SSDs.");
+
+	tsv_sim_close ();
+}
+END_TEST
+
+
+/* Reads and writes of whole runs of Sectors are coalesced when the arena has a staging area. */
+START_TEST (test_sim_staging)
+{
+	static uint8_t arena[5 * 4096 + 64 * 1024];
+	TSV_CONFIG config = {.max_sector_size = 4096, .staging_size = 64 * 1024};
+	uint32_t sector_count = 256;
+	size_t volume_len = 4096 * (size_t)sector_count;
+	uint8_t *model = malloc (volume_len);
+	uint8_t *result = malloc (volume_len);
+	TSV_SIM_STATS stats;
+	uint64_t plain_reads = 0, plain_ns = 0;
+
+	tsv_read_urandom (model, volume_len);
+	mu_assert (tsv_arena_size (&config) <= sizeof (arena), "The arena should be large enough.");
+
+	for (int staged = 0; staged < 2; ++staged)
+	{
+		tsv_close ();
+		mu_assert (!tsv_init (staged ? arena : NULL, sizeof (arena), &config), "tsv_init should succeed.");
+		mu_assert (!_open_volume (&TSV_SIM_SATA_SSD, 4096, sector_count), "A volume should be created on simulated storage.");
+		mu_assert (!tsv_write (0, model, volume_len), "tsv_write should succeed on simulated storage.");
+		tsv_sim_reset ();
+
+		mu_assert (!tsv_read (result, 0, volume_len) && !memcmp (result, model, volume_len), "tsv_read should return what was written.");
+		tsv_sim_stats (&stats);
+
+		if (!staged)
+		{
+			plain_reads = stats.ops[TSV_SIM_READ];
+			plain_ns = stats.elapsed_ns;
+			mu_assert (plain_reads == 2 * sector_count, "Without staging every Sector should take two reads.");
+		}
+		else
+		{
+			mu_assert (stats.ops[TSV_SIM_READ] * 12 <= plain_reads, "Staging should coalesce reads.");
+			mu_assert (stats.elapsed_ns * 4 < plain_ns, "Coalesced reads should be predicted to be faster.");
+		}
+	}
+
+	mu_assert (!tsv_close (), "tsv_close should succeed on simulated storage.");
+	mu_assert (!tsv_init (NULL, 0, NULL), "tsv_init should go back to the default arena.");
+	tsv_sim_close ();
+
+	free (model);
+	free (result);
+}
+END_TEST
+
+
+/* A split volume writes each copy to its own device and spreads reads over both. */
+START_TEST (test_sim_split)
+{
+	uint32_t sector_count = 256;
+	size_t volume_len = 4096 * (size_t)sector_count;
+	uint64_t device_size = tsv_physical_size_ex (4096, sector_count, TSV_FEATURE_SPLIT);
+	uint8_t *model = malloc (volume_len);
+	uint8_t *result = malloc (volume_len);
+	uint64_t per_device[2] = {0, 0};
+	TSV_SIM_OP log[64];
+	TSV_SIM_STATS stats;
+
+	tsv_read_urandom (model, volume_len);
+	tsv_close ();
+
+	mu_assert (!tsv_sim_open (device_size, &TSV_SIM_HDD) && !tsv_sim_open_second (device_size), "Two simulated devices should open.");
+	mu_assert (!tsv_create_ex (g_mac_key, g_encryption_key, 4096, sector_count, TSV_FEATURE_SPLIT), "tsv_create_ex should succeed on two devices.");
+	mu_assert (!tsv_open (g_mac_key, g_encryption_key), "tsv_open should succeed on two devices.");
+	mu_assert (!tsv_write (0, model, volume_len), "tsv_write should succeed on two devices.");
+
+	tsv_sim_record (log, 64);
+	mu_assert (!tsv_write (5 * 4096, model, 4096), "tsv_write should succeed on two devices.");
+	tsv_sim_record (NULL, 0);
+	tsv_sim_stats (&stats);
+	mu_assert (stats.recorded == 6 && (log[0].offset < TSV_SPLIT_OFFSET) && (log[1].offset < TSV_SPLIT_OFFSET) && (log[3].offset >= TSV_SPLIT_OFFSET) && (log[4].offset >= TSV_SPLIT_OFFSET), "Each copy should be written to its own device.");
+	memmove (model + 5 * 4096, model, 4096);
+
+	/* One-Sector reads, in order, alternate between the devices a stripe at a time */
+	tsv_sim_record (log, 64);
+
+	for (uint32_t i = 0; i < 32; ++i)
+		mu_assert (!tsv_read (result + (size_t)i * 4096, (uint64_t)i * 4096, 4096), "tsv_read should succeed on two devices.");
+
+	tsv_sim_record (NULL, 0);
+
+	for (uint32_t i = 0; i < 64; ++i)
+		per_device[log[i].offset >= TSV_SPLIT_OFFSET] += 1;
+
+	mu_assert (per_device[0] == 32 && per_device[1] == 32, "Reads should be spread over both devices.");
+	mu_assert (!memcmp (result, model, 32 * 4096), "Reads from either device should match.");
+
+	/* Damage to the first device is covered by the second */
+	memset (tsv_sim_data () + 4096, 0, (size_t)(device_size - 4096));
+	mu_assert (!tsv_read (result, 0, volume_len) && !memcmp (result, model, volume_len), "tsv_read should fall back to the second device.");
+
+	mu_assert (!tsv_close (), "tsv_close should succeed on two devices.");
+	tsv_sim_close ();
+
+	free (model);
+	free (result);
+}
+END_TEST
+
+
+/* With an I/O queue, a batch of sequential one-Sector writes reaches storage as a few long writes. */
+START_TEST (test_sim_queue)
+{
+	static uint8_t arena[5 * 4096 + 3 * 512 * 1024];
+	TSV_CONFIG config = {.max_sector_size = 4096, .io_queue_size = 512 * 1024};
+	uint8_t buf[4096];
+	uint64_t plain_writes = 0, plain_ns = 0;
+	TSV_SIM_STATS stats;
+
+	tsv_read_urandom (buf, sizeof (buf));
+	mu_assert (tsv_arena_size (&config) <= sizeof (arena), "The arena should be large enough.");
+
+	for (int queued = 0; queued < 2; ++queued)
+	{
+		tsv_close ();
+		mu_assert (!tsv_init (queued ? arena : NULL, sizeof (arena), &config), "tsv_init should succeed.");
+		mu_assert (!_open_volume (&TSV_SIM_HDD, 4096, 256), "A volume should be created on simulated storage.");
+
+		mu_assert (!tsv_batch_begin (), "tsv_batch_begin should succeed on simulated storage.");
+
+		for (uint32_t i = 0; i < 64; ++i)
+			mu_assert (!tsv_write ((uint64_t)i * 4096, buf, sizeof (buf)), "tsv_write should succeed on simulated storage.");
+
+		mu_assert (!tsv_batch_end (), "tsv_batch_end should succeed on simulated storage.");
+		tsv_sim_stats (&stats);
+
+		if (!queued)
+		{
+			plain_writes = stats.ops[TSV_SIM_WRITE];
+			plain_ns = stats.elapsed_ns;
+			mu_assert (plain_writes == 4 * 64, "Without a queue every Sector should take four writes.");
+		}
+		else
+		{
+			/* A run of data and a run of tags per copy */
+			mu_assert (stats.ops[TSV_SIM_WRITE] == 4 && stats.ops[TSV_SIM_SYNC] == 2, "Queued writes should be merged between the barriers.");
+			mu_assert (stats.elapsed_ns * 2 < plain_ns, "Merged writes should be predicted to be faster.");
+		}
+	}
+
+	mu_assert (!tsv_close (), "tsv_close should succeed on simulated storage.");
+	mu_assert (!tsv_init (NULL, 0, NULL), "tsv_init should go back to the default arena.");
+	tsv_sim_close ();
+}
+END_TEST
+
+
+static char *all_tests (void)
+{
+	mu_run_test (test_sim_record);
+	mu_run_test (test_sim_profiles);
+	mu_run_test (test_sim_staging);
+	mu_run_test (test_sim_split);
+	mu_run_test (test_sim_queue);
+
+	return 0;
+}
+
+
+int main (void)
+{
+	tsv_read_urandom (g_mac_key, sizeof (g_mac_key));
+	tsv_read_urandom (g_encryption_key, sizeof (g_encryption_key));
+
+	char *result = all_tests ();
+
+	if (result != 0)
+		printf ("%s\n", result);
+	else
+		printf ("ALL TESTS PASSED\n");
+	printf ("Tests run: %d\n", tests_run);
+
+	return result != 0;
+}
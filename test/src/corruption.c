@@ -5,9 +5,10 @@
 
 
 void new_ramdisk (size_t len);
+char *for_each_sector_size (char *(*test) (uint32_t sector_size));
 
 
-START_TEST (test_corruption0)
+static char *_test_corruption0 (uint32_t sector_size)
 {
 	int err;
 	uint8_t mac_key[TSV_MAC_KEY_SIZE];
@@ -22,7 +23,7 @@ START_TEST (test_corruption0)
 	tsv_close ();
 
 	new_ramdisk (volume_len * 3);
-	mu_assert (!tsv_create (mac_key, encryption_key, 4096, volume_len / 4096), "tsv_create should succeed in test_corruption.");
+	mu_assert (!tsv_create (mac_key, encryption_key, sector_size, volume_len / sector_size), "tsv_create should succeed in test_corruption.");
 	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_corruption.");
 
 	tsv_read_urandom (real_copy, volume_len);
@@ -36,7 +37,7 @@ START_TEST (test_corruption0)
 
 		tsv_read_urandom (&len, sizeof (len));
 		tsv_read_urandom (&offset, sizeof (offset));
-		len = (len % 4096) + 1;
+		len = (len % sector_size) + 1;
 
 		offset = offset % (volume_len * 3 - len);
 		mu_assert (!tsv_physical_write (offset, buf, len), "tsv_physical_write should succeed in test_corruption.");
@@ -54,6 +55,17 @@ START_TEST (test_corruption0)
 	mu_assert (!err, "tsv_read should succeed in test_corruption.");
 
 	mu_assert (!memcmp (real_copy, result, volume_len), "Volume should not become corrupted from small errors on disk.");
+
+	free (real_copy);
+	free (result);
+
+	return 0;
+}
+
+
+START_TEST (test_corruption0)
+{
+	return for_each_sector_size (_test_corruption0);
 }
 END_TEST
 
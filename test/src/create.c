@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include <string.h>
 #include <minunit.h>
 #include <titan-secure-volume/titan-secure-volume.h>
@@ -5,10 +6,16 @@
 
 
 void new_ramdisk (size_t len);
+int sector_size_skipped (uint32_t sector_size);
+extern uint8_t *g_ramdisk;
+extern unsigned int g_urandom_count;
 
 
 START_TEST (test_create0)
 {
+	if (sector_size_skipped (512))
+		return 0;
+
 	int err;
 	uint8_t mac_key[TSV_MAC_KEY_SIZE];
 	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
@@ -45,9 +52,52 @@ START_TEST (test_create0)
 END_TEST
 
 
+/* Noise comes from the internal DRBG, seeded once per volume, and never repeats across volumes. */
+START_TEST (test_create1)
+{
+	if (sector_size_skipped (512))
+		return 0;
+
+	uint8_t mac_key[TSV_MAC_KEY_SIZE] = {0};
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE] = {0};
+	uint32_t sector_count = 1000;
+	size_t len = tsv_physical_size (512, sector_count);
+	uint8_t *first = malloc (len);
+	unsigned int calls;
+
+	tsv_close ();
+
+	for (int i = 0; i < 2; ++i)
+	{
+		new_ramdisk (len);
+		calls = g_urandom_count;
+		mu_assert (!tsv_create (mac_key, encryption_key, 512, sector_count), "tsv_create should succeed in test_create.");
+		mu_assert (g_urandom_count - calls == 1, "tsv_create should seed its noise once.");
+
+		if (i == 0)
+			memmove (first, g_ramdisk, len);
+	}
+
+	/* Same keys, so everything after the header differs only because of the noise */
+	size_t same = 0;
+
+	for (size_t j = 512; j < len; j += 64)
+		same += !memcmp (first + j, g_ramdisk + j, 64);
+
+	mu_assert (same == 0, "Noise should not repeat across volumes.");
+
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_create.");
+	mu_assert (!tsv_close (), "tsv_close should succeed in test_create.");
+
+	free (first);
+}
+END_TEST
+
+
 char *test_create (void)
 {
 	mu_run_test (test_create0);
+	mu_run_test (test_create1);
 
 	return 0;
 }
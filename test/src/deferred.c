@@ -0,0 +1,168 @@
+#include <stdlib.h>
+#include <string.h>
+#include <minunit.h>
+#include <titan-secure-volume/titan-secure-volume.h>
+#include <titan-secure-volume/app.h>
+
+
+void new_ramdisk (size_t len);
+char *for_each_sector_size (char *(*test) (uint32_t sector_size));
+extern uint8_t *g_ramdisk;
+extern unsigned int g_sync_count;
+
+
+/* Writes with deferred replication, checking the pending count and that the queue
+ * is drained by tsv_replicate, by filling up, and by tsv_flush.
+ */
+static char *_test_deferred0 (uint32_t sector_size)
+{
+	int err;
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint8_t buf[4096];
+	uint32_t sector_count = 256;
+	size_t volume_len = sector_size * (size_t)sector_count;
+	size_t mac_table_len = (32 * sector_count + sector_size - 1) / sector_size * sector_size;
+	size_t secondary = sector_size + mac_table_len + volume_len;
+	uint8_t *real_copy = malloc (volume_len);
+	uint8_t *result = malloc (volume_len);
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_close ();
+
+	new_ramdisk (secondary + mac_table_len + volume_len);
+	mu_assert (!tsv_create (mac_key, encryption_key, sector_size, sector_count), "tsv_create should succeed in test_deferred.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_deferred.");
+
+	tsv_read_urandom (real_copy, volume_len);
+	mu_assert (!tsv_write (0, real_copy, volume_len), "tsv_write should succeed in test_deferred.");
+	mu_assert (tsv_replicas_pending () == 0, "Replicas should be in sync after tsv_write.");
+
+	mu_assert (!tsv_set_deferred (1), "tsv_set_deferred should succeed.");
+	g_sync_count = 0;
+
+	for (uint32_t i = 0; i < 8; ++i)
+	{
+		tsv_read_urandom (buf, 100);
+		memmove (real_copy + i * sector_size + 7, buf, 100);
+		mu_assert (!tsv_write (i * sector_size + 7, buf, 100), "tsv_write should succeed in deferred mode.");
+	}
+
+	/* Rewriting a pending sector must not grow the queue */
+	tsv_read_urandom (buf, 100);
+	memmove (real_copy + 3 * sector_size + 200, buf, 100);
+	mu_assert (!tsv_write (3 * sector_size + 200, buf, 100), "tsv_write should succeed in deferred mode.");
+
+	mu_assert (g_sync_count == 0, "tsv_write should not issue barriers in deferred mode.");
+	mu_assert (tsv_replicas_pending () == 8, "Each written sector should have one stale copy.");
+
+	err = tsv_read (result, 0, volume_len);
+	mu_assert (!err, "tsv_read should succeed in deferred mode.");
+	mu_assert (!memcmp (result, real_copy, volume_len), "tsv_read should never return a stale copy.");
+
+	mu_assert (!tsv_replicate (3), "tsv_replicate should succeed.");
+	mu_assert (tsv_replicas_pending () == 5, "tsv_replicate should bring the requested number of sectors in sync.");
+	mu_assert (g_sync_count == 2, "tsv_replicate should issue two barriers.");
+
+	/* Touch more sectors than the queue holds */
+	for (uint32_t i = 0; i < sector_count; ++i)
+	{
+		tsv_read_urandom (buf, 16);
+		memmove (real_copy + i * sector_size + 500, buf, 12);
+		mu_assert (!tsv_write (i * sector_size + 500, buf, 12), "tsv_write should succeed when the queue fills.");
+		mu_assert (tsv_replicas_pending () > 0, "Replicas should be out of sync in deferred mode.");
+	}
+
+	err = tsv_read (result, 0, volume_len);
+	mu_assert (!err, "tsv_read should succeed in deferred mode.");
+	mu_assert (!memcmp (result, real_copy, volume_len), "tsv_read should never return a stale copy.");
+
+	mu_assert (!tsv_set_deferred (0), "tsv_set_deferred should succeed.");
+	mu_assert (tsv_replicas_pending () == 0, "Leaving deferred mode should flush.");
+
+	/* Destroy either copy; everything must still be readable from the other */
+	memset (g_ramdisk + secondary, 0, mac_table_len + volume_len);
+	err = tsv_read (result, 0, volume_len);
+	mu_assert (!err && !memcmp (result, real_copy, volume_len), "Primary copies should be up to date after flush.");
+
+	mu_assert (!tsv_write (0, real_copy, volume_len), "tsv_write should succeed in test_deferred.");
+	memset (g_ramdisk + sector_size, 0, mac_table_len + volume_len);
+	err = tsv_read (result, 0, volume_len);
+	mu_assert (!err && !memcmp (result, real_copy, volume_len), "Secondary copies should be up to date after flush.");
+
+	free (real_copy);
+	free (result);
+
+	return 0;
+}
+
+
+START_TEST (test_deferred0)
+{
+	return for_each_sector_size (_test_deferred0);
+}
+END_TEST
+
+
+/* A fresh copy damaged in the middle of the queue fails the commit, without keeping the Sectors after
+ * it from being replicated.
+ */
+static char *_test_deferred1 (uint32_t sector_size)
+{
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint32_t sector_count = 64;
+	size_t volume_len = sector_size * (size_t)sector_count;
+	size_t mac_table_len = (32 * sector_count + sector_size - 1) / sector_size * sector_size;
+	size_t primary = sector_size + mac_table_len;
+	size_t secondary = primary + volume_len;
+	uint8_t *real_copy = malloc (volume_len);
+	uint8_t *result = malloc (volume_len);
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_read_urandom (real_copy, volume_len);
+	tsv_close ();
+
+	new_ramdisk (secondary + mac_table_len + volume_len);
+	mu_assert (!tsv_create (mac_key, encryption_key, sector_size, sector_count), "tsv_create should succeed in test_deferred.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_deferred.");
+	mu_assert (!tsv_set_deferred (1), "tsv_set_deferred should succeed.");
+
+	/* Whole Sectors, so the first copy of each is the fresh one */
+	mu_assert (!tsv_write (0, real_copy, 8 * sector_size), "tsv_write should succeed in deferred mode.");
+	mu_assert (tsv_replicas_pending () == 8, "Each written sector should have one stale copy.");
+
+	g_ramdisk[primary + 3 * sector_size + 10] ^= 1;
+	mu_assert (tsv_flush () == -1, "tsv_flush should fail when a fresh copy is damaged.");
+	mu_assert (tsv_replicas_pending () == 0, "The rest of the queue should still be replicated.");
+	mu_assert (!tsv_flush (), "The damaged Sector should only be reported once.");
+
+	/* Every other Sector reads from its second copy */
+	memset (g_ramdisk + primary, 0, volume_len);
+	mu_assert (!tsv_read (result, 0, 3 * sector_size) && !memcmp (result, real_copy, 3 * sector_size), "Sectors before the damage should be replicated.");
+	mu_assert (!tsv_read (result, 4 * sector_size, 4 * sector_size) && !memcmp (result, real_copy + 4 * sector_size, 4 * sector_size), "Sectors after the damage should be replicated.");
+	mu_assert (!tsv_close (), "tsv_close should succeed in test_deferred.");
+
+	free (real_copy);
+	free (result);
+
+	return 0;
+}
+
+
+START_TEST (test_deferred1)
+{
+	return for_each_sector_size (_test_deferred1);
+}
+END_TEST
+
+
+char *test_deferred (void)
+{
+	mu_run_test (test_deferred0);
+	mu_run_test (test_deferred1);
+
+	return 0;
+}
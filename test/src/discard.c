@@ -0,0 +1,243 @@
+#include <stdlib.h>
+#include <string.h>
+#include <minunit.h>
+#include <titan-secure-volume/titan-secure-volume.h>
+#include <titan-secure-volume/app.h>
+
+
+void new_ramdisk (size_t len);
+char *for_each_sector_size (char *(*test) (uint32_t sector_size));
+extern uint8_t *g_ramdisk;
+extern unsigned int g_read_count;
+extern unsigned int g_discard_count;
+extern uint64_t g_drop_offset;
+extern size_t g_drop_len;
+extern uint8_t *g_crash_image;
+extern int g_crashed;
+
+
+static void discard_model (uint8_t *model, uint32_t sector_size, uint64_t offset, uint64_t len)
+{
+	uint64_t first = (offset + sector_size - 1) / sector_size;
+	uint64_t end = (offset + len) / sector_size;
+
+	if (first < end)
+		memset (model + first * sector_size, 0, (end - first) * sector_size);
+}
+
+
+/* Mixes writes and discards against a model of the volume, through a reopen, corruption of
+ * either copy, a grow and a rekey.
+ */
+static char *_test_discard0 (uint32_t sector_size)
+{
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint32_t sector_count = 5000, grown_count = 9000;
+	uint32_t physical_count = sector_count + (sector_count + 8 * sector_size - 1) / (8 * sector_size);  /* One bitmap Sector per 8 * sector_size Sectors */
+	size_t volume_len = sector_size * (size_t)grown_count;
+	size_t mac_table_len = (32 * physical_count + sector_size - 1) / sector_size * sector_size;
+	size_t physical_len = tsv_physical_size_ex (sector_size, grown_count, TSV_FEATURE_DISCARD);
+	uint8_t *model = calloc (1, volume_len);
+	uint8_t *result = malloc (volume_len);
+	uint8_t *snapshot = malloc (physical_len);
+	uint8_t *buf = malloc (8 * sector_size);
+
+	mu_assert (tsv_physical_size_ex (sector_size, sector_count, TSV_FEATURE_DISCARD) == tsv_physical_size (sector_size, physical_count), "Bitmap Sectors should be included in the physical size.");
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_close ();
+
+	/* Not available without the feature */
+	new_ramdisk (physical_len);
+	mu_assert (!tsv_create (mac_key, encryption_key, sector_size, 64), "tsv_create should succeed in test_discard.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_discard.");
+	mu_assert (tsv_get_features () == 0, "tsv_create should not enable features.");
+	mu_assert (tsv_discard (0, sector_size) == -1, "tsv_discard should need TSV_FEATURE_DISCARD.");
+	tsv_close ();
+
+	new_ramdisk (physical_len);
+	mu_assert (!tsv_create_ex (mac_key, encryption_key, sector_size, sector_count, TSV_FEATURE_DISCARD), "tsv_create_ex should succeed.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_discard.");
+	mu_assert (tsv_get_features () == TSV_FEATURE_DISCARD, "tsv_get_features should report TSV_FEATURE_DISCARD.");
+	mu_assert (tsv_get_size () == sector_size * (uint64_t)sector_count, "Bitmap Sectors should not be part of the size.");
+
+	/* A new volume is all discarded; only the bitmap is read */
+	g_read_count = 0;
+	memset (result, 0xAA, sector_size * sector_count);
+	mu_assert (!tsv_read (result, 0, sector_size * sector_count), "tsv_read should succeed in test_discard.");
+	mu_assert (!memcmp (result, model, sector_size * sector_count), "A new volume should read as zeros.");
+	mu_assert (g_read_count <= 4, "Discarded Sectors should not be read from storage.");
+
+	g_discard_count = 0;
+	srand (3);
+
+	for (int i = 0; i < 400; ++i)
+	{
+		uint64_t offset = (uint64_t)rand () % (sector_size * sector_count);
+		uint64_t len = (uint64_t)rand () % (8 * sector_size);
+
+		if (len > sector_size * sector_count - offset)
+			len = sector_size * sector_count - offset;
+
+		if (i % 3 == 2)
+		{
+			discard_model (model, sector_size, offset, len);
+			mu_assert (!tsv_discard (offset, len), "tsv_discard should succeed.");
+		}
+		else
+		{
+			tsv_read_urandom (buf, len);
+			memmove (model + offset, buf, len);
+			mu_assert (!tsv_write (offset, buf, len), "tsv_write should succeed in test_discard.");
+		}
+	}
+
+	mu_assert (g_discard_count > 0, "Discards should be passed on to the platform.");
+	mu_assert (tsv_discard (sector_size * sector_count, sector_size) == -1, "tsv_discard should fail past the end.");
+
+	/* Discards in a batch are not passed on */
+	mu_assert (!tsv_batch_begin (), "tsv_batch_begin should succeed.");
+	g_discard_count = 0;
+	discard_model (model, sector_size, 2 * sector_size - 24, 19 * sector_size + 100);
+	mu_assert (!tsv_discard (2 * sector_size - 24, 19 * sector_size + 100), "tsv_discard should succeed in a batch.");
+	mu_assert (!tsv_write (5 * sector_size + 440, model + 5 * sector_size + 440, 100), "tsv_write should succeed in a batch.");
+	mu_assert (g_discard_count == 0, "Discards in a batch should wait for its commit.");
+	mu_assert (!tsv_batch_end (), "tsv_batch_end should succeed.");
+
+	/* Sectors 2-20, less Sector 5 which was written since, from each copy */
+	mu_assert (g_discard_count == 4, "Discards in a batch should be passed on at its commit.");
+
+	/* The bitmap Sector's second copy must not be taken from the data written */
+	tsv_read_urandom (model, 2 * sector_size);
+	mu_assert (!tsv_write (0, model, 2 * sector_size), "tsv_write should succeed in test_discard.");
+
+	memset (result, 0xAA, sector_size * sector_count);
+	mu_assert (!tsv_read (result, 0, sector_size * sector_count), "tsv_read should succeed in test_discard.");
+	mu_assert (!memcmp (result, model, sector_size * sector_count), "tsv_read should match writes and discards.");
+
+	/* Reopen, then check each copy on its own */
+	mu_assert (!tsv_close (), "tsv_close should succeed in test_discard.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_discard.");
+
+	memmove (snapshot, g_ramdisk, physical_len);
+	memset (g_ramdisk + sector_size + mac_table_len + sector_size * physical_count, 0, mac_table_len + sector_size * physical_count);
+	mu_assert (!tsv_read (result, 0, sector_size * sector_count) && !memcmp (result, model, sector_size * sector_count), "First copy should hold data and bitmap.");
+	tsv_close ();
+	memmove (g_ramdisk, snapshot, physical_len);
+	memset (g_ramdisk + sector_size, 0, mac_table_len + sector_size * physical_count);
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_discard.");
+	mu_assert (!tsv_read (result, 0, sector_size * sector_count) && !memcmp (result, model, sector_size * sector_count), "Second copy should hold data and bitmap.");
+	tsv_close ();
+	memmove (g_ramdisk, snapshot, physical_len);
+
+	/* New Sectors start out discarded */
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_discard.");
+	mu_assert (!tsv_grow (grown_count), "tsv_grow should succeed with TSV_FEATURE_DISCARD.");
+	mu_assert (tsv_get_size () == volume_len, "tsv_grow should not count bitmap Sectors.");
+	tsv_read_urandom (model + volume_len - 3000, 3000);
+	mu_assert (!tsv_write (volume_len - 3000, model + volume_len - 3000, 3000), "tsv_write should succeed after a grow.");
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	mu_assert (!tsv_rekey (mac_key, encryption_key), "tsv_rekey should skip discarded Sectors.");
+	mu_assert (!tsv_close (), "tsv_close should succeed in test_discard.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_discard.");
+
+	memset (result, 0xAA, volume_len);
+	mu_assert (!tsv_read (result, 0, volume_len), "tsv_read should succeed in test_discard.");
+	mu_assert (!memcmp (result, model, volume_len), "Contents should survive a grow and rekey.");
+
+	free (model);
+	free (result);
+	free (snapshot);
+	free (buf);
+
+	return 0;
+}
+
+
+START_TEST (test_discard0)
+{
+	return for_each_sector_size (_test_discard0);
+}
+END_TEST
+
+
+/* Writing a discarded Sector clears its bit only once the data is durable: a crash that loses the data
+ * leaves the Sector reading as zeros, not as an error or what was there before the discard.
+ */
+static char *_test_discard1 (uint32_t sector_size)
+{
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint32_t sector_count = 100, physical_count = 101;
+	size_t mac_table_len = (32 * physical_count + sector_size - 1) / sector_size * sector_size;
+	size_t physical_len = tsv_physical_size_ex (sector_size, sector_count, TSV_FEATURE_DISCARD);
+	uint8_t data[4096], zeros[4096] = {0}, result[4096];
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_close ();
+
+	new_ramdisk (physical_len);
+	mu_assert (!tsv_create_ex (mac_key, encryption_key, sector_size, sector_count, TSV_FEATURE_DISCARD), "tsv_create_ex should succeed.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_discard.");
+	tsv_read_urandom (data, sector_size);
+	mu_assert (!tsv_write (sector_size * 50, data, sector_size), "tsv_write should succeed in test_discard.");
+	mu_assert (!tsv_discard (sector_size * 50, sector_size), "tsv_discard should succeed in test_discard.");
+
+	/* User Sector 50 is on-disk Sector 51; its first copy is written first, and lost */
+	g_crash_image = malloc (physical_len);
+	g_crashed = 0;
+	g_drop_offset = sector_size + mac_table_len + sector_size * 51;
+	g_drop_len = sector_size;
+	tsv_read_urandom (data, sector_size);
+	mu_assert (!tsv_write (sector_size * 50, data, sector_size), "tsv_write should succeed in test_discard.");
+	mu_assert (g_crashed == 2, "The write of the data should have been lost.");
+	tsv_close ();
+
+	memmove (g_ramdisk, g_crash_image, physical_len);
+	free (g_crash_image);
+	g_crash_image = NULL;
+	g_crashed = 0;
+
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed after a crash.");
+	mu_assert (!tsv_read (result, sector_size * 50, sector_size), "A Sector whose write was lost should still read.");
+	mu_assert (!memcmp (result, zeros, sector_size), "A Sector whose write was lost should still read as discarded.");
+
+	/* Deferred discards wait for a commit, which a full queue of them forces */
+	for (uint32_t i = 0; i < 20; ++i)
+		mu_assert (!tsv_write (sector_size * i, data, sector_size), "tsv_write should succeed in test_discard.");
+
+	mu_assert (!tsv_set_deferred (1), "tsv_set_deferred should succeed.");
+	g_discard_count = 0;
+
+	for (uint32_t i = 0; i < 8; ++i)
+		mu_assert (!tsv_discard (sector_size * 2 * i, sector_size), "tsv_discard should succeed in deferred mode.");
+
+	mu_assert (g_discard_count == 0, "Deferred discards should wait for a commit.");
+	mu_assert (!tsv_discard (sector_size * 16, sector_size) && !tsv_discard (sector_size * 18, sector_size), "tsv_discard should succeed in deferred mode.");
+	mu_assert (g_discard_count == 2 * 8, "A full queue of discards should be committed and passed on.");
+	mu_assert (!tsv_flush (), "tsv_flush should succeed in deferred mode.");
+	mu_assert (g_discard_count == 2 * 10, "tsv_flush should pass on the rest.");
+	tsv_close ();
+
+	return 0;
+}
+
+
+START_TEST (test_discard1)
+{
+	return for_each_sector_size (_test_discard1);
+}
+END_TEST
+
+
+char *test_discard (void)
+{
+	mu_run_test (test_discard0);
+	mu_run_test (test_discard1);
+
+	return 0;
+}
@@ -0,0 +1,198 @@
+#include <stdlib.h>
+#include <string.h>
+#include <minunit.h>
+#include <titan-secure-volume/titan-secure-volume.h>
+#include <titan-secure-volume/app.h>
+
+
+void new_ramdisk (size_t len);
+int sector_size_skipped (uint32_t sector_size);
+extern uint8_t *g_ramdisk;
+
+
+/* Grows a volume step by step, checking it stays readable and read-only, then that the
+ * old contents survive and the new layout is complete in both copies.
+ */
+START_TEST (test_grow0)
+{
+	if (sector_size_skipped (512))
+		return 0;
+
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint32_t const counts[][2] = {{64, 300}, {60, 64}};
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+
+	for (size_t c = 0; c < sizeof (counts) / sizeof (counts[0]); ++c)
+	{
+		uint32_t old_count = counts[c][0];
+		uint32_t new_count = counts[c][1];
+		size_t old_len = 512 * old_count;
+		size_t new_len = 512 * new_count;
+		size_t mac_table_len = (32 * new_count + 511) / 512 * 512;
+		uint8_t *real_copy = malloc (new_len);
+		uint8_t *result = malloc (new_len);
+		int ret;
+
+		tsv_close ();
+		new_ramdisk (tsv_physical_size (512, new_count));
+		mu_assert (!tsv_create (mac_key, encryption_key, 512, old_count), "tsv_create should succeed in test_grow.");
+		mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_grow.");
+
+		tsv_read_urandom (real_copy, new_len);
+		mu_assert (!tsv_write (0, real_copy, old_len), "tsv_write should succeed in test_grow.");
+
+		mu_assert (tsv_grow_begin (old_count - 1) == -1, "tsv_grow_begin should not shrink.");
+		mu_assert (!tsv_grow_begin (new_count), "tsv_grow_begin should succeed.");
+		mu_assert (tsv_grow_begin (new_count + 1) == -1, "tsv_grow_begin should refuse a different target mid-grow.");
+
+		do {
+			ret = tsv_grow_step (4096);
+			mu_assert (ret >= 0, "tsv_grow_step should succeed.");
+
+			memset (result, 0, old_len);
+			mu_assert (!tsv_read (result, 0, old_len), "tsv_read should succeed during a grow.");
+			mu_assert (!memcmp (result, real_copy, old_len), "Contents should not change during a grow.");
+
+			if (ret)
+			{
+				mu_assert (tsv_write (0, real_copy, 512) == -1, "tsv_write should fail during a grow.");
+				mu_assert (tsv_get_size () == old_len, "Size should not change until the grow finishes.");
+			}
+		} while (ret);
+
+		mu_assert (tsv_get_size () == new_len, "Size should change once the grow finishes.");
+		mu_assert (tsv_grow_step (4096) == 0, "tsv_grow_step should have nothing left to do.");
+
+		mu_assert (!tsv_read (result, 0, old_len), "tsv_read should succeed after a grow.");
+		mu_assert (!memcmp (result, real_copy, old_len), "Contents should survive a grow.");
+		mu_assert (!tsv_read (result, old_len, new_len - old_len), "New sectors should be readable.");
+		mu_assert (!tsv_write (old_len, real_copy + old_len, new_len - old_len), "New sectors should be writable.");
+
+		/* Reopen, then check each copy on its own */
+		mu_assert (!tsv_close (), "tsv_close should succeed in test_grow.");
+		mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed after a grow.");
+		mu_assert (tsv_get_size () == new_len, "Grown size should persist.");
+
+		memset (g_ramdisk + 512 + mac_table_len + new_len, 0, mac_table_len + new_len);
+		memset (result, 0, new_len);
+		mu_assert (!tsv_read (result, 0, new_len) && !memcmp (result, real_copy, new_len), "First copy should be complete after a grow.");
+
+		mu_assert (!tsv_write (0, real_copy, new_len), "tsv_write should succeed in test_grow.");
+		memset (g_ramdisk + 512, 0, mac_table_len + new_len);
+		memset (result, 0, new_len);
+		mu_assert (!tsv_read (result, 0, new_len) && !memcmp (result, real_copy, new_len), "Second copy should be complete after a grow.");
+
+		free (real_copy);
+		free (result);
+	}
+
+	/* Sectors too small to hold the progress record */
+	if (sector_size_skipped (128))
+		return 0;
+
+	tsv_close ();
+	new_ramdisk (tsv_physical_size (128, 64));
+	mu_assert (!tsv_create (mac_key, encryption_key, 128, 32), "tsv_create should succeed in test_grow.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_grow.");
+	mu_assert (tsv_grow (64) == -1, "tsv_grow should fail with 128 byte sectors.");
+	mu_assert (tsv_grow (32) == 0, "tsv_grow to the same size should do nothing.");
+}
+END_TEST
+
+
+/* Interrupts a grow after each step with a torn write, then reopens and finishes it. */
+START_TEST (test_grow1)
+{
+	if (sector_size_skipped (512))
+		return 0;
+
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint32_t old_count = 64, new_count = 300;
+	size_t old_len = 512 * old_count;
+	size_t new_len = 512 * new_count;
+	size_t mac_table_len = (32 * new_count + 511) / 512 * 512;
+	size_t physical_len = tsv_physical_size (512, new_count);
+	uint8_t *real_copy = malloc (old_len);
+	uint8_t *result = malloc (new_len);
+	uint8_t *snapshot = malloc (physical_len);
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	srand (1);
+
+	for (unsigned int crash = 0; ; ++crash)
+	{
+		unsigned int steps = 0;
+
+		tsv_close ();
+		new_ramdisk (physical_len);
+		mu_assert (!tsv_create (mac_key, encryption_key, 512, old_count), "tsv_create should succeed in test_grow.");
+		mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_grow.");
+		tsv_read_urandom (real_copy, old_len);
+		mu_assert (!tsv_write (0, real_copy, old_len), "tsv_write should succeed in test_grow.");
+
+		mu_assert (!tsv_grow_begin (new_count), "tsv_grow_begin should succeed.");
+
+		for (; steps < crash; ++steps)
+			mu_assert (tsv_grow_step (4096) == 1, "tsv_grow_step should succeed.");
+
+		/* Tear the next step: undo a random part of what it wrote, except for the header Sector */
+		memmove (snapshot, g_ramdisk, physical_len);
+		int ret = tsv_grow_step (4096);
+		mu_assert (ret >= 0, "tsv_grow_step should succeed.");
+
+		for (size_t i = 512; i < physical_len; i += 64)
+		{
+			if (rand () & 1)
+				memmove (g_ramdisk + i, snapshot + i, 64);
+		}
+
+		tsv_close ();
+		mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed after an interrupted grow.");
+
+		if (ret)
+		{
+			mu_assert (tsv_get_size () == old_len, "An interrupted grow should not change the size.");
+			mu_assert (tsv_write (0, real_copy, 512) == -1, "An interrupted grow should resume read-only.");
+			mu_assert (!tsv_read (result, 0, old_len) && !memcmp (result, real_copy, old_len), "Contents should be readable after an interrupted grow.");
+		}
+
+		mu_assert (!tsv_grow (new_count), "tsv_grow should finish an interrupted grow.");
+		mu_assert (tsv_get_size () == new_len, "Size should change once the grow finishes.");
+		mu_assert (!tsv_read (result, 0, new_len), "tsv_read should succeed after an interrupted grow.");
+		mu_assert (!memcmp (result, real_copy, old_len), "Contents should survive an interrupted grow.");
+
+		tsv_close ();
+		mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed after an interrupted grow.");
+
+		/* Both copies must have survived */
+		memmove (snapshot, g_ramdisk, physical_len);
+		memset (g_ramdisk + 512 + mac_table_len + new_len, 0, mac_table_len + new_len);
+		mu_assert (!tsv_read (result, 0, old_len) && !memcmp (result, real_copy, old_len), "First copy should survive an interrupted grow.");
+		memmove (g_ramdisk, snapshot, physical_len);
+		memset (g_ramdisk + 512, 0, mac_table_len + new_len);
+		mu_assert (!tsv_read (result, 0, old_len) && !memcmp (result, real_copy, old_len), "Second copy should survive an interrupted grow.");
+
+		/* The torn step was the last one */
+		if (ret == 0)
+			break;
+	}
+
+	free (real_copy);
+	free (result);
+	free (snapshot);
+}
+END_TEST
+
+
+char *test_grow (void)
+{
+	mu_run_test (test_grow0);
+	mu_run_test (test_grow1);
+
+	return 0;
+}
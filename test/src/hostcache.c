@@ -0,0 +1,202 @@
+#include <stdlib.h>
+#include <string.h>
+#include <minunit.h>
+#include <titan-secure-volume/titan-secure-volume.h>
+#include <titan-secure-volume/app.h>
+
+
+void new_ramdisk (size_t len);
+int sector_size_skipped (uint32_t sector_size);
+extern uint8_t *g_ramdisk;
+extern size_t g_ramdisk_len;
+extern unsigned int g_read_count;
+
+
+/* A second reader attached to the same host cache reads nothing for Sectors the first already read, and
+ * nothing is ever written.
+ */
+START_TEST (test_hostcache0)
+{
+	if (sector_size_skipped (512))
+		return 0;
+
+	uint8_t mac_key[TSV_MAC_KEY_SIZE], other_mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint32_t sector_count = 64;
+	size_t volume_len = 512 * sector_count;
+	size_t cache_len = tsv_host_cache_size (512, 2 * sector_count);   /* Room for the bitmap Sector too */
+	uint8_t *cache = calloc (1, cache_len);
+	uint8_t *model = malloc (volume_len);
+	uint8_t *result = malloc (volume_len);
+	uint8_t *before = NULL;
+	TSV_IOVEC iov = {.base = model, .len = 512};
+	unsigned int reads;
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_read_urandom (model, volume_len);
+	tsv_close ();
+
+	new_ramdisk (tsv_physical_size_ex (512, sector_count, TSV_FEATURE_DISCARD));
+	mu_assert (!tsv_create_ex (mac_key, encryption_key, 512, sector_count, TSV_FEATURE_DISCARD), "tsv_create_ex should succeed in test_hostcache.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_hostcache.");
+	mu_assert (!tsv_write (0, model, volume_len), "tsv_write should succeed in test_hostcache.");
+	mu_assert (!tsv_close (), "tsv_close should succeed in test_hostcache.");
+
+	before = malloc (g_ramdisk_len);
+	memmove (before, g_ramdisk, g_ramdisk_len);
+
+	/* The first reader fills the cache */
+	mu_assert (!tsv_open_readonly (mac_key, encryption_key, cache, cache_len), "tsv_open_readonly should succeed with a new host cache.");
+	mu_assert (!tsv_read (result, 0, volume_len) && !memcmp (result, model, volume_len), "tsv_read should succeed on a read-only volume.");
+
+	/* Nothing can be written */
+	mu_assert (tsv_write (0, model, 512), "tsv_write should fail on a read-only volume.");
+	mu_assert (tsv_writev (0, &iov, 1), "tsv_writev should fail on a read-only volume.");
+	mu_assert (tsv_discard (0, 512), "tsv_discard should fail on a read-only volume.");
+	mu_assert (tsv_grow (2 * sector_count), "tsv_grow should fail on a read-only volume.");
+	mu_assert (tsv_rekey (mac_key, encryption_key), "tsv_rekey should fail on a read-only volume.");
+	mu_assert (!tsv_close (), "tsv_close should succeed on a read-only volume.");
+
+	/* The second is served from it */
+	mu_assert (!tsv_open_readonly (mac_key, encryption_key, cache, cache_len), "tsv_open_readonly should attach to a host cache.");
+	reads = g_read_count;
+	mu_assert (!tsv_read (result, 0, volume_len) && !memcmp (result, model, volume_len), "tsv_read should succeed from a host cache.");
+	mu_assert (g_read_count == reads, "Sectors in the host cache should not be read again.");
+	mu_assert (!tsv_close (), "tsv_close should succeed on a read-only volume.");
+	mu_assert (!memcmp (before, g_ramdisk, g_ramdisk_len), "A read-only volume should never be written.");
+
+	/* Other keys, or memory that does not suit, cannot attach */
+	memmove (other_mac_key, mac_key, sizeof (other_mac_key));
+	other_mac_key[0] ^= 1;
+	mu_assert (tsv_open_readonly (other_mac_key, encryption_key, cache, cache_len), "tsv_open_readonly should fail with the wrong keys.");
+	mu_assert (tsv_open_readonly (mac_key, encryption_key, cache + 1, cache_len - 8), "tsv_open_readonly should fail with an unaligned host cache.");
+	mu_assert (tsv_open_readonly (mac_key, encryption_key, cache, 100), "tsv_open_readonly should fail with a tiny host cache.");
+
+	new_ramdisk (tsv_physical_size (512, sector_count));
+	mu_assert (!tsv_create (mac_key, encryption_key, 512, sector_count), "tsv_create should succeed in test_hostcache.");
+	mu_assert (tsv_open_readonly (mac_key, encryption_key, cache, cache_len), "tsv_open_readonly should fail with another volume's host cache.");
+	mu_assert (!tsv_open_readonly (mac_key, encryption_key, NULL, 0), "tsv_open_readonly should succeed without a host cache.");
+	mu_assert (!tsv_close (), "tsv_close should succeed on a read-only volume.");
+
+	free (cache);
+	free (model);
+	free (result);
+	free (before);
+}
+END_TEST
+
+
+/* A host cache smaller than the volume, behind an arena with a Sector cache and staging, under random
+ * reads.
+ */
+START_TEST (test_hostcache1)
+{
+	if (sector_size_skipped (512))
+		return 0;
+
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint32_t sector_count = 200;
+	size_t volume_len = 512 * sector_count;
+	TSV_CONFIG config = {.max_sector_size = 512, .cache_sectors = 4, .mac_pages = 2, .staging_size = 16 * 1024};
+	size_t arena_len = tsv_arena_size (&config);
+	uint8_t *arena = malloc (arena_len);
+	size_t cache_len = tsv_host_cache_size (512, 37);
+	uint8_t *cache = calloc (1, cache_len);
+	uint8_t *model = malloc (volume_len);
+	uint8_t buf[8 * 512];
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_read_urandom (model, volume_len);
+	tsv_close ();
+	srand (5);
+
+	new_ramdisk (tsv_physical_size (512, sector_count));
+	mu_assert (!tsv_create (mac_key, encryption_key, 512, sector_count), "tsv_create should succeed in test_hostcache.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_hostcache.");
+	mu_assert (!tsv_write (0, model, volume_len), "tsv_write should succeed in test_hostcache.");
+	mu_assert (!tsv_close (), "tsv_close should succeed in test_hostcache.");
+
+	mu_assert (!tsv_init (arena, arena_len, &config), "tsv_init should succeed in test_hostcache.");
+
+	for (int round = 0; round < 2; ++round)
+	{
+		mu_assert (!tsv_open_readonly (mac_key, encryption_key, cache, cache_len), "tsv_open_readonly should succeed with a host cache.");
+
+		for (int i = 0; i < 300; ++i)
+		{
+			size_t len = 1 + (size_t)rand () % sizeof (buf);
+			uint64_t offset = (uint64_t)rand () % (volume_len - len);
+
+			/* Mostly whole Sectors, so runs are staged */
+			if (i % 3)
+			{
+				offset &= ~(uint64_t)511;
+				len = (len + 511) & ~(size_t)511;
+			}
+
+			mu_assert (!tsv_read (buf, offset, len) && !memcmp (buf, model + offset, len), "Reads should match through a host cache.");
+		}
+
+		mu_assert (!tsv_close (), "tsv_close should succeed on a read-only volume.");
+	}
+
+	mu_assert (!tsv_init (NULL, 0, NULL), "tsv_init should go back to the default arena.");
+
+	free (arena);
+	free (cache);
+	free (model);
+}
+END_TEST
+
+
+/* A volume left by a crash must be opened read-write first. */
+START_TEST (test_hostcache2)
+{
+	if (sector_size_skipped (512))
+		return 0;
+
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint32_t sector_count = 64;
+	uint8_t buf[512];
+	uint8_t *snapshot = NULL;
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_read_urandom (buf, sizeof (buf));
+	tsv_close ();
+
+	new_ramdisk (tsv_physical_size_ex (512, sector_count, TSV_FEATURE_INTENT));
+	mu_assert (!tsv_create_ex (mac_key, encryption_key, 512, sector_count, TSV_FEATURE_INTENT), "tsv_create_ex should succeed in test_hostcache.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_hostcache.");
+	mu_assert (!tsv_set_deferred (1), "tsv_set_deferred should succeed in test_hostcache.");
+	mu_assert (!tsv_write (3 * 512, buf, sizeof (buf)), "tsv_write should succeed in test_hostcache.");
+
+	/* Crash with the write half done */
+	snapshot = malloc (g_ramdisk_len);
+	memmove (snapshot, g_ramdisk, g_ramdisk_len);
+	mu_assert (!tsv_close (), "tsv_close should succeed in test_hostcache.");
+	memmove (g_ramdisk, snapshot, g_ramdisk_len);
+
+	mu_assert (tsv_open_readonly (mac_key, encryption_key, NULL, 0), "tsv_open_readonly should fail after a crash.");
+	mu_assert (!memcmp (snapshot, g_ramdisk, g_ramdisk_len), "A failed read-only open should not write anything.");
+	mu_assert (!tsv_open (mac_key, encryption_key) && !tsv_close (), "tsv_open should recover after a crash.");
+	mu_assert (!tsv_open_readonly (mac_key, encryption_key, NULL, 0), "tsv_open_readonly should succeed once recovered.");
+	mu_assert (!tsv_close (), "tsv_close should succeed on a read-only volume.");
+
+	free (snapshot);
+}
+END_TEST
+
+
+char *test_hostcache (void)
+{
+	mu_run_test (test_hostcache0);
+	mu_run_test (test_hostcache1);
+	mu_run_test (test_hostcache2);
+
+	return 0;
+}
@@ -0,0 +1,155 @@
+#include <stdlib.h>
+#include <string.h>
+#include <minunit.h>
+#include <titan-secure-volume/titan-secure-volume.h>
+#include <titan-secure-volume/app.h>
+
+
+void new_ramdisk (size_t len);
+int sector_size_skipped (uint32_t sector_size);
+extern uint8_t *g_ramdisk;
+extern size_t g_ramdisk_len;
+extern unsigned int g_sync_count;
+extern unsigned int g_read_count;
+
+
+/* A crash with writes in flight only costs reading the regions being written, and leaves the copies
+ * agreeing, with the first copy winning.  A record torn by the crash costs reading everything.
+ */
+START_TEST (test_intent0)
+{
+	if (sector_size_skipped (512))
+		return 0;
+
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint32_t sector_count = 20000;
+	size_t volume_len = 512 * (size_t)sector_count;
+	size_t mac_table_len = (32 * (size_t)sector_count + 511) / 512 * 512;
+	uint8_t *model = malloc (volume_len);
+	uint8_t *snapshot = NULL;
+	uint8_t buf[4 * 512], result[4 * 512];
+	unsigned int reads, clean;
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_read_urandom (model, volume_len);
+	tsv_close ();
+
+	new_ramdisk (tsv_physical_size_ex (512, sector_count, TSV_FEATURE_INTENT));
+	mu_assert (!tsv_create_ex (mac_key, encryption_key, 512, sector_count, TSV_FEATURE_INTENT), "tsv_create_ex should succeed in test_intent.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_intent.");
+	mu_assert (!tsv_write (0, model, volume_len), "tsv_write should succeed in test_intent.");
+	mu_assert (!tsv_close (), "tsv_close should succeed in test_intent.");
+
+	/* After a clean close there is nothing to check */
+	reads = g_read_count;
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_intent.");
+	clean = g_read_count - reads;
+	mu_assert (clean <= 4, "tsv_open after a clean close should not read any Sectors.");
+
+	/* Whole Sectors write the first copy first, partial ones the second */
+	tsv_read_urandom (buf, sizeof (buf));
+	mu_assert (!tsv_set_deferred (1), "tsv_set_deferred should succeed in test_intent.");
+	mu_assert (!tsv_write (100 * 512, buf, sizeof (buf)), "tsv_write should succeed in test_intent.");
+	mu_assert (!tsv_write (15000 * 512 + 7, buf, 100), "tsv_write should succeed in test_intent.");
+	memmove (model + 100 * 512, buf, sizeof (buf));
+
+	/* Crash with both writes half done */
+	snapshot = malloc (g_ramdisk_len);
+	memmove (snapshot, g_ramdisk, g_ramdisk_len);
+	mu_assert (!tsv_close (), "tsv_close should succeed in test_intent.");
+	memmove (g_ramdisk, snapshot, g_ramdisk_len);
+
+	reads = g_read_count;
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed after a crash.");
+	mu_assert (g_read_count - reads < 100, "tsv_open should only check the regions being written.");
+
+	/* With the first copies damaged, the second copies must say the same */
+	uint8_t *data_a = g_ramdisk + 512 + mac_table_len;
+
+	for (uint32_t i = 100; i < 104; ++i)
+		data_a[i * 512] ^= 1;
+
+	data_a[15000 * 512] ^= 1;
+	mu_assert (!tsv_read (result, 100 * 512, sizeof (result)) && !memcmp (result, buf, sizeof (result)), "The written copy should have been carried over.");
+	mu_assert (!tsv_read (result, 15000 * 512, 512) && !memcmp (result, model + 15000 * 512, 512), "The first copy should have won.");
+	mu_assert (!tsv_close (), "tsv_close should succeed in test_intent.");
+
+	reads = g_read_count;
+	mu_assert (!tsv_open (mac_key, encryption_key) && g_read_count - reads == clean, "Reconciling should clear the record.");
+
+	/* Crash with a write half done, and the record torn: every region must be checked */
+	mu_assert (!tsv_write (7000 * 512, buf, 512), "tsv_write should succeed in test_intent.");
+	memmove (snapshot, g_ramdisk, g_ramdisk_len);
+	mu_assert (!tsv_close (), "tsv_close should succeed in test_intent.");
+	memmove (g_ramdisk, snapshot, g_ramdisk_len);
+	g_ramdisk[64 + 32 + 64 + 32 + 5] ^= 1;
+
+	reads = g_read_count;
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed after a torn record.");
+	mu_assert (g_read_count - reads > sector_count, "A torn record should reconcile every region.");
+	data_a[7000 * 512] ^= 1;
+	mu_assert (!tsv_read (result, 7000 * 512, 512) && !memcmp (result, buf, 512), "The written copy should have been carried over.");
+	mu_assert (!tsv_close (), "tsv_close should succeed in test_intent.");
+
+	reads = g_read_count;
+	mu_assert (!tsv_open (mac_key, encryption_key) && g_read_count - reads == clean, "Reconciling should rewrite the torn record.");
+	mu_assert (!tsv_close (), "tsv_close should succeed in test_intent.");
+
+	free (snapshot);
+	free (model);
+}
+END_TEST
+
+
+/* A region is marked with one barrier, stays marked while it is busy, and is cleared lazily. */
+START_TEST (test_intent1)
+{
+	if (sector_size_skipped (512))
+		return 0;
+
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint8_t buf[512];
+	unsigned int syncs;
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_read_urandom (buf, sizeof (buf));
+	tsv_close ();
+
+	mu_assert (tsv_create_ex (mac_key, encryption_key, 256, 64, TSV_FEATURE_INTENT) == -1, "The record should need room in the header Sector.");
+	mu_assert (tsv_create_ex (mac_key, encryption_key, 512, 64, TSV_FEATURE_INTENT | TSV_FEATURE_PARITY) == -1, "Parity volumes should not take a write-intent record.");
+
+	new_ramdisk (tsv_physical_size_ex (512, 64, TSV_FEATURE_INTENT));
+	mu_assert (!tsv_create_ex (mac_key, encryption_key, 512, 64, TSV_FEATURE_INTENT), "tsv_create_ex should succeed in test_intent.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_intent.");
+
+	syncs = g_sync_count;
+	mu_assert (!tsv_write (0, buf, sizeof (buf)), "tsv_write should succeed in test_intent.");
+	mu_assert (g_sync_count - syncs == 3, "The first write to a region should add one barrier.");
+
+	syncs = g_sync_count;
+	mu_assert (!tsv_write (0, buf, sizeof (buf)), "tsv_write should succeed in test_intent.");
+	mu_assert (g_sync_count - syncs == 2, "A marked region should not be marked again.");
+
+	/* Two rounds of commits elsewhere clear it */
+	for (int i = 0; i < 128; ++i)
+		mu_assert (!tsv_write (40 * 512, buf, sizeof (buf)), "tsv_write should succeed in test_intent.");
+
+	syncs = g_sync_count;
+	mu_assert (!tsv_write (0, buf, sizeof (buf)), "tsv_write should succeed in test_intent.");
+	mu_assert (g_sync_count - syncs == 3, "An idle region should be cleared lazily.");
+	mu_assert (!tsv_close (), "tsv_close should succeed in test_intent.");
+}
+END_TEST
+
+
+char *test_intent (void)
+{
+	mu_run_test (test_intent0);
+	mu_run_test (test_intent1);
+
+	return 0;
+}
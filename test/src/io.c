@@ -0,0 +1,164 @@
+#include <stdlib.h>
+#include <string.h>
+#include <minunit.h>
+#include <titan-secure-volume/titan-secure-volume.h>
+#include <titan-secure-volume/app.h>
+
+
+void new_ramdisk (size_t len);
+int sector_size_skipped (uint32_t sector_size);
+extern uint8_t *g_ramdisk;
+extern size_t g_ramdisk_len;
+extern unsigned int g_write_count;
+extern unsigned int g_sync_count;
+
+
+/* Writes between two barriers reach storage sorted and merged, and reads see queued writes. */
+START_TEST (test_io0)
+{
+	if (sector_size_skipped (512))
+		return 0;
+
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint32_t sector_count = 64;
+	size_t volume_len = 512 * sector_count;
+	TSV_CONFIG config = {.max_sector_size = 512, .io_queue_size = 64 * 1024};
+	size_t arena_len = tsv_arena_size (&config);
+	uint8_t *arena = malloc (arena_len);
+	uint8_t *model = malloc (volume_len);
+	uint8_t *result = malloc (volume_len);
+	uint8_t *before = malloc (tsv_physical_size (512, sector_count));
+	unsigned int writes, syncs;
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_read_urandom (model, volume_len);
+	tsv_close ();
+
+	mu_assert (!tsv_init (arena, arena_len, &config), "tsv_init should succeed with an I/O queue.");
+	new_ramdisk (tsv_physical_size (512, sector_count));
+	mu_assert (!tsv_create (mac_key, encryption_key, 512, sector_count), "tsv_create should succeed with an I/O queue.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed with an I/O queue.");
+
+	/* 16 Sectors and their tags, in each copy, as one run of data and one of tags */
+	writes = g_write_count;
+	syncs = g_sync_count;
+	mu_assert (!tsv_write (0, model, 16 * 512), "tsv_write should succeed with an I/O queue.");
+	mu_assert (g_write_count - writes == 4 && g_sync_count - syncs == 2, "Adjacent writes should be merged between barriers.");
+
+	/* A deferred write is held back, but reads see it */
+	mu_assert (!tsv_write (16 * 512, model + 16 * 512, volume_len - 16 * 512), "tsv_write should succeed with an I/O queue.");
+	mu_assert (!tsv_set_deferred (1), "tsv_set_deferred should succeed with an I/O queue.");
+	tsv_read_urandom (model + 20 * 512 + 100, 1000);
+	memmove (before, g_ramdisk, g_ramdisk_len);
+	writes = g_write_count;
+	mu_assert (!tsv_write (20 * 512 + 100, model + 20 * 512 + 100, 1000), "tsv_write should succeed with an I/O queue.");
+	mu_assert (!tsv_write (20 * 512 + 100, model + 20 * 512 + 100, 1000), "tsv_write should succeed with an I/O queue.");
+	mu_assert (g_write_count == writes && !memcmp (before, g_ramdisk, g_ramdisk_len), "Deferred writes should wait in the queue.");
+	mu_assert (!tsv_read (result, 0, volume_len) && !memcmp (result, model, volume_len), "Reads should see queued writes.");
+
+	/* tsv_flush hands everything to storage, and both copies are complete */
+	mu_assert (!tsv_flush (), "tsv_flush should succeed with an I/O queue.");
+	mu_assert (!tsv_close (), "tsv_close should succeed with an I/O queue.");
+
+	size_t copy_len = (g_ramdisk_len - 512) / 2;
+
+	memmove (before, g_ramdisk, g_ramdisk_len);
+	memset (g_ramdisk + 512, 0, copy_len);
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed with an I/O queue.");
+	mu_assert (!tsv_read (result, 0, volume_len) && !memcmp (result, model, volume_len), "The second copy should be complete.");
+	mu_assert (!tsv_close (), "tsv_close should succeed with an I/O queue.");
+	memmove (g_ramdisk, before, g_ramdisk_len);
+	memset (g_ramdisk + 512 + copy_len, 0, copy_len);
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed with an I/O queue.");
+	mu_assert (!tsv_read (result, 0, volume_len) && !memcmp (result, model, volume_len), "The first copy should be complete.");
+	mu_assert (!tsv_close (), "tsv_close should succeed with an I/O queue.");
+
+	mu_assert (!tsv_init (NULL, 0, NULL), "tsv_init should go back to the default arena.");
+
+	free (arena);
+	free (model);
+	free (result);
+	free (before);
+}
+END_TEST
+
+
+/* A small queue flushes whenever it fills, under random partial writes, batches and discards. */
+START_TEST (test_io1)
+{
+	if (sector_size_skipped (512))
+		return 0;
+
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint32_t sector_count = 200;
+	size_t volume_len = 512 * sector_count;
+	TSV_CONFIG config = {.max_sector_size = 512, .features = TSV_FEATURE_DISCARD, .cache_sectors = 8, .mac_pages = 2, .io_queue_size = 2048};
+	size_t arena_len = tsv_arena_size (&config);
+	uint8_t *arena = malloc (arena_len);
+	uint8_t *model = calloc (1, volume_len);
+	uint8_t *result = malloc (volume_len);
+	uint8_t buf[3000];
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_close ();
+	srand (3);
+
+	mu_assert (!tsv_init (arena, arena_len, &config), "tsv_init should succeed with an I/O queue.");
+	new_ramdisk (tsv_physical_size_ex (512, sector_count, TSV_FEATURE_DISCARD));
+	mu_assert (!tsv_create_ex (mac_key, encryption_key, 512, sector_count, TSV_FEATURE_DISCARD), "tsv_create_ex should succeed with an I/O queue.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed with an I/O queue.");
+	mu_assert (!tsv_discard (0, volume_len), "tsv_discard should succeed with an I/O queue.");
+
+	for (int i = 0; i < 300; ++i)
+	{
+		size_t len = 1 + (size_t)rand () % sizeof (buf);
+		uint64_t offset = (uint64_t)rand () % (volume_len - len);
+
+		if (i % 50 == 0)
+			mu_assert (!tsv_set_deferred (i % 100 == 0), "tsv_set_deferred should succeed with an I/O queue.");
+
+		if (i % 7 == 0)
+		{
+			uint64_t first = (offset + 511) / 512 * 512;
+
+			if (first + 512 <= volume_len)
+			{
+				mu_assert (!tsv_discard (first, 512), "tsv_discard should succeed with an I/O queue.");
+				memset (model + first, 0, 512);
+			}
+
+			continue;
+		}
+
+		tsv_read_urandom (buf, len);
+		mu_assert (!tsv_write (offset, buf, len), "tsv_write should succeed with an I/O queue.");
+		memmove (model + offset, buf, len);
+
+		if (i % 13 == 0)
+			mu_assert (!tsv_read (result, 0, volume_len) && !memcmp (result, model, volume_len), "Reads should match under a small queue.");
+	}
+
+	mu_assert (!tsv_close () && !tsv_open (mac_key, encryption_key), "tsv_open should succeed with an I/O queue.");
+	mu_assert (!tsv_read (result, 0, volume_len) && !memcmp (result, model, volume_len), "Contents should survive reopening.");
+	mu_assert (!tsv_close (), "tsv_close should succeed with an I/O queue.");
+
+	mu_assert (!tsv_init (NULL, 0, NULL), "tsv_init should go back to the default arena.");
+
+	free (arena);
+	free (model);
+	free (result);
+}
+END_TEST
+
+
+char *test_io (void)
+{
+	mu_run_test (test_io0);
+	mu_run_test (test_io1);
+
+	return 0;
+}
@@ -0,0 +1,256 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <minunit.h>
+#include <titan-secure-volume/titan-secure-volume.h>
+#include <titan-secure-volume/app.h>
+
+
+void new_ramdisk (size_t len);
+int sector_size_skipped (uint32_t sector_size);
+extern uint8_t *g_ramdisk;
+extern size_t g_ramdisk_len;
+extern unsigned int g_write_count;
+extern unsigned int g_sync_count;
+
+/* Tail record, then each copy's entry table and slots, for 512 byte Sectors */
+#define LOG_LEN (512 + 2 * (256 * 96 + 256 * 512))
+#define LOG_COPY_LEN (256 * 96 + 256 * 512)
+
+
+/* Random partial writes, discards and cleaning against a model, through several laps of the log. */
+START_TEST (test_log0)
+{
+	if (sector_size_skipped (512))
+		return 0;
+
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint32_t sector_count = 300;
+	uint32_t features[] = {TSV_FEATURE_LOG | TSV_FEATURE_DISCARD, TSV_FEATURE_LOG | TSV_FEATURE_SHARED};
+	size_t volume_len = 512 * sector_count;
+	TSV_CONFIG config = {.max_sector_size = 512, .features = TSV_FEATURE_LOG | TSV_FEATURE_DISCARD | TSV_FEATURE_SHARED, .cache_sectors = 8, .mac_pages = 2, .staging_size = 8 * 1024, .io_queue_size = 16 * 1024};
+	size_t arena_len = tsv_arena_size (&config);
+	uint8_t *arena = malloc (arena_len);
+	uint8_t *model = calloc (1, volume_len);
+	uint8_t *result = malloc (volume_len);
+	uint8_t buf[3000];
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_close ();
+	srand (5);
+
+	mu_assert (!tsv_init (arena, arena_len, &config), "tsv_init should succeed in test_log.");
+
+	for (size_t f = 0; f < sizeof (features) / sizeof (features[0]); ++f)
+	{
+		bool discard = features[f] & TSV_FEATURE_DISCARD;
+
+		new_ramdisk (tsv_physical_size_ex (512, sector_count, features[f]));
+		mu_assert (!tsv_create_ex (mac_key, encryption_key, 512, sector_count, features[f]), "tsv_create_ex should succeed in test_log.");
+		mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_log.");
+		mu_assert (tsv_get_features () == features[f], "tsv_get_features should report the log.");
+
+		if (discard)
+			mu_assert (!tsv_discard (0, volume_len), "tsv_discard should succeed in test_log.");
+		else
+			mu_assert (!tsv_read (model, 0, volume_len), "tsv_read should succeed in test_log.");
+
+		for (int i = 0; i < 1500; ++i)
+		{
+			size_t len = 1 + (size_t)rand () % sizeof (buf);
+			uint64_t offset = (uint64_t)rand () % (volume_len - len);
+
+			if (i % 50 == 0)
+				mu_assert (!tsv_set_deferred (i % 100 == 0), "tsv_set_deferred should succeed in test_log.");
+
+			if (i % 97 == 0)
+				mu_assert (!tsv_log_clean ((uint32_t)rand () % 64), "tsv_log_clean should succeed in test_log.");
+
+			if (discard && i % 7 == 0)
+			{
+				uint64_t first = (offset + 511) / 512 * 512;
+
+				if (first + 512 <= volume_len)
+				{
+					mu_assert (!tsv_discard (first, 512), "tsv_discard should succeed in test_log.");
+					memset (model + first, 0, 512);
+				}
+
+				continue;
+			}
+
+			tsv_read_urandom (buf, len);
+			mu_assert (!tsv_write (offset, buf, len), "tsv_write should succeed in test_log.");
+			memmove (model + offset, buf, len);
+			mu_assert (tsv_log_used () <= 256, "The log should never hold more than its slots.");
+
+			if (i % 101 == 0)
+				mu_assert (!tsv_read (result, 0, volume_len) && !memcmp (result, model, volume_len), "Reads should see the log.");
+		}
+
+		mu_assert (!tsv_close () && !tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_log.");
+		mu_assert (!tsv_read (result, 0, volume_len) && !memcmp (result, model, volume_len), "Contents should survive reopening.");
+
+		/* Once cleaned, the Sectors' own copies hold everything */
+		mu_assert (!tsv_log_clean (256) && tsv_log_used () == 0, "tsv_log_clean should empty the log.");
+		mu_assert (!tsv_close (), "tsv_close should succeed in test_log.");
+		tsv_read_urandom (g_ramdisk + g_ramdisk_len - LOG_LEN, LOG_LEN);
+		mu_assert (!tsv_open (mac_key, encryption_key) && tsv_log_used () == 0, "tsv_open should find an empty log.");
+		mu_assert (!tsv_read (result, 0, volume_len) && !memcmp (result, model, volume_len), "Cleaned Sectors should not need the log.");
+		mu_assert (!tsv_close (), "tsv_close should succeed in test_log.");
+	}
+
+	mu_assert (!tsv_init (NULL, 0, NULL), "tsv_init should go back to the default arena.");
+
+	free (arena);
+	free (model);
+	free (result);
+}
+END_TEST
+
+
+/* Scattered writes reach storage as runs, and a crash keeps a Sector's fresh copy if it is intact. */
+START_TEST (test_log1)
+{
+	if (sector_size_skipped (512))
+		return 0;
+
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint32_t sector_count = 200;
+	size_t volume_len = 512 * sector_count;
+	TSV_CONFIG config = {.max_sector_size = 512, .io_queue_size = 64 * 1024};
+	size_t arena_len = tsv_arena_size (&config);
+	uint8_t *arena = malloc (arena_len);
+	uint8_t *model = malloc (volume_len);
+	uint8_t *result = malloc (volume_len);
+	uint8_t *snapshot = NULL;
+	uint8_t buf[512];
+	unsigned int writes, syncs;
+	uint32_t used;
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_read_urandom (model, volume_len);
+	tsv_close ();
+
+	mu_assert (!tsv_init (arena, arena_len, &config), "tsv_init should succeed in test_log.");
+	new_ramdisk (tsv_physical_size_ex (512, sector_count, TSV_FEATURE_LOG));
+	mu_assert (g_ramdisk_len == tsv_physical_size (512, sector_count) + LOG_LEN, "The log should follow the second copy.");
+	mu_assert (!tsv_create_ex (mac_key, encryption_key, 512, sector_count, TSV_FEATURE_LOG), "tsv_create_ex should succeed in test_log.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_log.");
+	mu_assert (!tsv_write (0, model, volume_len), "tsv_write should succeed in test_log.");
+	mu_assert (!tsv_log_clean (256) && !tsv_flush (), "tsv_log_clean should succeed in test_log.");
+
+	/* 16 Sectors all over the volume: one run of Sectors and one of entries in each copy */
+	writes = g_write_count;
+	syncs = g_sync_count;
+	mu_assert (!tsv_batch_begin (), "tsv_batch_begin should succeed in test_log.");
+
+	for (uint32_t i = 0; i < 16; ++i)
+	{
+		uint32_t sector = (i * 97) % sector_count;
+
+		tsv_read_urandom (model + sector * 512 + 100, 50);
+		mu_assert (!tsv_write (sector * 512 + 100, model + sector * 512 + 100, 50), "tsv_write should succeed in test_log.");
+	}
+
+	mu_assert (!tsv_batch_end (), "tsv_batch_end should succeed in test_log.");
+	mu_assert (g_write_count - writes == 4 && g_sync_count - syncs == 2, "Scattered writes should be appended to the log.");
+	mu_assert (tsv_log_used () == 16, "Each Sector should take a slot.");
+	mu_assert (!tsv_read (result, 0, volume_len) && !memcmp (result, model, volume_len), "Reads should see the log.");
+
+	/* Crash with a partial write's fresh copy, the second, written; the default arena has no I/O queue
+	 * to hold it back.
+	 */
+	mu_assert (!tsv_close () && !tsv_init (NULL, 0, NULL), "tsv_init should go back to the default arena.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_log.");
+	mu_assert (!tsv_set_deferred (1), "tsv_set_deferred should succeed in test_log.");
+	tsv_read_urandom (model + 5 * 512 + 7, 100);
+	mu_assert (!tsv_write (5 * 512 + 7, model + 5 * 512 + 7, 100), "tsv_write should succeed in test_log.");
+
+	snapshot = malloc (g_ramdisk_len);
+	memmove (snapshot, g_ramdisk, g_ramdisk_len);
+	mu_assert (!tsv_close (), "tsv_close should succeed in test_log.");
+	memmove (g_ramdisk, snapshot, g_ramdisk_len);
+
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed after a crash.");
+	mu_assert (tsv_log_used () == 17 && tsv_replicas_pending () == 0, "Replay should commit the fresh copy.");
+	mu_assert (!tsv_read (result, 0, volume_len) && !memcmp (result, model, volume_len), "The fresh copy should have survived.");
+
+	/* The same, with the fresh copy damaged: the Sector keeps what it had */
+	used = tsv_log_used ();
+	mu_assert (!tsv_set_deferred (1), "tsv_set_deferred should succeed in test_log.");
+	tsv_read_urandom (buf, 100);
+	mu_assert (!tsv_write (6 * 512 + 7, buf, 100), "tsv_write should succeed in test_log.");
+	memmove (snapshot, g_ramdisk, g_ramdisk_len);
+	mu_assert (!tsv_close (), "tsv_close should succeed in test_log.");
+	memmove (g_ramdisk, snapshot, g_ramdisk_len);
+	memset (g_ramdisk + g_ramdisk_len - LOG_COPY_LEN + 256 * 96, 0, 256 * 512);
+
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed after a crash.");
+	mu_assert (tsv_log_used () == used + 1 && tsv_replicas_pending () == 0, "A damaged fresh copy should be dropped.");
+	mu_assert (!tsv_read (result, 0, volume_len) && !memcmp (result, model, volume_len), "The damaged write should be lost, and nothing else.");
+
+	/* Writes after a pass record its tail; so does the tail record on its own */
+	mu_assert (!tsv_log_clean (10) && tsv_log_used () == used - 9, "tsv_log_clean should free the oldest slots.");
+	mu_assert (!tsv_write (0, buf, 100), "tsv_write should succeed in test_log.");
+	memmove (model, buf, 100);
+	mu_assert (!tsv_close () && !tsv_open (mac_key, encryption_key) && tsv_log_used () == used - 8, "tsv_open should resume after the slots cleaned.");
+	mu_assert (!tsv_log_clean (256), "tsv_log_clean should succeed in test_log.");
+	mu_assert (!tsv_close () && !tsv_open (mac_key, encryption_key) && tsv_log_used () == 0, "tsv_open should find the tail record.");
+	mu_assert (!tsv_read (result, 0, volume_len) && !memcmp (result, model, volume_len), "Contents should survive cleaning.");
+	mu_assert (!tsv_close (), "tsv_close should succeed in test_log.");
+
+	free (arena);
+	free (model);
+	free (result);
+	free (snapshot);
+}
+END_TEST
+
+
+/* What log volumes cannot be combined with, or do. */
+START_TEST (test_log2)
+{
+	if (sector_size_skipped (512))
+		return 0;
+
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_close ();
+
+	mu_assert (tsv_physical_size_ex (512, 64, TSV_FEATURE_LOG | TSV_FEATURE_SPLIT) == 0, "Split volumes should not take a log.");
+	mu_assert (tsv_create_ex (mac_key, encryption_key, 512, 64, TSV_FEATURE_LOG | TSV_FEATURE_PARITY) == -1, "Parity volumes should not take a log.");
+	mu_assert (tsv_create_ex (mac_key, encryption_key, 512, 64, TSV_FEATURE_LOG | TSV_FEATURE_INTENT) == -1, "Log volumes should not take a write-intent record.");
+
+	new_ramdisk (tsv_physical_size (512, 64));
+	mu_assert (!tsv_create (mac_key, encryption_key, 512, 64), "tsv_create should succeed in test_log.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_log.");
+	mu_assert (tsv_log_clean (1) == -1 && tsv_log_used () == 0, "Volumes without a log have nothing to clean.");
+	mu_assert (!tsv_close (), "tsv_close should succeed in test_log.");
+
+	new_ramdisk (tsv_physical_size_ex (512, 200, TSV_FEATURE_LOG));
+	mu_assert (!tsv_create_ex (mac_key, encryption_key, 512, 64, TSV_FEATURE_LOG), "tsv_create_ex should succeed in test_log.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_log.");
+	mu_assert (tsv_grow (200) == -1, "Log volumes should not grow.");
+	mu_assert (tsv_rekey (mac_key, encryption_key) == -1, "Log volumes should not rekey.");
+	mu_assert (tsv_set_threaded (1) == -1, "Log volumes should not use threaded mode.");
+	mu_assert (!tsv_close (), "tsv_close should succeed in test_log.");
+}
+END_TEST
+
+
+char *test_log (void)
+{
+	mu_run_test (test_log0);
+	mu_run_test (test_log1);
+	mu_run_test (test_log2);
+
+	return 0;
+}
@@ -11,6 +11,7 @@
 #include <titan-secure-volume/app.h>
 
 int tests_run = 0;
+int tests_skipped = 0;
 
 char *test_create (void);
 char *test_open (void);
@@ -18,11 +19,43 @@ char *test_read (void);
 char *test_write (void);
 char *test_read_write (void);
 char *test_corruption (void);
+char *test_sync (void);
+char *test_deferred (void);
+char *test_map (void);
+char *test_grow (void);
+char *test_rekey (void);
+char *test_discard (void);
+char *test_verify (void);
+char *test_memory (void);
+char *test_vector (void);
+char *test_parity (void);
+char *test_intent (void);
+char *test_shared (void);
+char *test_io (void);
+char *test_log (void);
+char *test_hostcache (void);
+char *test_track (void);
+char *test_trace (void);
 
 
 /* TSV BSP */
 uint8_t *g_ramdisk = NULL;
 size_t g_ramdisk_len = 0;
+unsigned int g_sync_count = 0;
+int g_map_enabled = 0;
+unsigned int g_map_count = 0;
+unsigned int g_read_count = 0;
+unsigned int g_discard_count = 0;
+unsigned int g_urandom_count = 0;
+unsigned int g_write_count = 0;
+
+/* Crash model: the first write overlapping [g_drop_offset, g_drop_offset+g_drop_len) is lost, and the
+ * device stops at the next sync.  What storage held then is left in g_crash_image, if set.
+ */
+uint64_t g_drop_offset = 0;
+size_t g_drop_len = 0;
+uint8_t *g_crash_image = NULL;
+int g_crashed = 0;
 
 void tsv_fatal_error (void)
 {
@@ -35,6 +68,8 @@ void tsv_read_urandom (void *dst, size_t len)
 {
 	int fd = open ("/dev/urandom", O_RDONLY);
 
+	g_urandom_count += 1;
+
 	if (fd == -1)
 		tsv_fatal_error ();
 	
@@ -64,6 +99,7 @@ int tsv_physical_read (void *dst, uint64_t offset, size_t len)
 	if (offset >= g_ramdisk_len || (g_ramdisk_len - offset) < len)
 		return -1;
 
+	g_read_count += 1;
 	memmove (dst, g_ramdisk + offset, len);
 
 	return 0;
@@ -81,12 +117,68 @@ int tsv_physical_write (uint64_t offset, void const *src, size_t len)
 	if (offset >= g_ramdisk_len || (g_ramdisk_len - offset) < len)
 		return -1;
 
+	g_write_count += 1;
+
+	if (g_drop_len && offset < g_drop_offset + g_drop_len && g_drop_offset < offset + len)
+	{
+		g_drop_len = 0;
+		g_crashed = 1;
+		return 0;
+	}
+
 	memmove (g_ramdisk + offset, src, len);
 
 	return 0;
 }
 
 
+int tsv_physical_sync (void)
+{
+	if (!g_ramdisk)
+		return -1;
+
+	g_sync_count += 1;
+
+	if (g_crashed == 1 && g_crash_image)
+	{
+		memmove (g_crash_image, g_ramdisk, g_ramdisk_len);
+		g_crashed = 2;
+	}
+
+	return 0;
+}
+
+
+void const *tsv_physical_map (uint64_t offset, size_t len)
+{
+	if (!g_ramdisk || !g_map_enabled)
+		return NULL;
+
+	if (offset >= g_ramdisk_len || (g_ramdisk_len - offset) < len)
+		return NULL;
+
+	g_map_count += 1;
+
+	return g_ramdisk + offset;
+}
+
+
+/* Like a device that reads back zeros after TRIM */
+int tsv_physical_discard (uint64_t offset, size_t len)
+{
+	if (!g_ramdisk)
+		return -1;
+
+	if (offset >= g_ramdisk_len || (g_ramdisk_len - offset) < len)
+		return -1;
+
+	g_discard_count += 1;
+	memset (g_ramdisk + offset, 0, len);
+
+	return 0;
+}
+
+
 void new_ramdisk (size_t len)
 {
 	free (g_ramdisk);
@@ -97,6 +189,46 @@ void new_ramdisk (size_t len)
 }
 
 
+/* Builds made with TSV_FIXED_SECTOR_SIZE only take volumes of that Sector size, so tests written for
+ * another size return early when this is true.
+ */
+int sector_size_skipped (uint32_t sector_size)
+{
+#ifdef TSV_FIXED_SECTOR_SIZE
+	if (sector_size != TSV_FIXED_SECTOR_SIZE)
+	{
+		tests_skipped += 1;
+		return 1;
+	}
+#endif
+	(void)sector_size;
+
+	return 0;
+}
+
+
+/* Runs a test written for any Sector size with 512 and 4096 byte Sectors, or with the one size of a
+ * TSV_FIXED_SECTOR_SIZE build, and returns the first failure.
+ */
+char *for_each_sector_size (char *(*test) (uint32_t sector_size))
+{
+#ifdef TSV_FIXED_SECTOR_SIZE
+	static uint32_t const sector_sizes[] = {TSV_FIXED_SECTOR_SIZE};
+#else
+	static uint32_t const sector_sizes[] = {512, 4096};
+#endif
+	char *msg;
+
+	for (size_t i = 0; i < sizeof (sector_sizes) / sizeof (sector_sizes[0]); ++i)
+	{
+		if ((msg = test (sector_sizes[i])))
+			return msg;
+	}
+
+	return 0;
+}
+
+
 static char *all_tests ()
 {
 	char *msg;
@@ -107,6 +239,23 @@ static char *all_tests ()
 	if ((msg = test_write ())) return msg;
 	if ((msg = test_read_write ())) return msg;
 	if ((msg = test_corruption ())) return msg;
+	if ((msg = test_sync ())) return msg;
+	if ((msg = test_deferred ())) return msg;
+	if ((msg = test_map ())) return msg;
+	if ((msg = test_grow ())) return msg;
+	if ((msg = test_rekey ())) return msg;
+	if ((msg = test_discard ())) return msg;
+	if ((msg = test_verify ())) return msg;
+	if ((msg = test_memory ())) return msg;
+	if ((msg = test_vector ())) return msg;
+	if ((msg = test_parity ())) return msg;
+	if ((msg = test_intent ())) return msg;
+	if ((msg = test_shared ())) return msg;
+	if ((msg = test_io ())) return msg;
+	if ((msg = test_log ())) return msg;
+	if ((msg = test_hostcache ())) return msg;
+	if ((msg = test_track ())) return msg;
+	if ((msg = test_trace ())) return msg;
 	
 	return 0;
 }
@@ -121,6 +270,8 @@ int main (void)
 	else
 		printf ("ALL TESTS PASSED\n");
 	printf ("Tests run: %d\n", tests_run);
+	if (tests_skipped)
+		printf ("Tests skipped for another Sector size: %d\n", tests_skipped);
 	
 	return result != 0;
 }
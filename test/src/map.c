@@ -0,0 +1,86 @@
+#include <string.h>
+#include <minunit.h>
+#include <titan-secure-volume/titan-secure-volume.h>
+#include <titan-secure-volume/app.h>
+
+
+void new_ramdisk (size_t len);
+int sector_size_skipped (uint32_t sector_size);
+extern uint8_t *g_ramdisk;
+extern int g_map_enabled;
+extern unsigned int g_map_count;
+
+
+/* Reads through tsv_physical_map, including from damaged copies, and checks the
+ * results against reads through tsv_physical_read.
+ */
+START_TEST (test_map0)
+{
+	if (sector_size_skipped (4096))
+		return 0;
+
+	int err;
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	int volume_len = 1024 * 1024;
+	uint8_t *real_copy = malloc (volume_len);
+	uint8_t *result = malloc (volume_len);
+	uint64_t physical_size = tsv_physical_size (4096, volume_len / 4096);
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_close ();
+
+	mu_assert (physical_size == 4096 + 2 * (8192 + (uint64_t)volume_len), "tsv_physical_size should match the volume layout.");
+	mu_assert (tsv_physical_size (1000, 1) == 0, "tsv_physical_size should reject invalid parameters.");
+
+	new_ramdisk (physical_size);
+	mu_assert (!tsv_create (mac_key, encryption_key, 4096, volume_len / 4096), "tsv_create should succeed in test_map.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_map.");
+
+	tsv_read_urandom (real_copy, volume_len);
+	mu_assert (!tsv_write (0, real_copy, volume_len), "tsv_write should succeed in test_map.");
+
+	g_map_enabled = 1;
+	g_map_count = 0;
+
+	err = tsv_read (result, 0, volume_len);
+	mu_assert (!err, "tsv_read should succeed through tsv_physical_map.");
+	mu_assert (g_map_count > 0, "tsv_read should use tsv_physical_map when available.");
+	mu_assert (!memcmp (result, real_copy, volume_len), "Mapped reads should return the data written.");
+
+	/* Unaligned reads */
+	memset (result, 0, volume_len);
+	err = tsv_read (result + 123, 123, 3 * 4096 + 7);
+	mu_assert (!err, "Unaligned tsv_read should succeed through tsv_physical_map.");
+	mu_assert (!memcmp (result + 123, real_copy + 123, 3 * 4096 + 7), "Unaligned mapped reads should return the data written.");
+
+	/* Damage every primary copy; mapped reads must fall back to the secondary copies */
+	for (int i = 0; i < volume_len / 4096; ++i)
+		g_ramdisk[4096 + 8192 + i * 4096 + (i % 4096)] ^= 0x01;
+
+	err = tsv_read (result, 0, volume_len);
+	mu_assert (!err, "tsv_read should recover damaged sectors through tsv_physical_map.");
+	mu_assert (!memcmp (result, real_copy, volume_len), "Mapped reads should recover damaged sectors.");
+
+	/* Writes go through tsv_physical_write; read back with mapping disabled */
+	tsv_read_urandom (real_copy + 5000, 10000);
+	mu_assert (!tsv_write (5000, real_copy + 5000, 10000), "tsv_write should succeed with mapping enabled.");
+
+	g_map_enabled = 0;
+	err = tsv_read (result, 0, volume_len);
+	mu_assert (!err, "tsv_read should succeed without tsv_physical_map.");
+	mu_assert (!memcmp (result, real_copy, volume_len), "Unmapped reads should match mapped writes.");
+
+	free (real_copy);
+	free (result);
+}
+END_TEST
+
+
+char *test_map (void)
+{
+	mu_run_test (test_map0);
+
+	return 0;
+}
@@ -0,0 +1,232 @@
+#include <stdlib.h>
+#include <string.h>
+#include <minunit.h>
+#include <titan-secure-volume/titan-secure-volume.h>
+#include <titan-secure-volume/app.h>
+
+
+void new_ramdisk (size_t len);
+int sector_size_skipped (uint32_t sector_size);
+extern uint8_t *g_ramdisk;
+extern unsigned int g_read_count;
+
+
+static int is_zero (uint8_t const *buf, size_t len)
+{
+	for (size_t i = 0; i < len; ++i)
+	{
+		if (buf[i])
+			return 0;
+	}
+
+	return 1;
+}
+
+
+/* Random writes and reads against a model with every cache and staging enabled, and a caller's arena
+ * that limits the Sector size.
+ */
+START_TEST (test_memory0)
+{
+	if (sector_size_skipped (512))
+		return 0;
+
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint32_t sector_count = 300;
+	size_t volume_len = 512 * sector_count;
+	size_t mac_table_len = (32 * sector_count + 511) / 512 * 512;
+	TSV_CONFIG config = {.max_sector_size = 512, .cache_sectors = 16, .mac_pages = 4, .staging_size = 8 * (512 + 32)};
+	size_t arena_len = tsv_arena_size (&config);
+	uint8_t *arena = calloc (1, arena_len + 1);
+	uint8_t *model = malloc (volume_len);
+	uint8_t *result = malloc (volume_len);
+	uint8_t buf[4096];
+	unsigned int reads;
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_read_urandom (model, volume_len);
+	tsv_close ();
+
+	TSV_CONFIG bad = config;
+	bad.max_sector_size = 100;
+	mu_assert (tsv_arena_size (&bad) == 0 && tsv_arena_size (NULL) == 0, "tsv_arena_size should reject invalid configurations.");
+	mu_assert (arena_len >= 8 * (512 + 32) + 17 * 512 + 4 * 512, "tsv_arena_size should cover every part of the arena.");
+
+	/* Buffers only some features or vectored I/O need take a Sector each */
+	TSV_CONFIG full = config;
+	full.features = TSV_FEATURE_DISCARD | TSV_FEATURE_TRACK;
+	full.vectored = 1;
+	mu_assert (tsv_arena_size (&full) == arena_len + 3 * 512, "tsv_arena_size should only count buffers config asks for.");
+	mu_assert (tsv_init (arena + 1, arena_len - 1, &config) == -1, "tsv_init should fail with a short arena.");
+
+	/* Unaligned on purpose */
+	mu_assert (!tsv_init (arena + 1, arena_len, &config), "tsv_init should succeed.");
+
+	new_ramdisk (tsv_physical_size (4096, 8));
+	mu_assert (tsv_create (mac_key, encryption_key, 4096, 8) == -1, "Sectors larger than max_sector_size should be refused.");
+
+	new_ramdisk (tsv_physical_size_ex (512, 8, TSV_FEATURE_DISCARD));
+	mu_assert (tsv_create_ex (mac_key, encryption_key, 512, 8, TSV_FEATURE_DISCARD) == -1, "Features without their buffers in the arena should be refused.");
+
+	new_ramdisk (tsv_physical_size (512, sector_count));
+	mu_assert (!tsv_create (mac_key, encryption_key, 512, sector_count), "tsv_create should succeed in test_memory.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_memory.");
+	mu_assert (tsv_init (NULL, 0, NULL) == -1, "tsv_init should fail while a volume is open.");
+	mu_assert (!tsv_write (0, model, volume_len), "tsv_write should succeed in test_memory.");
+
+	srand (5);
+
+	for (int i = 0; i < 500; ++i)
+	{
+		uint32_t offset = (uint32_t)rand () % volume_len;
+		uint32_t len = (uint32_t)rand () % sizeof (buf);
+
+		if (len > volume_len - offset)
+			len = (uint32_t)(volume_len - offset);
+
+		if (i % 2)
+		{
+			tsv_read_urandom (buf, len);
+			memmove (model + offset, buf, len);
+			mu_assert (!tsv_write (offset, buf, len), "tsv_write should succeed in test_memory.");
+		}
+		else
+		{
+			mu_assert (!tsv_read (buf, offset, len), "tsv_read should succeed in test_memory.");
+			mu_assert (!memcmp (buf, model + offset, len), "tsv_read should match the model with caches enabled.");
+		}
+	}
+
+	/* Cached Sectors are not read again */
+	mu_assert (!tsv_read (buf, 512 * 7 + 10, 100), "tsv_read should succeed in test_memory.");
+	reads = g_read_count;
+	mu_assert (!tsv_read (buf, 512 * 7 + 200, 100), "tsv_read should succeed in test_memory.");
+	mu_assert (g_read_count == reads && !memcmp (buf, model + 512 * 7 + 200, 100), "A cached Sector should come from memory.");
+
+	/* A run of whole Sectors takes two reads: ciphertext and tags */
+	reads = g_read_count;
+	mu_assert (!tsv_read (buf, 512 * 100, 8 * 512), "tsv_read should succeed in test_memory.");
+	mu_assert (g_read_count == reads + 2 && !memcmp (buf, model + 512 * 100, 8 * 512), "Staged reads should be coalesced.");
+
+	/* Damaged Sectors in a staged run fall back to the second copy */
+	g_ramdisk[512 + mac_table_len + 512 * 203] ^= 1;
+	g_ramdisk[512 + mac_table_len + 512 * 205 + 511] ^= 1;
+	mu_assert (!tsv_read (result, 512 * 200, 8 * 512), "tsv_read should succeed on damaged Sectors.");
+	mu_assert (!memcmp (result, model + 512 * 200, 8 * 512), "Staged reads should recover damaged Sectors.");
+
+	mu_assert (!tsv_read (result, 0, volume_len), "tsv_read should succeed in test_memory.");
+	mu_assert (!memcmp (result, model, volume_len), "tsv_read should match the model with caches enabled.");
+
+	/* A page of tags cached across a write to one of its Sectors.  Sectors 56 and 57 share Sector cache
+	 * slots with 40 and 41, so those are read through the page each time.
+	 */
+	mu_assert (!tsv_read (buf, 512 * 56 + 1, 511), "tsv_read should succeed in test_memory.");
+	mu_assert (!tsv_read (buf, 512 * 40 + 1, 511), "tsv_read should succeed in test_memory.");
+	tsv_read_urandom (model + 512 * 41, 512);
+	mu_assert (!tsv_write (512 * 41, model + 512 * 41, 512), "tsv_write should succeed in test_memory.");
+	mu_assert (!tsv_read (buf, 512 * 57 + 1, 511), "tsv_read should succeed in test_memory.");
+
+	/* Without the second copy, every cached MAC tag of the first must be current */
+	memset (g_ramdisk + 512 + 2 * mac_table_len + volume_len, 0, volume_len);
+
+	for (uint32_t i = 0; i < sector_count; ++i)
+	{
+		if (i == 203 || i == 205)
+			continue;
+
+		mu_assert (!tsv_read (buf, 512 * i + 1, 511), "tsv_read should succeed from the first copy.");
+		mu_assert (!memcmp (buf, model + 512 * i + 1, 511), "Cached MAC tags should match storage.");
+	}
+
+	mu_assert (!tsv_close (), "tsv_close should succeed in test_memory.");
+	mu_assert (is_zero (arena, arena_len + 1), "tsv_close should wipe the arena.");
+
+	/* Everything reached storage */
+	mu_assert (!tsv_init (NULL, 0, NULL), "tsv_init should go back to the default arena.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_memory.");
+	mu_assert (!tsv_read (result, 512 * 206, volume_len - 512 * 206), "tsv_read should succeed in test_memory.");
+	mu_assert (!memcmp (result, model + 512 * 206, volume_len - 512 * 206), "Writes made with caches enabled should be on storage.");
+	tsv_close ();
+
+	free (arena);
+	free (model);
+	free (result);
+}
+END_TEST
+
+
+/* Caches must not go stale across batches, discards, a grow and a rekey. */
+START_TEST (test_memory1)
+{
+	if (sector_size_skipped (512))
+		return 0;
+
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint32_t sector_count = 5000, grown_count = 6000;
+	size_t volume_len = 512 * (size_t)grown_count;
+	TSV_CONFIG config = {.max_sector_size = 4096, .features = TSV_FEATURE_DISCARD, .cache_sectors = 64, .mac_pages = 8, .staging_size = 64 * 1024};
+	size_t arena_len = tsv_arena_size (&config);
+	uint8_t *arena = malloc (arena_len);
+	uint8_t *model = calloc (1, volume_len);
+	uint8_t *result = malloc (volume_len);
+	unsigned int reads;
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_close ();
+
+	mu_assert (!tsv_init (arena, arena_len, &config), "tsv_init should succeed.");
+
+	new_ramdisk (tsv_physical_size_ex (512, grown_count, TSV_FEATURE_DISCARD));
+	mu_assert (!tsv_create_ex (mac_key, encryption_key, 512, sector_count, TSV_FEATURE_DISCARD), "tsv_create_ex should succeed in test_memory.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_memory.");
+
+	tsv_read_urandom (model, 512 * sector_count);
+	mu_assert (!tsv_write (0, model, 512 * sector_count), "tsv_write should succeed in test_memory.");
+	mu_assert (!tsv_read (result, 0, 512 * sector_count), "tsv_read should succeed in test_memory.");
+
+	mu_assert (!tsv_batch_begin (), "tsv_batch_begin should succeed.");
+	tsv_read_urandom (model + 1000, 20000);
+	mu_assert (!tsv_write (1000, model + 1000, 20000), "tsv_write should succeed in a batch.");
+	memset (model + 512 * 100, 0, 512 * 50);
+	mu_assert (!tsv_discard (512 * 100, 512 * 50), "tsv_discard should succeed in a batch.");
+	mu_assert (!tsv_read (result, 0, 512 * sector_count) && !memcmp (result, model, 512 * sector_count), "Reads in a batch should see the batch.");
+	mu_assert (!tsv_batch_end (), "tsv_batch_end should succeed.");
+
+	/* About 2.5 MB moved, in pieces of the staging area rather than of one Sector */
+	reads = g_read_count;
+	mu_assert (!tsv_grow (grown_count), "tsv_grow should succeed with caches enabled.");
+	mu_assert (g_read_count - reads < 200, "tsv_grow should move data through the staging area.");
+	tsv_read_urandom (model + 512 * (sector_count - 3), 512 * 10);
+	mu_assert (!tsv_write (512 * (sector_count - 3), model + 512 * (sector_count - 3), 512 * 10), "tsv_write should succeed after a grow.");
+	mu_assert (!tsv_read (result, 0, volume_len) && !memcmp (result, model, volume_len), "Reads should match after a grow.");
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	mu_assert (!tsv_rekey (mac_key, encryption_key), "tsv_rekey should succeed with caches enabled.");
+	tsv_read_urandom (model + 777, 3000);
+	mu_assert (!tsv_write (777, model + 777, 3000), "tsv_write should succeed after a rekey.");
+	mu_assert (!tsv_read (result, 0, volume_len) && !memcmp (result, model, volume_len), "Reads should match after a rekey.");
+
+	mu_assert (!tsv_close (), "tsv_close should succeed in test_memory.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_memory.");
+	mu_assert (!tsv_read (result, 0, volume_len) && !memcmp (result, model, volume_len), "Reads should match after reopening.");
+	tsv_close ();
+	mu_assert (!tsv_init (NULL, 0, NULL), "tsv_init should go back to the default arena.");
+
+	free (arena);
+	free (model);
+	free (result);
+}
+END_TEST
+
+
+char *test_memory (void)
+{
+	mu_run_test (test_memory0);
+	mu_run_test (test_memory1);
+
+	return 0;
+}
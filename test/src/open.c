@@ -5,10 +5,14 @@
 
 
 void new_ramdisk (size_t len);
+int sector_size_skipped (uint32_t sector_size);
 
 
 START_TEST (test_open0)
 {
+	if (sector_size_skipped (512))
+		return 0;
+
 	int err;
 	uint8_t mac_key[TSV_MAC_KEY_SIZE];
 	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
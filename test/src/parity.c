@@ -0,0 +1,179 @@
+#include <stdlib.h>
+#include <string.h>
+#include <minunit.h>
+#include <titan-secure-volume/titan-secure-volume.h>
+#include <titan-secure-volume/app.h>
+
+
+void new_ramdisk (size_t len);
+int sector_size_skipped (uint32_t sector_size);
+extern uint8_t *g_ramdisk;
+
+
+/* Damage to up to parity_shards Sectors of a group is rebuilt from the rest, including after writes
+ * that moved the parity on, and tsv_verify counts it.
+ */
+START_TEST (test_parity0)
+{
+	if (sector_size_skipped (512))
+		return 0;
+
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint8_t scratch[2 * 512];
+	uint32_t sector_count = 50;
+	size_t volume_len = 512 * sector_count;
+	size_t mac_table_len = (32 * sector_count + 511) / 512 * 512;
+	uint8_t *model = malloc (volume_len);
+	uint8_t *result = malloc (volume_len);
+	uint8_t *data, *parity;
+	TSV_VERIFY verify;
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_read_urandom (model, volume_len);
+	tsv_close ();
+
+	/* 13 groups of four, the last with two Sectors, and two parity Sectors each with two Sectors of tags */
+	new_ramdisk (tsv_physical_size_parity (512, sector_count, 4, 2));
+	mu_assert (tsv_physical_size_parity (512, sector_count, 4, 2) == 512 + 2 * mac_table_len + volume_len + 2 * 512 + 26 * 512, "tsv_physical_size_parity should count the parity Sectors.");
+	mu_assert (!tsv_create_parity (mac_key, encryption_key, 512, sector_count, 4, 2), "tsv_create_parity should succeed.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_parity.");
+	mu_assert (!tsv_read (result, 0, volume_len), "A new parity volume should be readable.");
+	mu_assert (!tsv_write (0, model, volume_len), "tsv_write should succeed in test_parity.");
+
+	data = g_ramdisk + 512 + mac_table_len;
+	parity = data + volume_len + mac_table_len + 2 * 512;
+
+	/* Two data Sectors of group 1, and one data and one parity Sector of the short last group */
+	data[4 * 512] ^= 1;
+	data[6 * 512 + 200] ^= 1;
+	data[49 * 512] ^= 1;
+	parity[24 * 512] ^= 1;
+
+	mu_assert (!tsv_read (result, 0, volume_len) && !memcmp (result, model, volume_len), "Damaged Sectors should be rebuilt from parity.");
+
+	memset (&verify, 0, sizeof (verify));
+	mu_assert (!tsv_verify (0, sector_count, scratch, &verify), "tsv_verify should succeed on a parity volume.");
+	mu_assert (verify.bad[0] == 3 && verify.bad[1] == 1 && !verify.lost, "tsv_verify should count data and parity damage.");
+
+	/* A partial write over a damaged Sector, which also repairs Sector 4 when group 1's parity moves on */
+	tsv_read_urandom (model + 6 * 512 + 10, 100);
+	mu_assert (!tsv_write (6 * 512 + 10, model + 6 * 512 + 10, 100), "A partial write over a damaged Sector should succeed.");
+	tsv_read_urandom (model + 5 * 512, 512);
+	mu_assert (!tsv_write (5 * 512, model + 5 * 512, 512), "tsv_write should succeed in test_parity.");
+	data[5 * 512 + 1] ^= 1;
+	data[6 * 512 + 1] ^= 1;
+	mu_assert (!tsv_read (result, 0, volume_len) && !memcmp (result, model, volume_len), "Rebuilt Sectors should reflect later writes.");
+
+	/* A third damaged Sector in the group is more than the parity covers */
+	data[7 * 512] ^= 1;
+	mu_assert (tsv_read (result, 7 * 512, 512) == -1, "Three damaged Sectors of a group should not be rebuilt.");
+
+	memset (&verify, 0, sizeof (verify));
+	mu_assert (!tsv_verify (0, sector_count, scratch, &verify), "tsv_verify should succeed on a parity volume.");
+	mu_assert (verify.bad[0] == 4 && verify.lost == 3, "tsv_verify should count the Sectors of an unrecoverable group as lost.");
+
+	/* The parity geometry survives reopening */
+	data[7 * 512] ^= 1;
+	mu_assert (!tsv_close () && !tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_parity.");
+	mu_assert (!tsv_read (result, 0, volume_len) && !memcmp (result, model, volume_len), "A reopened parity volume should rebuild.");
+	mu_assert (!tsv_close (), "tsv_close should succeed in test_parity.");
+
+	free (model);
+	free (result);
+}
+END_TEST
+
+
+/* One data and two parity shards are a three-way mirror, with parity accumulated in the staging area. */
+START_TEST (test_parity1)
+{
+	if (sector_size_skipped (512))
+		return 0;
+
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint32_t sector_count = 20;
+	size_t volume_len = 512 * sector_count;
+	size_t mac_table_len = (32 * sector_count + 511) / 512 * 512;
+	TSV_CONFIG config = {.max_sector_size = 512, .features = TSV_FEATURE_PARITY, .staging_size = 4 * 512};
+	size_t arena_len = tsv_arena_size (&config);
+	uint8_t *arena = malloc (arena_len);
+	uint8_t *model = malloc (volume_len);
+	uint8_t *result = malloc (volume_len);
+	uint8_t *data, *parity;
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_read_urandom (model, volume_len);
+	tsv_close ();
+
+	for (int staged = 0; staged < 2; ++staged)
+	{
+		mu_assert (!tsv_init (staged ? arena : NULL, arena_len, &config), "tsv_init should succeed.");
+		new_ramdisk (tsv_physical_size_parity (512, sector_count, 1, 2));
+		mu_assert (!tsv_create_parity (mac_key, encryption_key, 512, sector_count, 1, 2), "tsv_create_parity should succeed.");
+		mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_parity.");
+		mu_assert (!tsv_write (0, model, volume_len), "tsv_write should succeed in test_parity.");
+
+		data = g_ramdisk + 512 + mac_table_len;
+		parity = data + volume_len + mac_table_len + 3 * 512;
+
+		/* Sector 3 from its second parity Sector, Sector 8 from its first */
+		data[3 * 512] ^= 1;
+		parity[(3 * 2) * 512] ^= 1;
+		data[8 * 512] ^= 1;
+		parity[(8 * 2 + 1) * 512] ^= 1;
+
+		mu_assert (!tsv_read (result, 0, volume_len) && !memcmp (result, model, volume_len), "Both parity Sectors should be full copies.");
+		mu_assert (!tsv_close (), "tsv_close should succeed in test_parity.");
+	}
+
+	mu_assert (!tsv_init (NULL, 0, NULL), "tsv_init should go back to the default arena.");
+
+	free (arena);
+	free (model);
+	free (result);
+}
+END_TEST
+
+
+/* Geometry limits, and the modes parity volumes do not support. */
+START_TEST (test_parity2)
+{
+	if (sector_size_skipped (512))
+		return 0;
+
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_close ();
+
+	mu_assert (!tsv_physical_size_parity (512, 64, 0, 2) && !tsv_physical_size_parity (512, 64, 33, 2) && !tsv_physical_size_parity (512, 64, 4, 0) && !tsv_physical_size_parity (512, 64, 4, 9), "tsv_physical_size_parity should reject bad geometry.");
+	mu_assert (!tsv_physical_size_ex (512, 64, TSV_FEATURE_PARITY), "tsv_physical_size_ex should leave parity to tsv_physical_size_parity.");
+
+	new_ramdisk (tsv_physical_size_parity (512, 64, 32, 8));
+	mu_assert (tsv_create_parity (mac_key, encryption_key, 512, 64, 33, 2) == -1, "tsv_create_parity should reject too many data shards.");
+	mu_assert (tsv_create_ex (mac_key, encryption_key, 512, 64, TSV_FEATURE_PARITY) == -1, "tsv_create_ex should not create parity volumes.");
+	mu_assert (!tsv_create_parity (mac_key, encryption_key, 512, 64, 32, 8), "tsv_create_parity should accept the largest geometry.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_parity.");
+
+	mu_assert (tsv_set_threaded (1) == -1, "Parity volumes should refuse threaded mode.");
+	mu_assert (tsv_grow_begin (128) == -1, "Parity volumes should refuse to grow.");
+	mu_assert (tsv_rekey_begin (mac_key, encryption_key) == -1, "Parity volumes should refuse to rekey.");
+	mu_assert (!tsv_close (), "tsv_close should succeed in test_parity.");
+}
+END_TEST
+
+
+char *test_parity (void)
+{
+	mu_run_test (test_parity0);
+	mu_run_test (test_parity1);
+	mu_run_test (test_parity2);
+
+	return 0;
+}
@@ -5,35 +5,44 @@
 
 
 void new_ramdisk (size_t len);
+char *for_each_sector_size (char *(*test) (uint32_t sector_size));
 
 
-START_TEST (test_read0)
+static char *_test_read0 (uint32_t sector_size)
 {
 	int err;
 	uint8_t mac_key[TSV_MAC_KEY_SIZE];
 	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
-	uint8_t buf[1024];
+	uint8_t buf[4096 + 1];
 
 	tsv_read_urandom (mac_key, sizeof (mac_key));
 	tsv_read_urandom (encryption_key, sizeof (encryption_key));
 	tsv_close ();
 
-	new_ramdisk (5*512);
-	mu_assert (!tsv_create (mac_key, encryption_key, 512, 1), "tsv_create should succeed in test_read.");
+	new_ramdisk (5 * sector_size);
+	mu_assert (!tsv_create (mac_key, encryption_key, sector_size, 1), "tsv_create should succeed in test_read.");
 
 	err = tsv_read (buf, 0, 1);
 	mu_assert (err, "tsv_read should fail if the volume isn't open.");
 
 	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed.");
 
-	err = tsv_read (buf, 512, 1);
+	err = tsv_read (buf, sector_size, 1);
 	mu_assert (err, "tsv_read should fail if reading outside disk.");
 
-	err = tsv_read (buf, 0, 513);
+	err = tsv_read (buf, 0, sector_size + 1);
 	mu_assert (err, "tsv_read should fail if reading outside disk.");
 
 	err = tsv_read (buf, 0, 1);
 	mu_assert (!err, "tsv_read should succeed if reading inside the disk.");
+
+	return 0;
+}
+
+
+START_TEST (test_read0)
+{
+	return for_each_sector_size (_test_read0);
 }
 END_TEST
 
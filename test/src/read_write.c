@@ -5,12 +5,13 @@
 
 
 void new_ramdisk (size_t len);
+char *for_each_sector_size (char *(*test) (uint32_t sector_size));
 
 
 /* Performs a random mix of small and large writes to the disk, and then reads back
  * to make sure all the writes succeeded.
  */
-START_TEST (test_read_write0)
+static char *_test_read_write0 (uint32_t sector_size)
 {
 	int err;
 	uint8_t mac_key[TSV_MAC_KEY_SIZE];
@@ -25,7 +26,7 @@ START_TEST (test_read_write0)
 	tsv_close ();
 
 	new_ramdisk (volume_len * 3);
-	mu_assert (!tsv_create (mac_key, encryption_key, 512, volume_len / 512), "tsv_create should succeed here.");
+	mu_assert (!tsv_create (mac_key, encryption_key, sector_size, volume_len / sector_size), "tsv_create should succeed here.");
 	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed here.");
 
 	err = tsv_write (0, real_copy, volume_len);
@@ -57,6 +58,18 @@ START_TEST (test_read_write0)
 	mu_assert (!err, "tsv_read should succeed in read-write test.");
 
 	mu_assert (!memcmp (result, real_copy, volume_len), "Readback during read-write test should give back same data written.");
+
+	free (buf);
+	free (real_copy);
+	free (result);
+
+	return 0;
+}
+
+
+START_TEST (test_read_write0)
+{
+	return for_each_sector_size (_test_read_write0);
 }
 END_TEST
 
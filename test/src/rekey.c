@@ -0,0 +1,255 @@
+#include <stdlib.h>
+#include <string.h>
+#include <minunit.h>
+#include <titan-secure-volume/titan-secure-volume.h>
+#include <titan-secure-volume/app.h>
+
+
+void new_ramdisk (size_t len);
+int sector_size_skipped (uint32_t sector_size);
+extern uint8_t *g_ramdisk;
+extern unsigned int g_read_count;
+extern unsigned int g_write_count;
+
+
+/* Rekeys a volume, then checks only the new keys open it and both copies were re-sealed. */
+START_TEST (test_rekey0)
+{
+	if (sector_size_skipped (512))
+		return 0;
+
+	uint8_t mac_key[TSV_MAC_KEY_SIZE], new_mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE], new_encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint32_t sector_count = 100;
+	size_t volume_len = 512 * sector_count;
+	size_t mac_table_len = (32 * sector_count + 511) / 512 * 512;
+	uint8_t *real_copy = malloc (volume_len);
+	uint8_t *result = malloc (volume_len);
+	int ret;
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_read_urandom (new_mac_key, sizeof (new_mac_key));
+	tsv_read_urandom (new_encryption_key, sizeof (new_encryption_key));
+	tsv_close ();
+
+	new_ramdisk (tsv_physical_size (512, sector_count));
+	mu_assert (!tsv_create (mac_key, encryption_key, 512, sector_count), "tsv_create should succeed in test_rekey.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_rekey.");
+	tsv_read_urandom (real_copy, volume_len);
+	mu_assert (!tsv_write (0, real_copy, volume_len), "tsv_write should succeed in test_rekey.");
+
+	mu_assert (!tsv_rekey_begin (new_mac_key, new_encryption_key), "tsv_rekey_begin should succeed.");
+	mu_assert (tsv_rekey_begin (mac_key, new_encryption_key) == -1, "tsv_rekey_begin should refuse different keys mid-rekey.");
+	mu_assert (tsv_grow_begin (sector_count + 1) == -1, "tsv_grow_begin should fail during a rekey.");
+
+	do {
+		ret = tsv_rekey_step (4096);
+		mu_assert (ret >= 0, "tsv_rekey_step should succeed.");
+
+		memset (result, 0, volume_len);
+		mu_assert (!tsv_read (result, 0, volume_len), "tsv_read should succeed during a rekey.");
+		mu_assert (!memcmp (result, real_copy, volume_len), "Contents should not change during a rekey.");
+
+		if (ret)
+			mu_assert (tsv_write (0, real_copy, 512) == -1, "tsv_write should fail during a rekey.");
+	} while (ret);
+
+	mu_assert (!tsv_write (0, real_copy, 512), "tsv_write should succeed after a rekey.");
+	mu_assert (!tsv_close (), "tsv_close should succeed in test_rekey.");
+	mu_assert (tsv_open (mac_key, encryption_key) == -1, "Old keys should not open a rekeyed volume.");
+	mu_assert (!tsv_open (new_mac_key, new_encryption_key), "New keys should open a rekeyed volume.");
+
+	memset (g_ramdisk + 512 + mac_table_len + volume_len, 0, mac_table_len + volume_len);
+	memset (result, 0, volume_len);
+	mu_assert (!tsv_read (result, 0, volume_len) && !memcmp (result, real_copy, volume_len), "First copy should be rekeyed.");
+
+	mu_assert (!tsv_write (0, real_copy, volume_len), "tsv_write should succeed in test_rekey.");
+	memset (g_ramdisk + 512, 0, mac_table_len + volume_len);
+	memset (result, 0, volume_len);
+	mu_assert (!tsv_read (result, 0, volume_len) && !memcmp (result, real_copy, volume_len), "Second copy should be rekeyed.");
+
+	free (real_copy);
+	free (result);
+}
+END_TEST
+
+
+/* Interrupts a rekey after each step with a torn write, then reopens and finishes it. */
+START_TEST (test_rekey1)
+{
+	if (sector_size_skipped (512))
+		return 0;
+
+	uint8_t mac_key[TSV_MAC_KEY_SIZE], new_mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE], new_encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint32_t sector_count = 64;
+	size_t volume_len = 512 * sector_count;
+	size_t physical_len = tsv_physical_size (512, sector_count);
+	uint8_t *real_copy = malloc (volume_len);
+	uint8_t *result = malloc (volume_len);
+	uint8_t *snapshot = malloc (physical_len);
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_read_urandom (new_mac_key, sizeof (new_mac_key));
+	tsv_read_urandom (new_encryption_key, sizeof (new_encryption_key));
+	srand (2);
+
+	for (unsigned int crash = 0; ; ++crash)
+	{
+		tsv_close ();
+		new_ramdisk (physical_len);
+		mu_assert (!tsv_create (mac_key, encryption_key, 512, sector_count), "tsv_create should succeed in test_rekey.");
+		mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_rekey.");
+		tsv_read_urandom (real_copy, volume_len);
+		mu_assert (!tsv_write (0, real_copy, volume_len), "tsv_write should succeed in test_rekey.");
+
+		mu_assert (!tsv_rekey_begin (new_mac_key, new_encryption_key), "tsv_rekey_begin should succeed.");
+
+		for (unsigned int steps = 0; steps < crash; ++steps)
+			mu_assert (tsv_rekey_step (4096) == 1, "tsv_rekey_step should succeed.");
+
+		/* Tear the next step, except for the header Sector */
+		memmove (snapshot, g_ramdisk, physical_len);
+		int ret = tsv_rekey_step (4096);
+		mu_assert (ret >= 0, "tsv_rekey_step should succeed.");
+
+		for (size_t i = 512; i < physical_len; i += 64)
+		{
+			if (rand () & 1)
+				memmove (g_ramdisk + i, snapshot + i, 64);
+		}
+
+		tsv_close ();
+
+		/* The torn step was the last one */
+		if (ret == 0)
+		{
+			mu_assert (!tsv_open (new_mac_key, new_encryption_key), "New keys should open a rekeyed volume.");
+			mu_assert (!tsv_read (result, 0, volume_len) && !memcmp (result, real_copy, volume_len), "Contents should survive a rekey.");
+			break;
+		}
+
+		mu_assert (!tsv_open (mac_key, encryption_key), "Old keys should open an interrupted rekey.");
+		mu_assert (tsv_write (0, real_copy, 512) == -1, "An interrupted rekey should resume read-only.");
+		mu_assert (tsv_rekey_step (4096) == -1, "tsv_rekey_step should need the new keys after tsv_open.");
+		mu_assert (tsv_rekey_begin (new_mac_key, encryption_key) == -1, "tsv_rekey_begin should refuse different keys.");
+		mu_assert (!tsv_rekey_begin (new_mac_key, new_encryption_key), "tsv_rekey_begin should resume with the same keys.");
+		mu_assert (!tsv_read (result, 0, volume_len) && !memcmp (result, real_copy, volume_len), "Contents should be readable after an interrupted rekey.");
+
+		mu_assert (!tsv_rekey (new_mac_key, new_encryption_key), "tsv_rekey should finish an interrupted rekey.");
+		tsv_close ();
+		mu_assert (!tsv_open (new_mac_key, new_encryption_key), "New keys should open a rekeyed volume.");
+		mu_assert (!tsv_read (result, 0, volume_len) && !memcmp (result, real_copy, volume_len), "Contents should survive an interrupted rekey.");
+	}
+
+	free (real_copy);
+	free (result);
+	free (snapshot);
+}
+END_TEST
+
+
+/* Steps handed out by tsv_rekey_next are re-sealed in parts by tsv_rekey_range, a run at a time, and a
+ * step left unfinished is handed out again.  Discarded Sectors are skipped and a damaged Sector is
+ * re-sealed from its other copy.
+ */
+START_TEST (test_rekey2)
+{
+	if (sector_size_skipped (512))
+		return 0;
+
+	uint8_t mac_key[TSV_MAC_KEY_SIZE], new_mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE], new_encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint32_t sector_count = 200;
+	uint32_t physical_count = 201;      /* One bitmap Sector per 4096 Sectors */
+	size_t volume_len = 512 * (size_t)sector_count;
+	size_t mac_table_len = (32 * physical_count + 511) / 512 * 512;
+	TSV_CONFIG config = {.max_sector_size = 512, .features = TSV_FEATURE_DISCARD, .staging_size = 16 * (512 + 32)};
+	size_t arena_len = tsv_arena_size (&config);
+	uint8_t *arena = malloc (arena_len);
+	uint8_t *real_copy = malloc (volume_len);
+	uint8_t *result = malloc (volume_len);
+	uint8_t scratch[8 * (512 + 32)];
+	uint32_t first, count, again;
+	unsigned int reads, writes;
+	TSV_VERIFY verify;
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_read_urandom (new_mac_key, sizeof (new_mac_key));
+	tsv_read_urandom (new_encryption_key, sizeof (new_encryption_key));
+	tsv_read_urandom (real_copy, volume_len);
+	tsv_close ();
+
+	mu_assert (!tsv_init (arena, arena_len, &config), "tsv_init should succeed in test_rekey.");
+	new_ramdisk (tsv_physical_size_ex (512, sector_count, TSV_FEATURE_DISCARD));
+	mu_assert (tsv_physical_size_ex (512, sector_count, TSV_FEATURE_DISCARD) == tsv_physical_size (512, physical_count), "Bitmap Sectors should be included in the physical size.");
+	mu_assert (!tsv_create_ex (mac_key, encryption_key, 512, sector_count, TSV_FEATURE_DISCARD), "tsv_create_ex should succeed in test_rekey.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_rekey.");
+	mu_assert (!tsv_write (0, real_copy, volume_len), "tsv_write should succeed in test_rekey.");
+	memset (real_copy + 512 * 50, 0, 512 * 10);
+	mu_assert (!tsv_discard (512 * 50, 512 * 10), "tsv_discard should succeed in test_rekey.");
+	mu_assert (!tsv_flush (), "tsv_flush should succeed in test_rekey.");
+
+	/* The first copy of one Sector is damaged */
+	g_ramdisk[512 + mac_table_len + 512 * 100] ^= 1;
+
+	mu_assert (tsv_rekey_range (0, 1, scratch, sizeof (scratch)) == -1, "tsv_rekey_range should need a step from tsv_rekey_next.");
+	mu_assert (!tsv_rekey_begin (new_mac_key, new_encryption_key), "tsv_rekey_begin should succeed.");
+	mu_assert (tsv_rekey_next (16 * 512, &first, &count) == 1 && first == 0 && count == 16, "tsv_rekey_next should hand out the first step.");
+	mu_assert (tsv_rekey_range (8, 9, scratch, sizeof (scratch)) == -1, "tsv_rekey_range should stay within the step.");
+	mu_assert (tsv_rekey_range (100, 1, scratch, sizeof (scratch)) == -1, "tsv_rekey_range should refuse a range past the step.");
+	mu_assert (tsv_rekey_range (UINT32_MAX, 2, scratch, sizeof (scratch)) == -1, "tsv_rekey_range should refuse a range past the volume.");
+	mu_assert (tsv_rekey_range (0, 8, scratch, 512) == -1, "tsv_rekey_range should need room for a Sector and its tag.");
+
+	reads = g_read_count;
+	writes = g_write_count;
+	mu_assert (!tsv_rekey_range (8, 8, scratch, sizeof (scratch)), "tsv_rekey_range should succeed.");
+	mu_assert (g_read_count - reads == 2 && g_write_count - writes == 2, "A run should cost one read and one write each of data and tags.");
+
+	/* Half a step is not enough */
+	mu_assert (tsv_rekey_next (16 * 512, &again, &count) == 1 && again == first, "An unfinished step should be handed out again.");
+
+	/* Nor is the same half twice */
+	mu_assert (!tsv_rekey_range (first, 8, scratch, sizeof (scratch)), "tsv_rekey_range should succeed.");
+	mu_assert (!tsv_rekey_range (first, 8, scratch, sizeof (scratch)), "A repeated tsv_rekey_range should succeed.");
+	mu_assert (tsv_rekey_next (16 * 512, &again, &count) == 1 && again == first, "A step with a repeated range should be handed out again.");
+
+	mu_assert (!tsv_rekey_range (first, 8, scratch, sizeof (scratch)), "tsv_rekey_range should succeed.");
+	mu_assert (!tsv_rekey_range (first + 8, 8, scratch, sizeof (scratch)), "tsv_rekey_range should succeed.");
+
+	/* tsv_rekey_step goes through the staging area: the progress record, then one write of data and one of tags */
+	writes = g_write_count;
+	mu_assert (tsv_rekey_step (16 * 512) == 1 && g_write_count - writes == 3, "tsv_rekey_step should re-seal a run at a time.");
+
+	while (tsv_rekey_next (3000, &first, &count) == 1)
+	{
+		mu_assert (!tsv_rekey_range (first, count / 2, scratch, sizeof (scratch)), "tsv_rekey_range should succeed.");
+		mu_assert (!tsv_rekey_range (first + count / 2, count - count / 2, scratch, sizeof (scratch)), "tsv_rekey_range should succeed.");
+	}
+
+	mu_assert (!tsv_close (), "tsv_close should succeed in test_rekey.");
+	mu_assert (!tsv_open (new_mac_key, new_encryption_key), "New keys should open a rekeyed volume.");
+	mu_assert (!tsv_read (result, 0, volume_len) && !memcmp (result, real_copy, volume_len), "Contents should survive a rekey.");
+	memset (&verify, 0, sizeof (verify));
+	mu_assert (!tsv_verify (0, sector_count, scratch, &verify) && !verify.bad[0] && !verify.bad[1], "Both copies should be re-sealed.");
+	mu_assert (!tsv_close (), "tsv_close should succeed in test_rekey.");
+	mu_assert (!tsv_init (NULL, 0, NULL), "tsv_init should go back to the default arena.");
+
+	free (arena);
+	free (real_copy);
+	free (result);
+}
+END_TEST
+
+
+char *test_rekey (void)
+{
+	mu_run_test (test_rekey0);
+	mu_run_test (test_rekey1);
+	mu_run_test (test_rekey2);
+
+	return 0;
+}
@@ -0,0 +1,138 @@
+#include <stdlib.h>
+#include <string.h>
+#include <minunit.h>
+#include <titan-secure-volume/titan-secure-volume.h>
+#include <titan-secure-volume/app.h>
+
+
+void new_ramdisk (size_t len);
+int sector_size_skipped (uint32_t sector_size);
+extern uint8_t *g_ramdisk;
+
+
+/* Both copies hold the same ciphertext and tags, whichever way the second copy was written, and either
+ * one can be read on its own.
+ */
+START_TEST (test_shared0)
+{
+	if (sector_size_skipped (512))
+		return 0;
+
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint32_t sector_count = 300;
+	uint32_t features = TSV_FEATURE_SHARED | TSV_FEATURE_DISCARD;
+	size_t volume_len = 512 * sector_count;
+	/* Each copy's MAC tags and data, including the allocation bitmap */
+	size_t copy_len = (tsv_physical_size_ex (512, sector_count, features) - 512) / 2;
+	uint8_t *model = malloc (volume_len);
+	uint8_t *result = malloc (volume_len);
+	uint8_t *copy_a, *copy_b;
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_read_urandom (model, volume_len);
+	tsv_close ();
+
+	new_ramdisk (tsv_physical_size_ex (512, sector_count, features));
+	mu_assert (!tsv_create_ex (mac_key, encryption_key, 512, sector_count, features), "tsv_create_ex should succeed in test_shared.");
+
+	copy_a = g_ramdisk + 512;
+	copy_b = copy_a + copy_len;
+	mu_assert (!memcmp (copy_a, copy_b, copy_len), "A new volume should have identical copies.");
+
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_shared.");
+
+	/* Whole Sectors committed from the caller's buffer */
+	mu_assert (!tsv_write (0, model, volume_len), "tsv_write should succeed in test_shared.");
+	mu_assert (!memcmp (copy_a, copy_b, copy_len), "Committed copies should be identical.");
+
+	/* Partial Sectors, and deferred commits, copy the fresh copy */
+	tsv_read_urandom (model + 10 * 512 + 7, 1000);
+	mu_assert (!tsv_write (10 * 512 + 7, model + 10 * 512 + 7, 1000), "A partial write should succeed in test_shared.");
+	mu_assert (!tsv_set_deferred (1), "tsv_set_deferred should succeed in test_shared.");
+
+	for (uint32_t i = 0; i < 100; ++i)
+	{
+		tsv_read_urandom (model + (100 + i) * 512, 512);
+		mu_assert (!tsv_write ((100 + i) * 512, model + (100 + i) * 512, 512), "tsv_write should succeed in test_shared.");
+	}
+
+	mu_assert (!tsv_discard (250 * 512, 10 * 512), "tsv_discard should succeed in test_shared.");
+	memset (model + 250 * 512, 0, 10 * 512);
+	mu_assert (!tsv_flush (), "tsv_flush should succeed in test_shared.");
+	mu_assert (!memcmp (copy_a, copy_b, copy_len), "Copies should be identical after deferred commits.");
+
+	/* Either copy alone is enough */
+	memset (copy_a, 0, copy_len);
+	mu_assert (!tsv_read (result, 0, volume_len) && !memcmp (result, model, volume_len), "tsv_read should fall back to the second copy.");
+	mu_assert (!tsv_close () && !tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_shared.");
+	memmove (copy_a, copy_b, copy_len);
+	memset (copy_b, 0, copy_len);
+	mu_assert (!tsv_read (result, 0, volume_len) && !memcmp (result, model, volume_len), "The second copy's ciphertext should read as the first copy.");
+	mu_assert (!tsv_close (), "tsv_close should succeed in test_shared.");
+
+	free (model);
+	free (result);
+}
+END_TEST
+
+
+/* Recovery and growing keep the copies identical, and parity volumes have no second copy to share. */
+START_TEST (test_shared1)
+{
+	if (sector_size_skipped (512))
+		return 0;
+
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint32_t sector_count = 64;
+	uint32_t features = TSV_FEATURE_SHARED | TSV_FEATURE_INTENT;
+	size_t copy_len = (tsv_physical_size_ex (512, sector_count, features) - 512) / 2;
+	size_t physical_len = tsv_physical_size_ex (512, 200, features);
+	size_t grown_len = (physical_len - 512) / 2;
+	uint8_t buf[512], result[512];
+	uint8_t *snapshot = malloc (physical_len);
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_read_urandom (buf, sizeof (buf));
+	tsv_close ();
+
+	mu_assert (tsv_create_ex (mac_key, encryption_key, 512, sector_count, TSV_FEATURE_SHARED | TSV_FEATURE_PARITY) == -1, "Parity volumes should not share ciphertext.");
+
+	new_ramdisk (physical_len);
+	mu_assert (!tsv_create_ex (mac_key, encryption_key, 512, sector_count, features), "tsv_create_ex should succeed in test_shared.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_shared.");
+
+	/* Crash with only the first copy written */
+	mu_assert (!tsv_set_deferred (1), "tsv_set_deferred should succeed in test_shared.");
+	mu_assert (!tsv_write (5 * 512, buf, sizeof (buf)), "tsv_write should succeed in test_shared.");
+
+	memmove (snapshot, g_ramdisk, physical_len);
+	mu_assert (!tsv_close (), "tsv_close should succeed in test_shared.");
+	memmove (g_ramdisk, snapshot, physical_len);
+	mu_assert (memcmp (g_ramdisk + 512, g_ramdisk + 512 + copy_len, copy_len), "The copies should differ after the crash.");
+
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed after a crash.");
+	mu_assert (!memcmp (g_ramdisk + 512, g_ramdisk + 512 + copy_len, copy_len), "Recovery should make the copies identical.");
+	mu_assert (!tsv_read (result, 5 * 512, sizeof (result)) && !memcmp (result, buf, sizeof (buf)), "The first copy should have won.");
+
+	/* New Sectors are sealed once for both copies */
+	mu_assert (!tsv_grow (200), "tsv_grow should succeed in test_shared.");
+	mu_assert (!memcmp (g_ramdisk + 512, g_ramdisk + 512 + grown_len, grown_len), "Grown copies should be identical.");
+	mu_assert (!tsv_read (result, 5 * 512, sizeof (result)) && !memcmp (result, buf, sizeof (buf)), "Data should survive growing.");
+	mu_assert (!tsv_close (), "tsv_close should succeed in test_shared.");
+
+	free (snapshot);
+}
+END_TEST
+
+
+char *test_shared (void)
+{
+	mu_run_test (test_shared0);
+	mu_run_test (test_shared1);
+
+	return 0;
+}
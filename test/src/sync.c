@@ -0,0 +1,120 @@
+#include <string.h>
+#include <minunit.h>
+#include <titan-secure-volume/titan-secure-volume.h>
+#include <titan-secure-volume/app.h>
+
+
+void new_ramdisk (size_t len);
+int sector_size_skipped (uint32_t sector_size);
+extern uint8_t *g_ramdisk;
+extern unsigned int g_sync_count;
+
+
+/* Checks the number of barriers issued by tsv_write and group commit, and that
+ * only one copy of each sector is touched until a batch is committed.
+ */
+START_TEST (test_sync0)
+{
+	if (sector_size_skipped (512))
+		return 0;
+
+	int err;
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint8_t buf[1024];
+	uint32_t sector_count = 64;
+	size_t volume_len = 512 * sector_count;
+	size_t mac_table_len = 32 * sector_count;
+	size_t secondary = 512 + mac_table_len + volume_len;
+	uint8_t *real_copy = malloc (volume_len);
+	uint8_t *result = malloc (volume_len);
+	size_t disk_len = secondary + mac_table_len + volume_len;
+	uint8_t *snapshot = malloc (disk_len);
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_close ();
+
+	new_ramdisk (disk_len);
+	mu_assert (!tsv_create (mac_key, encryption_key, 512, sector_count), "tsv_create should succeed in test_sync.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_sync.");
+
+	memset (real_copy, 0, volume_len);
+	g_sync_count = 0;
+	err = tsv_write (0, real_copy, volume_len);
+	mu_assert (!err, "tsv_write should succeed in test_sync.");
+	mu_assert (g_sync_count == 2, "tsv_write should issue exactly two barriers.");
+
+	tsv_read_urandom (buf, 10);
+	memmove (real_copy + 100, buf, 10);
+	err = tsv_write (100, buf, 10);
+	mu_assert (!err, "tsv_write should succeed in test_sync.");
+	mu_assert (g_sync_count == 4, "A partial tsv_write should issue exactly two barriers.");
+
+	/* Group commit */
+	mu_assert (!tsv_batch_begin (), "tsv_batch_begin should succeed.");
+	memmove (snapshot, g_ramdisk, disk_len);
+
+	for (int i = 0; i < 256; ++i)
+	{
+		uint32_t len, offset;
+
+		tsv_read_urandom (&len, sizeof (len));
+		tsv_read_urandom (&offset, sizeof (offset));
+		len = len % sizeof (buf);
+		offset = offset % (volume_len - len);
+
+		tsv_read_urandom (buf, len);
+		memmove (real_copy + offset, buf, len);
+
+		err = tsv_write (offset, buf, len);
+		mu_assert (!err, "tsv_write should succeed during a batch.");
+	}
+
+	mu_assert (g_sync_count == 4, "tsv_write should not issue barriers during a batch.");
+
+	/* Until the batch is committed, one copy of every sector must still hold its old contents */
+	for (uint32_t i = 0; i < sector_count; ++i)
+	{
+		int intact = 0;
+
+		for (size_t copy = 512; copy <= secondary; copy += secondary - 512)
+		{
+			size_t tag = copy + 32 * i;
+			size_t data = copy + mac_table_len + 512 * i;
+
+			if (!memcmp (snapshot + tag, g_ramdisk + tag, 32) && !memcmp (snapshot + data, g_ramdisk + data, 512))
+				intact = 1;
+		}
+
+		mu_assert (intact, "One copy of each sector should be untouched before commit.");
+	}
+
+	err = tsv_read (result, 0, volume_len);
+	mu_assert (!err, "tsv_read should succeed during a batch.");
+	mu_assert (!memcmp (result, real_copy, volume_len), "tsv_read should return data written earlier in the batch.");
+
+	mu_assert (!tsv_flush (), "tsv_flush should succeed.");
+	mu_assert (g_sync_count == 6, "Committing a batch should issue exactly two barriers.");
+	mu_assert (!tsv_batch_end (), "tsv_batch_end should succeed.");
+	mu_assert (g_sync_count == 6, "tsv_batch_end should not issue barriers when nothing is pending.");
+
+	/* Destroy the primary copies; everything must still be readable from the secondaries */
+	memset (g_ramdisk + 512, 0, mac_table_len + volume_len);
+	err = tsv_read (result, 0, volume_len);
+	mu_assert (!err, "tsv_read should succeed from the secondary copies.");
+	mu_assert (!memcmp (result, real_copy, volume_len), "Secondary copies should match after commit.");
+
+	free (real_copy);
+	free (result);
+	free (snapshot);
+}
+END_TEST
+
+
+char *test_sync (void)
+{
+	mu_run_test (test_sync0);
+
+	return 0;
+}
@@ -0,0 +1,168 @@
+#include <stdlib.h>
+#include <string.h>
+#include <minunit.h>
+#include <titan-secure-volume/titan-secure-volume.h>
+#include <titan-secure-volume/app.h>
+
+
+void new_ramdisk (size_t len);
+int sector_size_skipped (uint32_t sector_size);
+
+
+typedef struct
+{
+	uint32_t type;
+	uint64_t offset;
+	uint64_t len;
+	int result;
+} CALL;
+
+static CALL g_calls[16];
+static int g_call_count;
+
+
+static void _trace_hook (void *ctx, uint32_t type, uint64_t offset, uint64_t len, int result)
+{
+	(void)ctx;
+
+	if (g_call_count < 16)
+		g_calls[g_call_count] = (CALL){type, offset, len, result};
+
+	g_call_count += 1;
+}
+
+
+static int _traced (int i, uint32_t type, uint64_t offset, uint64_t len, int result)
+{
+	return i < g_call_count && g_calls[i].type == type && g_calls[i].offset == offset && g_calls[i].len == len && g_calls[i].result == result;
+}
+
+
+/* Every public read, write, discard and flush reaches the hook with its result, vectors and batches
+ * included, until it is removed.
+ */
+START_TEST (test_trace0)
+{
+	if (sector_size_skipped (512))
+		return 0;
+
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint32_t sector_count = 64;
+	uint8_t buf[3 * 512];
+	TSV_IOVEC iov[2] = {{.base = buf, .len = 100}, {.base = buf + 100, .len = 924}};
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_read_urandom (buf, sizeof (buf));
+	tsv_close ();
+
+	new_ramdisk (tsv_physical_size_ex (512, sector_count, TSV_FEATURE_DISCARD));
+	mu_assert (!tsv_create_ex (mac_key, encryption_key, 512, sector_count, TSV_FEATURE_DISCARD), "tsv_create_ex should succeed in test_trace.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_trace.");
+
+	g_call_count = 0;
+	tsv_set_trace (_trace_hook, NULL);
+	mu_assert (!tsv_write (700, buf, 1000), "tsv_write should succeed in test_trace.");
+	mu_assert (!tsv_read (buf, 512, 512), "tsv_read should succeed in test_trace.");
+	mu_assert (tsv_read (buf, 512 * sector_count, 1) == -1, "tsv_read should fail past the end.");
+	mu_assert (!tsv_discard (10 * 512, 2 * 512), "tsv_discard should succeed in test_trace.");
+	mu_assert (!tsv_flush (), "tsv_flush should succeed in test_trace.");
+
+	mu_assert (g_call_count == 5, "Each call should be traced once.");
+	mu_assert (_traced (0, TSV_TRACE_WRITE, 700, 1000, 0), "tsv_write should be traced.");
+	mu_assert (_traced (1, TSV_TRACE_READ, 512, 512, 0), "tsv_read should be traced.");
+	mu_assert (_traced (2, TSV_TRACE_READ, 512 * sector_count, 1, -1), "A failed call should be traced with its result.");
+	mu_assert (_traced (3, TSV_TRACE_DISCARD, 10 * 512, 2 * 512, 0), "tsv_discard should be traced.");
+	mu_assert (_traced (4, TSV_TRACE_FLUSH, 0, 0, 0), "tsv_flush should be traced.");
+
+	/* Vectors are traced whole, without the reads, writes and commit they are made of */
+	g_call_count = 0;
+	mu_assert (!tsv_readv (0, iov, 2), "tsv_readv should succeed in test_trace.");
+	mu_assert (!tsv_writev (512, iov, 2), "tsv_writev should succeed in test_trace.");
+	mu_assert (g_call_count == 2, "tsv_readv and tsv_writev should be traced once each.");
+	mu_assert (_traced (0, TSV_TRACE_READV, 0, 1024, 0), "tsv_readv should be traced with its whole range.");
+	mu_assert (_traced (1, TSV_TRACE_WRITEV, 512, 1024, 0), "tsv_writev should be traced with its whole range.");
+
+	/* A batch is traced a request at a time, leaving out empty ones */
+	TSV_READ_REQUEST requests[3] = {{buf, 2048, 100}, {buf, 0, 0}, {buf + 512, 100, 512}};
+
+	g_call_count = 0;
+	mu_assert (!tsv_read_batch (requests, 3), "tsv_read_batch should succeed in test_trace.");
+	mu_assert (g_call_count == 2, "tsv_read_batch should be traced once per request.");
+	mu_assert (_traced (0, TSV_TRACE_READ_BATCH, 2048, 100, 0), "The first request should begin the batch.");
+	mu_assert (_traced (1, TSV_TRACE_READ_BATCH_NEXT, 100, 512, 0), "Further requests should follow it.");
+
+	/* The hook stays through tsv_close, which flushes */
+	g_call_count = 0;
+	mu_assert (!tsv_close (), "tsv_close should succeed in test_trace.");
+	mu_assert (g_call_count == 1 && _traced (0, TSV_TRACE_FLUSH, 0, 0, 0), "tsv_close should trace its flush.");
+	mu_assert (tsv_read (buf, 0, 1) == -1 && g_call_count == 2, "Calls on a closed volume should be traced too.");
+
+	tsv_set_trace (NULL, NULL);
+	mu_assert (!tsv_open (mac_key, encryption_key) && !tsv_read (buf, 0, 1) && !tsv_close (), "tsv_open should succeed in test_trace.");
+	mu_assert (g_call_count == 2, "Nothing should be traced once the hook is removed.");
+}
+END_TEST
+
+
+/* The crypto counters add up what each primitive processed. */
+START_TEST (test_trace1)
+{
+	if (sector_size_skipped (512))
+		return 0;
+
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint32_t sector_count = 64;
+	uint8_t buf[4 * 512];
+	TSV_CRYPTO_STATS stats;
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_read_urandom (buf, sizeof (buf));
+	tsv_close ();
+
+	new_ramdisk (tsv_physical_size (512, sector_count));
+	tsv_crypto_reset ();
+	mu_assert (!tsv_crypto_count (1), "tsv_crypto_count should succeed on Linux.");
+	mu_assert (!tsv_create (mac_key, encryption_key, 512, sector_count), "tsv_create should succeed in test_trace.");
+	tsv_crypto_stats (&stats);
+	mu_assert (stats.keystream + stats.encrypted >= 2 * 512 * sector_count && stats.authenticated >= 2 * 512 * sector_count, "tsv_create should seal both copies of every Sector.");
+
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_trace.");
+
+	/* Both copies of 4 Sectors are sealed */
+	tsv_crypto_reset ();
+	mu_assert (!tsv_write (0, buf, sizeof (buf)), "tsv_write should succeed in test_trace.");
+	tsv_crypto_stats (&stats);
+	mu_assert (stats.encrypted == 2 * sizeof (buf) && stats.decrypted == 0 && stats.authenticated >= 2 * sizeof (buf), "tsv_write should encrypt each copy once.");
+
+	/* Then one copy is authenticated and decrypted */
+	tsv_crypto_reset ();
+	mu_assert (!tsv_read (buf, 0, sizeof (buf)), "tsv_read should succeed in test_trace.");
+	tsv_crypto_stats (&stats);
+	mu_assert (stats.encrypted == 0 && stats.keystream == 0 && stats.decrypted == sizeof (buf) && stats.authenticated == sizeof (buf), "tsv_read should decrypt each Sector once.");
+
+	/* Nothing is counted while counting is off */
+	tsv_crypto_reset ();
+	mu_assert (!tsv_crypto_count (0), "tsv_crypto_count should succeed.");
+	mu_assert (!tsv_read (buf, 0, sizeof (buf)), "tsv_read should succeed in test_trace.");
+	tsv_crypto_stats (&stats);
+	mu_assert (!stats.decrypted && !stats.authenticated, "Nothing should be counted while counting is off.");
+	mu_assert (!tsv_close (), "tsv_close should succeed in test_trace.");
+
+	tsv_crypto_reset ();
+	tsv_crypto_stats (&stats);
+	mu_assert (!stats.encrypted && !stats.decrypted && !stats.keystream && !stats.authenticated, "tsv_crypto_reset should clear the counters.");
+}
+END_TEST
+
+
+char *test_trace (void)
+{
+	mu_run_test (test_trace0);
+	mu_run_test (test_trace1);
+
+	return 0;
+}
@@ -0,0 +1,203 @@
+#include <stdlib.h>
+#include <string.h>
+#include <minunit.h>
+#include <titan-secure-volume/titan-secure-volume.h>
+#include <titan-secure-volume/app.h>
+
+
+void new_ramdisk (size_t len);
+int sector_size_skipped (uint32_t sector_size);
+extern uint8_t *g_ramdisk;
+extern size_t g_ramdisk_len;
+extern unsigned int g_sync_count;
+
+
+/* An incremental backup exports only what changed since the last one, and brings a replica made from a
+ * copy of storage up to date without decrypting anything.
+ */
+START_TEST (test_track0)
+{
+	if (sector_size_skipped (512))
+		return 0;
+
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint32_t sector_count = 300;
+	uint32_t features = TSV_FEATURE_TRACK | TSV_FEATURE_DISCARD;
+	size_t volume_len = 512 * sector_count;
+	size_t record_size = TSV_TRACK_RECORD_SIZE (512);
+	uint8_t *model = malloc (volume_len);
+	uint8_t *result = malloc (volume_len);
+	uint8_t *records = malloc (8 * record_size);
+	uint8_t *replica = NULL, *source = NULL;
+	uint8_t buf[512];
+	uint32_t epoch, cursor = 0;
+	unsigned int syncs, first;
+	int count = 0, n;
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_read_urandom (model, volume_len);
+	tsv_close ();
+
+	new_ramdisk (tsv_physical_size_ex (512, sector_count, features));
+	mu_assert (tsv_physical_size_ex (512, sector_count, features) > tsv_physical_size_ex (512, sector_count, TSV_FEATURE_DISCARD), "The track map should take room.");
+	mu_assert (!tsv_create_ex (mac_key, encryption_key, 512, sector_count, features), "tsv_create_ex should succeed in test_track.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_track.");
+	mu_assert (tsv_track_epoch () == 1 && tsv_track_record_size () == record_size, "A new volume should be in the first epoch.");
+	mu_assert (!tsv_write (0, model, volume_len), "tsv_write should succeed in test_track.");
+
+	/* The full backup */
+	epoch = tsv_track_advance ();
+	mu_assert (epoch == 2 && tsv_track_epoch () == 2, "tsv_track_advance should start a new epoch.");
+	replica = malloc (g_ramdisk_len);
+	memmove (replica, g_ramdisk, g_ramdisk_len);
+
+	/* Only the first write to a Sector in an epoch waits for its mark */
+	tsv_read_urandom (model + 7 * 512, 512);
+	syncs = g_sync_count;
+	mu_assert (!tsv_write (7 * 512, model + 7 * 512, 512), "tsv_write should succeed in test_track.");
+	first = g_sync_count - syncs;
+	tsv_read_urandom (model + 7 * 512, 512);
+	syncs = g_sync_count;
+	mu_assert (!tsv_write (7 * 512, model + 7 * 512, 512), "tsv_write should succeed in test_track.");
+	mu_assert (g_sync_count - syncs == first - 1, "Writing a marked Sector should cost no barrier for the mark.");
+
+	tsv_read_urandom (model + 150 * 512 + 100, 1000);
+	mu_assert (!tsv_write (150 * 512 + 100, model + 150 * 512 + 100, 1000), "tsv_write should succeed in test_track.");
+	mu_assert (!tsv_discard (290 * 512, 512), "tsv_discard should succeed in test_track.");
+	memset (model + 290 * 512, 0, 512);
+
+	/* Sectors 7 and 150 to 152, and the bitmap Sector of 290, a few records at a time */
+	while ((n = tsv_track_export (epoch, &cursor, records + (size_t)count * record_size, 2)) > 0)
+		count += n;
+
+	mu_assert (n == 0 && count == 5 && cursor == sector_count + 1, "tsv_track_export should return what changed.");
+	mu_assert (!tsv_close (), "tsv_close should succeed in test_track.");
+
+	/* A damaged record is refused before anything is written */
+	source = malloc (g_ramdisk_len);
+	memmove (source, g_ramdisk, g_ramdisk_len);
+	memmove (g_ramdisk, replica, g_ramdisk_len);
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed on the replica.");
+	records[3 * record_size + 100] ^= 1;
+	mu_assert (tsv_track_import (records, (uint32_t)count) == -1, "tsv_track_import should refuse a damaged record.");
+	mu_assert (!tsv_close (), "tsv_close should succeed on the replica.");
+	mu_assert (!memcmp (g_ramdisk, replica, g_ramdisk_len), "A refused import should write nothing.");
+	records[3 * record_size + 100] ^= 1;
+
+	/* The replica then matches */
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed on the replica.");
+	mu_assert (!tsv_read (buf, 7 * 512, 512) && memcmp (buf, model + 7 * 512, 512), "The replica should be behind.");
+	mu_assert (!tsv_track_import (records, (uint32_t)count), "tsv_track_import should succeed.");
+	mu_assert (!tsv_read (result, 0, volume_len) && !memcmp (result, model, volume_len), "The replica should match after the import.");
+	mu_assert (!tsv_close (), "tsv_close should succeed on the replica.");
+
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed on the replica.");
+	mu_assert (!tsv_read (result, 0, volume_len) && !memcmp (result, model, volume_len), "The import should survive reopening.");
+	mu_assert (!tsv_close (), "tsv_close should succeed on the replica.");
+
+	free (model);
+	free (result);
+	free (records);
+	free (replica);
+	free (source);
+}
+END_TEST
+
+
+/* Marks are never lost: a crash keeps them, and a lost map page marks all of its Sectors. */
+START_TEST (test_track1)
+{
+	if (sector_size_skipped (512))
+		return 0;
+
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint32_t sector_count = 300;
+	size_t volume_len = 512 * sector_count;
+	size_t record_size = TSV_TRACK_RECORD_SIZE (512);
+	uint8_t *model = malloc (volume_len);
+	uint8_t *records = malloc (sector_count * record_size);
+	uint8_t *snapshot = NULL;
+	uint8_t buf[512];
+	uint32_t epoch, cursor = 0;
+	int count;
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_read_urandom (model, volume_len);
+	tsv_read_urandom (buf, sizeof (buf));
+	tsv_close ();
+
+	/* 126 entries to a 512 byte page, so 3 pages; each copy is a Sector of tags then the pages */
+	uint64_t map = tsv_physical_size (512, sector_count);
+	uint64_t map_copy = (tsv_physical_size_ex (512, sector_count, TSV_FEATURE_TRACK) - map) / 2;
+
+	new_ramdisk (tsv_physical_size_ex (512, sector_count, TSV_FEATURE_TRACK));
+	mu_assert (map_copy == 4 * 512, "The track map should be a Sector of tags and 3 pages per copy.");
+	mu_assert (!tsv_create_ex (mac_key, encryption_key, 512, sector_count, TSV_FEATURE_TRACK), "tsv_create_ex should succeed in test_track.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_track.");
+	mu_assert (!tsv_write (0, model, volume_len), "tsv_write should succeed in test_track.");
+	epoch = tsv_track_advance ();
+	mu_assert (epoch == 2, "tsv_track_advance should start a new epoch.");
+
+	/* Crash with a deferred write half done */
+	mu_assert (!tsv_set_deferred (1), "tsv_set_deferred should succeed in test_track.");
+	mu_assert (!tsv_write (200 * 512, buf, sizeof (buf)), "tsv_write should succeed in test_track.");
+	snapshot = malloc (g_ramdisk_len);
+	memmove (snapshot, g_ramdisk, g_ramdisk_len);
+	mu_assert (!tsv_close (), "tsv_close should succeed in test_track.");
+	memmove (g_ramdisk, snapshot, g_ramdisk_len);
+
+	mu_assert (!tsv_open (mac_key, encryption_key) && tsv_track_epoch () == epoch, "The epoch should survive a crash.");
+	count = tsv_track_export (epoch, &cursor, records, sector_count);
+	mu_assert (count == 1 && records[0] == 200, "A Sector written at a crash should be marked.");
+	mu_assert (!tsv_close (), "tsv_close should succeed in test_track.");
+
+	/* Losing both copies of the middle page marks its 126 Sectors, 200 among them */
+	memset (g_ramdisk + map + 2 * 512, 0, 512);
+	memset (g_ramdisk + map + map_copy + 2 * 512, 0, 512);
+	cursor = 0;
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed with a map page lost.");
+	count = tsv_track_export (epoch, &cursor, records, sector_count);
+	mu_assert (count == 126, "A lost map page should mark all of its Sectors.");
+
+	/* The epoch's page only has to survive in one copy */
+	mu_assert (tsv_track_advance () == epoch + 1, "tsv_track_advance should start a new epoch.");
+	mu_assert (!tsv_close (), "tsv_close should succeed in test_track.");
+	memset (g_ramdisk + map + 512, 0, 512);
+	mu_assert (!tsv_open (mac_key, encryption_key) && tsv_track_epoch () == epoch + 1, "The epoch should come from the second copy.");
+	mu_assert (!tsv_close (), "tsv_close should succeed in test_track.");
+	memset (g_ramdisk + map + map_copy + 512, 0, 512);
+	mu_assert (tsv_open (mac_key, encryption_key) == -1, "tsv_open should fail without the epoch.");
+
+	/* What tracking cannot be combined with */
+	new_ramdisk (tsv_physical_size (512, sector_count) * 2);
+	mu_assert (tsv_create_ex (mac_key, encryption_key, 512, sector_count, TSV_FEATURE_TRACK | TSV_FEATURE_LOG) == -1, "Tracked volumes should refuse a log.");
+	mu_assert (tsv_create_ex (mac_key, encryption_key, 512, sector_count, TSV_FEATURE_TRACK | TSV_FEATURE_SPLIT) == -1, "Tracked volumes should refuse a split.");
+	mu_assert (!tsv_create_ex (mac_key, encryption_key, 512, sector_count, TSV_FEATURE_TRACK | TSV_FEATURE_SHARED), "tsv_create_ex should succeed in test_track.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_track.");
+	mu_assert (tsv_grow (2 * sector_count) == -1, "Tracked volumes should refuse to grow.");
+	mu_assert (tsv_rekey (mac_key, encryption_key) == -1, "Tracked volumes should refuse to rekey.");
+	mu_assert (tsv_set_threaded (1) == -1, "Tracked volumes should refuse threaded mode.");
+	mu_assert (!tsv_close (), "tsv_close should succeed in test_track.");
+	mu_assert (!tsv_open_readonly (mac_key, encryption_key, NULL, 0), "tsv_open_readonly should succeed in test_track.");
+	mu_assert (tsv_track_advance () == 0 && tsv_track_import (records, 0) == -1, "A read-only volume should not change its map.");
+	mu_assert (!tsv_close (), "tsv_close should succeed in test_track.");
+	mu_assert (tsv_track_epoch () == 0 && tsv_track_record_size () == 0, "Nothing is tracked while closed.");
+
+	free (model);
+	free (records);
+	free (snapshot);
+}
+END_TEST
+
+
+char *test_track (void)
+{
+	mu_run_test (test_track0);
+	mu_run_test (test_track1);
+
+	return 0;
+}
@@ -0,0 +1,251 @@
+#include <stdlib.h>
+#include <string.h>
+#include <minunit.h>
+#include <titan-secure-volume/titan-secure-volume.h>
+#include <titan-secure-volume/app.h>
+
+
+void new_ramdisk (size_t len);
+int sector_size_skipped (uint32_t sector_size);
+extern unsigned int g_sync_count;
+extern unsigned int g_write_count;
+extern unsigned int g_read_count;
+
+#ifndef MIN
+	#define MIN(a,b)  (((a) < (b)) ? (a) : (b))
+#endif
+
+
+/* Splits buf into up to max_count buffers of random lengths, some of them empty. */
+static size_t _split (TSV_IOVEC *iov, size_t max_count, uint8_t *buf, size_t len)
+{
+	size_t count = 0;
+
+	while (len && count < max_count - 1)
+	{
+		size_t n = ((size_t)rand () % 5 == 0) ? 0 : (size_t)rand () % 700;
+
+		n = MIN (n, len);
+
+		iov[count++] = (TSV_IOVEC){buf, n};
+		buf += n;
+		len -= n;
+	}
+
+	iov[count++] = (TSV_IOVEC){buf, len};
+
+	return count;
+}
+
+
+/* Random vectors against a model, for Sector sizes with and without a power of two. */
+START_TEST (test_vector0)
+{
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint32_t sector_sizes[] = {512, 576, 4096};
+	uint32_t sector_count = 64;
+	TSV_IOVEC iov[64];
+	uint8_t buf[8192];
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	srand (11);
+
+	for (size_t s = 0; s < sizeof (sector_sizes) / sizeof (sector_sizes[0]); ++s)
+	{
+		if (sector_size_skipped (sector_sizes[s]))
+			continue;
+
+		size_t volume_len = (size_t)sector_sizes[s] * sector_count;
+		uint8_t *model = malloc (volume_len);
+
+		tsv_close ();
+		new_ramdisk (tsv_physical_size (sector_sizes[s], sector_count));
+		mu_assert (!tsv_create (mac_key, encryption_key, sector_sizes[s], sector_count), "tsv_create should succeed in test_vector.");
+		mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_vector.");
+		mu_assert (!tsv_read (model, 0, volume_len), "tsv_read should succeed in test_vector.");
+
+		for (int i = 0; i < 300; ++i)
+		{
+			size_t offset = (size_t)rand () % volume_len;
+			size_t len = (size_t)rand () % sizeof (buf);
+
+			len = MIN (len, volume_len - offset);
+			size_t count = _split (iov, 1 + (size_t)rand () % 64, buf, len);
+
+			if (i % 2)
+			{
+				tsv_read_urandom (buf, len);
+				memmove (model + offset, buf, len);
+				mu_assert (!tsv_writev (offset, iov, count), "tsv_writev should succeed.");
+			}
+			else
+			{
+				memset (buf, 0, len);
+				mu_assert (!tsv_readv (offset, iov, count), "tsv_readv should succeed.");
+				mu_assert (!memcmp (buf, model + offset, len), "tsv_readv should match the model.");
+			}
+		}
+
+		mu_assert (!tsv_close (), "tsv_close should succeed in test_vector.");
+		mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_vector.");
+
+		uint8_t *result = malloc (volume_len);
+
+		mu_assert (!tsv_read (result, 0, volume_len) && !memcmp (result, model, volume_len), "tsv_writev should reach storage.");
+		mu_assert (tsv_writev (volume_len - 10, (TSV_IOVEC[]){{buf, 5}, {buf, 6}}, 2) == -1, "tsv_writev past the end should fail.");
+		mu_assert (!tsv_close (), "tsv_close should succeed in test_vector.");
+
+		free (result);
+		free (model);
+	}
+}
+END_TEST
+
+
+/* Many small buffers cost the same physical writes and barriers as one tsv_write. */
+START_TEST (test_vector1)
+{
+	if (sector_size_skipped (512))
+		return 0;
+
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint8_t buf[10 * 512], result[10 * 512];
+	TSV_IOVEC iov[64];
+	unsigned int writes, syncs;
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_read_urandom (buf, sizeof (buf));
+	tsv_close ();
+
+	new_ramdisk (tsv_physical_size (512, 64));
+	mu_assert (!tsv_create (mac_key, encryption_key, 512, 64), "tsv_create should succeed in test_vector.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_vector.");
+
+	g_write_count = g_sync_count = 0;
+	mu_assert (!tsv_write (512 * 3 + 100, buf, sizeof (buf)), "tsv_write should succeed in test_vector.");
+	writes = g_write_count;
+	syncs = g_sync_count;
+
+	for (size_t i = 0; i < 64; ++i)
+		iov[i] = (TSV_IOVEC){buf + i * 80, (i == 63) ? sizeof (buf) - 63 * 80 : 80};
+
+	g_write_count = g_sync_count = 0;
+	mu_assert (!tsv_writev (512 * 20 + 100, iov, 64), "tsv_writev should succeed in test_vector.");
+	mu_assert (g_write_count == writes && g_sync_count == syncs, "tsv_writev should seal each Sector once.");
+
+	mu_assert (!tsv_read (result, 512 * 20 + 100, sizeof (result)), "tsv_read should succeed in test_vector.");
+	mu_assert (!memcmp (result, buf, sizeof (buf)), "tsv_writev should write its buffers in order.");
+	mu_assert (!tsv_close (), "tsv_close should succeed in test_vector.");
+}
+END_TEST
+
+
+/* Batches of overlapping random reads, with and without a staging area, and one Sector read per
+ * distinct Sector.
+ */
+START_TEST (test_vector2)
+{
+	if (sector_size_skipped (512))
+		return 0;
+
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint32_t sector_count = 200;
+	size_t volume_len = 512 * (size_t)sector_count;
+	TSV_CONFIG config = {.max_sector_size = 512, .features = TSV_FEATURE_DISCARD, .vectored = 1, .staging_size = 16 * (512 + 32)};
+	size_t arena_len = tsv_arena_size (&config);
+	uint8_t *arena = malloc (arena_len);
+	uint8_t *model = malloc (volume_len);
+	uint8_t *result = malloc (100 * 1024);
+	uint8_t *whole = malloc (volume_len);
+	TSV_READ_REQUEST requests[100];
+	unsigned int reads;
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_read_urandom (model, volume_len);
+	srand (13);
+
+	for (int staged = 0; staged < 2; ++staged)
+	{
+		tsv_close ();
+		mu_assert (!tsv_init (staged ? arena : NULL, arena_len, &config), "tsv_init should succeed.");
+		new_ramdisk (tsv_physical_size_ex (512, sector_count, TSV_FEATURE_DISCARD));
+		mu_assert (!tsv_create_ex (mac_key, encryption_key, 512, sector_count, TSV_FEATURE_DISCARD), "tsv_create_ex should succeed in test_vector.");
+		mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_vector.");
+		mu_assert (!tsv_write (0, model, volume_len), "tsv_write should succeed in test_vector.");
+		memset (model + 512 * 50, 0, 512 * 10);
+		mu_assert (!tsv_discard (512 * 50, 512 * 10), "tsv_discard should succeed in test_vector.");
+
+		for (int i = 0; i < 50; ++i)
+		{
+			for (size_t j = 0; j < 100; ++j)
+			{
+				size_t offset = (size_t)rand () % volume_len;
+				size_t len = (size_t)rand () % 1024;
+
+				requests[j] = (TSV_READ_REQUEST){result + j * 1024, offset, MIN (len, volume_len - offset)};
+			}
+
+			mu_assert (!tsv_read_batch (requests, 100), "tsv_read_batch should succeed.");
+
+			for (size_t j = 0; j < 100; ++j)
+				mu_assert (!memcmp (requests[j].dst, model + requests[j].offset, requests[j].len), "tsv_read_batch should match the model.");
+		}
+
+		/* A window of reads within Sectors 10 to 12 */
+		for (size_t j = 0; j < TSV_READ_BATCH_WINDOW; ++j)
+			requests[j] = (TSV_READ_REQUEST){result + j * 1024, 512 * 10 + (size_t)rand () % 1000, 1 + (size_t)rand () % 500};
+
+		reads = g_read_count;
+		mu_assert (!tsv_read_batch (requests, TSV_READ_BATCH_WINDOW), "tsv_read_batch should succeed.");
+		mu_assert (g_read_count - reads == (staged ? 2u : 6u), "tsv_read_batch should read each distinct Sector once.");
+
+		for (size_t j = 0; j < TSV_READ_BATCH_WINDOW; ++j)
+			mu_assert (!memcmp (requests[j].dst, model + requests[j].offset, requests[j].len), "tsv_read_batch should match the model.");
+
+		/* The whole volume, with small reads inside it, is fetched in runs as long as the staging area, skipping
+		 * the discarded Sectors 50 to 59.
+		 */
+		requests[0] = (TSV_READ_REQUEST){whole, 0, volume_len};
+
+		for (size_t j = 1; j < 10; ++j)
+			requests[j] = (TSV_READ_REQUEST){result + j * 1024, (size_t)rand () % (volume_len - 1024), 1 + (size_t)rand () % 1024};
+
+		reads = g_read_count;
+		mu_assert (!tsv_read_batch (requests, 10), "tsv_read_batch should succeed.");
+		mu_assert (g_read_count - reads == (staged ? 26u : 380u), "tsv_read_batch should read each stored Sector once, in runs of 16 with staging.");
+		mu_assert (!memcmp (whole, model, volume_len), "tsv_read_batch should match the model.");
+
+		for (size_t j = 1; j < 10; ++j)
+			mu_assert (!memcmp (requests[j].dst, model + requests[j].offset, requests[j].len), "tsv_read_batch should match the model.");
+
+		requests[0].offset = volume_len - 10;
+		requests[0].len = 11;
+		reads = g_read_count;
+		mu_assert (tsv_read_batch (requests, 100) == -1 && g_read_count == reads, "tsv_read_batch should refuse out of range requests before reading.");
+		mu_assert (!tsv_close (), "tsv_close should succeed in test_vector.");
+	}
+
+	mu_assert (!tsv_init (NULL, 0, NULL), "tsv_init should go back to the default arena.");
+
+	free (arena);
+	free (model);
+	free (result);
+	free (whole);
+}
+END_TEST
+
+
+char *test_vector (void)
+{
+	mu_run_test (test_vector0);
+	mu_run_test (test_vector1);
+	mu_run_test (test_vector2);
+
+	return 0;
+}
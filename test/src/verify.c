@@ -0,0 +1,129 @@
+#include <stdlib.h>
+#include <string.h>
+#include <minunit.h>
+#include <titan-secure-volume/titan-secure-volume.h>
+#include <titan-secure-volume/app.h>
+
+
+void new_ramdisk (size_t len);
+int sector_size_skipped (uint32_t sector_size);
+extern uint8_t *g_ramdisk;
+
+
+/* Corrupts single copies, tags and whole Sectors, and checks tsv_verify counts each of them. */
+START_TEST (test_verify0)
+{
+	if (sector_size_skipped (512))
+		return 0;
+
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint8_t scratch[2 * 512];
+	uint32_t sector_count = 100;
+	size_t volume_len = 512 * sector_count;
+	size_t mac_table_len = (32 * sector_count + 511) / 512 * 512;
+	uint8_t *data_a = NULL, *data_b = NULL, *mac_b = NULL;
+	uint8_t *real_copy = malloc (volume_len);
+	TSV_VERIFY result;
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_read_urandom (real_copy, volume_len);
+	tsv_close ();
+
+	new_ramdisk (tsv_physical_size (512, sector_count));
+	mu_assert (!tsv_create (mac_key, encryption_key, 512, sector_count), "tsv_create should succeed in test_verify.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_verify.");
+	mu_assert (tsv_get_sector_size () == 512, "tsv_get_sector_size should return the Sector size.");
+	mu_assert (!tsv_write (0, real_copy, volume_len), "tsv_write should succeed in test_verify.");
+
+	memset (&result, 0, sizeof (result));
+	mu_assert (!tsv_verify (0, sector_count, scratch, &result), "tsv_verify should succeed.");
+	mu_assert (!result.bad[0] && !result.bad[1] && !result.lost, "tsv_verify should find nothing on a good volume.");
+
+	data_a = g_ramdisk + 512 + mac_table_len;
+	mac_b = data_a + volume_len;
+	data_b = mac_b + mac_table_len;
+	data_a[5 * 512 + 100] ^= 1;
+	mac_b[7 * 32] ^= 1;
+	data_a[9 * 512] ^= 1;
+	data_b[9 * 512 + 511] ^= 1;
+
+	memset (&result, 0, sizeof (result));
+	mu_assert (!tsv_verify (0, sector_count, scratch, &result), "tsv_verify should succeed on a damaged volume.");
+	mu_assert (result.bad[0] == 2 && result.bad[1] == 2 && result.lost == 1, "tsv_verify should count each bad copy.");
+
+	/* Split ranges add up to the same result */
+	memset (&result, 0, sizeof (result));
+	mu_assert (!tsv_verify (0, 6, scratch, &result) && !tsv_verify (6, sector_count - 6, scratch, &result), "tsv_verify should succeed on parts of the volume.");
+	mu_assert (result.bad[0] == 2 && result.bad[1] == 2 && result.lost == 1, "Split tsv_verify calls should add up.");
+
+	mu_assert (tsv_verify (sector_count, 1, scratch, &result) == -1, "tsv_verify should fail past the end.");
+
+	/* Verify does not repair */
+	memset (&result, 0, sizeof (result));
+	mu_assert (!tsv_verify (5, 1, scratch, &result) && result.bad[0] == 1, "tsv_verify should not repair.");
+
+	mu_assert (!tsv_batch_begin (), "tsv_batch_begin should succeed.");
+	mu_assert (!tsv_write (0, real_copy, 512), "tsv_write should succeed in a batch.");
+	mu_assert (tsv_verify (0, 1, scratch, &result) == -1, "tsv_verify should fail with pending replicas.");
+	mu_assert (!tsv_batch_end (), "tsv_batch_end should succeed.");
+
+	free (real_copy);
+}
+END_TEST
+
+
+/* Discarded Sectors are skipped, and bitmap Sectors are counted once. */
+START_TEST (test_verify1)
+{
+	if (sector_size_skipped (512))
+		return 0;
+
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint8_t scratch[2 * 512];
+	uint8_t buf[10 * 512];
+	uint32_t sector_count = 5000;
+	uint32_t physical_count = 5002;
+	size_t mac_table_len = (32 * physical_count + 511) / 512 * 512;
+	uint8_t *data_a, *data_b;
+	TSV_VERIFY result;
+
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_read_urandom (buf, sizeof (buf));
+	tsv_close ();
+
+	new_ramdisk (tsv_physical_size_ex (512, sector_count, TSV_FEATURE_DISCARD));
+	mu_assert (!tsv_create_ex (mac_key, encryption_key, 512, sector_count, TSV_FEATURE_DISCARD), "tsv_create_ex should succeed in test_verify.");
+	mu_assert (!tsv_open (mac_key, encryption_key), "tsv_open should succeed in test_verify.");
+	mu_assert (!tsv_write (0, buf, sizeof (buf)), "tsv_write should succeed in test_verify.");
+	mu_assert (!tsv_write (4100 * 512, buf, sizeof (buf)), "tsv_write should succeed in test_verify.");
+
+	memset (&result, 0, sizeof (result));
+	mu_assert (!tsv_verify (0, sector_count, scratch, &result), "tsv_verify should succeed.");
+	mu_assert (!result.bad[0] && !result.bad[1] && !result.lost, "tsv_verify should skip discarded Sectors.");
+
+	/* First bitmap Sector, first copy */
+	data_a = g_ramdisk + 512 + mac_table_len;
+	data_b = data_a + 512 * physical_count + mac_table_len;
+	data_a[0] ^= 1;
+
+	memset (&result, 0, sizeof (result));
+	mu_assert (!tsv_verify (0, 20, scratch, &result) && !tsv_verify (20, sector_count - 20, scratch, &result), "tsv_verify should use the good copy of a bitmap Sector.");
+	mu_assert (result.bad[0] == 1 && !result.bad[1] && !result.lost, "A bitmap Sector should be counted once.");
+
+	data_b[0] ^= 1;
+	mu_assert (tsv_verify (0, 20, scratch, &result) == -1, "tsv_verify should fail without a bitmap Sector.");
+}
+END_TEST
+
+
+char *test_verify (void)
+{
+	mu_run_test (test_verify0);
+	mu_run_test (test_verify1);
+
+	return 0;
+}
@@ -0,0 +1,198 @@
+/*
+ * tsv-nbd: serves a Titan Secure Volume over the NBD protocol on a Unix socket.
+ *
+ *   tsv-nbd [-r] [-b] [-m] [-t trace] <device> <mac-key-file> <encryption-key-file> <socket-path>
+ *
+ *   -r  read only
+ *   -b  buffered I/O instead of O_DIRECT
+ *   -m  mmap instead of O_DIRECT
+ *   -t  record every call to the volume in a trace file, for tsv-replay
+ *
+ * Clients are served one at a time, e.g. with nbd-client -unix <socket-path> /dev/nbd0.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <titan-secure-volume/titan-secure-volume.h>
+#include <titan-secure-volume/app.h>
+#include <titan-secure-volume/linux.h>
+#include "nbd.h"
+
+
+static volatile sig_atomic_t g_stop = 0;
+
+
+void tsv_fatal_error (void)
+{
+	fprintf (stderr, "ERROR: TSV_FATAL_ERROR\n");
+	exit (-1);
+}
+
+
+static void _on_signal (int signum)
+{
+	(void)signum;
+	g_stop = 1;
+}
+
+
+static int _read_key (uint8_t *dst, size_t len, char const *path)
+{
+	FILE *f = fopen (path, "rb");
+
+	if (f == NULL)
+		return -1;
+
+	size_t got = fread (dst, 1, len, f);
+
+	fclose (f);
+
+	return got == len ? 0 : -1;
+}
+
+
+static int _listen (char const *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen (path) >= sizeof (addr.sun_path))
+		return -1;
+
+	memset (&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	strcpy (addr.sun_path, path);
+
+	if ((fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+		return -1;
+
+	unlink (path);
+
+	if (bind (fd, (struct sockaddr *)&addr, sizeof (addr)) || listen (fd, 1))
+	{
+		close (fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+static void _usage (void)
+{
+	fprintf (stderr, "Usage: tsv-nbd [-r] [-b] [-m] [-t trace] <device> <mac-key-file> <encryption-key-file> <socket-path>\n");
+	exit (-1);
+}
+
+
+int main (int argc, char *argv[])
+{
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	int read_only = 0;
+	int mode = TSV_LINUX_DIRECT;
+	char const *trace_path = NULL;
+	int opt;
+	int err = 0;
+
+	while ((opt = getopt (argc, argv, "rbmt:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'r': read_only = 1; break;
+			case 'b': mode = TSV_LINUX_BUFFERED; break;
+			case 'm': mode = TSV_LINUX_MMAP; break;
+			case 't': trace_path = optarg; break;
+			default: _usage ();
+		}
+	}
+
+	if (argc - optind != 4)
+		_usage ();
+
+	char const *device = argv[optind];
+	char const *socket_path = argv[optind + 3];
+
+	if (_read_key (mac_key, sizeof (mac_key), argv[optind + 1]) || _read_key (encryption_key, sizeof (encryption_key), argv[optind + 2]))
+	{
+		fprintf (stderr, "ERROR: Unable to read keys.\n");
+		return -1;
+	}
+
+	if (tsv_linux_open (device, 0, mode) || tsv_open (mac_key, encryption_key))
+	{
+		fprintf (stderr, "ERROR: Unable to open volume.\n");
+		return -1;
+	}
+
+	memset (mac_key, 0, sizeof (mac_key));
+	memset (encryption_key, 0, sizeof (encryption_key));
+
+	if (trace_path && tsv_linux_trace_open (trace_path))
+	{
+		fprintf (stderr, "ERROR: Unable to create %s.\n", trace_path);
+		tsv_close ();
+		tsv_linux_close ();
+		return -1;
+	}
+
+	int listen_fd = _listen (socket_path);
+
+	if (listen_fd == -1)
+	{
+		fprintf (stderr, "ERROR: Unable to listen on %s.\n", socket_path);
+		tsv_close ();
+		tsv_linux_close ();
+		return -1;
+	}
+
+	/* No SA_RESTART, so a signal interrupts accept and ends the loop */
+	struct sigaction sa;
+
+	memset (&sa, 0, sizeof (sa));
+	sa.sa_handler = _on_signal;
+	sigaction (SIGINT, &sa, NULL);
+	sigaction (SIGTERM, &sa, NULL);
+	signal (SIGPIPE, SIG_IGN);
+
+	while (!g_stop)
+	{
+		int fd = accept4 (listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+		if (fd == -1)
+		{
+			if (errno == EINTR)
+				continue;
+
+			err = -1;
+			break;
+		}
+
+		if (nbd_serve (fd, read_only))
+			fprintf (stderr, "WARNING: Client connection ended with an error.\n");
+
+		close (fd);
+	}
+
+	close (listen_fd);
+	unlink (socket_path);
+
+	if (tsv_close () || tsv_linux_close ())
+		err = -1;
+
+	if (trace_path && tsv_linux_trace_close ())
+	{
+		fprintf (stderr, "ERROR: Unable to write %s.\n", trace_path);
+		err = -1;
+	}
+
+	return err;
+}
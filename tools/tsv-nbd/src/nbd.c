@@ -0,0 +1,376 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <titan-secure-volume/titan-secure-volume.h>
+#include "nbd.h"
+
+
+/* Protocol constants, from the NBD protocol specification */
+#define NBD_MAGIC                 0x4e42444d41474943ull   /* "NBDMAGIC" */
+#define NBD_OPTS_MAGIC            0x49484156454F5054ull   /* "IHAVEOPT" */
+#define NBD_REP_MAGIC             0x0003e889045565a9ull
+#define NBD_REQUEST_MAGIC         0x25609513
+#define NBD_SIMPLE_REPLY_MAGIC    0x67446698
+
+#define NBD_FLAG_FIXED_NEWSTYLE   (1 << 0)
+#define NBD_FLAG_NO_ZEROES        (1 << 1)
+
+#define NBD_FLAG_HAS_FLAGS        (1 << 0)
+#define NBD_FLAG_READ_ONLY        (1 << 1)
+#define NBD_FLAG_SEND_FLUSH       (1 << 2)
+#define NBD_FLAG_SEND_FUA         (1 << 3)
+#define NBD_FLAG_SEND_TRIM        (1 << 5)
+
+#define NBD_OPT_EXPORT_NAME       1
+#define NBD_OPT_ABORT             2
+#define NBD_OPT_INFO              6
+#define NBD_OPT_GO                7
+
+#define NBD_REP_ACK               1
+#define NBD_REP_INFO              3
+#define NBD_REP_ERR_UNSUP         0x80000001
+#define NBD_REP_ERR_INVALID       0x80000003
+
+#define NBD_INFO_EXPORT           0
+
+#define NBD_CMD_READ              0
+#define NBD_CMD_WRITE             1
+#define NBD_CMD_DISC              2
+#define NBD_CMD_FLUSH             3
+#define NBD_CMD_TRIM              4
+
+#define NBD_CMD_FLAG_FUA          (1 << 0)
+
+#define NBD_EPERM                 1
+#define NBD_EIO                   5
+#define NBD_ENOMEM                12
+#define NBD_EINVAL                22
+
+/* Options carry at most an export name and a few info requests */
+#define NBD_MAX_OPTION            4096
+
+
+#define RtnOnError(x) {int _xxerr; if ((_xxerr = (x))) return _xxerr;}
+
+
+static void _pack_be16 (uint8_t *dst, uint16_t src)
+{
+	dst[0] = (uint8_t)(src >> 8);
+	dst[1] = (uint8_t)(src >> 0);
+}
+
+
+static void _pack_be32 (uint8_t *dst, uint32_t src)
+{
+	_pack_be16 (dst, (uint16_t)(src >> 16));
+	_pack_be16 (dst + 2, (uint16_t)src);
+}
+
+
+static void _pack_be64 (uint8_t *dst, uint64_t src)
+{
+	_pack_be32 (dst, (uint32_t)(src >> 32));
+	_pack_be32 (dst + 4, (uint32_t)src);
+}
+
+
+static uint16_t _unpack_be16 (uint8_t const *src)
+{
+	return (uint16_t)(((uint16_t)src[0] << 8) | src[1]);
+}
+
+
+static uint32_t _unpack_be32 (uint8_t const *src)
+{
+	return ((uint32_t)_unpack_be16 (src) << 16) | _unpack_be16 (src + 2);
+}
+
+
+static uint64_t _unpack_be64 (uint8_t const *src)
+{
+	return ((uint64_t)_unpack_be32 (src) << 32) | _unpack_be32 (src + 4);
+}
+
+
+static int _read_full (int fd, void *dst, size_t len)
+{
+	while (len)
+	{
+		ssize_t bytes = read (fd, dst, len);
+
+		if (bytes < 0 && errno == EINTR)
+			continue;
+
+		if (bytes <= 0)
+			return -1;
+
+		dst = ((uint8_t *)dst) + bytes;
+		len -= (size_t)bytes;
+	}
+
+	return 0;
+}
+
+
+static int _write_full (int fd, void const *src, size_t len)
+{
+	while (len)
+	{
+		ssize_t bytes = write (fd, src, len);
+
+		if (bytes < 0 && errno == EINTR)
+			continue;
+
+		if (bytes <= 0)
+			return -1;
+
+		src = ((uint8_t const *)src) + bytes;
+		len -= (size_t)bytes;
+	}
+
+	return 0;
+}
+
+
+static int _option_reply (int fd, uint32_t option, uint32_t type, void const *data, uint32_t len)
+{
+	uint8_t reply[20];
+
+	_pack_be64 (reply, NBD_REP_MAGIC);
+	_pack_be32 (reply + 8, option);
+	_pack_be32 (reply + 12, type);
+	_pack_be32 (reply + 16, len);
+
+	RtnOnError (_write_full (fd, reply, sizeof (reply)));
+
+	return _write_full (fd, data, len);
+}
+
+
+static uint16_t _transmission_flags (int read_only)
+{
+	uint16_t flags = NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA;
+
+	if (read_only)
+		flags |= NBD_FLAG_READ_ONLY;
+	else if (tsv_get_features () & TSV_FEATURE_DISCARD)
+		flags |= NBD_FLAG_SEND_TRIM;
+
+	return flags;
+}
+
+
+/* Runs option haggling.  Returns 1 once the client is ready for transmission, 0 if it aborted. */
+static int _negotiate (int fd, int read_only)
+{
+	uint8_t buf[NBD_MAX_OPTION];
+	uint32_t client_flags;
+
+	_pack_be64 (buf, NBD_MAGIC);
+	_pack_be64 (buf + 8, NBD_OPTS_MAGIC);
+	_pack_be16 (buf + 16, NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+	RtnOnError (_write_full (fd, buf, 18));
+
+	RtnOnError (_read_full (fd, buf, 4));
+	client_flags = _unpack_be32 (buf);
+
+	if (!(client_flags & NBD_FLAG_FIXED_NEWSTYLE))
+		return -1;
+
+	while (1)
+	{
+		RtnOnError (_read_full (fd, buf, 16));
+
+		if (_unpack_be64 (buf) != NBD_OPTS_MAGIC)
+			return -1;
+
+		uint32_t option = _unpack_be32 (buf + 8);
+		uint32_t len = _unpack_be32 (buf + 12);
+
+		if (len > sizeof (buf))
+			return -1;
+
+		RtnOnError (_read_full (fd, buf, len));
+
+		switch (option)
+		{
+			case NBD_OPT_EXPORT_NAME:
+			{
+				/* No reply header; size and flags go straight out */
+				_pack_be64 (buf, tsv_get_size ());
+				_pack_be16 (buf + 8, _transmission_flags (read_only));
+				memset (buf + 10, 0, 124);
+
+				RtnOnError (_write_full (fd, buf, (client_flags & NBD_FLAG_NO_ZEROES) ? 10 : 134));
+				return 1;
+			}
+
+			case NBD_OPT_ABORT:
+				_option_reply (fd, option, NBD_REP_ACK, NULL, 0);
+				return 0;
+
+			case NBD_OPT_INFO:
+			case NBD_OPT_GO:
+			{
+				/* Name length, name, number of info requests, requests.  There is only one export. */
+				if (len < 6 || _unpack_be32 (buf) > len - 6)
+				{
+					RtnOnError (_option_reply (fd, option, NBD_REP_ERR_INVALID, NULL, 0));
+					break;
+				}
+
+				uint8_t info[12];
+
+				_pack_be16 (info, NBD_INFO_EXPORT);
+				_pack_be64 (info + 2, tsv_get_size ());
+				_pack_be16 (info + 10, _transmission_flags (read_only));
+
+				RtnOnError (_option_reply (fd, option, NBD_REP_INFO, info, sizeof (info)));
+				RtnOnError (_option_reply (fd, option, NBD_REP_ACK, NULL, 0));
+
+				if (option == NBD_OPT_GO)
+					return 1;
+				break;
+			}
+
+			default:
+				RtnOnError (_option_reply (fd, option, NBD_REP_ERR_UNSUP, NULL, 0));
+				break;
+		}
+	}
+}
+
+
+static int _simple_reply (int fd, uint32_t error, uint8_t const handle[static 8], void const *data, size_t len)
+{
+	uint8_t reply[16];
+
+	_pack_be32 (reply, NBD_SIMPLE_REPLY_MAGIC);
+	_pack_be32 (reply + 4, error);
+	memmove (reply + 8, handle, 8);
+
+	RtnOnError (_write_full (fd, reply, sizeof (reply)));
+
+	if (error)
+		return 0;
+
+	return _write_full (fd, data, len);
+}
+
+
+static int _in_range (uint64_t offset, uint32_t len)
+{
+	uint64_t size = tsv_get_size ();
+
+	return len != 0 && offset < size && (size - offset) >= len;
+}
+
+
+int nbd_serve (int fd, int read_only)
+{
+	uint8_t request[28];
+	uint8_t *buf;
+	int ret = -1;
+	int negotiated = _negotiate (fd, read_only);
+
+	if (negotiated <= 0)
+		return negotiated;
+
+	if ((buf = malloc (NBD_MAX_REQUEST)) == NULL)
+		return -1;
+
+	/* Writes only have to be durable once the client asks for a flush */
+	if (!read_only && tsv_batch_begin ())
+		goto done;
+
+	while (1)
+	{
+		if (_read_full (fd, request, sizeof (request)))
+			goto done;
+
+		if (_unpack_be32 (request) != NBD_REQUEST_MAGIC)
+			goto done;
+
+		uint16_t flags = _unpack_be16 (request + 4);
+		uint16_t type = _unpack_be16 (request + 6);
+		uint8_t const *handle = request + 8;
+		uint64_t offset = _unpack_be64 (request + 16);
+		uint32_t len = _unpack_be32 (request + 24);
+		uint32_t error = 0;
+
+		switch (type)
+		{
+			case NBD_CMD_READ:
+				if (len > NBD_MAX_REQUEST)
+					goto done;
+
+				if (!_in_range (offset, len))
+					error = NBD_EINVAL;
+				else if (tsv_read (buf, offset, len))
+					error = NBD_EIO;
+
+				if (_simple_reply (fd, error, handle, buf, len))
+					goto done;
+				break;
+
+			case NBD_CMD_WRITE:
+				/* The payload has to be consumed even if the write is refused */
+				if (len > NBD_MAX_REQUEST || _read_full (fd, buf, len))
+					goto done;
+
+				if (read_only)
+					error = NBD_EPERM;
+				else if (!_in_range (offset, len))
+					error = NBD_EINVAL;
+				else if (tsv_write (offset, buf, len))
+					error = NBD_EIO;
+				else if ((flags & NBD_CMD_FLAG_FUA) && tsv_flush ())
+					error = NBD_EIO;
+
+				if (_simple_reply (fd, error, handle, NULL, 0))
+					goto done;
+				break;
+
+			case NBD_CMD_FLUSH:
+				if (tsv_flush ())
+					error = NBD_EIO;
+
+				if (_simple_reply (fd, error, handle, NULL, 0))
+					goto done;
+				break;
+
+			case NBD_CMD_TRIM:
+				if (read_only)
+					error = NBD_EPERM;
+				else if (!_in_range (offset, len))
+					error = NBD_EINVAL;
+				else if (tsv_discard (offset, len))
+					error = NBD_EIO;
+				else if ((flags & NBD_CMD_FLAG_FUA) && tsv_flush ())
+					error = NBD_EIO;
+
+				if (_simple_reply (fd, error, handle, NULL, 0))
+					goto done;
+				break;
+
+			case NBD_CMD_DISC:
+				ret = 0;
+				goto done;
+
+			default:
+				if (_simple_reply (fd, NBD_EINVAL, handle, NULL, 0))
+					goto done;
+				break;
+		}
+	}
+
+done:
+	if (!read_only && tsv_batch_end ())
+		ret = -1;
+
+	free (buf);
+	return ret;
+}
@@ -0,0 +1,23 @@
+/*
+ * Minimal NBD server for an open Titan Secure Volume.
+ *
+ * Fixed newstyle negotiation with simple replies.  Requests are processed in the order they arrive,
+ * so clients may keep as many in flight as they like.  Writes are group committed; NBD_CMD_FLUSH and
+ * the FUA flag map to tsv_flush.  NBD_CMD_TRIM maps to tsv_discard on volumes with TSV_FEATURE_DISCARD.
+ */
+#ifndef __TSV_NBD_H__
+#define __TSV_NBD_H__
+
+#include <stdint.h>
+
+
+/* Largest request accepted, in bytes.  Larger requests end the connection. */
+#define NBD_MAX_REQUEST (32 * 1024 * 1024)
+
+
+/* Serves the currently open volume on fd until the client disconnects.
+ * Returns 0 on a clean disconnect, -1 on a protocol or I/O error.
+ */
+int nbd_serve (int fd, int read_only);
+
+#endif
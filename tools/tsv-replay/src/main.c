@@ -0,0 +1,432 @@
+/*
+ * tsv-replay: replays a trace (see TSV_TRACE_MAGIC) against a new volume on simulated storage, to
+ * compare volume configurations and media without the workload that made it.
+ *
+ *   tsv-replay [-s sector-size] [-f features] [-c cache-sectors] [-a mac-pages] [-t staging-bytes]
+ *              [-q io-queue-bytes] [-d] [-p profile] <trace>
+ *
+ *   -s  Sector size in bytes (default 4096)
+ *   -f  TSV_FEATURE_* flags to create the volume with, e.g. 0x1
+ *   -c  -a -t -q  TSV_CONFIG cache_sectors, mac_pages, staging_size and io_queue_size
+ *   -d  deferred replication, so only the trace's flushes commit
+ *   -p  ram, hdd, sata, nvme or all (default)
+ *
+ * Calls are issued back to back, ignoring the trace's timestamps, and calls that failed when traced
+ * are left out.  A tsv_readv or tsv_writev is replayed with one buffer, and each tsv_read_batch as a
+ * batch of the same requests.  The volume is just big enough for the trace.  Writes carry a fixed pattern and the keys
+ * are fixed, so counts are the same on every run.  For each profile it reports the CPU time, the time
+ * the simulated device kept the caller waiting, the throughput over both, physical requests and bytes
+ * by type, and bytes through the cipher and MAC.  ram is storage that takes no time.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <titan-secure-volume/titan-secure-volume.h>
+#include <titan-secure-volume/app.h>
+#include <titan-secure-volume/sim.h>
+
+
+#ifndef MIN
+	#define MIN(a,b)  (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef MAX
+	#define MAX(a,b)  (((a) > (b)) ? (a) : (b))
+#endif
+
+#define MIB (1024.0 * 1024.0)
+
+
+typedef struct
+{
+	uint64_t time_ns;
+	uint64_t offset;
+	uint32_t len;
+	uint8_t type;
+	uint8_t failed;
+} RECORD;
+
+static TSV_SIM_PROFILE const g_ram = {0};
+
+static struct {
+	char const *name;
+	TSV_SIM_PROFILE const *profile;
+} const g_profiles[] = {
+	{"ram", &g_ram},
+	{"hdd", &TSV_SIM_HDD},
+	{"sata", &TSV_SIM_SATA_SSD},
+	{"nvme", &TSV_SIM_NVME},
+};
+
+
+void tsv_fatal_error (void)
+{
+	fprintf (stderr, "ERROR: TSV_FATAL_ERROR\n");
+	exit (-1);
+}
+
+
+void tsv_read_urandom (void *dst, size_t len)
+{
+	int fd = open ("/dev/urandom", O_RDONLY | O_CLOEXEC);
+
+	while (len)
+	{
+		ssize_t got = (fd == -1) ? -1 : read (fd, dst, len);
+
+		if (got <= 0)
+			tsv_fatal_error ();
+
+		dst = (uint8_t *)dst + got;
+		len -= (size_t)got;
+	}
+
+	close (fd);
+}
+
+
+static void _usage (void)
+{
+	fprintf (stderr,
+		"Usage: tsv-replay [-s sector-size] [-f features] [-c cache-sectors] [-a mac-pages] [-t staging-bytes]\n"
+		"                  [-q io-queue-bytes] [-d] [-p ram|hdd|sata|nvme|all] <trace>\n");
+	exit (-1);
+}
+
+
+static double _now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+
+static uint64_t _unpack_little (uint8_t const *src, size_t len)
+{
+	uint64_t value = 0;
+
+	for (size_t i = len; i; --i)
+		value = (value << 8) | src[i - 1];
+
+	return value;
+}
+
+
+/* Reads every record of the trace at path.  Returns NULL if it cannot be read or is not a trace. */
+static RECORD *_load_trace (char const *path, size_t *count)
+{
+	FILE *file = fopen (path, "rb");
+	uint8_t buf[TSV_TRACE_RECORD_SIZE];
+	RECORD *records = NULL;
+	size_t capacity = 0;
+	bool failed = false;
+
+	*count = 0;
+
+	if (file == NULL)
+		return NULL;
+
+	if (fread (buf, 1, 8, file) != 8 || memcmp (buf, TSV_TRACE_MAGIC, 8))
+	{
+		fclose (file);
+		return NULL;
+	}
+
+	while (fread (buf, 1, sizeof (buf), file) == sizeof (buf))
+	{
+		if (*count == capacity)
+		{
+			RECORD *grown = realloc (records, (capacity = MAX (capacity * 2, 4096)) * sizeof (RECORD));
+
+			if (grown == NULL)
+			{
+				failed = true;
+				break;
+			}
+
+			records = grown;
+		}
+
+		records[*count].time_ns = _unpack_little (buf, 8);
+		records[*count].offset = _unpack_little (buf + 8, 8);
+		records[*count].len = (uint32_t)_unpack_little (buf + 16, 4);
+		records[*count].type = buf[20];
+		records[*count].failed = buf[21];
+		*count += 1;
+	}
+
+	/* A truncated last record is ignored, as a trace cut short by a crash ends with one */
+	if (failed || ferror (file))
+	{
+		free (records);
+		records = NULL;
+	}
+	else if (records == NULL)
+	{
+		records = calloc (1, sizeof (RECORD));
+	}
+
+	fclose (file);
+
+	return records;
+}
+
+
+static bool _replayed (RECORD const *record, uint32_t features)
+{
+	if (record->failed || record->type > TSV_TRACE_READ_BATCH_NEXT)
+		return false;
+
+	return record->type != TSV_TRACE_DISCARD || (features & TSV_FEATURE_DISCARD);
+}
+
+
+/* Replays the tsv_read_batch whose first request is records[*i], leaving *i on its last record. */
+static int _replay_batch (RECORD const *records, size_t count, size_t *i, uint8_t *buf)
+{
+	TSV_READ_REQUEST requests[TSV_READ_BATCH_WINDOW];
+	size_t n = 0;
+
+	/* A window at a time, as tsv_read_batch takes them */
+	for (;;)
+	{
+		bool last = *i + 1 == count || records[*i + 1].type != TSV_TRACE_READ_BATCH_NEXT || records[*i + 1].failed;
+
+		requests[n++] = (TSV_READ_REQUEST){.dst = buf, .offset = records[*i].offset, .len = records[*i].len};
+
+		if (n == TSV_READ_BATCH_WINDOW || last)
+		{
+			if (tsv_read_batch (requests, n))
+				return -1;
+
+			n = 0;
+		}
+
+		if (last)
+			return 0;
+
+		*i += 1;
+	}
+}
+
+
+static int _replay (RECORD const *records, size_t count, uint32_t features, uint8_t *buf)
+{
+	for (size_t i = 0; i < count; ++i)
+	{
+		RECORD const *record = &records[i];
+		TSV_IOVEC iov = {.base = buf, .len = record->len};
+		int err = 0;
+
+		if (!_replayed (record, features))
+			continue;
+
+		switch (record->type)
+		{
+			case TSV_TRACE_READ: err = tsv_read (buf, record->offset, record->len); break;
+			case TSV_TRACE_WRITE: err = tsv_write (record->offset, buf, record->len); break;
+			case TSV_TRACE_FLUSH: err = tsv_flush (); break;
+			case TSV_TRACE_DISCARD: err = tsv_discard (record->offset, record->len); break;
+			case TSV_TRACE_READV: err = tsv_readv (record->offset, &iov, 1); break;
+			case TSV_TRACE_WRITEV: err = tsv_writev (record->offset, &iov, 1); break;
+			case TSV_TRACE_READ_BATCH:
+			case TSV_TRACE_READ_BATCH_NEXT: err = _replay_batch (records, count, &i, buf); break;
+		}
+
+		if (err)
+		{
+			fprintf (stderr, "ERROR: Call %zu of the trace failed.\n", i);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+/* One run of the whole trace on a new volume, then one line of results. */
+static int _run (char const *name, TSV_SIM_PROFILE const *profile, RECORD const *records, size_t count, uint32_t sector_size, uint32_t sector_count, uint32_t features, bool deferred, uint8_t *buf, uint64_t user_bytes)
+{
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	TSV_SIM_STATS sim;
+	TSV_CRYPTO_STATS crypto;
+	int err = 0;
+
+	memset (mac_key, 0x5A, sizeof (mac_key));
+	memset (encryption_key, 0xA5, sizeof (encryption_key));
+
+	uint64_t physical_size = tsv_physical_size_ex (sector_size, sector_count, features);
+
+	if (tsv_sim_open (physical_size, profile) || ((features & TSV_FEATURE_SPLIT) && tsv_sim_open_second (physical_size)) ||
+	    tsv_create_ex (mac_key, encryption_key, sector_size, sector_count, features) || tsv_open (mac_key, encryption_key) ||
+	    (deferred && tsv_set_deferred (1)))
+	{
+		fprintf (stderr, "ERROR: Unable to create a volume for profile %s.\n", name);
+		tsv_close ();
+		tsv_sim_close ();
+		return -1;
+	}
+
+	/* Creating the volume is not part of the workload */
+	tsv_sim_reset ();
+	tsv_crypto_reset ();
+	tsv_crypto_count (1);
+
+	double start = _now ();
+
+	err |= _replay (records, count, features, buf);
+	err |= tsv_close ();
+
+	double cpu = _now () - start;
+
+	tsv_sim_stats (&sim);
+	tsv_crypto_stats (&crypto);
+	tsv_crypto_count (0);
+	tsv_sim_close ();
+
+	double device = (double)sim.elapsed_ns / 1e9;
+
+	printf ("%-5s %9.3f %9.3f %9.1f %8llu %8llu %7llu %8llu %9.1f %9.1f %7llu %9.1f %9.1f %9.1f\n", name, cpu, device,
+		(double)user_bytes / MIB / MAX (cpu + device, 1e-9),
+		(unsigned long long)sim.ops[TSV_SIM_READ], (unsigned long long)sim.ops[TSV_SIM_WRITE],
+		(unsigned long long)sim.ops[TSV_SIM_SYNC], (unsigned long long)sim.ops[TSV_SIM_DISCARD],
+		(double)sim.bytes[TSV_SIM_READ] / MIB, (double)sim.bytes[TSV_SIM_WRITE] / MIB, (unsigned long long)sim.seeks,
+		(double)(crypto.encrypted + crypto.keystream) / MIB, (double)crypto.decrypted / MIB, (double)crypto.authenticated / MIB);
+
+	return err;
+}
+
+
+int main (int argc, char *argv[])
+{
+	TSV_CONFIG config = {0};
+	uint32_t sector_size = 4096;
+	uint32_t features = 0;
+	bool deferred = false;
+	char const *profile = "all";
+	int opt;
+	int err = 0;
+
+	while ((opt = getopt (argc, argv, "s:f:c:a:t:q:dp:")) != -1)
+	{
+		switch (opt)
+		{
+			case 's': sector_size = (uint32_t)strtoul (optarg, NULL, 0); break;
+			case 'f': features = (uint32_t)strtoul (optarg, NULL, 0); break;
+			case 'c': config.cache_sectors = (uint32_t)strtoul (optarg, NULL, 0); break;
+			case 'a': config.mac_pages = (uint32_t)strtoul (optarg, NULL, 0); break;
+			case 't': config.staging_size = (uint32_t)strtoul (optarg, NULL, 0); break;
+			case 'q': config.io_queue_size = (uint32_t)strtoul (optarg, NULL, 0); break;
+			case 'd': deferred = true; break;
+			case 'p': profile = optarg; break;
+			default: _usage ();
+		}
+	}
+
+	bool found = !strcmp (profile, "all");
+
+	for (size_t i = 0; i < sizeof (g_profiles) / sizeof (g_profiles[0]); ++i)
+		found |= !strcmp (profile, g_profiles[i].name);
+
+	if (argc - optind != 1 || !found)
+		_usage ();
+
+	size_t count;
+	RECORD *records = _load_trace (argv[optind], &count);
+
+	if (records == NULL)
+	{
+		fprintf (stderr, "ERROR: Unable to read the trace %s.\n", argv[optind]);
+		return -1;
+	}
+
+	/* What the trace covers */
+	uint64_t end = 0, calls[TSV_TRACE_READ_BATCH_NEXT + 1] = {0}, bytes[TSV_TRACE_READ_BATCH_NEXT + 1] = {0}, skipped = 0;
+	uint32_t max_len = 1;
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (!_replayed (&records[i], features))
+		{
+			skipped += 1;
+			continue;
+		}
+
+		calls[records[i].type] += 1;
+		bytes[records[i].type] += records[i].len;
+		max_len = MAX (max_len, records[i].len);
+
+		if (records[i].type != TSV_TRACE_FLUSH)
+			end = MAX (end, records[i].offset + records[i].len);
+	}
+
+	uint64_t sector_count = (end + MAX (sector_size, 1) - 1) / MAX (sector_size, 1);
+	uint8_t *buf = malloc (max_len);
+	void *arena = NULL;
+
+	/* The default arena only fits Sectors of up to 4096 bytes */
+	if (config.cache_sectors || config.mac_pages || config.staging_size || config.io_queue_size || sector_size > 4096)
+	{
+		config.max_sector_size = sector_size;
+		config.features = features;
+		config.vectored = 1;
+
+		size_t arena_len = tsv_arena_size (&config);
+
+		if (arena_len == 0 || (arena = malloc (arena_len)) == NULL || tsv_init (arena, arena_len, &config))
+		{
+			fprintf (stderr, "ERROR: Invalid cache, staging or I/O queue size.\n");
+			return -1;
+		}
+	}
+
+	if (sector_count > UINT32_MAX || tsv_physical_size_ex (sector_size, (uint32_t)MAX (sector_count, 1), features) == 0 || buf == NULL)
+	{
+		fprintf (stderr, "ERROR: Invalid sector size or features for this trace.\n");
+		return -1;
+	}
+
+	/* Anything written is a fixed pattern */
+	for (uint32_t i = 0; i < max_len; ++i)
+		buf[i] = (uint8_t)(i * 131 + (i >> 8));
+
+	/* A batch counts as one read per request */
+	uint64_t read_calls = calls[TSV_TRACE_READ] + calls[TSV_TRACE_READV] + calls[TSV_TRACE_READ_BATCH] + calls[TSV_TRACE_READ_BATCH_NEXT];
+	uint64_t read_bytes = bytes[TSV_TRACE_READ] + bytes[TSV_TRACE_READV] + bytes[TSV_TRACE_READ_BATCH] + bytes[TSV_TRACE_READ_BATCH_NEXT];
+	uint64_t write_calls = calls[TSV_TRACE_WRITE] + calls[TSV_TRACE_WRITEV];
+	uint64_t write_bytes = bytes[TSV_TRACE_WRITE] + bytes[TSV_TRACE_WRITEV];
+
+	printf ("Trace: %zu calls over %.3f s, %llu left out; %llu reads (%.1f MiB), %llu writes (%.1f MiB), %llu flushes, %llu discards\n",
+		count, count ? (double)records[count - 1].time_ns / 1e9 : 0.0, (unsigned long long)skipped,
+		(unsigned long long)read_calls, (double)read_bytes / MIB,
+		(unsigned long long)write_calls, (double)write_bytes / MIB,
+		(unsigned long long)calls[TSV_TRACE_FLUSH], (unsigned long long)calls[TSV_TRACE_DISCARD]);
+	printf ("Volume: %u Sectors of %u bytes, features 0x%x, %u cache Sectors, %u MAC pages, %u staging bytes, %u I/O queue bytes%s\n",
+		(uint32_t)MAX (sector_count, 1), sector_size, features, config.cache_sectors, config.mac_pages, config.staging_size, config.io_queue_size, deferred ? ", deferred" : "");
+	printf ("%-5s %9s %9s %9s %8s %8s %7s %8s %9s %9s %7s %9s %9s %9s\n", "", "CPU s", "Device s", "MiB/s",
+		"Reads", "Writes", "Syncs", "Discards", "Read MiB", "Wrote MiB", "Seeks", "Enc MiB", "Dec MiB", "MAC MiB");
+
+	for (size_t i = 0; i < sizeof (g_profiles) / sizeof (g_profiles[0]); ++i)
+	{
+		if (strcmp (profile, "all") && strcmp (profile, g_profiles[i].name))
+			continue;
+
+		err |= _run (g_profiles[i].name, g_profiles[i].profile, records, count, sector_size, (uint32_t)MAX (sector_count, 1), features, deferred, buf, read_bytes + write_bytes);
+	}
+
+	tsv_init (NULL, 0, NULL);
+	free (arena);
+	free (buf);
+	free (records);
+
+	return err;
+}
@@ -0,0 +1,864 @@
+/*
+ * tsv-tool: command line access to Titan Secure Volumes on a file or block device.
+ *
+ *   tsv-tool create [-s sector-size] [-d] <device> <mac-key> <encryption-key> <sector-count>
+ *   tsv-tool import [-b] [-m] <device> <mac-key> <encryption-key> [input]
+ *   tsv-tool export [-b] [-m] <device> <mac-key> <encryption-key> [output]
+ *   tsv-tool verify [-m] [-j threads] <device> <mac-key> <encryption-key>
+ *   tsv-tool info <device> <mac-key> <encryption-key>
+ *   tsv-tool bench [-s sector-size] [-b] [-m] <file> <size-in-MiB>
+ *
+ *   -s  Sector size in bytes (default 4096)
+ *   -d  create with TSV_FEATURE_DISCARD
+ *   -b  buffered I/O instead of O_DIRECT
+ *   -m  mmap instead of O_DIRECT
+ *   -j  verify threads (default: one per CPU)
+ *
+ * Keys are read from a file, or from an open file descriptor given as fd:<n>.  Input and output
+ * default to stdin and stdout, also selected with "-".  import and export move CHUNK_SIZE bytes per
+ * tsv_write or tsv_read, while another thread reads the input or writes the output.
+ * verify exits with 1 if any copy is bad, and bench overwrites <file> with a new volume.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <titan-secure-volume/titan-secure-volume.h>
+#include <titan-secure-volume/app.h>
+#include <titan-secure-volume/linux.h>
+
+
+#ifndef MIN
+	#define MIN(a,b)  (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef MAX
+	#define MAX(a,b)  (((a) > (b)) ? (a) : (b))
+#endif
+
+#define RtnOnError(x) {int _xxerr; if ((_xxerr = (x))) return _xxerr;}
+
+
+/* Bytes per tsv_read or tsv_write in import, export and bench */
+#define CHUNK_SIZE (4 * 1024 * 1024)
+
+/* Sectors handed to a verify thread at a time */
+#define VERIFY_CHUNK 4096
+
+/* Length of the random I/O part of bench */
+#define BENCH_SECONDS 2.0
+
+
+void tsv_fatal_error (void)
+{
+	fprintf (stderr, "ERROR: TSV_FATAL_ERROR\n");
+	exit (-1);
+}
+
+
+static void _usage (void)
+{
+	fprintf (stderr,
+		"Usage: tsv-tool create [-s sector-size] [-d] <device> <mac-key> <encryption-key> <sector-count>\n"
+		"       tsv-tool import [-b] [-m] <device> <mac-key> <encryption-key> [input]\n"
+		"       tsv-tool export [-b] [-m] <device> <mac-key> <encryption-key> [output]\n"
+		"       tsv-tool verify [-m] [-j threads] <device> <mac-key> <encryption-key>\n"
+		"       tsv-tool info <device> <mac-key> <encryption-key>\n"
+		"       tsv-tool bench [-s sector-size] [-b] [-m] <file> <size-in-MiB>\n"
+		"Keys are file paths or fd:<n>.\n");
+	exit (-1);
+}
+
+
+static int _read_full (int fd, void *dst, size_t len, size_t *got)
+{
+	*got = 0;
+
+	while (*got < len)
+	{
+		ssize_t ret = read (fd, (uint8_t *)dst + *got, len - *got);
+
+		if (ret == 0)
+			break;
+
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		*got += (size_t)ret;
+	}
+
+	return 0;
+}
+
+
+static int _write_full (int fd, void const *src, size_t len)
+{
+	while (len)
+	{
+		ssize_t ret = write (fd, src, len);
+
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		src = (uint8_t const *)src + ret;
+		len -= (size_t)ret;
+	}
+
+	return 0;
+}
+
+
+/* Reads a key from a file, or from fd:<n>. */
+static int _read_key (uint8_t *dst, size_t len, char const *spec)
+{
+	size_t got;
+	int fd;
+	int err;
+
+	if (strncmp (spec, "fd:", 3) == 0)
+	{
+		char *end;
+		long n = strtol (spec + 3, &end, 10);
+
+		if (*end || end == spec + 3 || n < 0 || n > 65535)
+			return -1;
+
+		fd = (int)n;
+	}
+	else if ((fd = open (spec, O_RDONLY | O_CLOEXEC)) == -1)
+		return -1;
+
+	err = _read_full (fd, dst, len, &got);
+	close (fd);
+
+	return (err || got != len) ? -1 : 0;
+}
+
+
+static int _open_volume (char const *device, char const *mac_key_spec, char const *encryption_key_spec, int mode)
+{
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	int err = 0;
+
+	if (_read_key (mac_key, sizeof (mac_key), mac_key_spec) || _read_key (encryption_key, sizeof (encryption_key), encryption_key_spec))
+	{
+		fprintf (stderr, "ERROR: Unable to read keys.\n");
+		return -1;
+	}
+
+	if (tsv_linux_open (device, 0, mode))
+		err = -1;
+	else if (tsv_open (mac_key, encryption_key))
+	{
+		tsv_linux_close ();
+		err = -1;
+	}
+
+	memset (mac_key, 0, sizeof (mac_key));
+	memset (encryption_key, 0, sizeof (encryption_key));
+
+	if (err)
+		fprintf (stderr, "ERROR: Unable to open volume.\n");
+
+	return err;
+}
+
+
+static int _close_volume (void)
+{
+	if (tsv_close () | tsv_linux_close ())
+	{
+		fprintf (stderr, "ERROR: Unable to close volume.\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+static double _now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+
+/* Pipeline.  Two buffers passed back and forth between a thread doing plain file I/O and the main
+ * thread doing volume I/O, so one can fill a buffer while the other drains the other one.
+ */
+typedef struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint8_t *buf[2];
+	size_t len[2];
+	bool full[2];
+	bool done;       /* Producer has nothing more */
+	bool failed;     /* Either side gave up */
+	int fd;
+} PIPELINE;
+
+
+static int _pipe_init (PIPELINE *pipeline, int fd)
+{
+	memset (pipeline, 0, sizeof (*pipeline));
+	pipeline->fd = fd;
+	pipeline->buf[0] = malloc (CHUNK_SIZE);
+	pipeline->buf[1] = malloc (CHUNK_SIZE);
+
+	if (!pipeline->buf[0] || !pipeline->buf[1])
+		return -1;
+
+	pthread_mutex_init (&pipeline->lock, NULL);
+	pthread_cond_init (&pipeline->cond, NULL);
+
+	return 0;
+}
+
+
+static void _pipe_free (PIPELINE *pipeline)
+{
+	pthread_mutex_destroy (&pipeline->lock);
+	pthread_cond_destroy (&pipeline->cond);
+	free (pipeline->buf[0]);
+	free (pipeline->buf[1]);
+}
+
+
+/* Producer side.  Waits for buffer i to be empty; NULL if the consumer failed. */
+static uint8_t *_pipe_get_empty (PIPELINE *pipeline, int i)
+{
+	pthread_mutex_lock (&pipeline->lock);
+
+	while (pipeline->full[i] && !pipeline->failed)
+		pthread_cond_wait (&pipeline->cond, &pipeline->lock);
+
+	uint8_t *buf = pipeline->failed ? NULL : pipeline->buf[i];
+
+	pthread_mutex_unlock (&pipeline->lock);
+
+	return buf;
+}
+
+
+static void _pipe_put_full (PIPELINE *pipeline, int i, size_t len)
+{
+	pthread_mutex_lock (&pipeline->lock);
+	pipeline->len[i] = len;
+	pipeline->full[i] = true;
+	pthread_cond_broadcast (&pipeline->cond);
+	pthread_mutex_unlock (&pipeline->lock);
+}
+
+
+/* Consumer side.  Waits for buffer i to be filled; NULL once the producer is done or failed. */
+static uint8_t *_pipe_get_full (PIPELINE *pipeline, int i, size_t *len)
+{
+	pthread_mutex_lock (&pipeline->lock);
+
+	while (!pipeline->full[i] && !pipeline->done && !pipeline->failed)
+		pthread_cond_wait (&pipeline->cond, &pipeline->lock);
+
+	uint8_t *buf = (pipeline->full[i] && !pipeline->failed) ? pipeline->buf[i] : NULL;
+
+	*len = pipeline->len[i];
+	pthread_mutex_unlock (&pipeline->lock);
+
+	return buf;
+}
+
+
+static void _pipe_put_empty (PIPELINE *pipeline, int i)
+{
+	pthread_mutex_lock (&pipeline->lock);
+	pipeline->full[i] = false;
+	pthread_cond_broadcast (&pipeline->cond);
+	pthread_mutex_unlock (&pipeline->lock);
+}
+
+
+static void _pipe_finish (PIPELINE *pipeline, bool failed)
+{
+	pthread_mutex_lock (&pipeline->lock);
+	pipeline->done = true;
+	pipeline->failed |= failed;
+	pthread_cond_broadcast (&pipeline->cond);
+	pthread_mutex_unlock (&pipeline->lock);
+}
+
+
+/* Import producer: reads the input file. */
+static void *_import_reader (void *arg)
+{
+	PIPELINE *pipeline = arg;
+	bool failed = false;
+
+	for (int i = 0; ; i ^= 1)
+	{
+		uint8_t *buf = _pipe_get_empty (pipeline, i);
+		size_t got;
+
+		if (buf == NULL)
+			break;
+
+		if (_read_full (pipeline->fd, buf, CHUNK_SIZE, &got))
+		{
+			failed = true;
+			break;
+		}
+
+		if (got == 0)
+			break;
+
+		_pipe_put_full (pipeline, i, got);
+
+		if (got < CHUNK_SIZE)
+			break;
+	}
+
+	_pipe_finish (pipeline, failed);
+
+	return NULL;
+}
+
+
+/* Export consumer: writes the output file. */
+static void *_export_writer (void *arg)
+{
+	PIPELINE *pipeline = arg;
+	bool failed = false;
+
+	for (int i = 0; ; i ^= 1)
+	{
+		size_t len;
+		uint8_t *buf = _pipe_get_full (pipeline, i, &len);
+
+		if (buf == NULL)
+			break;
+
+		if (_write_full (pipeline->fd, buf, len))
+		{
+			failed = true;
+			break;
+		}
+
+		_pipe_put_empty (pipeline, i);
+	}
+
+	if (failed)
+		_pipe_finish (pipeline, true);
+
+	return NULL;
+}
+
+
+static int _parse_mode (int opt, int *mode)
+{
+	switch (opt)
+	{
+		case 'b': *mode = TSV_LINUX_BUFFERED; return 0;
+		case 'm': *mode = TSV_LINUX_MMAP; return 0;
+		default: return -1;
+	}
+}
+
+
+static int _cmd_create (int argc, char *argv[])
+{
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint32_t sector_size = 4096;
+	uint32_t features = 0;
+	int opt;
+	int err = 0;
+
+	while ((opt = getopt (argc, argv, "s:d")) != -1)
+	{
+		switch (opt)
+		{
+			case 's': sector_size = (uint32_t)strtoul (optarg, NULL, 0); break;
+			case 'd': features |= TSV_FEATURE_DISCARD; break;
+			default: _usage ();
+		}
+	}
+
+	if (argc - optind != 4)
+		_usage ();
+
+	uint32_t sector_count = (uint32_t)strtoul (argv[optind + 3], NULL, 0);
+	uint64_t physical_size = tsv_physical_size_ex (sector_size, sector_count, features);
+
+	if (physical_size == 0)
+	{
+		fprintf (stderr, "ERROR: Invalid sector size or count.\n");
+		return -1;
+	}
+
+	if (_read_key (mac_key, sizeof (mac_key), argv[optind + 1]) || _read_key (encryption_key, sizeof (encryption_key), argv[optind + 2]))
+	{
+		fprintf (stderr, "ERROR: Unable to read keys.\n");
+		return -1;
+	}
+
+	if (tsv_linux_open (argv[optind], physical_size, TSV_LINUX_BUFFERED))
+	{
+		fprintf (stderr, "ERROR: Unable to open %s.\n", argv[optind]);
+		return -1;
+	}
+
+	if (tsv_create_ex (mac_key, encryption_key, sector_size, sector_count, features))
+	{
+		fprintf (stderr, "ERROR: Unable to create volume.\n");
+		err = -1;
+	}
+
+	memset (mac_key, 0, sizeof (mac_key));
+	memset (encryption_key, 0, sizeof (encryption_key));
+
+	if (tsv_linux_close ())
+		err = -1;
+
+	return err;
+}
+
+
+static int _cmd_import (int argc, char *argv[])
+{
+	PIPELINE pipeline;
+	pthread_t thread;
+	uint64_t offset = 0;
+	int mode = TSV_LINUX_DIRECT;
+	int opt;
+	int err = 0;
+	int fd = STDIN_FILENO;
+
+	while ((opt = getopt (argc, argv, "bm")) != -1)
+	{
+		if (_parse_mode (opt, &mode))
+			_usage ();
+	}
+
+	if (argc - optind != 3 && argc - optind != 4)
+		_usage ();
+
+	if (argc - optind == 4 && strcmp (argv[optind + 3], "-") && (fd = open (argv[optind + 3], O_RDONLY | O_CLOEXEC)) == -1)
+	{
+		fprintf (stderr, "ERROR: Unable to open %s.\n", argv[optind + 3]);
+		return -1;
+	}
+
+	RtnOnError (_open_volume (argv[optind], argv[optind + 1], argv[optind + 2], mode));
+
+	if (_pipe_init (&pipeline, fd) || pthread_create (&thread, NULL, _import_reader, &pipeline))
+	{
+		fprintf (stderr, "ERROR: Out of memory.\n");
+		exit (-1);
+	}
+
+	/* Group commit; tsv_batch_end makes it all durable */
+	err = tsv_batch_begin ();
+
+	for (int i = 0; !err; i ^= 1)
+	{
+		size_t len;
+		uint8_t *buf = _pipe_get_full (&pipeline, i, &len);
+
+		if (buf == NULL)
+			break;
+
+		if (len > tsv_get_size () - offset)
+		{
+			fprintf (stderr, "ERROR: Input is larger than the volume (%llu bytes).\n", (unsigned long long)tsv_get_size ());
+			err = -1;
+		}
+		else if (tsv_write (offset, buf, len))
+		{
+			fprintf (stderr, "ERROR: tsv_write failed at offset %llu.\n", (unsigned long long)offset);
+			err = -1;
+		}
+
+		offset += len;
+		_pipe_put_empty (&pipeline, i);
+	}
+
+	_pipe_finish (&pipeline, err != 0);
+	pthread_join (thread, NULL);
+
+	if (!err && pipeline.failed)
+	{
+		fprintf (stderr, "ERROR: Unable to read input.\n");
+		err = -1;
+	}
+
+	if (tsv_batch_end ())
+		err = -1;
+
+	_pipe_free (&pipeline);
+	err |= _close_volume ();
+
+	if (fd != STDIN_FILENO)
+		close (fd);
+
+	if (!err)
+		fprintf (stderr, "Imported %llu bytes.\n", (unsigned long long)offset);
+
+	return err;
+}
+
+
+static int _cmd_export (int argc, char *argv[])
+{
+	PIPELINE pipeline;
+	pthread_t thread;
+	int mode = TSV_LINUX_DIRECT;
+	int opt;
+	int err = 0;
+	int fd = STDOUT_FILENO;
+
+	while ((opt = getopt (argc, argv, "bm")) != -1)
+	{
+		if (_parse_mode (opt, &mode))
+			_usage ();
+	}
+
+	if (argc - optind != 3 && argc - optind != 4)
+		_usage ();
+
+	if (argc - optind == 4 && strcmp (argv[optind + 3], "-") && (fd = open (argv[optind + 3], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) == -1)
+	{
+		fprintf (stderr, "ERROR: Unable to open %s.\n", argv[optind + 3]);
+		return -1;
+	}
+
+	RtnOnError (_open_volume (argv[optind], argv[optind + 1], argv[optind + 2], mode));
+
+	if (_pipe_init (&pipeline, fd) || pthread_create (&thread, NULL, _export_writer, &pipeline))
+	{
+		fprintf (stderr, "ERROR: Out of memory.\n");
+		exit (-1);
+	}
+
+	uint64_t size = tsv_get_size ();
+	uint64_t offset = 0;
+
+	for (int i = 0; offset < size; i ^= 1)
+	{
+		size_t len = (size_t)MIN (size - offset, CHUNK_SIZE);
+		uint8_t *buf = _pipe_get_empty (&pipeline, i);
+
+		if (buf == NULL)
+			break;
+
+		if (tsv_read (buf, offset, len))
+		{
+			fprintf (stderr, "ERROR: tsv_read failed at offset %llu.\n", (unsigned long long)offset);
+			err = -1;
+			break;
+		}
+
+		_pipe_put_full (&pipeline, i, len);
+		offset += len;
+	}
+
+	_pipe_finish (&pipeline, err != 0);
+	pthread_join (thread, NULL);
+
+	if (!err && pipeline.failed)
+	{
+		fprintf (stderr, "ERROR: Unable to write output.\n");
+		err = -1;
+	}
+
+	_pipe_free (&pipeline);
+	err |= _close_volume ();
+
+	if (fd != STDOUT_FILENO && close (fd))
+		err = -1;
+
+	return err;
+}
+
+
+/* Verify.  Threads take VERIFY_CHUNK Sectors at a time and add up their results under the lock. */
+static struct
+{
+	pthread_mutex_t lock;
+	uint32_t next;
+	uint32_t count;
+	TSV_VERIFY result;
+	bool failed;
+} g_verify = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+
+static void *_verify_thread (void *arg)
+{
+	uint8_t *scratch = malloc (2 * (size_t)tsv_get_sector_size ());
+
+	(void)arg;
+
+	while (scratch)
+	{
+		TSV_VERIFY result;
+
+		memset (&result, 0, sizeof (result));
+		pthread_mutex_lock (&g_verify.lock);
+		uint32_t first = g_verify.next;
+		uint32_t count = MIN (g_verify.count - first, VERIFY_CHUNK);
+		g_verify.next += count;
+		pthread_mutex_unlock (&g_verify.lock);
+
+		if (count == 0)
+			break;
+
+		int err = tsv_verify (first, count, scratch, &result);
+
+		pthread_mutex_lock (&g_verify.lock);
+		g_verify.failed |= (err != 0);
+		g_verify.result.bad[0] += result.bad[0];
+		g_verify.result.bad[1] += result.bad[1];
+		g_verify.result.lost += result.lost;
+		pthread_mutex_unlock (&g_verify.lock);
+	}
+
+	if (scratch == NULL)
+	{
+		pthread_mutex_lock (&g_verify.lock);
+		g_verify.failed = true;
+		pthread_mutex_unlock (&g_verify.lock);
+	}
+
+	free (scratch);
+
+	return NULL;
+}
+
+
+static int _cmd_verify (int argc, char *argv[])
+{
+	long threads = sysconf (_SC_NPROCESSORS_ONLN);
+	int mode = TSV_LINUX_BUFFERED;    /* The O_DIRECT bounce buffer is not thread safe */
+	int opt;
+
+	while ((opt = getopt (argc, argv, "mj:")) != -1)
+	{
+		if (opt == 'j')
+			threads = strtol (optarg, NULL, 10);
+		else if (opt != 'm' || _parse_mode (opt, &mode))
+			_usage ();
+	}
+
+	if (argc - optind != 3 || threads < 1)
+		_usage ();
+
+	RtnOnError (_open_volume (argv[optind], argv[optind + 1], argv[optind + 2], mode));
+
+	pthread_t *thread = calloc ((size_t)threads, sizeof (pthread_t));
+	double start = _now ();
+	long started = 0;
+
+	g_verify.count = (uint32_t)(tsv_get_size () / tsv_get_sector_size ());
+
+	for (; thread && started < threads; ++started)
+	{
+		if (pthread_create (&thread[started], NULL, _verify_thread, NULL))
+			break;
+	}
+
+	/* With no threads at all, verify on this one */
+	if (started == 0)
+		_verify_thread (NULL);
+
+	for (long i = 0; i < started; ++i)
+		pthread_join (thread[i], NULL);
+
+	free (thread);
+
+	double elapsed = _now () - start;
+	int err = _close_volume ();
+
+	if (g_verify.failed)
+	{
+		fprintf (stderr, "ERROR: Verify failed; the allocation bitmap may be damaged.\n");
+		return -1;
+	}
+
+	printf ("Sectors:             %u\n", g_verify.count);
+	printf ("Bad first copies:    %u\n", g_verify.result.bad[0]);
+	printf ("Bad second copies:   %u\n", g_verify.result.bad[1]);
+	printf ("Lost sectors:        %u\n", g_verify.result.lost);
+	printf ("Time:                %.2f s\n", elapsed);
+
+	if (err)
+		return -1;
+
+	return (g_verify.result.bad[0] || g_verify.result.bad[1]) ? 1 : 0;
+}
+
+
+static int _cmd_info (int argc, char *argv[])
+{
+	if (argc != 4)
+		_usage ();
+
+	RtnOnError (_open_volume (argv[1], argv[2], argv[3], TSV_LINUX_BUFFERED));
+
+	uint32_t sector_size = tsv_get_sector_size ();
+	uint32_t sector_count = (uint32_t)(tsv_get_size () / sector_size);
+	uint32_t features = tsv_get_features ();
+
+	printf ("Sector size:         %u\n", sector_size);
+	printf ("Sectors:             %u\n", sector_count);
+	printf ("Size:                %llu\n", (unsigned long long)tsv_get_size ());
+	printf ("Physical size:       %llu\n", (unsigned long long)tsv_physical_size_ex (sector_size, sector_count, features));
+	printf ("Features:           %s%s\n", (features & TSV_FEATURE_DISCARD) ? " discard" : "", features ? "" : " none");
+
+	return _close_volume ();
+}
+
+
+static void _bench_report (char const *name, uint64_t bytes, uint64_t ops, double elapsed)
+{
+	printf ("%-22s %9.1f MiB/s  %9.0f IOPS\n", name, (double)bytes / (1024.0 * 1024.0) / elapsed, (double)ops / elapsed);
+}
+
+
+/* Sequential and random throughput of a new volume in a scratch file. */
+static int _cmd_bench (int argc, char *argv[])
+{
+	uint8_t mac_key[TSV_MAC_KEY_SIZE];
+	uint8_t encryption_key[TSV_ENCRYPTION_KEY_SIZE];
+	uint32_t sector_size = 4096;
+	int mode = TSV_LINUX_DIRECT;
+	int opt;
+	int err = 0;
+
+	while ((opt = getopt (argc, argv, "s:bm")) != -1)
+	{
+		if (opt == 's')
+			sector_size = (uint32_t)strtoul (optarg, NULL, 0);
+		else if (_parse_mode (opt, &mode))
+			_usage ();
+	}
+
+	if (argc - optind != 2)
+		_usage ();
+
+	uint64_t size = strtoull (argv[optind + 1], NULL, 0) * 1024 * 1024;
+	uint32_t sector_count = (uint32_t)MIN (size / MAX (sector_size, 1), 0x7FFFFFFF);
+	uint64_t physical_size = tsv_physical_size (sector_size, sector_count);
+	uint8_t *buf = malloc (CHUNK_SIZE);
+
+	if (physical_size == 0 || buf == NULL)
+	{
+		fprintf (stderr, "ERROR: Invalid sector size or volume size.\n");
+		return -1;
+	}
+
+	size = (uint64_t)sector_size * sector_count;
+	tsv_read_urandom (mac_key, sizeof (mac_key));
+	tsv_read_urandom (encryption_key, sizeof (encryption_key));
+	tsv_read_urandom (buf, CHUNK_SIZE);
+
+	if (tsv_linux_open (argv[optind], physical_size, mode) || tsv_create (mac_key, encryption_key, sector_size, sector_count) || tsv_open (mac_key, encryption_key))
+	{
+		fprintf (stderr, "ERROR: Unable to create volume.\n");
+		return -1;
+	}
+
+	double start = _now ();
+
+	err |= tsv_batch_begin ();
+
+	for (uint64_t offset = 0; !err && offset < size; offset += CHUNK_SIZE)
+		err |= tsv_write (offset, buf, (size_t)MIN (size - offset, CHUNK_SIZE));
+
+	err |= tsv_batch_end ();
+	_bench_report ("Sequential write", size, (size + CHUNK_SIZE - 1) / CHUNK_SIZE, _now () - start);
+
+	start = _now ();
+
+	for (uint64_t offset = 0; !err && offset < size; offset += CHUNK_SIZE)
+		err |= tsv_read (buf, offset, (size_t)MIN (size - offset, CHUNK_SIZE));
+
+	_bench_report ("Sequential read", size, (size + CHUNK_SIZE - 1) / CHUNK_SIZE, _now () - start);
+
+	/* One Sector at a time, at random */
+	for (int write = 0; write < 2 && !err; ++write)
+	{
+		uint64_t ops = 0;
+
+		start = _now ();
+
+		while (!err && _now () - start < BENCH_SECONDS)
+		{
+			for (int i = 0; i < 64 && !err; ++i, ++ops)
+			{
+				uint64_t offset = ((uint64_t)rand () % sector_count) * sector_size;
+
+				err |= write ? tsv_write (offset, buf, sector_size) : tsv_read (buf, offset, sector_size);
+			}
+		}
+
+		_bench_report (write ? "Random write (sync)" : "Random read", ops * sector_size, ops, _now () - start);
+	}
+
+	free (buf);
+	err |= _close_volume ();
+
+	if (err)
+		fprintf (stderr, "ERROR: Volume I/O failed.\n");
+
+	return err;
+}
+
+
+int main (int argc, char *argv[])
+{
+	static struct {
+		char const *name;
+		int (*run) (int argc, char *argv[]);
+	} const commands[] = {
+		{"create", _cmd_create},
+		{"import", _cmd_import},
+		{"export", _cmd_export},
+		{"verify", _cmd_verify},
+		{"info", _cmd_info},
+		{"bench", _cmd_bench},
+	};
+
+	if (argc < 2)
+		_usage ();
+
+	for (size_t i = 0; i < sizeof (commands) / sizeof (commands[0]); ++i)
+	{
+		/* getopt starts at argv[1], the command */
+		if (strcmp (argv[1], commands[i].name) == 0)
+			return commands[i].run (argc - 1, argv + 1);
+	}
+
+	_usage ();
+
+	return -1;
+}